@@ -348,31 +348,52 @@ int pwp_conn_send_statechange(pwp_conn_t* me_, const unsigned char msg_type)
     return 1;
 }
 
-void pwp_conn_send_piece(pwp_conn_t* me_, bt_block_t * req)
+int pwp_conn_send_piece(pwp_conn_t* me_, bt_block_t * req)
 {
     pwp_conn_private_t *me = (void*)me_;
-    char *data = NULL;
-    char *ptr;
-    unsigned int size;
+    char header[4 + 1 + 4 + 4], *block, *ptr = header;
 
     assert(NULL != me);
     assert(NULL != me->cb.write_block_to_stream);
 
-    /* prepare buf */
-    size = 4 + 1 + 4 + 4 + req->len;
-    if (!(data = malloc(size)))
-    {
-        perror("out of memory");
-        exit(0);
-    }
-
-    ptr = data;
-    bitstream_write_uint32(&ptr, fe(size - 4));
+    bitstream_write_uint32(&ptr, fe(sizeof(header) - 4 + req->len));
     bitstream_write_byte(&ptr, PWP_MSGTYPE_PIECE);
     bitstream_write_uint32(&ptr, fe(req->piece_idx));
     bitstream_write_uint32(&ptr, fe(req->offset));
-    me->cb.write_block_to_stream(me->cb_ctx, req, &ptr);
-    __send_to_peer(me, data, size);
+
+    switch (me->cb.send_piece ?
+            me->cb.send_piece(me->cb_ctx, me->peer_udata, req, header,
+                              sizeof(header)) : -1)
+    {
+    case 1:
+        break;
+    case 0:
+        __disconnect(me, "peer dropped connection");
+        break;
+    default:
+        /* we have to copy the block */
+        if (me->cb.alloc_block)
+        {
+            if (!(block = me->cb.alloc_block(me->cb_ctx, req->len)))
+                return 0;
+        }
+        else if (!(block = malloc(req->len)))
+        {
+            perror("out of memory");
+            exit(0);
+        }
+
+        ptr = block;
+        me->cb.write_block_to_stream(me->cb_ctx, req, &ptr);
+        if (__send_to_peer(me, header, sizeof(header)))
+            __send_to_peer(me, block, req->len);
+
+        if (me->cb.free_block)
+            me->cb.free_block(me->cb_ctx, block);
+        else
+            free(block);
+        break;
+    }
 
 #if 0
     #define BYTES_SENT 1
@@ -392,7 +413,7 @@ void pwp_conn_send_piece(pwp_conn_t* me_, bt_block_t * req)
     __log(me, "send,piece,piece_idx=%d offset=%d len=%d",
           req->piece_idx, req->offset, req->len);
 
-    free(data);
+    return 1;
 }
 
 int pwp_conn_send_have(pwp_conn_t* me_, const int piece_idx)
@@ -492,6 +513,18 @@ int pwp_conn_get_npending_peer_requests(const pwp_conn_t* me_)
     return llqueue_count(me->peer_reqs);
 }
 
+int pwp_conn_peek_peer_requests(const pwp_conn_t* me_, bt_block_t* reqs,
+                                const int max)
+{
+    const pwp_conn_private_t * me = (void*)me_;
+    const llqnode_t *n;
+    int i = 0;
+
+    for (n = me->peer_reqs->head; n && i < max; n = n->next)
+        memcpy(&reqs[i++], n->item, sizeof(bt_block_t));
+    return i;
+}
+
 void pwp_conn_request_block_from_peer(pwp_conn_t* me_, bt_block_t * blk)
 {
     pwp_conn_private_t * me = (void*)me_;
@@ -585,13 +618,11 @@ void pwp_conn_periodic(pwp_conn_t* me_)
         goto cleanup;
     }
 
-    /* Send one pending request to the peer */
-    if (0 < llqueue_count(me->peer_reqs))
-    {
-        bt_block_t* b = llqueue_poll(me->peer_reqs);
-        pwp_conn_send_piece(me_, b);
-        free(b);
-    }
+    /* Send one pending request to the peer. If it can't be sent yet it
+     * stays at the front of the queue */
+    if (0 < llqueue_count(me->peer_reqs) &&
+        pwp_conn_send_piece(me_, me->peer_reqs->head->item))
+        free(llqueue_poll(me->peer_reqs));
 
     /* unchoke interested peer */
     if (pwp_conn_peer_is_interested(me_))
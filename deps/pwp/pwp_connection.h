@@ -22,6 +22,28 @@ typedef void (*func_write_block_to_stream_f)(
         bt_block_t *blk,
         char **msg);
 
+/**
+ * Send a PIECE message without copying the block into a buffer
+ * @param header The PIECE message up until the block's data
+ * @return 1 if sent; 0 on failure; -1 if it can't be done this way */
+typedef int (*func_send_piece_f)(
+        void *udata,
+        const void *peer,
+        const bt_block_t *blk,
+        const void *header,
+        const int header_len);
+
+/**
+ * Get a buffer to copy a block into before it's sent
+ * @return buffer of at least len bytes; NULL if none can be had right now */
+typedef void *(*func_alloc_block_f)(
+        void *udata,
+        const unsigned int len);
+
+typedef void (*func_free_block_f)(
+        void *udata,
+        void *buf);
+
 #ifndef HAVE_FUNC_LOG
 #define HAVE_FUNC_LOG
 typedef void (
@@ -172,8 +194,10 @@ int pwp_conn_send_statechange(pwp_conn_t* pco, const unsigned char msg_type);
 /**
  * Send the piece highlighted by this request.
  * @pararm req - the requesting block
+ * @return 1 if sent, or the connection was dropped; 0 if there isn't a
+ *  buffer to copy the block into right now, try again later
  **/
-void pwp_conn_send_piece(pwp_conn_t* pco, bt_block_t * req);
+int pwp_conn_send_piece(pwp_conn_t* pco, bt_block_t * req);
 
 /**
  * Tell peer we have this piece 
@@ -209,6 +233,13 @@ int pwp_conn_get_npending_requests(const pwp_conn_t* pco);
  * @return number of requests we will request from the peer */
 int pwp_conn_get_npending_peer_requests(const pwp_conn_t* pco);
 
+/**
+ * Look at the blocks the peer has requested, in the order we'll send them
+ * @param reqs Filled in with up to max requests
+ * @return number of requests filled in */
+int pwp_conn_peek_peer_requests(const pwp_conn_t* pco, bt_block_t* reqs,
+                                const int max);
+
 /**
  * pend a block request */
 void pwp_conn_request_block_from_peer(pwp_conn_t* pco, bt_block_t * blk);
@@ -230,6 +261,14 @@ typedef struct {
     /* manage piece related operations */
     func_write_block_to_stream_f write_block_to_stream;
 
+    /* optional; tried before write_block_to_stream */
+    func_send_piece_f send_piece;
+
+    /* optional; buffers that write_block_to_stream writes into.
+     * Without them buffers are malloc()ed */
+    func_alloc_block_f alloc_block;
+    func_free_block_f free_block;
+
     /**
      * Ask our caller if they have an idea of what block they would like.
      * We're able to request a block from the peer now.
@@ -12,6 +12,9 @@
 #ifndef BT_H_
 #define BT_H_
 
+/* for uint64_t */
+#include <stdint.h>
+
 #ifndef HAVE_BT_BLOCK_T
 #define HAVE_BT_BLOCK_T
 typedef struct
@@ -42,6 +45,31 @@ typedef int (
     const bt_block_t * blk
     );
 
+/**
+ * We're going to read this block soon; start getting it ready.
+ * Only a hint, so it mustn't wait for the data */
+typedef void (
+*func_prefetch_block_f
+)   (
+    void *udata,
+    void *caller,
+    const bt_block_t * blk
+    );
+
+/**
+ * Find where the block lives on disk, so it can be sent without a copy
+ * The fd belongs to the blockrw, and is only valid until its next call
+ * @param offset Set to the block's offset within the file
+ * @return file descriptor holding all of the block; -1 if there isn't one,
+ *  eg. the block spans files, or the only up to date copy is in memory */
+typedef int (
+*func_block_fd_f
+)   (
+    void *udata,
+    const bt_block_t * blk,
+    uint64_t * offset
+    );
+
 /**
  * @return 0 on error */
 typedef int (
@@ -61,6 +89,26 @@ typedef void *(
     const bt_block_t * blk
     );
 
+typedef struct
+{
+    const void *data;
+    unsigned int len;
+} bt_iovec_t;
+
+/**
+ * Write a block whose data is gathered from several buffers
+ * @param iov Buffers whose lengths add up to blk->len
+ * @return 0 on error */
+typedef int (
+*func_write_blockv_f
+)   (
+    void *udata,
+    void *caller,
+    const bt_block_t * blk,
+    const bt_iovec_t * iov,
+    const int iovcnt
+    );
+
 
 typedef struct
 {
@@ -93,6 +141,9 @@ typedef struct
 
     /* size of array */
     int npeers_size;
+
+    /* bytes of the torrent we've completed; only kept by bt_piecedb */
+    uint64_t completed_bytes;
 } bt_dm_stats_t;
 
 typedef struct
@@ -100,8 +151,56 @@ typedef struct
     func_write_block_f write_block;
     func_read_block_f read_block;
     func_flush_block_f flush_block;
+
+    /* optional */
+    func_prefetch_block_f prefetch_block;
+    func_block_fd_f block_fd;
+    func_write_blockv_f write_blockv;
 } bt_blockrw_i;
 
+/**
+ * An asynchronous block read or write has finished
+ * @param data The block's data when reading. Only valid during the call
+ * @param ok 1 on success; otherwise 0 */
+typedef void (
+*func_block_done_f
+)   (
+    void *cb_udata,
+    const bt_block_t * blk,
+    const void *data,
+    int ok
+    );
+
+/**
+ * Asynchronous counterpart of bt_blockrw_i.
+ * Requests are only guaranteed to be issued, and done callbacks are only
+ * called, from within poll() */
+typedef struct
+{
+    /**
+     * Queue a write. blkdata is copied, so it can be reused straight away
+     * @return 1 if queued; otherwise 0 */
+    int (*submit_write)(void *udata,
+                        const bt_block_t * blk,
+                        const void *blkdata,
+                        func_block_done_f done,
+                        void *cb_udata);
+
+    /**
+     * Queue a read
+     * @return 1 if queued; otherwise 0 */
+    int (*submit_read)(void *udata,
+                       const bt_block_t * blk,
+                       func_block_done_f done,
+                       void *cb_udata);
+
+    /**
+     * Issue queued requests and call done for the ones that have finished
+     * @param wait If 1, block until at least one request has finished
+     * @return number of requests that finished */
+    int (*poll)(void *udata, int wait);
+} bt_blockrw_async_i;
+
 /**
  * Piece info
  * This is how this torrent has */
@@ -163,8 +262,29 @@ typedef struct
      * Get number of pieces */
     int (*get_npieces)(void* r);
 
+    /**
+     * Set how much we want this piece. Optional
+     * @param prio One of BT_PRIORITY_*; pieces start as BT_PRIORITY_NORMAL */
+    void (*set_piece_priority)(void* r, int piece_idx, int prio);
+
+    /**
+     * Set the priority of npieces pieces from piece_idx onwards. Optional;
+     * set_piece_priority is called for each piece otherwise */
+    void (*set_piece_priority_range)(void* r, int piece_idx, int npieces,
+                                     int prio);
+
+    /**
+     * Register this piece as something we no longer have, eg. its data
+     * failed a recheck. Optional */
+    void (*lost_piece)(void *r, int piece_idx);
+
 } bt_pieceselector_i;
 
+/* piece and file priorities; higher priorities are downloaded first */
+#define BT_PRIORITY_SKIP 0
+#define BT_PRIORITY_NORMAL 1
+#define BT_PRIORITY_HIGH 2
+
 #define BT_PEER_ID_LEN 20
 #define BT_VERSION_NUM 1000
 #define BT_BLOCK_SIZE 1 << 14 // 16kb
@@ -187,6 +307,18 @@ typedef struct
 
     /* message handler */
     void* mh;
+
+    /* the furthest piece of this peer's requests we've prefetched;
+     * -1 if none */
+    int prefetch_piece;
+
+    /* how many times in a row the peer's requests moved on to the next
+     * piece */
+    int prefetch_nsequential;
+
+    /* the newest of this peer's requests we've prefetched; len is 0 if
+     * none */
+    bt_block_t prefetch_last;
 } bt_peer_t;
 
 typedef struct
@@ -257,6 +389,26 @@ typedef struct
                      void* conn_ctx,
                      const char *send_data, const int len);
 
+    /**
+     * Send a PIECE message whose block is read straight from a file, eg.
+     * with sendfile(). Optional; without it blocks are copied into a
+     * buffer and sent with peer_send.
+     * The message has to go out after anything peer_send has left
+     * waiting for the connection, and mustn't block. A bt_sendqueue used
+     * by both peer_send and peer_sendfile does this for sockets.
+     * The fd belongs to storage; dup() it to send from it later.
+     *
+     * @param header The message up until the block's data
+     * @param fd File holding the block
+     * @param offset Where the block starts in the file
+     * @param len Length of the block
+     * @return 1 on success; 0 if the connection should be dropped */
+    int (*peer_sendfile)(void* me,
+                         void **udata,
+                         void* conn_ctx,
+                         const char *header, const int header_len,
+                         int fd, uint64_t offset, const unsigned int len);
+
     /**
      * Drop the connection for this peer
      * @return 1 on success, otherwise 0 */
@@ -402,9 +554,63 @@ void *bt_dm_get_piecedb(bt_dm_t* me_);
 void bt_dm_set_piece_db(bt_dm_t* me_, bt_piecedb_i* ipdb, void* piece_db);
 
 /**
- * Scan over downloaded pieces. Assess whether the pieces are complete. */
+ * Write blocks we receive from peers through this asynchronous interface,
+ * instead of through the piece database's blockrw.
+ * A block only counts as downloaded once its write has finished; finished
+ * writes are picked up in bt_dm_periodic().
+ * The piece database still reads through its own (synchronous) blockrw, and
+ * it has to see the same storage.
+ * @param iarw Asynchronous block writer; NULL to write synchronously */
+void bt_dm_set_async_blockrw(bt_dm_t* me_, bt_blockrw_async_i* iarw,
+                             void* udata);
+
+/**
+ * Stop requesting blocks from peers while storage can't keep up
+ * @param is_congested Returns 1 when storage has too much to write, eg.
+ *  bt_diskcache_is_congested(); NULL to always request
+ * @param udata Passed to is_congested */
+void bt_dm_set_write_throttle(bt_dm_t* me_, int (*is_congested)(void* udata),
+                              void* udata);
+
+/**
+ * Where peers' download rates come from. A peer that would get the rest of
+ * a piece within "piece_finish_secs" is given all of it; slower peers are
+ * given a block at a time
+ * @param rate Returns the bt_peer_t's rate in bytes per second; NULL for
+ *  the rate we measure
+ * @param udata Passed to rate */
+void bt_dm_set_peer_rate(bt_dm_t* me_,
+                         int (*rate)(void* udata, const void* peer),
+                         void* udata);
+
+/**
+ * Copy blocks that can't be sent straight from storage into buffers from
+ * this block pool, so that uploads count towards the pool's cap (see
+ * bt_blockpool_new()). While the pool is full, requests wait their turn.
+ * Share the pool with the cache and storage for one cap on block memory
+ * @param pool The pool; NULL to use the heap */
+void bt_dm_set_blockpool(bt_dm_t* me_, void* pool);
+
+/**
+ * Scan over downloaded pieces. Assess whether the pieces are complete.
+ * Pieces that the fast-resume state vouches for aren't re-hashed. */
 void bt_dm_check_pieces(bt_dm_t* me_);
 
+/**
+ * Keep fast-resume state up to date, and use it in bt_dm_check_pieces()
+ * The state is saved every "fastresume_save_interval" seconds if needed
+ * @param fr Fast-resume state from bt_fastresume_new(); NULL to stop */
+void bt_dm_set_fastresume(bt_dm_t* me_, void* fr);
+
+/**
+ * Hash all data straight from the storage files on every core, instead of
+ * validating pieces one at a time through the piece database.
+ * Pieces that are valid are marked as complete; pieces that were complete
+ * but are no longer valid are marked as incomplete, and the piece selector
+ * is told either way. Blocks until done
+ * @param rc Recheck from bt_recheck_new(), with the torrent's files added */
+void bt_dm_recheck(bt_dm_t* me_, void* rc);
+
 /**
  * @return current configuration */
 void* bt_dm_get_config(bt_dm_t* me_);
@@ -418,6 +624,22 @@ void* bt_dm_get_config(bt_dm_t* me_);
 void bt_dm_set_piece_selector(bt_dm_t* me_, bt_pieceselector_i* ips,
                               void* piece_selector);
 
+/**
+ * Set how much we want this piece. Skipped pieces aren't requested.
+ * Passed on to the piece selector; selectors without set_piece_priority
+ * still have skipped pieces filtered out, but can't favour high ones.
+ * bt_filedumper_get_piece_priority() maps file priorities onto pieces
+ * @param prio One of BT_PRIORITY_*; pieces start as BT_PRIORITY_NORMAL.
+ *  Anything else is ignored */
+void bt_dm_set_piece_priority(bt_dm_t* me_, const int idx, const int prio);
+
+/**
+ * Set the priority of npieces pieces from idx onwards, eg. a file's */
+void bt_dm_set_piece_priority_range(bt_dm_t* me_, const int idx,
+                                    const int npieces, const int prio);
+
+int bt_dm_get_piece_priority(bt_dm_t* me_, const int idx);
+
 void *bt_peer_get_conn_ctx(void* pr);
 
 /**
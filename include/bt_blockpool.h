@@ -0,0 +1,78 @@
+#ifndef BT_BLOCKPOOL_H_
+#define BT_BLOCKPOOL_H_
+
+typedef struct
+{
+    /* buffers handed out and not yet released */
+    int in_use;
+
+    /* most buffers we will hand out */
+    int max;
+
+    /* slabs that have been backed with memory so far */
+    int nslabs;
+
+    /* slabs handed out whole, by bt_blockpool_alloc_span() */
+    int nslabs_span;
+
+    /* slabs from the reserved huge page pool (MAP_HUGETLB); the others
+     * are left to transparent huge pages */
+    int nslabs_huge;
+} bt_blockpool_stats_t;
+
+/**
+ * A pool of BT_BLOCK_SIZE buffers, for passing block data between the
+ * network, cache and disk layers without copying it.
+ *
+ * Buffers are reference counted; whoever takes a reference releases it
+ * with bt_blockpool_unref(), and the last release returns the buffer to the
+ * pool. Buffers are carved out of 2MB slabs that are backed by huge pages
+ * where the OS lets us. Each thread keeps a few free buffers for itself, so
+ * most allocations don't need the pool's lock.
+ *
+ * Memory that has to be contiguous, such as a cache's slots, can be had
+ * from the same pool as spans of whole slabs. Buffers and spans together
+ * never use more than the pool's cap.
+ *
+ * @param max_bytes Most memory the pool will use; at least one slab
+ * @return newly initialised pool; NULL if the address space can't be had */
+void *bt_blockpool_new(const uint64_t max_bytes);
+
+/**
+ * Release all memory used by the pool.
+ * Buffers that are still referenced become invalid */
+void bt_blockpool_free(void *bpo);
+
+/**
+ * @return a buffer with one reference; NULL if the pool is exhausted */
+void *bt_blockpool_alloc(void *bpo);
+
+/**
+ * Take another reference to the buffer
+ * @param buf Anywhere within a buffer from this pool */
+void bt_blockpool_ref(void *bpo, const void *buf);
+
+/**
+ * Drop a reference to the buffer
+ * @param buf Anywhere within a buffer from this pool */
+void bt_blockpool_unref(void *bpo, const void *buf);
+
+/**
+ * Take whole slabs, side by side. Spans aren't reference counted.
+ * The memory isn't zeroed
+ * @param len Bytes wanted; rounded up to whole slabs
+ * @return the span; NULL if the pool doesn't have room */
+void *bt_blockpool_alloc_span(void *bpo, const uint64_t len);
+
+/**
+ * Give the span back; its slabs can be used for buffers or other spans
+ * @param span As returned by bt_blockpool_alloc_span() */
+void bt_blockpool_free_span(void *bpo, void *span);
+
+/**
+ * @return 1 if the memory is within a buffer from this pool; otherwise 0 */
+int bt_blockpool_owns(void *bpo, const void *buf);
+
+void bt_blockpool_get_stats(void *bpo, bt_blockpool_stats_t *stats);
+
+#endif /* BT_BLOCKPOOL_H_ */
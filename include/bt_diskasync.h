@@ -0,0 +1,19 @@
+#ifndef BT_DISKASYNC_H_
+#define BT_DISKASYNC_H_
+
+/**
+ * Wrap a synchronous blockrw so it can be used as a bt_blockrw_async_i.
+ * The I/O happens when requests are submitted; the done callbacks are
+ * called from poll(), like an asynchronous backend would */
+void *bt_diskasync_new(bt_blockrw_i * irw, void *irw_udata);
+
+void bt_diskasync_free(void *dao);
+
+/**
+ * Copy read data into buffers from this bt_blockpool. A done callback can
+ * bt_blockpool_ref() the data to keep it after the callback returns */
+void bt_diskasync_set_blockpool(void *dao, void *pool);
+
+bt_blockrw_async_i *bt_diskasync_get_blockrw_async(void *dao);
+
+#endif /* BT_DISKASYNC_H_ */
@@ -2,6 +2,24 @@
 #ifndef BT_DISKCACHE_H_
 #define BT_DISKCACHE_H_
 
+typedef struct
+{
+    /* reads served from the cache */
+    uint64_t hits;
+
+    /* reads that had to go to disk */
+    uint64_t misses;
+
+    /* pieces removed from the cache to make room */
+    uint64_t evictions;
+
+    /* runs of dirty blocks written to disk */
+    uint64_t writebacks;
+
+    /* bytes waiting to be written to disk */
+    uint64_t dirty_bytes;
+} bt_diskcache_stats_t;
+
 void bt_diskcache_set_func_log(
     void * dco,
     func_log_f log,
@@ -10,6 +28,10 @@ void bt_diskcache_set_func_log(
 
 void *bt_diskcache_new() ;
 
+/**
+ * Write dirty data to disk and release all memory */
+void bt_diskcache_free(void *dco);
+
 void bt_diskcache_set_size(
     void *dco,
     const int piece_bytes_size
@@ -25,6 +47,46 @@ void bt_diskcache_set_disk_blockrw(
 
 bt_blockrw_i *bt_diskcache_get_blockrw( void *dco);
 
+/**
+ * Keep at most this many bytes of pieces in memory. Defaults to 64MB.
+ * At least one piece is always cached */
+void bt_diskcache_set_budget(void *dco, const uint64_t bytes);
+
+/**
+ * Take the cache's memory from this block pool (see bt_blockpool_new()),
+ * so that it counts towards the pool's cap. If the pool can't spare the
+ * budget, fewer pieces are cached; if it can't spare one piece, that piece
+ * is cached on the heap
+ * @param pool The pool; NULL to use the heap */
+void bt_diskcache_set_blockpool(void *dco, void *pool);
+
+/**
+ * Dirty data starts being written in the background above the low
+ * watermark. Above the high watermark the cache is congested; without a
+ * write-behind thread, writes wait for dirty data to be written back.
+ * Default to a quarter and half of the budget */
+void bt_diskcache_set_dirty_watermarks(void *dco, const uint64_t low,
+                                       const uint64_t high);
+
+/**
+ * Start or stop the thread that writes dirty data in the background
+ * @return 1 on success; otherwise 0 */
+int bt_diskcache_set_writebehind(void *dco, const int on);
+
+/**
+ * @return 1 if there's more dirty data than the high watermark, ie. we
+ *  should stop asking for blocks; otherwise 0 */
+int bt_diskcache_is_congested(void *dco);
+
+/**
+ * By default a read that misses only reads the blocks it covers from disk.
+ * With read-ahead on, a miss reads the rest of the piece in too, which pays
+ * off when the piece's other blocks will be read soon
+ * @param whole_piece 1 to read whole pieces on a miss; otherwise 0 */
+void bt_diskcache_set_readahead(void *dco, const int whole_piece);
+
+void bt_diskcache_get_stats(void *dco, bt_diskcache_stats_t *stats);
+
 /**
  * put all pieces onto disk */
 void bt_diskcache_disk_dump( void *dco);
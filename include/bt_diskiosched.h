@@ -0,0 +1,67 @@
+#ifndef BT_DISKIOSCHED_H_
+#define BT_DISKIOSCHED_H_
+
+typedef struct
+{
+    /* writes waiting to be dispatched */
+    int depth;
+    uint64_t depth_bytes;
+
+    /* deepest the queue has been */
+    int max_depth;
+
+    /* writes we've been given */
+    uint64_t writes_in;
+
+    /* writes made to the disk blockrw; writes_in / writes_out is the
+     * merge ratio */
+    uint64_t writes_out;
+
+    /* batches dispatched */
+    uint64_t dispatches;
+} bt_diskiosched_stats_t;
+
+/**
+ * A blockrw that sits in front of the disk blockrw, and holds writes back
+ * so they can be written in (file, offset) order. Writes that follow on
+ * from each other are merged into one write_blockv.
+ *
+ * Reads, flushes and block_fd calls that touch queued writes dispatch the
+ * queue first, so they always see the latest data.
+ *
+ * Writes succeed once they're queued. If they fail to reach the disk, the
+ * next flush_block that covers them fails instead.
+ *
+ * Like the disk blockrws it isn't thread safe; bt_diskcache only calls it
+ * while holding its disk lock */
+void *bt_diskiosched_new();
+
+/**
+ * Dispatch queued writes and release all memory */
+void bt_diskiosched_free(void *dio);
+
+/**
+ * Piece_length is required for putting blocks in order */
+void bt_diskiosched_set_piece_length(void *dio, const int piece_length);
+
+/**
+ * Set the blockrw that we want to use to write to disk */
+void bt_diskiosched_set_disk_blockrw(void *dio, bt_blockrw_i * irw,
+                                     void *irw_data);
+
+bt_blockrw_i *bt_diskiosched_get_blockrw(void *dio);
+
+/**
+ * Dispatch the queue once this many bytes are waiting. Defaults to 4MB */
+void bt_diskiosched_set_batch(void *dio, const uint64_t bytes);
+
+/**
+ * Write everything that's queued
+ * @return 1 on success; 0 if a write failed */
+int bt_diskiosched_dispatch(void *dio);
+
+void bt_diskiosched_get_stats(void *dio, bt_diskiosched_stats_t *stats);
+
+void bt_diskiosched_set_func_log(void *dio, func_log_f log, void *udata);
+
+#endif /* BT_DISKIOSCHED_H_ */
@@ -2,12 +2,51 @@
 #ifndef BT_DISKMEM_H_
 #define BT_DISKMEM_H_
 
+/* malloc()'d memory */
+#define BT_DISKMEM_BACKING_HEAP 0
+
+/* reserved huge pages, otherwise transparent huge pages */
+#define BT_DISKMEM_BACKING_HUGEPAGES 1
+
+/* a memfd, so that blocks can be sent with sendfile() */
+#define BT_DISKMEM_BACKING_MEMFD 2
+
+/* a span from a block pool; see bt_diskmem_set_blockpool() */
+#define BT_DISKMEM_BACKING_BLOCKPOOL 3
+
 void *bt_diskmem_new();
 
 void bt_diskmem_free( void *dco);
 
+/**
+ * Set the piece length. Unless bt_diskmem_set_total_size() has been
+ * called, room is made for 10 pieces, and grows as blocks are written */
 void bt_diskmem_set_size(void *dco, const int piece_bytes_size);
 
+/**
+ * Memory to use for bt_diskmem_set_total_size(); BT_DISKMEM_BACKING_*.
+ * Linux only; elsewhere, and if the backing can't be had, the heap is used */
+void bt_diskmem_set_backing(void *dco, const int backing);
+
+/**
+ * Take all memory from this block pool (see bt_blockpool_new()), so that
+ * it counts towards the pool's cap. Writes that would need more memory than
+ * the pool can spare fail. Overrides bt_diskmem_set_backing().
+ * Call before bt_diskmem_set_size() or bt_diskmem_set_total_size() */
+void bt_diskmem_set_blockpool(void *dco, void *pool);
+
+/**
+ * @return the BT_DISKMEM_BACKING_* that's holding the data */
+int bt_diskmem_get_backing(void *dco);
+
+/**
+ * Allocate room for the whole torrent up front. The memory never moves or
+ * grows; blocks written past the end fail, and all of it reads as zeros
+ * until written.
+ * @param bytes Total length of the torrent
+ * @return 1 on success; otherwise 0 */
+int bt_diskmem_set_total_size(void *dco, const uint64_t bytes);
+
 bt_blockrw_i *bt_diskmem_get_blockrw( void *dco);
 
 int bt_diskmem_write_block(
@@ -0,0 +1,54 @@
+#ifndef BT_DISKMMAP_H_
+#define BT_DISKMMAP_H_
+
+#define BT_DISKMMAP_ADVICE_NORMAL 0
+#define BT_DISKMMAP_ADVICE_SEQUENTIAL 1
+#define BT_DISKMMAP_ADVICE_RANDOM 2
+
+/**
+ * A disk layer that memory maps the torrent's files.
+ * Reads return pointers into the mapping, unless the block straddles two
+ * files. Files are created at their full (sparse) size when first mapped.
+ * Disk space is allocated before bytes are written, so a full disk fails
+ * the write instead of raising SIGBUS */
+void *bt_diskmmap_new();
+
+void bt_diskmmap_free(void *dmo);
+
+/**
+ * Piece_length is required for figuring out where we are writing blocks */
+void bt_diskmmap_set_piece_length(void *dmo, const int piece_size);
+
+void bt_diskmmap_set_cwd(void *dmo, const char *path);
+
+/**
+ * Add the next file of the torrent
+ * @param fname file name, relative to cwd. Components that would take it
+ *  out of cwd, like ".." or a leading "/", are dropped
+ * @param fname_len length of fname
+ * @param size length in bytes of the file */
+void bt_diskmmap_add_file(void *dmo, const char *fname, int fname_len,
+                          const uint64_t size);
+
+/**
+ * Tell the kernel how we're going to access the data
+ * eg. BT_DISKMMAP_ADVICE_SEQUENTIAL when seeding a recheck or a streaming
+ * download; BT_DISKMMAP_ADVICE_RANDOM when seeding to many peers */
+void bt_diskmmap_set_advice(void *dmo, const int advice);
+
+/**
+ * Decide how the files' disk space is allocated.
+ * BT_FILEDUMPER_ALLOC_SPARSE (the default) allocates each write's bytes as
+ * they're written. BT_FILEDUMPER_ALLOC_FULL allocates a file when it's first
+ * mapped, and fails the mapping if there's no room.
+ * @param mode One of BT_FILEDUMPER_ALLOC_* */
+void bt_diskmmap_set_allocation(void *dmo, const int mode);
+
+/**
+ * For BT_FILEDUMPER_ALLOC_ON_WRITE, allocate this many bytes of a file at a
+ * time. Defaults to 16MB */
+void bt_diskmmap_set_allocation_region(void *dmo, const uint64_t size);
+
+bt_blockrw_i *bt_diskmmap_get_blockrw(void *dmo);
+
+#endif /* BT_DISKMMAP_H_ */
@@ -0,0 +1,51 @@
+#ifndef BT_DISKURING_H_
+#define BT_DISKURING_H_
+
+/**
+ * A disk layer that reads and writes the torrent's files through io_uring.
+ * Requests are batched and only handed to the kernel on poll(). Files are
+ * registered with the ring, and block sized requests use registered buffers.
+ *
+ * Where io_uring isn't available (not Linux, old kernel, seccomp) the same
+ * interface is served with pread()/pwrite().
+ *
+ * @param entries Size of the submission queue; 0 to not use io_uring
+ * @return newly initialised disk layer */
+void *bt_diskuring_new(const unsigned int entries);
+
+void bt_diskuring_free(void *duo);
+
+/**
+ * @return 1 if requests go through io_uring; 0 if we've fallen back */
+int bt_diskuring_is_async(void *duo);
+
+/**
+ * Piece_length is required for figuring out where we are writing blocks */
+void bt_diskuring_set_piece_length(void *duo, const int piece_size);
+
+void bt_diskuring_set_cwd(void *duo, const char *path);
+
+/**
+ * Add the next file of the torrent
+ * @param fname file name, relative to cwd. Components that would take it
+ *  out of cwd, like ".." or a leading "/", are dropped
+ * @param fname_len length of fname
+ * @param size length in bytes of the file */
+void bt_diskuring_add_file(void *duo, const char *fname, int fname_len,
+                           const uint64_t size);
+
+/**
+ * Take buffers from this bt_blockpool once the registered buffers run out.
+ * A done callback can bt_blockpool_ref() read data to keep it */
+void bt_diskuring_set_blockpool(void *duo, void *pool);
+
+bt_blockrw_async_i *bt_diskuring_get_blockrw_async(void *duo);
+
+/**
+ * Synchronous interface over the same files, eg. for the piece database.
+ * Each call waits for its request; other requests that finish in the
+ * meantime have their callbacks called.
+ * read_block's data is valid until the next read */
+bt_blockrw_i *bt_diskuring_get_blockrw(void *duo);
+
+#endif /* BT_DISKURING_H_ */
@@ -0,0 +1,74 @@
+#ifndef BT_FASTRESUME_H_
+#define BT_FASTRESUME_H_
+
+/**
+ * Fast-resume state
+ *
+ * A small file that remembers which pieces we have, the size and mtime of
+ * every file at the time we last vouched for it, and which blocks of
+ * unfinished pieces are already on disk. On startup a piece only needs to be
+ * re-hashed if a file it spans has changed behind our back. */
+
+#define BT_FASTRESUME_UNKNOWN 0
+#define BT_FASTRESUME_COMPLETE 1
+#define BT_FASTRESUME_INCOMPLETE 2
+
+/**
+ * @param path Where the resume file lives
+ * @return newly initialised fast-resume state */
+void* bt_fastresume_new(const char* path,
+                        const unsigned int npieces,
+                        const unsigned int piece_len);
+
+void bt_fastresume_free(void* fr);
+
+/**
+ * Add the next file of the torrent.
+ * Files need to be added in torrent order, before bt_fastresume_load()
+ * @param size Length of the file according to the torrent */
+void bt_fastresume_add_file(void* fr, const char* path, const uint64_t size);
+
+/**
+ * Read the resume file and stat every file.
+ * Pieces that span a file whose size or mtime differs from what was recorded
+ * are left as BT_FASTRESUME_UNKNOWN
+ * @return 1 if the resume file was read; 0 if it's missing or for a
+ *  different torrent */
+int bt_fastresume_load(void* fr);
+
+/**
+ * Write everything out to a temporary file and rename it over the resume
+ * file, so that a crash leaves either the old or the new state behind.
+ * The file and its directory are synced before we return
+ * @return 1 on success; otherwise 0 */
+int bt_fastresume_save(void* fr);
+
+/**
+ * @return 1 if there's state that only bt_fastresume_save() will persist */
+int bt_fastresume_is_dirty(void* fr);
+
+/**
+ * @return BT_FASTRESUME_COMPLETE or BT_FASTRESUME_INCOMPLETE if the resume
+ *  file can be trusted about this piece; otherwise BT_FASTRESUME_UNKNOWN */
+int bt_fastresume_get_piece_state(void* fr, const unsigned int idx);
+
+/**
+ * Record that this piece has been validated.
+ * The resume file is updated in place if it's in step with us.
+ * @param yes 1 if the piece is complete; 0 if it isn't */
+void bt_fastresume_mark_complete(void* fr, const unsigned int idx,
+                                 const int yes);
+
+/**
+ * Record that this block has been written to disk.
+ * Only whole BT_BLOCK_SIZE blocks are remembered */
+void bt_fastresume_mark_block(void* fr, const bt_block_t* blk);
+
+/**
+ * Iterate over the blocks of this piece that were on disk last session
+ * @param iter Iterator. Starts at 0
+ * @return 1 if blk was filled in; 0 when there are no more blocks */
+int bt_fastresume_get_partial(void* fr, const unsigned int idx,
+                              bt_block_t* blk, int* iter);
+
+#endif /* BT_FASTRESUME_H_ */
@@ -1,14 +1,20 @@
-
 #ifndef BT_FILEDUMPER_H_
 #define BT_FILEDUMPER_H_
 
+typedef struct
+{
+    /* fdatasync() calls */
+    uint64_t syncs;
+} bt_filedumper_stats_t;
+
 int bt_filedumper_write_block(
     void *flo,
     void *caller __attribute__((__unused__)),
     const bt_block_t * blk,
     const void *data);
 
-
+/**
+ * The data is only valid until the next read */
 void *bt_filedumper_read_block(
     void *flo,
     void *caller __attribute__((__unused__)),
@@ -17,11 +23,14 @@ void *bt_filedumper_read_block(
 
 void *bt_filedumper_new();
 
+void bt_filedumper_free(void* fl);
+
 /**
  * Add this file to the bittorrent client
  * This is used for adding new files.
  *
- * @param fname file name
+ * @param fname file name, relative to cwd. Components that would take it
+ *  out of cwd, like ".." or a leading "/", are dropped
  * @param fname_len length of fname
  * @param flen length in bytes of the file
  * @return 1 on sucess; otherwise 0 */
@@ -29,7 +38,7 @@ void bt_filedumper_add_file(
     void* fl,
     const char *fname,
     int fname_len,
-    const int size);
+    const uint64_t size);
 
 int bt_filedumper_get_nfiles( void * fl);
 
@@ -46,8 +55,67 @@ void bt_filedumper_set_piece_length( void * fl, const int piece_size);
 
 void bt_filedumper_set_cwd( void * fl, const char *path);
 
+/**
+ * Files are closed least recently used first when we have more than this
+ * many open */
+void bt_filedumper_set_max_open_files(void * fl, const int max);
+
+enum {
+    /* blocks take up space as they're written (the default) */
+    BT_FILEDUMPER_ALLOC_SPARSE,
+    /* every file has all its space allocated when it's added */
+    BT_FILEDUMPER_ALLOC_FULL,
+    /* a region's space is allocated when the first block is written to it */
+    BT_FILEDUMPER_ALLOC_ON_WRITE,
+};
+
+/**
+ * Decide how the files' disk space is allocated.
+ * Allocating ahead of writes keeps files from fragmenting when pieces arrive
+ * out of order.
+ * With BT_FILEDUMPER_ALLOC_FULL files that have already been added are
+ * allocated straight away, so the cwd needs to have been set.
+ * @param mode One of BT_FILEDUMPER_ALLOC_* */
+void bt_filedumper_set_allocation(void * fl, const int mode);
+
+/**
+ * For BT_FILEDUMPER_ALLOC_ON_WRITE, allocate this many bytes of the torrent
+ * at a time. Defaults to 16MB */
+void bt_filedumper_set_allocation_region(void * fl, const uint64_t size);
+
+/**
+ * Open files with O_DIRECT, bypassing the page cache; eg. when a bt_diskcache
+ * in front of us should be the only cache. Where the filesystem doesn't
+ * support it files are opened normally.
+ * Uploads aren't offered to sendfile() in this mode
+ * @param on 1 for direct I/O; 0 for buffered I/O (the default) */
+void bt_filedumper_set_direct_io(void * fl, const int on);
+
 /**
  * @return total file size in bytes */
-unsigned int bt_filedumper_get_total_size(void * fl);
+uint64_t bt_filedumper_get_total_size(void * fl);
+
+/**
+ * Set how much we want this file.
+ * A skipped file isn't created. Blocks of pieces it shares with wanted files
+ * still get written, and go to the part-file; when the file stops being
+ * skipped they are moved into it.
+ * Don't call this while blocks are being written
+ * @param priority One of BT_PRIORITY_*; files start as BT_PRIORITY_NORMAL */
+void bt_filedumper_set_file_priority(void * fl, const int idx,
+                                     const int priority);
+
+int bt_filedumper_get_file_priority(void * fl, const int idx);
+
+/**
+ * Work out a piece's priority from the files it covers
+ * @return the highest priority of the files the piece touches */
+int bt_filedumper_get_piece_priority(void * fl, const unsigned int piece_idx);
+
+/**
+ * Name the part-file, relative to the cwd. Defaults to ".parts" */
+void bt_filedumper_set_partfile(void * fl, const char *name);
+
+void bt_filedumper_get_stats(void * fl, bt_filedumper_stats_t *stats);
 
 #endif /* BT_FILEDUMPER_H_ */
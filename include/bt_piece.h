@@ -1,6 +1,20 @@
 #ifndef BT_PIECE_H
 #define BT_PIECE_H
 
+#define BT_PIECE_STATE_DOWNLOADED 1
+#define BT_PIECE_STATE_COMPLETE 2
+
+/**
+ * Called when the piece becomes, or stops being, downloaded or complete
+ * @param state BT_PIECE_STATE_* bits */
+typedef void (
+*func_piece_state_f
+)   (
+    void *udata,
+    bt_piece_t *me,
+    int state
+    );
+
 /**
  * @return newly initialised piece */
 bt_piece_t *bt_piece_new(
@@ -38,6 +52,10 @@ int bt_piece_is_downloaded(bt_piece_t * me);
 
 int bt_piece_is_fully_requested(bt_piece_t * me);
 
+/**
+ * @return number of bytes that haven't been requested yet */
+unsigned int bt_piece_get_nbytes_unrequested(bt_piece_t * me);
+
 /**
  * Get peers based off iterator
  * @param iter Iterator that we use to obtain the next peer. Starts at 0
@@ -63,6 +81,18 @@ void bt_piece_poll_block_request(bt_piece_t * me, bt_block_t * request);
 
 void bt_piece_giveback_block(bt_piece_t * me, bt_block_t * b);
 
+/**
+ * Get the next block that has been requested but hasn't arrived yet; so
+ * that it can be requested from another peer too
+ * @param iter Where to carry on from; start at 0
+ * @return 1 if there's a block; otherwise 0 */
+int bt_piece_poll_missing_block(bt_piece_t * me, bt_block_t * request,
+                                int *iter);
+
+/**
+ * @return 1 if we already have this block; otherwise 0 */
+int bt_piece_have_block(bt_piece_t * me, const bt_block_t * b);
+
 void bt_piece_set_complete(bt_piece_t * me, int yes);
 
 void bt_piece_set_idx(bt_piece_t * me, const int idx);
@@ -116,9 +146,18 @@ int bt_piece_write_block(
     const void *b_data,
     void* peer);
 
+/**
+ * Mark this block as downloaded without writing it.
+ * Used to restore progress that's already on disk from a previous session,
+ * and when the block was written by someone else (eg. asynchronously)
+ * @param peer The peer who gave us the block; NULL if nobody did
+ * @return 1 on success, 2 if now completely downloaded */
+int bt_piece_set_block_downloaded(bt_piece_t *me, const bt_block_t * b,
+                                  void* peer);
+
 /**
  * Write the block to the byte stream
- * I/O performed.
+ * I/O performed; only the block's range is read from storage.
  * @return 1 on success, 0 otherwise */
 int bt_piece_write_block_to_stream(
     bt_piece_t * me,
@@ -126,17 +165,39 @@ int bt_piece_write_block_to_stream(
     char ** msg);
 
 /**
- * I/O performed.
+ * Copy the block into out
+ * I/O performed; only the block's range is read from storage.
  * @return 1 on success, 0 otherwise */
-int bt_piece_write_block_to_stream(
+int bt_piece_write_block_to_str(
     bt_piece_t * me,
     bt_block_t * blk,
-    char ** msg);
+    char * out);
 
 void bt_piece_set_disk_blockrw(
         bt_piece_t *me,
         bt_blockrw_i * irw,
         void *udata);
 
+/**
+ * Let storage know that we'll be reading part of this piece soon
+ * @param blk Range of the piece; NULL for the whole piece */
+void bt_piece_prefetch(bt_piece_t *me, const bt_block_t *blk);
+
+/**
+ * Make sure the piece's data has reached the disk
+ * @return 1 on success; 0 if any of it couldn't be written */
+int bt_piece_flush(bt_piece_t *me);
+
+/**
+ * Find the file the block can be sent from without copying it
+ * @param offset Set to the block's offset within the file
+ * @return file descriptor; -1 if the block can't be sent from a file */
+int bt_piece_get_block_fd(bt_piece_t *me, const bt_block_t *blk,
+                          uint64_t *offset);
+
+/**
+ * Observe downloaded/complete transitions of this piece */
+void bt_piece_set_state_cb(bt_piece_t *me, func_piece_state_f cb, void *udata);
+
 
 #endif /* BT_PIECE_H */
@@ -4,6 +4,18 @@
 /* piece database */
 typedef void* bt_piecedb_t;
 
+/**
+ * The start of the piece database's private struct.
+ * Exposed so that bt_piecedb_get_fast() can be inlined; don't modify. */
+typedef struct
+{
+    /* pieces indexed by piece idx; NULL if not materialized yet */
+    bt_piece_t **pieces;
+
+    /* number of slots in pieces */
+    unsigned int size;
+} bt_piecedb_table_t;
+
 /**
  * @return newly initialised piece database */
 bt_piecedb_t *bt_piecedb_new();
@@ -13,13 +25,42 @@ bt_piecedb_t *bt_piecedb_new();
  * @return piece specified by piece_idx; otherwise NULL */
 void *bt_piecedb_get(void* dbo, const unsigned int idx);
 
-#if 0 /* planned for future */
 /**
- * @return 1 if we have npieces pieces from idx */
-int bt_piecedb_contains_piecerange(void* dbo, 
+ * Same as bt_piecedb_get(), but a piece that's already materialized is
+ * returned without a function call. */
+static inline void *bt_piecedb_get_fast(void* dbo, const unsigned int idx)
+{
+    const bt_piecedb_table_t *t = dbo;
+
+    if (idx < t->size && t->pieces[idx])
+        return t->pieces[idx];
+    return bt_piecedb_get(dbo, idx);
+}
+
+/**
+ * Mark this piece as complete without materializing it.
+ * For when we already know we have the piece, eg. from fast-resume */
+void bt_piecedb_set_complete(bt_piecedb_t * db, const unsigned int idx);
+
+/**
+ * Forget that this piece is complete, and any progress on it.
+ * For when its data turns out to be bad, eg. after a recheck */
+void bt_piecedb_clear_complete(bt_piecedb_t * db, const unsigned int idx);
+
+/**
+ * Amortized O(1) via the rank index over completed pieces. The first query
+ * after pieces change state refreshes the stale part of the index, which is
+ * O(npieces / 512)
+ * @return 1 if we have completed npieces pieces from idx */
+int bt_piecedb_contains_piecerange(void* dbo,
     const unsigned int idx,
     const unsigned int pieces);
-#endif
+
+/**
+ * Select the nth (starting at 0) completed piece
+ * O(log npieces) over the rank index, plus the same refresh as above
+ * @return idx of the piece; otherwise -1 if fewer pieces are complete */
+int bt_piecedb_nth_completed(bt_piecedb_t * db, const unsigned int n);
 
 /**
  * @return number of pieces */
@@ -37,12 +78,19 @@ int bt_piecedb_add(bt_piecedb_t * db, unsigned int npieces);
 void bt_piecedb_remove(bt_piecedb_t * db, int idx);
 
 /**
- * @return number of pieces downloaded */
+ * O(1); maintained as pieces change state
+ * @return number of pieces completed */
 int bt_piecedb_get_num_completed(bt_piecedb_t * db);
 
 /**
+ * O(1); maintained as pieces change state
  * @return number of pieces downloaded */
-int bt_piecedb_get_num_completed(bt_piecedb_t * db);
+int bt_piecedb_get_num_downloaded(bt_piecedb_t * db);
+
+/**
+ * O(1); maintained as pieces change state
+ * @return sum of the sizes of completed pieces in bytes */
+uint64_t bt_piecedb_get_completed_bytes(bt_piecedb_t * db);
 
 /**
  * @return 1 if all complete, 0 otherwise */
@@ -54,9 +102,17 @@ void bt_piecedb_print_pieces_downloaded(bt_piecedb_t * db);
 
 /**
  * Increase total file size by this file's size */
-void bt_piecedb_increase_piece_space(bt_piecedb_t* db, const int size);
+void bt_piecedb_increase_piece_space(bt_piecedb_t* db, const uint64_t size);
+
+void bt_piecedb_set_tot_file_size(bt_piecedb_t * db,
+                                  const uint64_t tot_file_size_bytes);
+
+/**
+ * @return length of the torrent in bytes */
+uint64_t bt_piecedb_get_tot_file_size(bt_piecedb_t * db);
 
 /**
+ * O(1)
  * @return 1 if all complete, 0 otherwise */
 int bt_piecedb_all_pieces_are_complete(bt_piecedb_t* db);
 
@@ -71,4 +127,14 @@ int bt_piecedb_add_with_hash_and_size(bt_piecedb_t * db,
 
 int bt_piecedb_add_at_idx(bt_piecedb_t * db, unsigned int npieces, int idx);
 
+/**
+ * Add all the pieces of a torrent in one go.
+ * Nothing is allocated per piece; pieces are materialized on first access.
+ * If the database is empty the hashes are used in place, therefore
+ * info->pieces_hash must outlive the database.
+ * @param tot_file_size_bytes Length of the torrent. Sizes the last piece
+ * @return idx of the first piece; otherwise -1 on error */
+int bt_piecedb_add_from_info(bt_piecedb_t * db,
+    const bt_piece_info_t * info, const uint64_t tot_file_size_bytes);
+
 #endif /* BT_PIECE_DB_H */
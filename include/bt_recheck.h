@@ -0,0 +1,49 @@
+#ifndef BT_RECHECK_H_
+#define BT_RECHECK_H_
+
+/**
+ * Hash every piece of the torrent straight from the storage files.
+ * Pieces are handed out in file order to a pool of threads, so that the
+ * disk streams sequentially while every core hashes. */
+
+/**
+ * Called as pieces are hashed. Calls are serialised
+ * @param ndone Number of pieces hashed so far
+ * @param npieces Number of pieces in total */
+typedef void (
+*func_recheck_progress_f
+)   (
+    void *udata,
+    unsigned int ndone,
+    unsigned int npieces
+    );
+
+/**
+ * @param info Hashes and piece length. Hashes must outlive the recheck
+ * @return newly initialised recheck */
+void* bt_recheck_new(const bt_piece_info_t* info);
+
+void bt_recheck_free(void* rc);
+
+/**
+ * Add the next file of the torrent. Files need to be added in torrent order
+ * @param size Length of the file according to the torrent */
+void bt_recheck_add_file(void* rc, const char* path, const uint64_t size);
+
+/**
+ * @param nthreads Number of hashing threads; 0 for one per core */
+void bt_recheck_set_nthreads(void* rc, const int nthreads);
+
+void bt_recheck_set_progress_cb(void* rc, func_recheck_progress_f cb,
+                                void* udata);
+
+/**
+ * Hash everything. Blocks until done
+ * @return number of valid pieces */
+int bt_recheck_run(void* rc);
+
+/**
+ * @return 1 if the piece matched its hash during the last run; otherwise 0 */
+int bt_recheck_piece_is_valid(void* rc, const unsigned int idx);
+
+#endif /* BT_RECHECK_H_ */
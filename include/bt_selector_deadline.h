@@ -0,0 +1,102 @@
+#ifndef BT_SELECTOR_DEADLINE_H
+#define BT_SELECTOR_DEADLINE_H
+
+typedef struct
+{
+    /* pieces in the window that arrived on time */
+    int nmet;
+
+    /* pieces in the window that arrived after their deadline */
+    int nmissed;
+
+    /* urgent pieces we asked a second, faster peer for */
+    int nduplicates;
+} bt_deadline_selector_stats_t;
+
+/**
+ * @return the current time in milliseconds */
+typedef uint64_t (*func_now_ms_f)(void* udata);
+
+/**
+ * @return how fast we're downloading from this peer, in bytes per second */
+typedef int (*func_peer_rate_f)(void* udata, const void* peer);
+
+/**
+ * A selector for streaming. Pieces from the playhead onwards, up to the
+ * window's length, get deadlines; the earliest deadline is polled first,
+ * and only by peers that look fast enough to make it. A piece that's about
+ * to miss its deadline is polled again by a faster peer, so that the two
+ * peers race for it.
+ * Everything outside the window is selected rarest first. */
+void *bt_deadline_selector_new(int npieces);
+
+void bt_deadline_selector_free(void *r);
+
+/**
+ * Add this piece back to the selector.
+ * @param peer The peer that was downloading it; NULL for all of them */
+void bt_deadline_selector_giveback_piece(void *r, void *peer, int piece_idx);
+
+/**
+ * Notify selector that we have this piece */
+void bt_deadline_selector_have_piece(void *r, int piece_idx);
+
+/**
+ * Notify selector that we no longer have this piece */
+void bt_deadline_selector_lost_piece(void *r, int piece_idx);
+
+void bt_deadline_selector_remove_peer(void *r, void *peer);
+
+void bt_deadline_selector_add_peer(void *r, void *peer);
+
+/**
+ * Let us know that there is a peer who has this piece */
+void bt_deadline_selector_peer_have_piece(void *r, void *peer, int piece_idx);
+
+int bt_deadline_selector_get_npeers(void *r);
+
+int bt_deadline_selector_get_npieces(void *r);
+
+/**
+ * Poll best piece from peer
+ * @param r deadline object
+ * @param peer Best piece in context of this peer
+ * @return idx of piece which is best; otherwise -1 */
+int bt_deadline_selector_poll_best_piece(void *r, const void *peer);
+
+/**
+ * Move the playhead. Pieces entering the window are given deadlines one
+ * piece's playing time apart, starting one piece's playing time from now */
+void bt_deadline_selector_set_playhead(void *r, int piece_idx);
+
+/**
+ * Pieces entering the window from the current playhead get deadlines, as
+ * with bt_deadline_selector_set_playhead()
+ * @param npieces Number of pieces from the playhead that have deadlines
+ * @param piece_ms How long it takes to play a piece */
+void bt_deadline_selector_set_window(void *r, int npieces, int piece_ms);
+
+/**
+ * Required for working out if a peer can download a piece in time */
+void bt_deadline_selector_set_piece_length(void *r, unsigned int piece_len);
+
+/**
+ * Tell us how fast peers are. With bt_dm the peer is a bt_peer_t, and
+ * pwp_conn_get_download_rate() on its pc gives the rate.
+ * Without it every peer is as fast as every other */
+void bt_deadline_selector_set_peer_rate(void *r, func_peer_rate_f rate,
+                                        void *udata);
+
+/**
+ * Use this clock instead of CLOCK_MONOTONIC */
+void bt_deadline_selector_set_clock(void *r, func_now_ms_f now, void *udata);
+
+/**
+ * Pieces this close to their deadline are raced by a second peer.
+ * Defaults to the playing time of one piece */
+void bt_deadline_selector_set_urgent_ms(void *r, int ms);
+
+void bt_deadline_selector_get_stats(void *r,
+                                    bt_deadline_selector_stats_t *stats);
+
+#endif /* BT_SELECTOR_DEADLINE_H */
@@ -3,12 +3,18 @@
 
 void *bt_rarestfirst_selector_new(int npieces);
 
+void bt_rarestfirst_selector_free(void *r);
+
 /**
  * Add this piece back to the selector */
 void bt_rarestfirst_selector_giveback_piece(void *r, void* peer, int piece_idx);
 
 void bt_rarestfirst_selector_have_piece(void *r, int piece_idx);
 
+/**
+ * Notify selector that we no longer have this piece */
+void bt_rarestfirst_selector_lost_piece(void *r, int piece_idx);
+
 void bt_rarestfirst_selector_remove_peer(void *r, void *peer);
 
 void bt_rarestfirst_selector_add_peer(void *r, void *peer);
@@ -21,6 +27,17 @@ void bt_rarestfirst_selector_peer_have_piece(void *r, void *peer,
 
 int bt_rarestfirst_selector_get_npeers(void *r);
 
+/**
+ * Skipped pieces aren't polled; otherwise higher priorities are polled
+ * before rarer pieces */
+void bt_rarestfirst_selector_set_piece_priority(void *r, int piece_idx,
+                                                int prio);
+
+/**
+ * Set the priority of npieces pieces from piece_idx onwards */
+void bt_rarestfirst_selector_set_piece_priority_range(void *r, int piece_idx,
+                                                      int npieces, int prio);
+
 
 int bt_rarestfirst_selector_get_npieces(void *r);
 
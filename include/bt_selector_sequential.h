@@ -3,6 +3,8 @@
 
 void *bt_sequential_selector_new(int npieces);
 
+void bt_sequential_selector_free(void *r);
+
 /**
  * Add this piece back to the selector.
  * This is usually when we want to make the piece a candidate again*/
@@ -12,6 +14,10 @@ void bt_sequential_selector_giveback_piece(void *r, void *peer, int piece_idx);
  * Notify selector that we have this piece */
 void bt_sequential_selector_have_piece(void *r, int piece_idx);
 
+/**
+ * Notify selector that we no longer have this piece */
+void bt_sequential_selector_lost_piece(void *r, int piece_idx);
+
 void bt_sequential_selector_remove_peer(void *r, void *peer);
 
 void bt_sequential_selector_add_peer(void *r, void *peer);
@@ -23,6 +29,16 @@ void bt_sequential_selector_peer_have_piece(void *r, void *peer, int piece_idx);
 
 int bt_sequential_selector_get_npeers(void *r);
 
+/**
+ * Skipped pieces aren't polled; otherwise higher priorities are polled
+ * first. O(1) */
+void bt_sequential_selector_set_piece_priority(void *r, int piece_idx, int prio);
+
+/**
+ * Set the priority of npieces pieces from piece_idx onwards */
+void bt_sequential_selector_set_piece_priority_range(void *r, int piece_idx,
+                                                 int npieces, int prio);
+
 int bt_sequential_selector_get_npieces(void *r);
 
 /**
@@ -0,0 +1,63 @@
+#ifndef BT_SENDFILE_H_
+#define BT_SENDFILE_H_
+
+#define BT_SENDFILE_ERROR 0
+#define BT_SENDFILE_DONE 1
+/* the socket is full; send again once it's writable */
+#define BT_SENDFILE_AGAIN 2
+
+/**
+ * A message header followed by part of a file, to be sent down a socket.
+ * On Linux the file data goes with sendfile(), and never passes through
+ * user space; elsewhere it's read into a buffer and sent.
+ *
+ * @param header Data to send first; NULL if none. It's copied
+ * @param fd File to send from. It's dup()ed, so the caller may close it
+ * @param offset Where to start reading the file from
+ * @param len Bytes of the file to send; 0 to only send the header
+ * @return newly initialised send; NULL on failure */
+void *bt_sendfile_new(const char *header, const int header_len,
+                      int fd, uint64_t offset, const unsigned int len);
+
+void bt_sendfile_free(void *sf);
+
+/**
+ * Send as much as the socket takes. Never waits for a non-blocking socket.
+ * @return BT_SENDFILE_DONE once everything has been sent;
+ *  BT_SENDFILE_AGAIN if the socket is full, call again when it's writable;
+ *  BT_SENDFILE_ERROR on failure */
+int bt_sendfile_send(void *sf, int sock);
+
+/**
+ * A connection's outgoing sends, kept in order. Suitable for bt_dm_cbs_t's
+ * peer_send and peer_sendfile: a PIECE sent from a file can't overtake, or
+ * interleave with, data that's still waiting for the socket.
+ * @return newly initialised send queue */
+void *bt_sendqueue_new();
+
+void bt_sendqueue_free(void *sq);
+
+/**
+ * Send data after everything that's queued; what doesn't fit is queued
+ * @return 1 if sent or queued; 0 on failure */
+int bt_sendqueue_send(void *sq, int sock, const char *data, const int len);
+
+/**
+ * Send a header and part of a file after everything that's queued, as with
+ * bt_sendfile_new(); what doesn't fit is queued
+ * @return 1 if sent or queued; 0 on failure */
+int bt_sendqueue_sendfile(void *sq, int sock,
+                          const char *header, const int header_len,
+                          int fd, uint64_t offset, const unsigned int len);
+
+/**
+ * Carry on sending; call when the socket is writable
+ * @return BT_SENDFILE_DONE once the queue is empty; BT_SENDFILE_AGAIN if
+ *  the socket is full; BT_SENDFILE_ERROR on failure */
+int bt_sendqueue_flush(void *sq, int sock);
+
+/**
+ * @return 1 if nothing is waiting to be sent */
+int bt_sendqueue_is_empty(void *sq);
+
+#endif /* BT_SENDFILE_H_ */
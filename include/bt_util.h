@@ -5,6 +5,14 @@ char *url2host(const char *url);
 
 char *bt_generate_peer_id();
 
+/**
+ * Make a file name from a torrent safe to join onto our download directory.
+ * "..", "." and empty components are dropped, so the name can't be absolute
+ * or climb out of the directory
+ * @param len Length of name
+ * @return newly allocated name; "_" if nothing is left of it */
+char *bt_path_sanitize(const char *name, const int len);
+
 #if WIN32
 char* strndup(const char* str, const unsigned int len);
 #endif
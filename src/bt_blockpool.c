@@ -0,0 +1,504 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Reference counted pool of block sized buffers
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ * @section description
+ * Address space for the whole memory cap is reserved up front, 2MB aligned,
+ * and committed a 2MB slab at a time. Slabs are either split into blocks, or
+ * handed out whole, side by side, as spans. We first ask for explicit huge
+ * pages for a slab; failing that it's marked for transparent huge pages.
+ * A buffer's slab is found from its address, without looking anything up.
+ *
+ * Free buffers live on a global stack guarded by the pool's lock. Each
+ * thread also caches up to CACHE_MAX free buffers, which it refills from
+ * and spills to the global stack half a cache at a time.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+/* for uint32_t */
+#include <stdint.h>
+
+#include <pthread.h>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+#include "bt.h"
+#include "bt_blockpool.h"
+
+#define BLOCK_LEN (BT_BLOCK_SIZE)
+#define SLAB_LEN (1 << 21)
+#define BLOCKS_PER_SLAB (SLAB_LEN / BLOCK_LEN)
+
+/* free buffers each thread keeps for itself */
+#define CACHE_MAX 16
+
+enum {
+    /* not committed yet */
+    SLAB_UNUSED,
+    /* committed, and free for either use */
+    SLAB_SPARE,
+    SLAB_BLOCKS,
+    SLAB_SPAN,
+};
+
+typedef struct
+{
+    /* SLAB_*; only ever becomes SLAB_BLOCKS once, so is read without the
+     * lock */
+    int state;
+
+    int refs[BLOCKS_PER_SLAB];
+
+    /* 1 if the memory came from MAP_HUGETLB */
+    int huge;
+
+    /* slabs in the span, if this is the first slab of one */
+    int span_len;
+} slab_t;
+
+typedef struct tcache_s tcache_t;
+
+typedef struct
+{
+    /* reserved address space; max_slabs * SLAB_LEN bytes */
+    char *base;
+
+    slab_t *slabs;
+    int max_slabs;
+
+    /* slabs that have been committed */
+    int nslabs;
+
+    /* slabs that are SLAB_UNUSED or SLAB_SPARE */
+    int navail;
+
+    /* free buffers not in a thread's cache */
+    void **free;
+    int nfree;
+
+    int in_use;
+
+    /* every thread's cache */
+    tcache_t *tcaches;
+
+    /* guards everything above, except slab refs and in_use */
+    pthread_mutex_t lock;
+
+    pthread_key_t key;
+} blockpool_t;
+
+struct tcache_s
+{
+    blockpool_t *pool;
+
+    void *bufs[CACHE_MAX];
+    int n;
+
+    tcache_t *prev, *next;
+};
+
+/**
+ * Move n buffers from the thread's cache to the global stack */
+static void __spill(blockpool_t *me, tcache_t *t, int n)
+{
+    pthread_mutex_lock(&me->lock);
+    while (0 < n-- && 0 < t->n)
+        me->free[me->nfree++] = t->bufs[--t->n];
+    pthread_mutex_unlock(&me->lock);
+}
+
+static void __tcache_unlink(blockpool_t *me, tcache_t *t)
+{
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        me->tcaches = t->next;
+    if (t->next)
+        t->next->prev = t->prev;
+}
+
+/**
+ * The thread is exiting; give its buffers back */
+static void __tcache_free(void *udata)
+{
+    tcache_t *t = udata;
+    blockpool_t *me = t->pool;
+
+    __spill(me, t, CACHE_MAX);
+    pthread_mutex_lock(&me->lock);
+    __tcache_unlink(me, t);
+    pthread_mutex_unlock(&me->lock);
+    free(t);
+}
+
+static tcache_t *__tcache(blockpool_t *me)
+{
+    tcache_t *t;
+
+    if ((t = pthread_getspecific(me->key)))
+        return t;
+
+    t = calloc(1, sizeof(tcache_t));
+    t->pool = me;
+    pthread_mutex_lock(&me->lock);
+    t->next = me->tcaches;
+    if (t->next)
+        t->next->prev = t;
+    me->tcaches = t;
+    pthread_mutex_unlock(&me->lock);
+    pthread_setspecific(me->key, t);
+    return t;
+}
+
+/**
+ * Reserve address space for the pool, aligned to a slab
+ * @return the reservation; NULL on failure */
+static char *__reserve(const int nslabs)
+{
+    char *mem;
+
+#if defined(__linux__)
+    char *raw;
+    unsigned long skew;
+    size_t len = (size_t)nslabs * SLAB_LEN;
+
+    /* over-reserve so that we can trim to a slab boundary */
+    raw = mmap(NULL, len + SLAB_LEN, PROT_NONE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (MAP_FAILED == raw)
+        return NULL;
+
+    skew = (unsigned long)raw % SLAB_LEN;
+    mem = raw + (skew ? SLAB_LEN - skew : 0);
+    if (mem != raw)
+        munmap(raw, mem - raw);
+    if (mem + len != raw + len + SLAB_LEN)
+        munmap(mem + len, raw + len + SLAB_LEN - (mem + len));
+#else
+    if (0 != posix_memalign((void**)&mem, SLAB_LEN, (size_t)nslabs * SLAB_LEN))
+        return NULL;
+#endif
+
+    return mem;
+}
+
+static void __unreserve(blockpool_t *me)
+{
+#if defined(__linux__)
+    munmap(me->base, (size_t)me->max_slabs * SLAB_LEN);
+#else
+    free(me->base);
+#endif
+}
+
+/**
+ * Back the slab with memory
+ * @return 1 on success; otherwise 0 */
+static int __commit(blockpool_t *me, const int i)
+{
+    slab_t *s = &me->slabs[i];
+
+#if defined(__linux__)
+    char *mem = me->base + (size_t)i * SLAB_LEN;
+
+#if defined(MAP_HUGETLB)
+    if (MAP_FAILED != mmap(mem, SLAB_LEN, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED |
+                           MAP_HUGETLB, -1, 0))
+    {
+        s->huge = 1;
+        goto done;
+    }
+#endif
+
+    /* a failed MAP_FIXED might have taken the reservation with it */
+    if (0 != mprotect(mem, SLAB_LEN, PROT_READ | PROT_WRITE) &&
+        MAP_FAILED == mmap(mem, SLAB_LEN, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0))
+        return 0;
+
+#if defined(MADV_HUGEPAGE)
+    madvise(mem, SLAB_LEN, MADV_HUGEPAGE);
+#endif
+    s->huge = 0;
+#if defined(MAP_HUGETLB)
+done:
+#endif
+#endif
+
+    s->state = SLAB_SPARE;
+    me->nslabs++;
+    return 1;
+}
+
+/**
+ * Make the slab ready for use
+ * @return 1 on success; otherwise 0 */
+static int __take(blockpool_t *me, const int i)
+{
+    if (SLAB_UNUSED == me->slabs[i].state && !__commit(me, i))
+        return 0;
+    me->navail--;
+    return 1;
+}
+
+/**
+ * Carve out another slab onto the global stack
+ * @return 1 on success; otherwise 0 */
+static int __grow(blockpool_t *me)
+{
+    slab_t *s;
+    char *mem;
+    int i, b;
+
+    if (0 == me->navail)
+        return 0;
+
+    /* committed memory first */
+    for (i = 0; i < me->max_slabs && SLAB_SPARE != me->slabs[i].state; i++)
+        ;
+    if (i == me->max_slabs)
+        for (i = 0; SLAB_UNUSED != me->slabs[i].state; i++)
+            ;
+
+    if (!__take(me, i))
+        return 0;
+
+    s = &me->slabs[i];
+    mem = me->base + (size_t)i * SLAB_LEN;
+    memset(s->refs, 0, sizeof(s->refs));
+
+    /* push backwards so that buffers are handed out in address order */
+    for (b = BLOCKS_PER_SLAB - 1; 0 <= b; b--)
+        me->free[me->nfree++] = mem + b * BLOCK_LEN;
+
+    /* readers don't take the lock */
+    __atomic_store_n(&s->state, SLAB_BLOCKS, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/**
+ * @param b Set to the buffer's index within the slab
+ * @return slab holding this buffer; NULL if not ours */
+static slab_t *__slab_of(blockpool_t *me, const void *buf, int *b)
+{
+    unsigned long off = (unsigned long)((const char*)buf - me->base);
+    slab_t *s;
+
+    /* memory below the base wraps around to a large offset */
+    if ((unsigned long)me->max_slabs * SLAB_LEN <= off)
+        return NULL;
+
+    s = &me->slabs[off / SLAB_LEN];
+    if (SLAB_BLOCKS != __atomic_load_n(&s->state, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    *b = off % SLAB_LEN / BLOCK_LEN;
+    return s;
+}
+
+void *bt_blockpool_new(const uint64_t max_bytes)
+{
+    blockpool_t *me;
+
+    me = calloc(1, sizeof(blockpool_t));
+    me->max_slabs = (max_bytes + SLAB_LEN - 1) / SLAB_LEN;
+    if (0 == me->max_slabs)
+        me->max_slabs = 1;
+    if (!(me->base = __reserve(me->max_slabs)))
+    {
+        free(me);
+        return NULL;
+    }
+    me->slabs = calloc(me->max_slabs, sizeof(slab_t));
+    me->navail = me->max_slabs;
+    me->free = malloc(sizeof(void*) * me->max_slabs * BLOCKS_PER_SLAB);
+    pthread_mutex_init(&me->lock, NULL);
+    pthread_key_create(&me->key, __tcache_free);
+    return me;
+}
+
+void bt_blockpool_free(void *bpo)
+{
+    blockpool_t *me = bpo;
+
+    /* no more destructors; we free the caches ourselves */
+    pthread_key_delete(me->key);
+    while (me->tcaches)
+    {
+        tcache_t *t = me->tcaches;
+
+        __tcache_unlink(me, t);
+        free(t);
+    }
+
+    __unreserve(me);
+    pthread_mutex_destroy(&me->lock);
+    free(me->slabs);
+    free(me->free);
+    free(me);
+}
+
+void *bt_blockpool_alloc(void *bpo)
+{
+    blockpool_t *me = bpo;
+    tcache_t *t = __tcache(me);
+    slab_t *s;
+    void *buf;
+    int b;
+
+    if (0 == t->n)
+    {
+        pthread_mutex_lock(&me->lock);
+        if (0 == me->nfree)
+            __grow(me);
+        while (0 < me->nfree && t->n < CACHE_MAX / 2)
+            t->bufs[t->n++] = me->free[--me->nfree];
+        pthread_mutex_unlock(&me->lock);
+
+        if (0 == t->n)
+            return NULL;
+    }
+
+    buf = t->bufs[--t->n];
+    s = __slab_of(me, buf, &b);
+    __atomic_store_n(&s->refs[b], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&me->in_use, 1, __ATOMIC_RELAXED);
+    return buf;
+}
+
+void bt_blockpool_ref(void *bpo, const void *buf)
+{
+    slab_t *s;
+    int b;
+
+    s = __slab_of(bpo, buf, &b);
+    assert(s);
+    assert(0 < s->refs[b]);
+    __atomic_add_fetch(&s->refs[b], 1, __ATOMIC_RELAXED);
+}
+
+void bt_blockpool_unref(void *bpo, const void *buf)
+{
+    blockpool_t *me = bpo;
+    tcache_t *t;
+    slab_t *s;
+    int b;
+
+    s = __slab_of(me, buf, &b);
+    assert(s);
+
+    if (0 < __atomic_sub_fetch(&s->refs[b], 1, __ATOMIC_ACQ_REL))
+        return;
+
+    __atomic_sub_fetch(&me->in_use, 1, __ATOMIC_RELAXED);
+
+    t = __tcache(me);
+    if (CACHE_MAX == t->n)
+        __spill(me, t, CACHE_MAX / 2);
+    t->bufs[t->n++] = (char*)buf - (unsigned long)buf % BLOCK_LEN;
+}
+
+void *bt_blockpool_alloc_span(void *bpo, const uint64_t len)
+{
+    blockpool_t *me = bpo;
+    int i, j, n = (len + SLAB_LEN - 1) / SLAB_LEN;
+    void *span = NULL;
+
+    if (0 == n)
+        n = 1;
+
+    pthread_mutex_lock(&me->lock);
+
+    if (me->navail < n)
+        goto done;
+
+    /* first run of n slabs that aren't in use */
+    for (i = 0, j = 0; j < n && i + n <= me->max_slabs; )
+    {
+        if (SLAB_UNUSED == me->slabs[i + j].state ||
+            SLAB_SPARE == me->slabs[i + j].state)
+            j++;
+        else
+            i += j + 1, j = 0;
+    }
+    if (j < n)
+        goto done;
+
+    for (j = 0; j < n; j++)
+    {
+        if (!__take(me, i + j))
+        {
+            /* what we took is committed, and can be used another time */
+            while (0 < j--)
+            {
+                me->slabs[i + j].state = SLAB_SPARE;
+                me->navail++;
+            }
+            goto done;
+        }
+        me->slabs[i + j].state = SLAB_SPAN;
+    }
+
+    me->slabs[i].span_len = n;
+    span = me->base + (size_t)i * SLAB_LEN;
+done:
+    pthread_mutex_unlock(&me->lock);
+    return span;
+}
+
+void bt_blockpool_free_span(void *bpo, void *span)
+{
+    blockpool_t *me = bpo;
+    int i, j;
+
+    i = ((char*)span - me->base) / SLAB_LEN;
+    assert(0 <= i && i < me->max_slabs);
+    assert(SLAB_SPAN == me->slabs[i].state && 0 < me->slabs[i].span_len);
+
+    pthread_mutex_lock(&me->lock);
+    for (j = 0; j < me->slabs[i].span_len; j++)
+        me->slabs[i + j].state = SLAB_SPARE;
+    me->navail += me->slabs[i].span_len;
+    me->slabs[i].span_len = 0;
+    pthread_mutex_unlock(&me->lock);
+}
+
+int bt_blockpool_owns(void *bpo, const void *buf)
+{
+    int b;
+
+    return NULL != __slab_of(bpo, buf, &b);
+}
+
+void bt_blockpool_get_stats(void *bpo, bt_blockpool_stats_t *stats)
+{
+    blockpool_t *me = bpo;
+    int i;
+
+    pthread_mutex_lock(&me->lock);
+    stats->in_use = __atomic_load_n(&me->in_use, __ATOMIC_RELAXED);
+    stats->max = me->max_slabs * BLOCKS_PER_SLAB;
+    stats->nslabs = me->nslabs;
+    stats->nslabs_huge = 0;
+    stats->nslabs_span = 0;
+    for (i = 0; i < me->max_slabs; i++)
+    {
+        if (SLAB_UNUSED != me->slabs[i].state)
+            stats->nslabs_huge += me->slabs[i].huge;
+        if (SLAB_SPAN == me->slabs[i].state)
+            stats->nslabs_span++;
+    }
+    pthread_mutex_unlock(&me->lock);
+}
@@ -0,0 +1,167 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Adapt a synchronous disk layer to the asynchronous interface
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+/* for uint32_t */
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_diskasync.h"
+#include "bt_blockpool.h"
+
+#include "linked_list_queue.h"
+
+typedef struct
+{
+    bt_block_t blk;
+
+    /* copy of what was read; NULL for writes */
+    void *data;
+
+    /* 1 if data is from the block pool */
+    int pooled;
+
+    int ok;
+
+    func_block_done_f done;
+    void *cb_udata;
+} req_t;
+
+typedef struct
+{
+    bt_blockrw_async_i iarw;
+
+    bt_blockrw_i *irw;
+    void *irw_udata;
+
+    /* requests that have finished, but we haven't told anyone about */
+    linked_list_queue_t *finished;
+
+    /* where read data is copied to; NULL to use malloc() */
+    void *pool;
+} diskasync_t;
+
+static void __finish(diskasync_t *me, const bt_block_t * blk, void *data,
+                     const int pooled, const int ok, func_block_done_f done,
+                     void *cb_udata)
+{
+    req_t *r = malloc(sizeof(req_t));
+
+    r->blk = *blk;
+    r->data = data;
+    r->pooled = pooled;
+    r->ok = ok;
+    r->done = done;
+    r->cb_udata = cb_udata;
+    llqueue_offer(me->finished, r);
+}
+
+static int __submit_write(void *udata, const bt_block_t * blk,
+                          const void *blkdata, func_block_done_f done,
+                          void *cb_udata)
+{
+    diskasync_t *me = udata;
+    int ok;
+
+    ok = me->irw->write_block(me->irw_udata, NULL, blk, blkdata);
+    __finish(me, blk, NULL, 0, 0 != ok, done, cb_udata);
+    return 1;
+}
+
+static int __submit_read(void *udata, const bt_block_t * blk,
+                         func_block_done_f done, void *cb_udata)
+{
+    diskasync_t *me = udata;
+    void *data, *copy = NULL;
+    int pooled = 0;
+
+    /* the backend's pointer might not survive until poll() */
+    if ((data = me->irw->read_block(me->irw_udata, NULL, blk)))
+    {
+        if (me->pool && blk->len <= (BT_BLOCK_SIZE) &&
+            (copy = bt_blockpool_alloc(me->pool)))
+            pooled = 1;
+        else
+            copy = malloc(blk->len);
+        memcpy(copy, data, blk->len);
+    }
+
+    __finish(me, blk, copy, pooled, NULL != copy, done, cb_udata);
+    return 1;
+}
+
+static void __release(diskasync_t *me, req_t *r)
+{
+    if (r->pooled)
+        bt_blockpool_unref(me->pool, r->data);
+    else
+        free(r->data);
+    free(r);
+}
+
+static int __poll(void *udata, int wait __attribute__((__unused__)))
+{
+    diskasync_t *me = udata;
+    int n = 0;
+    req_t *r;
+
+    while ((r = llqueue_poll(me->finished)))
+    {
+        if (r->done)
+            r->done(r->cb_udata, &r->blk, r->data, r->ok);
+        __release(me, r);
+        n++;
+    }
+
+    return n;
+}
+
+void *bt_diskasync_new(bt_blockrw_i * irw, void *irw_udata)
+{
+    diskasync_t *me;
+
+    assert(irw->write_block);
+    assert(irw->read_block);
+
+    me = calloc(1, sizeof(diskasync_t));
+    me->iarw.submit_write = __submit_write;
+    me->iarw.submit_read = __submit_read;
+    me->iarw.poll = __poll;
+    me->irw = irw;
+    me->irw_udata = irw_udata;
+    me->finished = llqueue_new();
+    return me;
+}
+
+void bt_diskasync_free(void *dao)
+{
+    diskasync_t *me = dao;
+    req_t *r;
+
+    while ((r = llqueue_poll(me->finished)))
+        __release(me, r);
+    llqueue_free(me->finished);
+    free(me);
+}
+
+void bt_diskasync_set_blockpool(void *dao, void *pool)
+{
+    ((diskasync_t*)dao)->pool = pool;
+}
+
+bt_blockrw_async_i *bt_diskasync_get_blockrw_async(void *dao)
+{
+    return &((diskasync_t*)dao)->iarw;
+}
@@ -1,12 +1,36 @@
 /**
  * Copyright (c) 2011, Willem-Hendrik Thiart
  * Use of this source code is governed by a BSD-style license that can be
- * found in the LICENSE file. 
+ * found in the LICENSE file.
  *
  * @file
  * @brief Manages layer between memory and disk
  * @author  Willem Thiart himself@willemthiart.com
  * @version 0.1
+ * @section description
+ * Pieces are cached in slots carved out of one slab, sized by a byte budget.
+ * Given a block pool, the slab is a span from the pool, so that the cache
+ * shares the pool's memory cap; if the pool is short, we get fewer slots.
+ *
+ * Slots are replaced using 2Q (Johnson & Shasha). A piece seen for the first
+ * time goes onto the A1in FIFO; when it falls off A1in we remember its index
+ * on the A1out ghost list. Only a piece that's asked for again while it's on
+ * A1out goes onto the Am LRU. A peer reading the torrent from start to end
+ * only churns A1in, and can't push out the pieces that many peers want.
+ *
+ * Dirty data is tracked per 16KB block, and written back a contiguous run of
+ * dirty blocks at a time. Writes that aren't whole blocks go straight through
+ * to disk. A read that misses only fetches the blocks it covers, unless
+ * read-ahead is on. Write-back happens when a slot is evicted or flushed, or in the
+ * background from a write-behind thread once enough of the cache is dirty.
+ * Past the high watermark the cache says it's congested, so that whoever is
+ * requesting blocks can back off.
+ *
+ * Write-back that nobody waits for (write-behind, eviction, the high
+ * watermark) can fail after the write was acknowledged. Failed runs are
+ * remembered, and a flush of any of their bytes reports the failure once.
+ *
+ * The disk blockrw is only ever called by one thread at a time.
  */
 
 #include <stdlib.h>
@@ -20,31 +44,128 @@
 /* for uint32_t */
 #include <stdint.h>
 
+#include <pthread.h>
+
 #include "bt.h"
+#include "bt_diskcache.h"
+#include "bt_blockpool.h"
+
+#define DEFAULT_BUDGET (1 << 26)
+
+/* granularity of dirty tracking */
+#define BLOCK_LEN (BT_BLOCK_SIZE)
+
+#define BIT_GET(m, b) ((m)[(b) / 8] & (1 << ((b) % 8)))
+#define BIT_SET(m, b) ((m)[(b) / 8] |= (1 << ((b) % 8)))
+#define BIT_CLR(m, b) ((m)[(b) / 8] &= ~(1 << ((b) % 8)))
+
+enum {
+    LIST_NONE,
+    LIST_A1IN,
+    LIST_AM,
+};
 
-/* for LRU cache */
-#include "pseudolru.h"
+/* piece_slot values for pieces that aren't cached */
+#define SLOT_NONE -1
+#define SLOT_GHOST -2
 
 typedef struct
 {
-    unsigned char *data;
-    int idx;
-} mpiece_t;
+    int piece_idx;
+
+    /* LIST_* */
+    int list;
+
+    /* neighbours on the list (or next on the free list); -1 if none */
+    int prev, next;
+
+    /* blocks that hold the piece's data; one bit per block */
+    unsigned char *valid;
+
+    /* blocks that need writing to disk */
+    unsigned char *dirty;
+} slot_t;
 
 typedef struct
 {
-    bt_blockrw_i irw;
+    /* most recently added or used; -1 if empty */
+    int head;
+    int tail;
+    int count;
+} list_t;
 
-    mpiece_t **pieces;
-    int npieces;
+typedef struct
+{
+    bt_blockrw_i irw;
 
     int piece_length;
 
+    uint64_t budget;
+
     bt_blockrw_i *disk;
     void *disk_udata;
 
-    /*  least recently used piece */
-    pseudolru_t *lru_piece;
+    /* NULL until first use */
+    unsigned char *slab;
+    slot_t *slots;
+
+    /* where the slab comes from; NULL for the heap */
+    void *pool;
+    int slab_is_span;
+
+    int nslots;
+    int free_slot;
+
+    /* valid and dirty bitmaps for all slots */
+    unsigned char *bitmaps;
+    int nblocks;
+
+    list_t a1in, am;
+
+    /* most slots that A1in keeps before it has to give one up */
+    int kin;
+
+    /* A1out; FIFO of piece indices */
+    int *ghost;
+    int kout;
+    int ghost_head;
+    int nghost;
+
+    /* slot holding each piece; SLOT_NONE or SLOT_GHOST if none */
+    int *piece_slot;
+    int npieces;
+
+    /* runs that failed to be written back; flushes of them report it */
+    bt_block_t *failed;
+    int nfailed;
+
+    bt_diskcache_stats_t stats;
+
+    /* dirty bytes we start writing back at, and stop taking more at */
+    uint64_t low_watermark, high_watermark;
+
+    /* guards everything above */
+    pthread_mutex_t lock;
+
+    /* held while calling the disk blockrw */
+    pthread_mutex_t disk_lock;
+
+    /* write-behind thread */
+    pthread_t thread;
+    int thread_running;
+    int thread_stop;
+
+    /* wakes the write-behind thread */
+    pthread_cond_t work;
+
+    /* signalled when the write-behind thread has finished with a slot */
+    pthread_cond_t idle;
+
+    /* slot the write-behind thread is writing from; -1 if none */
+    int busy;
+
+    /* on a miss read the whole piece, rather than just what was asked for */
+    int readahead;
 
     /* logger */
     func_log_f func_log;
@@ -54,16 +175,8 @@ typedef struct
 
 #define priv(x) ((diskcache_private_t*)(x))
 
-static int __lru_piece_compare(
-    const void *e1,
-    const void *e2
-)
-{
-    return e1 - e2;
-}
-
 static void __log(
-    bt_diskcache_t * me,
+    void * me,
     const char *format,
     ...
 )
@@ -80,156 +193,585 @@ static void __log(
     priv(me)->func_log(priv(me)->logger_data, me, buf);
 }
 
-/**
- * Get piece as per this piece_idx
- * 
- * @return always return a mpiece for us to read/write memory from/to
- */
-static mpiece_t *__get_piece(
-    bt_diskcache_t * me,
-    const int idx
+void bt_diskcache_set_func_log(
+    void * me,
+    func_log_f log,
+    void *udata
 )
 {
-    /*  allocate list space if we don't have enough slots */
-    if (priv(me)->npieces <= idx)
+    priv(me)->func_log = log;
+    priv(me)->logger_data = udata;
+}
+
+static unsigned char *__data(diskcache_private_t *me, const int s)
+{
+    return me->slab + (size_t)s * me->piece_length;
+}
+
+static void __list_remove(diskcache_private_t *me, list_t *l, const int s)
+{
+    slot_t *e = &me->slots[s];
+
+    if (-1 == e->prev)
+        l->head = e->next;
+    else
+        me->slots[e->prev].next = e->next;
+
+    if (-1 == e->next)
+        l->tail = e->prev;
+    else
+        me->slots[e->next].prev = e->prev;
+
+    l->count--;
+    e->list = LIST_NONE;
+}
+
+static void __list_push(diskcache_private_t *me, list_t *l, const int s,
+                        const int list)
+{
+    slot_t *e = &me->slots[s];
+
+    e->list = list;
+    e->prev = -1;
+    e->next = l->head;
+    if (-1 == l->head)
+        l->tail = s;
+    else
+        me->slots[l->head].prev = s;
+    l->head = s;
+    l->count++;
+}
+
+static list_t *__list(diskcache_private_t *me, const int list)
+{
+    return LIST_AM == list ? &me->am : &me->a1in;
+}
+
+/**
+ * @return slot that holds this piece; otherwise SLOT_NONE or SLOT_GHOST */
+static int __slot_of(diskcache_private_t *me, const int idx)
+{
+    /* allocate list space if we don't have enough slots */
+    if (me->npieces <= idx)
     {
-        int ii;
+        int i = me->npieces;
+
+        me->npieces = idx + 1;
+        me->piece_slot = realloc(me->piece_slot,
+                                 sizeof(int) * me->npieces);
+        for (; i < me->npieces; i++)
+            me->piece_slot[i] = SLOT_NONE;
+    }
+
+    return me->piece_slot[idx];
+}
 
-        ii = priv(me)->npieces;
-        priv(me)->npieces = idx + 1;
-        priv(me)->pieces =
-            realloc(priv(me)->pieces, sizeof(mpiece_t **) * priv(me)->npieces);
+static unsigned int __block_len(diskcache_private_t *me, const int b)
+{
+    return me->piece_length - b * BLOCK_LEN < BLOCK_LEN ?
+           me->piece_length - b * BLOCK_LEN : BLOCK_LEN;
+}
+
+static int __disk_write(diskcache_private_t *me, const bt_block_t * blk,
+                        const void *data)
+{
+    int ret;
+
+    pthread_mutex_lock(&me->disk_lock);
+    ret = me->disk->write_block(me->disk_udata, me, blk, data);
+    pthread_mutex_unlock(&me->disk_lock);
+    if (0 == ret)
+        __log(me, "ERROR,couldn't write back piece %d", blk->piece_idx);
+    return ret;
+}
+
+static void *__disk_read(diskcache_private_t *me, void *caller,
+                         const bt_block_t * blk)
+{
+    void *data;
+
+    pthread_mutex_lock(&me->disk_lock);
+    data = me->disk->read_block(me->disk_udata, caller, blk);
+    pthread_mutex_unlock(&me->disk_lock);
+    return data;
+}
+
+/**
+ * Remember that this run didn't make it to disk */
+static void __fail(diskcache_private_t *me, const bt_block_t * blk)
+{
+    me->failed = realloc(me->failed, sizeof(bt_block_t) * (me->nfailed + 1));
+    me->failed[me->nfailed++] = *blk;
+}
+
+/**
+ * Forget failed write-backs of these bytes
+ * @return 1 if there were any; otherwise 0 */
+static int __take_failed(diskcache_private_t *me, const bt_block_t * blk)
+{
+    int i, ret = 0;
+
+    for (i = 0; i < me->nfailed; )
+    {
+        bt_block_t *f = &me->failed[i];
 
-        for (; ii < priv(me)->npieces; ii++)
+        if (f->piece_idx == blk->piece_idx &&
+            f->offset < blk->offset + blk->len &&
+            blk->offset < f->offset + f->len)
         {
-            priv(me)->pieces[ii] = NULL;
+            ret = 1;
+            *f = me->failed[--me->nfailed];
         }
+        else
+            i++;
     }
 
-    /*  if memory isn't allocated yet... */
-    if (!priv(me)->pieces[idx])
+    return ret;
+}
+
+/**
+ * Find the first run of dirty blocks, and mark them clean
+ * @param blk The run as a block
+ * @return 1 if there was a run; otherwise 0 */
+static int __take_dirty_run(diskcache_private_t *me, const int s,
+                            bt_block_t *blk)
+{
+    slot_t *e = &me->slots[s];
+    int b, end;
+
+    for (b = 0; b < me->nblocks && !BIT_GET(e->dirty, b); b++)
+        ;
+    if (b == me->nblocks)
+        return 0;
+
+    blk->piece_idx = e->piece_idx;
+    blk->offset = b * BLOCK_LEN;
+    blk->len = 0;
+    for (end = b; end < me->nblocks && BIT_GET(e->dirty, end); end++)
     {
-        priv(me)->pieces[idx] = calloc(1, sizeof(mpiece_t));
-        priv(me)->pieces[idx]->idx = idx;
+        BIT_CLR(e->dirty, end);
+        blk->len += __block_len(me, end);
     }
 
-    return priv(me)->pieces[idx];
+    me->stats.dirty_bytes -= blk->len;
+    me->stats.writebacks++;
+    return 1;
 }
 
-void bt_diskcache_set_func_log(
-    bt_diskcache_t * me,
-    func_log_f log,
-    void *udata
-)
+/**
+ * Wait until the write-behind thread isn't using this slot
+ * @param s The slot; -1 for any slot */
+static void __wait_idle(diskcache_private_t *me, const int s)
 {
-    priv(me)->func_log = log;
-    priv(me)->logger_data = udata;
+    while (-1 != me->busy && (-1 == s || me->busy == s))
+        pthread_cond_wait(&me->idle, &me->lock);
 }
 
 /**
- * Dump this piece_idx to the disk */
-static void __diskdump_piece(bt_diskcache_t * me, const int piece_idx)
+ * Write the slot's dirty blocks to disk. Failed runs are remembered for
+ * __flush_block() */
+static void __writeback(diskcache_private_t *me, const int s)
 {
     bt_block_t blk;
-    mpiece_t *mpce;
 
-    mpce = __get_piece(me, piece_idx);
-    blk.piece_idx = piece_idx;
-    blk.offset = 0;
-    blk.len = priv(me)->piece_length;
-    if (0 == priv(me)->disk->write_block(priv(me)->disk_udata, me, &blk, mpce->data))
+    __wait_idle(me, s);
+
+    while (__take_dirty_run(me, s, &blk))
+        if (0 == __disk_write(me, &blk, __data(me, s) + blk.offset))
+            __fail(me, &blk);
+}
+
+/**
+ * @return the least recently used slot that has dirty blocks; otherwise -1 */
+static int __oldest_dirty(diskcache_private_t *me)
+{
+    int s, i;
+
+    for (s = me->a1in.tail; -1 != s; s = me->slots[s].prev)
+        for (i = 0; i < (me->nblocks + 7) / 8; i++)
+            if (me->slots[s].dirty[i])
+                return s;
+
+    for (s = me->am.tail; -1 != s; s = me->slots[s].prev)
+        for (i = 0; i < (me->nblocks + 7) / 8; i++)
+            if (me->slots[s].dirty[i])
+                return s;
+
+    return -1;
+}
+
+static void *__writebehind(void *udata)
+{
+    diskcache_private_t *me = udata;
+
+    pthread_mutex_lock(&me->lock);
+
+    while (!me->thread_stop)
     {
+        bt_block_t blk;
+        int s, ok;
+
+        if (me->stats.dirty_bytes <= me->low_watermark ||
+            -1 == (s = __oldest_dirty(me)))
+        {
+            pthread_cond_wait(&me->work, &me->lock);
+            continue;
+        }
 
+        __take_dirty_run(me, s, &blk);
+
+        /* nobody touches the slot while we're writing from it */
+        me->busy = s;
+        pthread_mutex_unlock(&me->lock);
+        ok = __disk_write(me, &blk, __data(me, s) + blk.offset);
+        pthread_mutex_lock(&me->lock);
+        if (!ok)
+            __fail(me, &blk);
+        me->busy = -1;
+        pthread_cond_broadcast(&me->idle);
     }
 
-    pseudolru_remove(priv(me)->lru_piece, (void *) mpce);
-    free(mpce->data);
-    mpce->data = NULL;
+    pthread_mutex_unlock(&me->lock);
+    return NULL;
+}
+
+/**
+ * Remember that we've recently seen this piece */
+static void __ghost_push(diskcache_private_t *me, const int idx)
+{
+    if (me->nghost == me->kout)
+    {
+        int old = me->ghost[me->ghost_head];
+
+        /* the piece might have come back since */
+        if (SLOT_GHOST == me->piece_slot[old])
+            me->piece_slot[old] = SLOT_NONE;
+        me->ghost_head = (me->ghost_head + 1) % me->kout;
+        me->nghost--;
+    }
+
+    me->ghost[(me->ghost_head + me->nghost) % me->kout] = idx;
+    me->nghost++;
+    me->piece_slot[idx] = SLOT_GHOST;
+}
+
+/**
+ * Give the slot back to the free list */
+static void __release(diskcache_private_t *me, const int s)
+{
+    slot_t *e = &me->slots[s];
+
+    if (LIST_NONE != e->list)
+        __list_remove(me, __list(me, e->list), s);
+    e->next = me->free_slot;
+    me->free_slot = s;
+}
+
+/**
+ * Make room by removing one piece from the cache */
+static void __evict(diskcache_private_t *me)
+{
+    int s, from_a1in;
+
+    /* the write-behind thread might be using the victim */
+    do
+    {
+        from_a1in = me->kin < me->a1in.count || 0 == me->am.count;
+        s = from_a1in ? me->a1in.tail : me->am.tail;
+        assert(-1 != s);
+        if (me->busy != s)
+            break;
+        __wait_idle(me, s);
+    }
+    while (1);
+
+    __writeback(me, s);
+    __release(me, s);
+
+    if (from_a1in)
+        __ghost_push(me, me->slots[s].piece_idx);
+    else
+        me->piece_slot[me->slots[s].piece_idx] = SLOT_NONE;
+
+    me->stats.evictions++;
+}
+
+/**
+ * Give this piece a slot
+ * @return the slot */
+static int __admit(diskcache_private_t *me, const int idx)
+{
+    int s, was_ghost;
+    slot_t *e;
+
+    was_ghost = SLOT_GHOST == __slot_of(me, idx);
+
+    if (-1 == me->free_slot)
+        __evict(me);
+
+    s = me->free_slot;
+    e = &me->slots[s];
+    me->free_slot = e->next;
+
+    e->piece_idx = idx;
+    memset(e->valid, 0, (me->nblocks + 7) / 8);
+    memset(e->dirty, 0, (me->nblocks + 7) / 8);
+
+    /* we've seen this piece recently, so it's worth keeping */
+    if (was_ghost)
+        __list_push(me, &me->am, s, LIST_AM);
+    else
+        __list_push(me, &me->a1in, s, LIST_A1IN);
+
+    me->piece_slot[idx] = s;
+    return s;
+}
+
+/**
+ * The piece has been used again */
+static void __touch(diskcache_private_t *me, const int s)
+{
+    /* A1in is a FIFO; repeated use there is usually the same reader */
+    if (LIST_AM == me->slots[s].list)
+    {
+        __list_remove(me, &me->am, s);
+        __list_push(me, &me->am, s, LIST_AM);
+    }
+}
+
+/**
+ * Carve the slab up into slots */
+static void __slab_init(diskcache_private_t *me)
+{
+    int i;
+
+    if (me->slab)
+        return;
+
+    assert(0 < me->piece_length);
+
+    me->nslots = me->budget / me->piece_length;
+    if (me->nslots < 1)
+        me->nslots = 1;
+
+    /* make do with what the pool can spare */
+    me->slab_is_span = 0;
+    if (me->pool)
+    {
+        for (; 0 < me->nslots; me->nslots /= 2)
+            if ((me->slab = bt_blockpool_alloc_span(
+                     me->pool, (uint64_t)me->nslots * me->piece_length)))
+                break;
+
+        if (me->slab)
+            me->slab_is_span = 1;
+        else
+        {
+            __log(me, "ERROR,block pool is full; using the heap");
+            me->nslots = 1;
+        }
+    }
+
+    if (!me->slab)
+        me->slab = malloc((size_t)me->nslots * me->piece_length);
+    me->slots = malloc(sizeof(slot_t) * me->nslots);
+    me->nblocks = (me->piece_length + BLOCK_LEN - 1) / BLOCK_LEN;
+    me->bitmaps = calloc(me->nslots * 2, (me->nblocks + 7) / 8);
+
+    for (i = 0; i < me->nslots; i++)
+    {
+        me->slots[i].valid = me->bitmaps + i * 2 * ((me->nblocks + 7) / 8);
+        me->slots[i].dirty = me->slots[i].valid + (me->nblocks + 7) / 8;
+        me->slots[i].list = LIST_NONE;
+        me->slots[i].next = i + 1 < me->nslots ? i + 1 : -1;
+    }
+    me->free_slot = 0;
+    me->a1in.head = me->a1in.tail = me->am.head = me->am.tail = -1;
+    me->a1in.count = me->am.count = 0;
+
+    me->kin = 1 < me->nslots / 4 ? me->nslots / 4 : 1;
+    me->kout = 1 < me->nslots / 2 ? me->nslots / 2 : 1;
+    me->ghost = malloc(sizeof(int) * me->kout);
+    me->ghost_head = me->nghost = 0;
+}
+
+/**
+ * Write everything back and give the slab up */
+static void __slab_free(diskcache_private_t *me)
+{
+    int i;
+
+    if (!me->slab)
+        return;
+
+    __wait_idle(me, -1);
+
+    for (i = 0; i < me->nslots; i++)
+        if (LIST_NONE != me->slots[i].list)
+            __writeback(me, i);
+
+    for (i = 0; i < me->npieces; i++)
+        me->piece_slot[i] = SLOT_NONE;
+
+    me->a1in.head = me->a1in.tail = me->am.head = me->am.tail = -1;
+    if (me->slab_is_span)
+        bt_blockpool_free_span(me->pool, me->slab);
+    else
+        free(me->slab);
+    free(me->slots);
+    free(me->bitmaps);
+    free(me->ghost);
+    me->slab = NULL;
+    me->slots = NULL;
+    me->ghost = NULL;
+}
+
+/**
+ * @return 1 if the block is made of whole blocks of ours */
+static int __is_aligned(diskcache_private_t *me, const bt_block_t * blk)
+{
+    return 0 == blk->offset % BLOCK_LEN &&
+           (0 == blk->len % BLOCK_LEN ||
+            blk->offset + blk->len == (unsigned int)me->piece_length);
 }
 
 /**
  * @return 0 on error */
 static int __write_block(
     void *udata,
-    void *caller,
+    void *caller __attribute__((__unused__)),
     const bt_block_t * blk,
     const void *blkdata
 )
 {
-    bt_diskcache_t *me = udata;
-    mpiece_t *mpce;
+    diskcache_private_t *me = udata;
+    slot_t *e;
+    int s, b, ret = 1;
 
-    mpce = __get_piece(me, blk->piece_idx);
+    assert(0 < me->piece_length);
+    assert(blk->offset + blk->len <= (unsigned int)me->piece_length);
 
-    if (!mpce->data)
-    {
-        mpce->data = calloc(1, priv(me)->piece_length);
-        assert(mpce->idx == blk->piece_idx);
-    }
+    pthread_mutex_lock(&me->lock);
 
-#if 0 /* debugging */
-    printf("me-writeblock: %d %d %d %d\n",
-           blk->piece_idx, blk->offset, blk->len,
-           pseudolru_count(priv(me)->lru_piece));
-#endif
+    __slab_init(me);
 
-    assert(0 < priv(me)->piece_length);
-    assert(mpce->data);
+    if (0 <= (s = __slot_of(me, blk->piece_idx)))
+        __touch(me, s);
+    else
+        s = __admit(me, blk->piece_idx);
 
-    /* TODO: remove memcpy for zero-copy */
-    memcpy(mpce->data + blk->offset, blkdata, blk->len);
+    __wait_idle(me, s);
+    e = &me->slots[s];
 
-    /*  touch piece to show how recent it is */
-    pseudolru_put(priv(me)->lru_piece, (void *) mpce, (void *) mpce);
+    /* TODO: remove memcpy for zero-copy */
+    memcpy(__data(me, s) + blk->offset, blkdata, blk->len);
 
-#if 1
-    /* check if we have enough pieces to write out to disk */
-    if (20 < pseudolru_count(priv(me)->lru_piece))
+    if (__is_aligned(me, blk))
     {
-        int ii;
-
-        /*  write out ten to disk */
-
-        for (ii=0; ii < 1; ii++)
+        for (b = blk->offset / BLOCK_LEN;
+             b * BLOCK_LEN < blk->offset + blk->len; b++)
         {
-            mpce = pseudolru_pop_lru(priv(me)->lru_piece);
-            __diskdump_piece(me, mpce->idx);
+            if (!BIT_GET(e->dirty, b))
+                me->stats.dirty_bytes += __block_len(me, b);
+            BIT_SET(e->valid, b);
+            BIT_SET(e->dirty, b);
         }
     }
-#endif
+    /* we'd have to read the rest of the block to be able to write it back */
+    else
+        ret = __disk_write(me, blk, blkdata);
 
-    return 1;
+    if (me->thread_running)
+    {
+        if (me->low_watermark < me->stats.dirty_bytes)
+            pthread_cond_signal(&me->work);
+    }
+    /* without a write-behind thread, writes pay for it */
+    else
+        while (me->high_watermark < me->stats.dirty_bytes &&
+               -1 != (s = __oldest_dirty(me)))
+            __writeback(me, s);
+
+    pthread_mutex_unlock(&me->lock);
+    return ret;
 }
 
 static int __flush_block(void *udata, void *caller, const bt_block_t * blk)
 {
-    bt_diskcache_t *me = udata;
-    mpiece_t *mpce;
+    diskcache_private_t *me = udata;
+    int s, ret = 1;
 
-    mpce = __get_piece(me, blk->piece_idx);
+    pthread_mutex_lock(&me->lock);
+    if (me->slab && 0 <= (s = __slot_of(me, blk->piece_idx)))
+        __writeback(me, s);
 
-    if (!mpce->data)
-    {
+    /* including what failed in the background, or when evicted */
+    if (__take_failed(me, blk))
+        ret = 0;
+    pthread_mutex_unlock(&me->lock);
+
+    if (0 == ret)
         return 0;
+
+    if (me->disk->flush_block)
+    {
+        pthread_mutex_lock(&me->disk_lock);
+        ret = me->disk->flush_block(me->disk_udata, caller, blk);
+        pthread_mutex_unlock(&me->disk_lock);
     }
 
-    __diskdump_piece(me,blk->piece_idx);
-    //__write_block(udata,caller,blk,blkdata);
+    return 0 != ret;
+}
+
+/**
+ * Read the blocks of this range that the slot doesn't have from disk.
+ * Dirty blocks are valid, so are never overwritten
+ * @return 1 on success; otherwise 0 */
+static int __load(diskcache_private_t *me, const int s, const bt_block_t * blk)
+{
+    slot_t *e = &me->slots[s];
+    int b, end;
+
+    end = (blk->offset + blk->len + BLOCK_LEN - 1) / BLOCK_LEN;
+
+    for (b = blk->offset / BLOCK_LEN; b < end; b++)
+    {
+        bt_block_t run;
+        void *data;
+        int i;
+
+        if (BIT_GET(e->valid, b))
+            continue;
+
+        /* one read for each run of blocks we don't have */
+        run.piece_idx = e->piece_idx;
+        run.offset = b * BLOCK_LEN;
+        run.len = 0;
+        for (i = b; i < end && !BIT_GET(e->valid, i); i++)
+            run.len += __block_len(me, i);
+
+        if (!(data = __disk_read(me, me, &run)))
+            return 0;
+
+        memcpy(__data(me, s) + run.offset, data, run.len);
+        for (; b < i; b++)
+            BIT_SET(e->valid, b);
+    }
 
     return 1;
 }
 
-static void *__get_piece_data_from_disk(
-    bt_diskcache_t * me,
-    const int piece_idx
-)
+/**
+ * @return 1 if the slot holds all of this block */
+static int __have(diskcache_private_t *me, const int s, const bt_block_t * blk)
 {
-    bt_block_t blk;
+    int b;
 
-    blk.piece_idx = piece_idx;
-    blk.offset = 0;
-    blk.len = priv(me)->piece_length;
-    return priv(me)->disk->read_block(priv(me)->disk_udata, me, &blk);
+    for (b = blk->offset / BLOCK_LEN;
+         b * BLOCK_LEN < blk->offset + blk->len; b++)
+        if (!BIT_GET(me->slots[s].valid, b))
+            return 0;
+    return 1;
 }
 
 /**
@@ -241,58 +783,229 @@ static void *__get_piece_data_from_disk(
  * */
 static void *__read_block(void *udata, void *caller, const bt_block_t * blk)
 {
-    bt_diskcache_t *me = udata;
+    diskcache_private_t *me = udata;
+    bt_block_t whole = { .piece_idx = blk->piece_idx, .offset = 0,
+                         .len = me->piece_length };
+    void *data;
+    int s, i;
 
-    mpiece_t *mpce;
+    assert(0 < me->piece_length);
 
-#if 0 /*  debugging */
-    printf("me-readblock: %d %d %d\n",
-            blk->piece_idx, blk->offset, blk->len);
-#endif
+    pthread_mutex_lock(&me->lock);
 
-    mpce = __get_piece(me, blk->piece_idx);
+    __slab_init(me);
 
-    /* do we have the data in memory? */
-    if (!mpce->data)
+    if (0 <= (s = __slot_of(me, blk->piece_idx)))
     {
-        if (!(mpce->data = __get_piece_data_from_disk(me, blk->piece_idx)))
-        {
-            mpce->data = malloc(priv(me)->piece_length);
-            mpce->idx = blk->piece_idx;
-            memset(mpce->data, 0, priv(me)->piece_length);
-        }
-        else
+        __touch(me, s);
+
+        if (__have(me, s, blk))
         {
-            return NULL;
+            me->stats.hits++;
+            pthread_mutex_unlock(&me->lock);
+            return __data(me, s) + blk->offset;
         }
     }
+    else
+        s = __admit(me, blk->piece_idx);
+
+    me->stats.misses++;
 
-    assert(mpce->data);
+    if (__load(me, s, me->readahead ? &whole : blk))
+    {
+        pthread_mutex_unlock(&me->lock);
+        return __data(me, s) + blk->offset;
+    }
 
-    /*  touch piece to show how recent it is */
-    pseudolru_put(priv(me)->lru_piece, (void *) mpce, (void *) mpce);
+    /* the piece isn't all on disk yet (eg. it's at the end of a short file);
+     * we'll have to go without the cache */
+    for (i = 0; i < (me->nblocks + 7) / 8 && !me->slots[s].valid[i]; i++)
+        ;
+    if (i == (me->nblocks + 7) / 8)
+    {
+        __release(me, s);
+        me->piece_slot[blk->piece_idx] = SLOT_NONE;
+    }
 
-    return mpce->data + blk->offset;
+    data = __disk_read(me, caller, blk);
+    pthread_mutex_unlock(&me->lock);
+    return data;
+}
+
+/**
+ * Pass the hint on, unless we already have the data */
+static void __prefetch_block(void *udata, void *caller, const bt_block_t * blk)
+{
+    diskcache_private_t *me = udata;
+    int s;
+
+    if (!me->disk->prefetch_block)
+        return;
+
+    pthread_mutex_lock(&me->lock);
+    s = me->slab ? __slot_of(me, blk->piece_idx) : SLOT_NONE;
+    if (s < 0 || !__have(me, s, blk))
+    {
+        pthread_mutex_lock(&me->disk_lock);
+        me->disk->prefetch_block(me->disk_udata, caller, blk);
+        pthread_mutex_unlock(&me->disk_lock);
+    }
+    pthread_mutex_unlock(&me->lock);
+}
+
+/**
+ * The disk's copy is only good if we aren't holding newer data */
+static int __block_fd(void *udata, const bt_block_t * blk, uint64_t *offset)
+{
+    diskcache_private_t *me = udata;
+    int s, b, fd = -1;
+
+    if (!me->disk->block_fd)
+        return -1;
+
+    pthread_mutex_lock(&me->lock);
+    s = me->slab ? __slot_of(me, blk->piece_idx) : SLOT_NONE;
+    if (0 <= s)
+    {
+        /* the write-behind thread is still putting it on disk */
+        if (me->busy == s)
+            goto done;
+
+        for (b = blk->offset / BLOCK_LEN;
+             b * BLOCK_LEN < blk->offset + blk->len; b++)
+            if (BIT_GET(me->slots[s].dirty, b))
+                goto done;
+    }
+
+    pthread_mutex_lock(&me->disk_lock);
+    fd = me->disk->block_fd(me->disk_udata, blk, offset);
+    pthread_mutex_unlock(&me->disk_lock);
+done:
+    pthread_mutex_unlock(&me->lock);
+    return fd;
 }
 
 void *bt_diskcache_new()
 {
-    bt_diskcache_t *me;
+    diskcache_private_t *me;
 
     me = calloc(1, sizeof(diskcache_private_t));
-    priv(me)->irw.write_block = __write_block;
-    priv(me)->irw.read_block = __read_block;
-    priv(me)->irw.flush_block = __flush_block;
-    priv(me)->piece_length = 0;
-    priv(me)->lru_piece = pseudolru_new(__lru_piece_compare);
+    me->irw.write_block = __write_block;
+    me->irw.read_block = __read_block;
+    me->irw.flush_block = __flush_block;
+    me->irw.prefetch_block = __prefetch_block;
+    me->irw.block_fd = __block_fd;
+    me->piece_length = 0;
+    me->budget = DEFAULT_BUDGET;
+    me->low_watermark = DEFAULT_BUDGET / 4;
+    me->high_watermark = DEFAULT_BUDGET / 2;
+    me->busy = -1;
+    pthread_mutex_init(&me->lock, NULL);
+    pthread_mutex_init(&me->disk_lock, NULL);
+    pthread_cond_init(&me->work, NULL);
+    pthread_cond_init(&me->idle, NULL);
     return me;
 }
 
+void bt_diskcache_free(void *dco)
+{
+    diskcache_private_t *me = dco;
+
+    bt_diskcache_set_writebehind(me, 0);
+    __slab_free(me);
+    pthread_mutex_destroy(&me->lock);
+    pthread_mutex_destroy(&me->disk_lock);
+    pthread_cond_destroy(&me->work);
+    pthread_cond_destroy(&me->idle);
+    free(me->piece_slot);
+    free(me->failed);
+    free(me);
+}
+
 void bt_diskcache_set_size(void *dco, const int piece_bytes_size)
 {
-    bt_diskcache_t *me = dco;
     assert(0 < piece_bytes_size);
-    priv(me)->piece_length = piece_bytes_size;
+    bt_diskcache_set_piece_length(dco, piece_bytes_size);
+}
+
+void bt_diskcache_set_budget(void *dco, const uint64_t bytes)
+{
+    diskcache_private_t *me = dco;
+
+    /* slots are sized from the budget */
+    pthread_mutex_lock(&me->lock);
+    __slab_free(me);
+    me->budget = bytes;
+    me->low_watermark = bytes / 4;
+    me->high_watermark = bytes / 2;
+    pthread_mutex_unlock(&me->lock);
+}
+
+void bt_diskcache_set_blockpool(void *dco, void *pool)
+{
+    diskcache_private_t *me = dco;
+
+    /* the slab is taken from the pool */
+    pthread_mutex_lock(&me->lock);
+    __slab_free(me);
+    me->pool = pool;
+    pthread_mutex_unlock(&me->lock);
+}
+
+void bt_diskcache_set_dirty_watermarks(void *dco, const uint64_t low,
+                                       const uint64_t high)
+{
+    diskcache_private_t *me = dco;
+
+    pthread_mutex_lock(&me->lock);
+    me->low_watermark = low;
+    me->high_watermark = high;
+    pthread_cond_signal(&me->work);
+    pthread_mutex_unlock(&me->lock);
+}
+
+int bt_diskcache_set_writebehind(void *dco, const int on)
+{
+    diskcache_private_t *me = dco;
+
+    if (on && !me->thread_running)
+    {
+        me->thread_stop = 0;
+        if (0 != pthread_create(&me->thread, NULL, __writebehind, me))
+            return 0;
+        me->thread_running = 1;
+    }
+    else if (!on && me->thread_running)
+    {
+        pthread_mutex_lock(&me->lock);
+        me->thread_stop = 1;
+        pthread_cond_signal(&me->work);
+        pthread_mutex_unlock(&me->lock);
+        pthread_join(me->thread, NULL);
+        me->thread_running = 0;
+    }
+
+    return 1;
+}
+
+void bt_diskcache_set_readahead(void *dco, const int whole_piece)
+{
+    diskcache_private_t *me = dco;
+
+    pthread_mutex_lock(&me->lock);
+    me->readahead = whole_piece;
+    pthread_mutex_unlock(&me->lock);
+}
+
+int bt_diskcache_is_congested(void *dco)
+{
+    diskcache_private_t *me = dco;
+    int ret;
+
+    pthread_mutex_lock(&me->lock);
+    ret = me->high_watermark < me->stats.dirty_bytes;
+    pthread_mutex_unlock(&me->lock);
+    return ret;
 }
 
 void bt_diskcache_set_disk_blockrw(
@@ -301,38 +1014,45 @@ void bt_diskcache_set_disk_blockrw(
     void *irw_data
 )
 {
-    bt_diskcache_t *me = dco;
+    diskcache_private_t *me = dco;
     assert(irw->write_block);
     assert(irw->read_block);
-    priv(me)->disk = irw;
-    priv(me)->disk_udata = irw_data;
+    me->disk = irw;
+    me->disk_udata = irw_data;
 }
 
 bt_blockrw_i *bt_diskcache_get_blockrw(void *dco)
 {
-    bt_diskcache_t *me = dco;
-    return &priv(me)->irw;
+    return &priv(dco)->irw;
 }
 
 void bt_diskcache_set_piece_length(void* dco, int piece_length)
 {
-    bt_diskcache_t *me = dco;
-    priv(me)->piece_length = piece_length;
+    diskcache_private_t *me = dco;
+
+    /* slots are sized from the piece length */
+    pthread_mutex_lock(&me->lock);
+    __slab_free(me);
+    me->piece_length = piece_length;
+    pthread_mutex_unlock(&me->lock);
 }
 
 void bt_diskcache_disk_dump(void *dco)
 {
-    bt_diskcache_t *me = dco;
-
-    int ii;
-
-    for (ii = 0; ii < priv(me)->npieces; ii++)
-    {
-        mpiece_t *p = __get_piece(me, ii);
+    diskcache_private_t *me = dco;
+    int i;
+
+    pthread_mutex_lock(&me->lock);
+    if (me->slab)
+        for (i = 0; i < me->nslots; i++)
+            if (LIST_NONE != me->slots[i].list)
+                __writeback(me, i);
+    pthread_mutex_unlock(&me->lock);
+}
 
-        if (p->data)
-        {
-            __diskdump_piece(me, ii);
-        }
-    }
+void bt_diskcache_get_stats(void *dco, bt_diskcache_stats_t *stats)
+{
+    pthread_mutex_lock(&priv(dco)->lock);
+    memcpy(stats, &priv(dco)->stats, sizeof(bt_diskcache_stats_t));
+    pthread_mutex_unlock(&priv(dco)->lock);
 }
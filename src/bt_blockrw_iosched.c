@@ -0,0 +1,385 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Orders and merges writes before they reach the disk
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ * @section description
+ * The torrent's files are laid end to end, so ordering writes by their
+ * offset within the torrent orders them by (file, offset).
+ *
+ * Queued writes are kept in an array sorted by offset. A write that
+ * overlaps one that's already queued dispatches the queue first; so queued
+ * writes never overlap, and the order they're written in can't matter.
+ *
+ * On dispatch each run of writes that follow on from each other goes out as
+ * one write_blockv. The merged block starts at the first write's piece and
+ * offset, and may run past the end of that piece.
+ *
+ * Writes are acknowledged once queued, so a run that fails to be written is
+ * remembered. Flushing any of its bytes reports the failure; the owner of
+ * the data flushes it before relying on it, eg. bt_dm when a piece is
+ * validated.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+/* for varags */
+#include <stdarg.h>
+
+/* for uint32_t */
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_diskiosched.h"
+
+#define DEFAULT_BATCH (1 << 22)
+
+typedef struct
+{
+    /* offset within the torrent */
+    uint64_t off;
+
+    bt_block_t blk;
+
+    char *data;
+} req_t;
+
+typedef struct
+{
+    /* offset within the torrent */
+    uint64_t off;
+    uint64_t len;
+} range_t;
+
+typedef struct
+{
+    bt_blockrw_i irw;
+
+    int piece_length;
+
+    bt_blockrw_i *disk;
+    void *disk_udata;
+
+    /* queued writes, sorted by off */
+    req_t *reqs;
+    int nreqs;
+    int size;
+
+    uint64_t batch;
+
+    /* dispatched writes that failed; flushes of these bytes report it */
+    range_t *failed;
+    int nfailed;
+
+    bt_diskiosched_stats_t stats;
+
+    /* logger */
+    func_log_f func_log;
+    void *logger_data;
+} diskiosched_t;
+
+#define priv(x) ((diskiosched_t*)(x))
+
+static void __log(void *me, const char *format, ...)
+{
+    char buf[1000];
+    va_list args;
+
+    if (!priv(me)->func_log)
+        return;
+
+    va_start(args, format);
+    vsprintf(buf, format, args);
+    va_end(args);
+    priv(me)->func_log(priv(me)->logger_data, me, buf);
+}
+
+static uint64_t __offset(diskiosched_t *me, const bt_block_t * blk)
+{
+    return (uint64_t)blk->piece_idx * me->piece_length + blk->offset;
+}
+
+/**
+ * @return idx of the first queued write at or after off */
+static int __find(diskiosched_t *me, const uint64_t off)
+{
+    int lo = 0, hi = me->nreqs;
+
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+
+        if (me->reqs[mid].off < off)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/**
+ * @return 1 if a queued write touches these bytes; otherwise 0 */
+static int __is_queued(diskiosched_t *me, const uint64_t off,
+                       const unsigned int len)
+{
+    int i = __find(me, off);
+
+    if (0 < i && off < me->reqs[i - 1].off + me->reqs[i - 1].blk.len)
+        return 1;
+    if (i < me->nreqs && me->reqs[i].off < off + len)
+        return 1;
+    return 0;
+}
+
+/**
+ * Write queued writes first to last, starting from i
+ * @param n Number of writes, which follow on from each other
+ * @return 1 on success; otherwise 0 */
+static int __write_run(diskiosched_t *me, const int i, const int n)
+{
+    bt_iovec_t *iov;
+    bt_block_t blk;
+    int k, ok = 1;
+
+    if (1 == n || !me->disk->write_blockv)
+    {
+        for (k = i; k < i + n; k++)
+        {
+            me->stats.writes_out++;
+            ok &= 0 != me->disk->write_block(me->disk_udata, me,
+                                             &me->reqs[k].blk,
+                                             me->reqs[k].data);
+        }
+        return ok;
+    }
+
+    iov = malloc(sizeof(bt_iovec_t) * n);
+    blk = me->reqs[i].blk;
+    blk.len = 0;
+    for (k = 0; k < n; k++)
+    {
+        iov[k].data = me->reqs[i + k].data;
+        iov[k].len = me->reqs[i + k].blk.len;
+        blk.len += iov[k].len;
+    }
+
+    me->stats.writes_out++;
+    ok = 0 != me->disk->write_blockv(me->disk_udata, me, &blk, iov, n);
+    free(iov);
+    return ok;
+}
+
+int bt_diskiosched_dispatch(void *dio)
+{
+    diskiosched_t *me = dio;
+    int i, n, ok = 1;
+
+    if (0 == me->nreqs)
+        return 1;
+
+    for (i = 0; i < me->nreqs; i += n)
+    {
+        for (n = 1; i + n < me->nreqs &&
+             me->reqs[i + n - 1].off + me->reqs[i + n - 1].blk.len ==
+             me->reqs[i + n].off; n++)
+            ;
+
+        if (!__write_run(me, i, n))
+        {
+            range_t *r;
+
+            __log(me, "ERROR,couldn't write %d blocks from piece %d",
+                  n, me->reqs[i].blk.piece_idx);
+            me->failed = realloc(me->failed,
+                                 sizeof(range_t) * (me->nfailed + 1));
+            r = &me->failed[me->nfailed++];
+            r->off = me->reqs[i].off;
+            r->len = me->reqs[i + n - 1].off + me->reqs[i + n - 1].blk.len -
+                     r->off;
+            ok = 0;
+        }
+    }
+
+    for (i = 0; i < me->nreqs; i++)
+        free(me->reqs[i].data);
+    me->nreqs = 0;
+    me->stats.depth = 0;
+    me->stats.depth_bytes = 0;
+    me->stats.dispatches++;
+    return ok;
+}
+
+static int __write_block(
+    void *udata,
+    void *caller __attribute__((__unused__)),
+    const bt_block_t * blk,
+    const void *blkdata
+)
+{
+    diskiosched_t *me = udata;
+    uint64_t off;
+    int i;
+
+    assert(0 < me->piece_length);
+
+    if (0 == blk->len)
+        return 1;
+
+    off = __offset(me, blk);
+
+    /* the later write has to win */
+    if (__is_queued(me, off, blk->len))
+        bt_diskiosched_dispatch(me);
+
+    if (me->nreqs == me->size)
+    {
+        me->size = me->size ? me->size * 2 : 64;
+        me->reqs = realloc(me->reqs, sizeof(req_t) * me->size);
+    }
+
+    i = __find(me, off);
+    memmove(&me->reqs[i + 1], &me->reqs[i],
+            sizeof(req_t) * (me->nreqs - i));
+    me->reqs[i].off = off;
+    me->reqs[i].blk = *blk;
+    me->reqs[i].data = malloc(blk->len);
+    memcpy(me->reqs[i].data, blkdata, blk->len);
+    me->nreqs++;
+
+    me->stats.writes_in++;
+    me->stats.depth = me->nreqs;
+    me->stats.depth_bytes += blk->len;
+    if (me->stats.max_depth < me->stats.depth)
+        me->stats.max_depth = me->stats.depth;
+
+    /* failures are for whoever flushes the failed bytes */
+    if (me->batch <= me->stats.depth_bytes)
+        bt_diskiosched_dispatch(me);
+    return 1;
+}
+
+static void *__read_block(void *udata, void *caller, const bt_block_t * blk)
+{
+    diskiosched_t *me = udata;
+
+    if (__is_queued(me, __offset(me, blk), blk->len))
+        bt_diskiosched_dispatch(me);
+
+    return me->disk->read_block(me->disk_udata, caller, blk);
+}
+
+static int __flush_block(void *udata, void *caller, const bt_block_t * blk)
+{
+    diskiosched_t *me = udata;
+    uint64_t off = __offset(me, blk);
+    int i, ok = 1;
+
+    bt_diskiosched_dispatch(me);
+
+    /* report, and forget, failures of these bytes */
+    for (i = 0; i < me->nfailed; )
+    {
+        range_t *r = &me->failed[i];
+
+        if (r->off < off + blk->len && off < r->off + r->len)
+        {
+            ok = 0;
+            *r = me->failed[--me->nfailed];
+        }
+        else
+            i++;
+    }
+
+    if (me->disk->flush_block &&
+        0 == me->disk->flush_block(me->disk_udata, caller, blk))
+        ok = 0;
+
+    return ok;
+}
+
+static void __prefetch_block(void *udata, void *caller, const bt_block_t * blk)
+{
+    diskiosched_t *me = udata;
+
+    if (me->disk->prefetch_block)
+        me->disk->prefetch_block(me->disk_udata, caller, blk);
+}
+
+static int __block_fd(void *udata, const bt_block_t * blk, uint64_t *offset)
+{
+    diskiosched_t *me = udata;
+
+    if (!me->disk->block_fd)
+        return -1;
+
+    if (__is_queued(me, __offset(me, blk), blk->len))
+        bt_diskiosched_dispatch(me);
+
+    return me->disk->block_fd(me->disk_udata, blk, offset);
+}
+
+void *bt_diskiosched_new()
+{
+    diskiosched_t *me;
+
+    me = calloc(1, sizeof(diskiosched_t));
+    me->irw.write_block = __write_block;
+    me->irw.read_block = __read_block;
+    me->irw.flush_block = __flush_block;
+    me->irw.prefetch_block = __prefetch_block;
+    me->irw.block_fd = __block_fd;
+    me->batch = DEFAULT_BATCH;
+    return me;
+}
+
+void bt_diskiosched_free(void *dio)
+{
+    diskiosched_t *me = dio;
+
+    if (me->disk)
+        bt_diskiosched_dispatch(me);
+    free(me->reqs);
+    free(me->failed);
+    free(me);
+}
+
+void bt_diskiosched_set_piece_length(void *dio, const int piece_length)
+{
+    priv(dio)->piece_length = piece_length;
+}
+
+void bt_diskiosched_set_disk_blockrw(void *dio, bt_blockrw_i * irw,
+                                     void *irw_data)
+{
+    priv(dio)->disk = irw;
+    priv(dio)->disk_udata = irw_data;
+}
+
+bt_blockrw_i *bt_diskiosched_get_blockrw(void *dio)
+{
+    return &priv(dio)->irw;
+}
+
+void bt_diskiosched_set_batch(void *dio, const uint64_t bytes)
+{
+    priv(dio)->batch = bytes;
+}
+
+void bt_diskiosched_get_stats(void *dio, bt_diskiosched_stats_t *stats)
+{
+    memcpy(stats, &priv(dio)->stats, sizeof(bt_diskiosched_stats_t));
+}
+
+void bt_diskiosched_set_func_log(void *dio, func_log_f log, void *udata)
+{
+    priv(dio)->func_log = log;
+    priv(dio)->logger_data = udata;
+}
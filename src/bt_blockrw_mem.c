@@ -9,6 +9,11 @@
  * @version 0.1
  * @section description
  * A backend block read/writer that puts data into RAM
+ *
+ * Without a total size the buffer grows as blocks are written past its
+ * end, doubling its capacity each time. Given the torrent's total size the
+ * buffer is allocated once, from the heap, huge pages or a memfd.
+ * Given a block pool, the buffer is always a span from the pool instead.
  */
 
 #include <stdlib.h>
@@ -27,16 +32,186 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <unistd.h>
+#include <fcntl.h>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
 #include "bt.h"
+#include "bt_diskmem.h"
+#include "bt_blockpool.h"
 
 typedef struct
 {
     bt_blockrw_i irw;
     int piece_size;
-    int data_size;
+
+    /* bytes that have been written up to */
+    uint64_t data_size;
+
+    /* bytes allocated */
+    uint64_t capacity;
+
+    /* 1 if capacity was set from the torrent's size, and is fixed */
+    int preallocated;
+
+    /* BT_DISKMEM_BACKING_*; what we'd like, and what we got */
+    int backing_wanted;
+    int backing;
+
+    /* for BT_DISKMEM_BACKING_MEMFD; otherwise -1 */
+    int fd;
+
+    /* bytes mapped; capacity rounded up to the page size of the mapping */
+    uint64_t mapped;
+
+    /* for BT_DISKMEM_BACKING_BLOCKPOOL; otherwise NULL */
+    void *pool;
+
     unsigned char *data;
 } diskmem_t;
 
+static void __release(diskmem_t *me)
+{
+    if (!me->data)
+        return;
+
+    if (BT_DISKMEM_BACKING_BLOCKPOOL == me->backing)
+        bt_blockpool_free_span(me->pool, me->data);
+#if defined(__linux__)
+    else if (BT_DISKMEM_BACKING_HEAP != me->backing)
+        munmap(me->data, me->mapped);
+#endif
+    else
+        free(me->data);
+
+    if (-1 != me->fd)
+        close(me->fd);
+
+    me->data = NULL;
+    me->fd = -1;
+    me->backing = BT_DISKMEM_BACKING_HEAP;
+}
+
+#if defined(__linux__) && defined(MAP_HUGETLB)
+/**
+ * @return the default huge page size in bytes */
+static uint64_t __huge_page_size(void)
+{
+    char line[128];
+    unsigned long kb = 2048;
+    FILE *f;
+
+    if (!(f = fopen("/proc/meminfo", "r")))
+        return (uint64_t)kb * 1024;
+
+    while (fgets(line, sizeof(line), f))
+        if (1 == sscanf(line, "Hugepagesize: %lu kB", &kb))
+            break;
+
+    fclose(f);
+    return (uint64_t)kb * 1024;
+}
+#endif
+
+/**
+ * Map len bytes with the backing we'd like
+ * @return 1 on success; otherwise 0 */
+static int __map(diskmem_t *me, const uint64_t len)
+{
+#if defined(__linux__)
+    void *data = MAP_FAILED;
+    uint64_t mapped = len;
+
+    switch (me->backing_wanted)
+    {
+    case BT_DISKMEM_BACKING_HUGEPAGES:
+#if defined(MAP_HUGETLB)
+        {
+            /* munmap of a hugetlb mapping needs a huge page aligned length */
+            uint64_t hp = __huge_page_size();
+
+            mapped = (len + hp - 1) / hp * hp;
+            data = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        }
+#endif
+        /* no huge pages reserved; ask for transparent huge pages instead */
+        if (MAP_FAILED == data)
+        {
+            mapped = len;
+            data = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#if defined(MADV_HUGEPAGE)
+            if (MAP_FAILED != data)
+                madvise(data, len, MADV_HUGEPAGE);
+#endif
+        }
+        break;
+
+    case BT_DISKMEM_BACKING_MEMFD:
+#if defined(SYS_memfd_create)
+        me->fd = syscall(SYS_memfd_create, "bt_diskmem", 0);
+        if (-1 == me->fd)
+            break;
+        fcntl(me->fd, F_SETFD, FD_CLOEXEC);
+        if (0 == ftruncate(me->fd, len))
+            data = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        me->fd, 0);
+        if (MAP_FAILED == data)
+        {
+            close(me->fd);
+            me->fd = -1;
+        }
+#endif
+        break;
+    }
+
+    if (MAP_FAILED != data)
+    {
+        me->data = data;
+        me->mapped = mapped;
+        me->backing = me->backing_wanted;
+        return 1;
+    }
+#endif
+
+    return 0;
+}
+
+/**
+ * Resize the buffer, keeping its contents. New memory reads as zeros
+ * @return 1 on success; otherwise 0 */
+static int __resize(diskmem_t *me, const uint64_t capacity)
+{
+    unsigned char *data;
+    uint64_t keep = me->data ? me->capacity : 0;
+
+    if (!me->pool)
+    {
+        if (!(data = realloc(me->data, capacity)))
+            return 0;
+    }
+    else
+    {
+        if (!(data = bt_blockpool_alloc_span(me->pool, capacity)))
+            return 0;
+        if (keep)
+            memcpy(data, me->data, keep < capacity ? keep : capacity);
+        __release(me);
+        me->backing = BT_DISKMEM_BACKING_BLOCKPOOL;
+    }
+
+    if (keep < capacity)
+        memset(data + keep, 0, capacity - keep);
+    me->data = data;
+    me->capacity = capacity;
+    return 1;
+}
+
 int bt_diskmem_write_block(
     void *udata,
     void *caller __attribute__((__unused__)),
@@ -45,7 +220,7 @@ int bt_diskmem_write_block(
 )
 {
     diskmem_t *me = udata;
-    unsigned int offset;
+    uint64_t offset;
 
 #if 0 /* debugging */
     int ii;
@@ -59,17 +234,26 @@ int bt_diskmem_write_block(
 //    printf("\n");
 #endif
 
-    assert(me->data);
-
-    offset = blk->piece_idx * me->piece_size + blk->offset;
+    offset = (uint64_t)blk->piece_idx * me->piece_size + blk->offset;
 
     /* if required, enlarge capacity */
-    if (me->data_size < offset + blk->len)
+    if (me->capacity < offset + blk->len)
     {
-        me->data_size = offset + blk->len;
-        me->data = realloc(me->data, me->data_size);
+        /* we might not have been able to allocate anything yet */
+        uint64_t capacity = me->capacity ? me->capacity : offset + blk->len;
+
+        if (me->preallocated)
+            return 0;
+
+        while (capacity < offset + blk->len)
+            capacity *= 2;
+        if (!__resize(me, capacity))
+            return 0;
     }
 
+    if (me->data_size < offset + blk->len)
+        me->data_size = offset + blk->len;
+
     memcpy(me->data + offset, blkdata, blk->len);
 
 #if 0 /* debugging */
@@ -97,9 +281,9 @@ static void *__read_block(
 )
 {
     diskmem_t *me = udata;
-    unsigned int offset;
+    uint64_t offset;
 
-    offset = blk->piece_idx * me->piece_size + blk->offset;
+    offset = (uint64_t)blk->piece_idx * me->piece_size + blk->offset;
 
     if (me->data_size < offset + blk->len)
     {
@@ -116,7 +300,21 @@ static int __flush_block(
     const bt_block_t * blk
 )
 {
-    return 0;
+    /* memory is as durable as it gets */
+    return 1;
+}
+
+static int __block_fd(void *udata, const bt_block_t * blk, uint64_t *offset)
+{
+    diskmem_t *me = udata;
+
+    if (-1 == me->fd)
+        return -1;
+
+    *offset = (uint64_t)blk->piece_idx * me->piece_size + blk->offset;
+    if (me->data_size < *offset + blk->len)
+        return -1;
+    return me->fd;
 }
 
 void *bt_diskmem_new(
@@ -128,7 +326,9 @@ void *bt_diskmem_new(
     me->irw.write_block = bt_diskmem_write_block;
     me->irw.read_block = __read_block;
     me->irw.flush_block = __flush_block;
+    me->irw.block_fd = __block_fd;
     me->data = NULL;
+    me->fd = -1;
 //    me->irw.giveup_block = NULL;
 
     return me;
@@ -140,8 +340,7 @@ void bt_diskmem_free(
 {
     diskmem_t *me = meo;
 
-    if (me->data)
-        free(me->data);
+    __release(me);
     free(me);
 }
 
@@ -153,9 +352,54 @@ void bt_diskmem_set_size(
     diskmem_t *me = meo;
 
     me->piece_size = piece_bytes_size;
-    me->data_size = piece_bytes_size * 10;
-    me->data = realloc(me->data, me->data_size);
-    memset(me->data, 0, me->data_size);
+
+    if (me->preallocated)
+        return;
+
+    /* start afresh */
+    me->capacity = 0;
+    __resize(me, (uint64_t)piece_bytes_size * 10);
+    me->data_size = me->capacity;
+}
+
+void bt_diskmem_set_backing(void *meo, const int backing)
+{
+    ((diskmem_t*)meo)->backing_wanted = backing;
+}
+
+void bt_diskmem_set_blockpool(void *meo, void *pool)
+{
+    ((diskmem_t*)meo)->pool = pool;
+}
+
+int bt_diskmem_get_backing(void *meo)
+{
+    return ((diskmem_t*)meo)->backing;
+}
+
+int bt_diskmem_set_total_size(void *meo, const uint64_t bytes)
+{
+    diskmem_t *me = meo;
+
+    __release(me);
+    me->capacity = 0;
+
+    if (me->pool)
+    {
+        /* all of our memory comes from the pool */
+        if (!__resize(me, bytes))
+            return 0;
+    }
+    else if (!__map(me, bytes))
+    {
+        /* calloc, like the mappings, gives us zeroed memory */
+        if (!(me->data = calloc(1, bytes)))
+            return 0;
+    }
+
+    me->data_size = me->capacity = bytes;
+    me->preallocated = 1;
+    return 1;
 }
 
 bt_blockrw_i *bt_diskmem_get_blockrw(
@@ -0,0 +1,513 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief A disk layer which memory maps the torrent's files
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ * @section description
+ * A backend block read/writer that maps files into memory.
+ * Files are mapped in fixed size windows as they're touched, so huge files
+ * don't need a huge chunk of address space. A block that sits in one window
+ * is read in place; one that straddles windows is gathered into a buffer.
+ * Writes are flushed to disk with msync() when flush_block is called.
+ *
+ * A store to a page the filesystem has no room for is a SIGBUS, so the
+ * bytes of a write always have their disk space allocated before they're
+ * copied in. The allocation modes are the filedumper's; sparse allocates
+ * exactly what's written.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <errno.h>
+
+/* for uint32_t */
+#include <stdint.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "bt.h"
+#include "bt_diskmmap.h"
+#include "bt_filedumper.h"
+#include "bt_util.h"
+
+/* size of the windows we map; a multiple of the page size */
+#define WINDOW_SIZE (sizeof(void*) == 8 ? (uint64_t)1 << 30 : 1 << 26)
+
+#define DEFAULT_REGION_SIZE (1 << 24)
+
+typedef struct
+{
+    /* name relative to cwd */
+    char *name;
+
+    /* offset of the file within the torrent */
+    uint64_t off;
+
+    uint64_t size;
+
+    /* mapped windows; NULL if not mapped yet */
+    char **windows;
+
+    /* kept open for allocating space; -1 if not opened yet */
+    int fd;
+
+    /* for BT_FILEDUMPER_ALLOC_ON_WRITE, regions of the file that have had
+     * their space allocated; one bit per region */
+    unsigned char *alloced;
+} file_t;
+
+typedef struct
+{
+    bt_blockrw_i irw;
+
+    file_t *files;
+    int nfiles;
+
+    uint64_t tot_size;
+
+    int piece_length;
+
+    char *cwd;
+
+    int advice;
+
+    /* BT_FILEDUMPER_ALLOC_* */
+    int alloc_mode;
+    uint64_t region_size;
+
+    /* for blocks that straddle windows */
+    char *buf;
+    unsigned int buf_size;
+} diskmmap_t;
+
+static uint64_t __window_len(file_t *f, const uint64_t w)
+{
+    return f->size - w * WINDOW_SIZE < WINDOW_SIZE ?
+           f->size - w * WINDOW_SIZE : WINDOW_SIZE;
+}
+
+/**
+ * Create the directories leading up to this file */
+static void __mkdirs(const char *path)
+{
+    char *p, *dir = strdup(path);
+
+    for (p = strchr(dir + 1, '/'); p; p = strchr(p + 1, '/'))
+    {
+        *p = '\0';
+        mkdir(dir, 0755);
+        *p = '/';
+    }
+
+    free(dir);
+}
+
+static void __advise(diskmmap_t *me, void *addr, const uint64_t len)
+{
+    switch (me->advice)
+    {
+    case BT_DISKMMAP_ADVICE_SEQUENTIAL:
+        madvise(addr, len, MADV_SEQUENTIAL);
+        break;
+    case BT_DISKMMAP_ADVICE_RANDOM:
+        madvise(addr, len, MADV_RANDOM);
+        break;
+    default:
+        madvise(addr, len, MADV_NORMAL);
+        break;
+    }
+}
+
+/**
+ * Open the file, creating it at its full size if need be
+ * @return file descriptor; otherwise -1 */
+static int __open(diskmmap_t *me, file_t *f)
+{
+    struct stat st;
+    char *path;
+    int fd;
+
+    if (-1 != f->fd)
+        return f->fd;
+
+    path = malloc(strlen(me->cwd) + 1 + strlen(f->name) + 1);
+    sprintf(path, "%s/%s", me->cwd, f->name);
+
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (-1 == fd && ENOENT == errno)
+    {
+        __mkdirs(path);
+        fd = open(path, O_RDWR | O_CREAT, 0644);
+    }
+    free(path);
+
+    if (-1 == fd)
+        return -1;
+
+    /* touching a page past the end of the file is a SIGBUS */
+    if (-1 == fstat(fd, &st) ||
+        ((uint64_t)st.st_size < f->size && -1 == ftruncate(fd, f->size)) ||
+        (BT_FILEDUMPER_ALLOC_FULL == me->alloc_mode &&
+         0 != posix_fallocate(fd, 0, f->size)))
+    {
+        close(fd);
+        return -1;
+    }
+
+    return f->fd = fd;
+}
+
+/**
+ * Make sure these bytes of the file have disk space
+ * @return 1 on success; 0 if the filesystem has no room for them */
+static int __allocate(diskmmap_t *me, file_t *f, const uint64_t foff,
+                      const uint64_t len)
+{
+    uint64_t r;
+    int fd;
+
+    if (-1 == (fd = __open(me, f)))
+        return 0;
+
+    switch (me->alloc_mode)
+    {
+    case BT_FILEDUMPER_ALLOC_FULL:
+        return 1;
+
+    case BT_FILEDUMPER_ALLOC_ON_WRITE:
+        if (!f->alloced)
+            f->alloced = calloc(
+                ((f->size + me->region_size - 1) / me->region_size + 7) / 8, 1);
+
+        for (r = foff / me->region_size;
+             r <= (foff + len - 1) / me->region_size; r++)
+        {
+            uint64_t start = r * me->region_size;
+
+            if (f->alloced[r / 8] & (1 << (r % 8)))
+                continue;
+            if (0 != posix_fallocate(fd, start,
+                                     f->size - start < me->region_size ?
+                                     f->size - start : me->region_size))
+                return 0;
+            f->alloced[r / 8] |= 1 << (r % 8);
+        }
+        return 1;
+
+    default:
+        return 0 == posix_fallocate(fd, foff, len);
+    }
+}
+
+/**
+ * Map this window of the file, creating the file if need be
+ * @return the window; otherwise NULL */
+static char *__window(diskmmap_t *me, file_t *f, const uint64_t w)
+{
+    void *addr;
+    int fd;
+
+    if (f->windows[w])
+        return f->windows[w];
+
+    if (-1 == (fd = __open(me, f)))
+        return NULL;
+
+    addr = mmap(NULL, __window_len(f, w), PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, w * WINDOW_SIZE);
+
+    if (MAP_FAILED == addr)
+        return NULL;
+
+    __advise(me, addr, __window_len(f, w));
+    return f->windows[w] = addr;
+}
+
+/**
+ * @return idx of the file that holds this byte of the torrent */
+static int __file_at(diskmmap_t *me, const uint64_t off)
+{
+    int lo = 0, hi = me->nfiles;
+
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+
+        if (me->files[mid].off + me->files[mid].size <= off)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/**
+ * Find the mapped memory for the start of this range of the torrent
+ * @param ptr Where the memory starts
+ * @return number of contiguous bytes at ptr; 0 on error */
+static unsigned int __segment(diskmmap_t *me, const uint64_t off,
+                              const unsigned int len, char **ptr)
+{
+    int i = __file_at(me, off);
+    uint64_t foff, w, n;
+    file_t *f;
+    char *win;
+
+    if (me->nfiles <= i)
+        return 0;
+
+    f = &me->files[i];
+    foff = off - f->off;
+    w = foff / WINDOW_SIZE;
+
+    if (!(win = __window(me, f, w)))
+        return 0;
+
+    *ptr = win + (foff - w * WINDOW_SIZE);
+    n = __window_len(f, w) - (foff - w * WINDOW_SIZE);
+    return n < len ? n : len;
+}
+
+static uint64_t __offset(diskmmap_t *me, const bt_block_t * blk)
+{
+    return (uint64_t)blk->piece_idx * me->piece_length + blk->offset;
+}
+
+static int __write_block(
+    void *udata,
+    void *caller __attribute__((__unused__)),
+    const bt_block_t * blk,
+    const void *blkdata
+)
+{
+    diskmmap_t *me = udata;
+    uint64_t off = __offset(me, blk);
+    unsigned int done, n;
+    char *ptr;
+
+    assert(0 < me->piece_length);
+
+    for (done = 0; done < blk->len; done += n)
+    {
+        file_t *f;
+
+        if (0 == (n = __segment(me, off + done, blk->len - done, &ptr)))
+            return 0;
+
+        /* no room on disk would be a SIGBUS on the memcpy */
+        f = &me->files[__file_at(me, off + done)];
+        if (!__allocate(me, f, off + done - f->off, n))
+            return 0;
+
+        memcpy(ptr, (const char*)blkdata + done, n);
+    }
+
+    return 1;
+}
+
+static void *__read_block(
+    void *udata,
+    void *caller __attribute__((__unused__)),
+    const bt_block_t * blk
+)
+{
+    diskmmap_t *me = udata;
+    uint64_t off = __offset(me, blk);
+    unsigned int done, n;
+    char *ptr;
+
+    assert(0 < me->piece_length);
+
+    if (0 == (n = __segment(me, off, blk->len, &ptr)))
+        return NULL;
+
+    /* no copy needed */
+    if (n == blk->len)
+        return ptr;
+
+    if (me->buf_size < blk->len)
+    {
+        me->buf_size = blk->len;
+        me->buf = realloc(me->buf, me->buf_size);
+    }
+
+    for (done = 0; done < blk->len; done += n)
+    {
+        if (0 == (n = __segment(me, off + done, blk->len - done, &ptr)))
+            return NULL;
+        memcpy(me->buf + done, ptr, n);
+    }
+
+    return me->buf;
+}
+
+static int __flush_block(
+    void *udata,
+    void *caller __attribute__((__unused__)),
+    const bt_block_t * blk
+)
+{
+    diskmmap_t *me = udata;
+    uint64_t off = __offset(me, blk);
+    unsigned long page = sysconf(_SC_PAGESIZE);
+    unsigned int done, n;
+    char *ptr;
+
+    for (done = 0; done < blk->len; done += n)
+    {
+        unsigned long skew;
+
+        if (0 == (n = __segment(me, off + done, blk->len - done, &ptr)))
+            return 0;
+
+        /* msync() wants a page aligned address; windows are page aligned */
+        skew = (unsigned long)ptr % page;
+        if (-1 == msync(ptr - skew, n + skew, MS_SYNC))
+            return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Have the kernel start paging the block in */
+static void __prefetch_block(
+    void *udata,
+    void *caller __attribute__((__unused__)),
+    const bt_block_t * blk
+)
+{
+    diskmmap_t *me = udata;
+    uint64_t off = __offset(me, blk);
+    unsigned long page = sysconf(_SC_PAGESIZE);
+    unsigned int done, n;
+    char *ptr;
+
+    for (done = 0; done < blk->len; done += n)
+    {
+        unsigned long skew;
+
+        if (0 == (n = __segment(me, off + done, blk->len - done, &ptr)))
+            return;
+
+        skew = (unsigned long)ptr % page;
+        madvise(ptr - skew, n + skew, MADV_WILLNEED);
+    }
+}
+
+void *bt_diskmmap_new()
+{
+    diskmmap_t *me;
+
+    me = calloc(1, sizeof(diskmmap_t));
+    me->irw.write_block = __write_block;
+    me->irw.read_block = __read_block;
+    me->irw.flush_block = __flush_block;
+    me->irw.prefetch_block = __prefetch_block;
+    me->cwd = strdup(".");
+    me->advice = BT_DISKMMAP_ADVICE_NORMAL;
+    me->alloc_mode = BT_FILEDUMPER_ALLOC_SPARSE;
+    me->region_size = DEFAULT_REGION_SIZE;
+    return me;
+}
+
+void bt_diskmmap_free(void *dmo)
+{
+    diskmmap_t *me = dmo;
+    int i;
+
+    for (i = 0; i < me->nfiles; i++)
+    {
+        file_t *f = &me->files[i];
+        uint64_t w;
+
+        for (w = 0; w * WINDOW_SIZE < f->size; w++)
+            if (f->windows[w])
+                munmap(f->windows[w], __window_len(f, w));
+        if (-1 != f->fd)
+            close(f->fd);
+        free(f->windows);
+        free(f->alloced);
+        free(f->name);
+    }
+
+    free(me->files);
+    free(me->cwd);
+    free(me->buf);
+    free(me);
+}
+
+void bt_diskmmap_set_piece_length(void *dmo, const int piece_size)
+{
+    ((diskmmap_t*)dmo)->piece_length = piece_size;
+}
+
+void bt_diskmmap_set_cwd(void *dmo, const char *path)
+{
+    diskmmap_t *me = dmo;
+
+    free(me->cwd);
+    me->cwd = strdup(path);
+}
+
+void bt_diskmmap_add_file(void *dmo, const char *fname, int fname_len,
+                          const uint64_t size)
+{
+    diskmmap_t *me = dmo;
+    file_t *f;
+
+    me->files = realloc(me->files, (me->nfiles + 1) * sizeof(file_t));
+    f = &me->files[me->nfiles++];
+    f->name = bt_path_sanitize(fname, fname_len);
+    f->off = me->tot_size;
+    f->size = size;
+    f->windows = calloc((size + WINDOW_SIZE - 1) / WINDOW_SIZE + 1,
+                        sizeof(char*));
+    f->fd = -1;
+    f->alloced = NULL;
+    me->tot_size += size;
+}
+
+void bt_diskmmap_set_allocation(void *dmo, const int mode)
+{
+    ((diskmmap_t*)dmo)->alloc_mode = mode;
+}
+
+void bt_diskmmap_set_allocation_region(void *dmo, const uint64_t size)
+{
+    ((diskmmap_t*)dmo)->region_size = size;
+}
+
+void bt_diskmmap_set_advice(void *dmo, const int advice)
+{
+    diskmmap_t *me = dmo;
+    int i;
+
+    me->advice = advice;
+
+    /* windows that are already mapped */
+    for (i = 0; i < me->nfiles; i++)
+    {
+        file_t *f = &me->files[i];
+        uint64_t w;
+
+        for (w = 0; w * WINDOW_SIZE < f->size; w++)
+            if (f->windows[w])
+                __advise(me, f->windows[w], __window_len(f, w));
+    }
+}
+
+bt_blockrw_i *bt_diskmmap_get_blockrw(void *dmo)
+{
+    return &((diskmmap_t*)dmo)->irw;
+}
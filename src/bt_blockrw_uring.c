@@ -0,0 +1,877 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief A disk layer which does its file I/O through io_uring
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ * @section description
+ * The torrent is one byte stream cut up into files, like bt_filedumper.
+ * A block becomes one request per file it touches; those requests only
+ * reach the kernel when poll() is called, so a burst of blocks costs one
+ * system call.
+ *
+ * We talk to the kernel with raw system calls rather than liburing, so that
+ * there's nothing extra to link against. If we can't get a ring the same
+ * requests are served with pread()/pwrite() as they're submitted.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <errno.h>
+
+/* for uint32_t */
+#include <stdint.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+/* IORING_OP_READ and friends arrived in the same kernels */
+#if defined(IORING_FEAT_FAST_POLL) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+#include "bt.h"
+#include "bt_diskuring.h"
+#include "bt_util.h"
+#include "bt_blockpool.h"
+
+/* number of registered buffers; each is BT_BLOCK_SIZE */
+#define NBUFS 32
+
+#define BUF_MALLOC -1
+#define BUF_POOL -2
+
+typedef struct req_s req_t;
+
+struct req_s
+{
+    bt_block_t blk;
+
+    char *buf;
+
+    /* registered buffer; BUF_MALLOC or BUF_POOL if it isn't one */
+    int buf_idx;
+
+    int is_write;
+
+    /* number of file requests that haven't finished */
+    int pending;
+
+    int failed;
+
+    /* bytes transferred so far */
+    unsigned int nbytes;
+
+    func_block_done_f done;
+    void *cb_udata;
+
+    /* finished list */
+    req_t *next;
+};
+
+typedef struct
+{
+    /* name relative to cwd */
+    char *name;
+
+    /* cwd + name; built on first use */
+    char *path;
+
+    /* offset of the file within the torrent */
+    uint64_t off;
+
+    uint64_t size;
+
+    /* -1 if not open, or if the ring has it */
+    int fd;
+
+    /* the ring has the file at slot idx */
+    int registered;
+} file_t;
+
+typedef struct
+{
+    bt_blockrw_async_i iarw;
+    bt_blockrw_i irw;
+
+    file_t *files;
+    int nfiles;
+
+    uint64_t tot_size;
+
+    int piece_length;
+
+    char *cwd;
+
+    /* -1 if we've fallen back to pread()/pwrite() */
+    int ring;
+
+#if HAVE_IO_URING
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_entries, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_map, *cq_map;
+    size_t sq_map_len, cq_map_len, sqes_len;
+#endif
+
+    /* SQEs filled in by us */
+    unsigned int sq_tail_local;
+
+    /* SQEs filled in, but not handed to the kernel yet */
+    unsigned int unsubmitted;
+
+    /* 1 if the ring has a file table; -1 if it can't */
+    int files_registered;
+
+    /* registered buffers */
+    char *bufs;
+    int free_bufs[NBUFS];
+    int nfree_bufs;
+
+    /* for when we run out of registered buffers; NULL to use malloc() */
+    void *pool;
+
+    /* requests that haven't had their callback called */
+    int inflight;
+
+    /* requests that are done, but haven't had their callback called */
+    req_t *finished_head, *finished_tail;
+
+    /* for the synchronous interface */
+    char *sbuf;
+    unsigned int sbuf_size;
+    int sync_done, sync_ok;
+} diskuring_t;
+
+#define priv(x) ((diskuring_t*)(x))
+
+static const char *__path(diskuring_t *me, file_t *f)
+{
+    if (!f->path)
+    {
+        f->path = malloc(strlen(me->cwd) + 1 + strlen(f->name) + 1);
+        sprintf(f->path, "%s/%s", me->cwd, f->name);
+    }
+
+    return f->path;
+}
+
+/**
+ * Create the directories leading up to this file */
+static void __mkdirs(const char *path)
+{
+    char *p, *dir = strdup(path);
+
+    for (p = strchr(dir + 1, '/'); p; p = strchr(p + 1, '/'))
+    {
+        *p = '\0';
+        mkdir(dir, 0755);
+        *p = '/';
+    }
+
+    free(dir);
+}
+
+/**
+ * @return idx of the file that holds this byte of the torrent */
+static int __file_at(diskuring_t *me, const uint64_t off)
+{
+    int lo = 0, hi = me->nfiles;
+
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+
+        if (me->files[mid].off + me->files[mid].size <= off)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+#if HAVE_IO_URING
+static int __register(diskuring_t *me, const unsigned int op, void *arg,
+                      const unsigned int nargs)
+{
+    return syscall(__NR_io_uring_register, me->ring, op, arg, nargs);
+}
+
+/**
+ * Give the ring a file table, with every slot empty */
+static void __register_files(diskuring_t *me)
+{
+    int *fds, i;
+
+    if (0 == me->nfiles)
+        return;
+
+    fds = malloc(sizeof(int) * me->nfiles);
+    for (i = 0; i < me->nfiles; i++)
+        fds[i] = -1;
+    me->files_registered =
+        0 == __register(me, IORING_REGISTER_FILES, fds, me->nfiles) ? 1 : -1;
+    free(fds);
+}
+#endif
+
+/**
+ * @param create Create the file if it doesn't exist
+ * @return 1 if the file is open; otherwise 0 */
+static int __open(diskuring_t *me, const int idx, const int create)
+{
+    file_t *f = &me->files[idx];
+
+    if (f->registered || -1 != f->fd)
+        return 1;
+
+    f->fd = open(__path(me, f), O_RDWR);
+    if (-1 == f->fd && ENOENT == errno && create)
+    {
+        __mkdirs(__path(me, f));
+        f->fd = open(__path(me, f), O_RDWR | O_CREAT, 0644);
+    }
+
+    if (-1 == f->fd)
+        return 0;
+
+#if HAVE_IO_URING
+    if (-1 != me->ring && 0 == me->files_registered)
+        __register_files(me);
+
+    /* the ring keeps its own reference, so we don't need to */
+    if (1 == me->files_registered)
+    {
+        struct io_uring_files_update up;
+
+        memset(&up, 0, sizeof(up));
+        up.offset = idx;
+        up.fds = (unsigned long)&f->fd;
+        if (1 == __register(me, IORING_REGISTER_FILES_UPDATE, &up, 1))
+        {
+            close(f->fd);
+            f->fd = -1;
+            f->registered = 1;
+        }
+    }
+#endif
+
+    return 1;
+}
+
+static void __finished(diskuring_t *me, req_t *r)
+{
+    r->next = NULL;
+    if (me->finished_tail)
+        me->finished_tail->next = r;
+    else
+        me->finished_head = r;
+    me->finished_tail = r;
+}
+
+static char *__get_buf(diskuring_t *me, const unsigned int len, int *idx)
+{
+    char *buf;
+
+    if (len <= (BT_BLOCK_SIZE) && 0 < me->nfree_bufs)
+    {
+        *idx = me->free_bufs[--me->nfree_bufs];
+        return me->bufs + *idx * (BT_BLOCK_SIZE);
+    }
+
+    if (me->pool && len <= (BT_BLOCK_SIZE) &&
+        (buf = bt_blockpool_alloc(me->pool)))
+    {
+        *idx = BUF_POOL;
+        return buf;
+    }
+
+    *idx = BUF_MALLOC;
+    return malloc(len);
+}
+
+static void __release_buf(diskuring_t *me, req_t *r)
+{
+    if (BUF_MALLOC == r->buf_idx)
+        free(r->buf);
+    else if (BUF_POOL == r->buf_idx)
+        bt_blockpool_unref(me->pool, r->buf);
+    else
+        me->free_bufs[me->nfree_bufs++] = r->buf_idx;
+}
+
+/**
+ * Do the I/O straight away, when we don't have a ring */
+static void __io_sync(diskuring_t *me, req_t *r)
+{
+    uint64_t off = (uint64_t)r->blk.piece_idx * me->piece_length +
+                   r->blk.offset;
+    unsigned int len = r->blk.len;
+    char *p = r->buf;
+    int i;
+
+    for (i = __file_at(me, off); 0 < len && !r->failed; i++)
+    {
+        file_t *f = &me->files[i];
+        unsigned int n, done;
+
+        if (me->nfiles <= i || !__open(me, i, r->is_write))
+        {
+            r->failed = 1;
+            break;
+        }
+
+        if (0 == f->size)
+            continue;
+
+        n = f->off + f->size - off < len ? f->off + f->size - off : len;
+
+        for (done = 0; done < n; )
+        {
+            ssize_t got = r->is_write ?
+                pwrite(f->fd, p + done, n - done, off - f->off + done) :
+                pread(f->fd, p + done, n - done, off - f->off + done);
+
+            if (-1 == got && EINTR == errno)
+                continue;
+            if (got <= 0)
+            {
+                r->failed = 1;
+                break;
+            }
+            done += got;
+        }
+
+        r->nbytes += done;
+        p += n;
+        off += n;
+        len -= n;
+    }
+}
+
+#if HAVE_IO_URING
+/**
+ * Hand the SQEs we've filled in to the kernel
+ * @param min_complete Wait until this many requests have completed */
+static void __enter(diskuring_t *me, const unsigned int min_complete)
+{
+    int ret;
+
+    if (0 == me->unsubmitted && 0 == min_complete)
+        return;
+
+    __atomic_store_n(me->sq_tail, me->sq_tail_local, __ATOMIC_RELEASE);
+
+    do
+        ret = syscall(__NR_io_uring_enter, me->ring, me->unsubmitted,
+                      min_complete,
+                      min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    while (-1 == ret && EINTR == errno);
+
+    if (0 < ret)
+        me->unsubmitted -= ret;
+}
+
+static struct io_uring_sqe *__get_sqe(diskuring_t *me)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int idx;
+
+    /* full; make room by submitting what we have */
+    if (*me->sq_entries <= me->sq_tail_local -
+        __atomic_load_n(me->sq_head, __ATOMIC_ACQUIRE))
+    {
+        __enter(me, 0);
+        if (*me->sq_entries <= me->sq_tail_local -
+            __atomic_load_n(me->sq_head, __ATOMIC_ACQUIRE))
+            return NULL;
+    }
+
+    idx = me->sq_tail_local & *me->sq_mask;
+    sqe = &me->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    me->sq_array[idx] = idx;
+    me->sq_tail_local++;
+    me->unsubmitted++;
+    return sqe;
+}
+
+/**
+ * Queue one request per file that the block touches */
+static void __io_ring(diskuring_t *me, req_t *r)
+{
+    uint64_t off = (uint64_t)r->blk.piece_idx * me->piece_length +
+                   r->blk.offset;
+    unsigned int len = r->blk.len;
+    char *p = r->buf;
+    int i;
+
+    for (i = __file_at(me, off); 0 < len; i++)
+    {
+        file_t *f = &me->files[i];
+        struct io_uring_sqe *sqe;
+        unsigned int n;
+
+        if (me->nfiles <= i || !__open(me, i, r->is_write))
+        {
+            r->failed = 1;
+            break;
+        }
+
+        if (0 == f->size)
+            continue;
+
+        n = f->off + f->size - off < len ? f->off + f->size - off : len;
+
+        if (!(sqe = __get_sqe(me)))
+        {
+            r->failed = 1;
+            break;
+        }
+
+        if (0 <= r->buf_idx)
+        {
+            sqe->opcode = r->is_write ?
+                          IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+            sqe->buf_index = r->buf_idx;
+        }
+        else
+            sqe->opcode = r->is_write ? IORING_OP_WRITE : IORING_OP_READ;
+
+        if (f->registered)
+        {
+            sqe->fd = i;
+            sqe->flags = IOSQE_FIXED_FILE;
+        }
+        else
+            sqe->fd = f->fd;
+
+        sqe->off = off - f->off;
+        sqe->addr = (unsigned long)p;
+        sqe->len = n;
+        sqe->user_data = (unsigned long)r;
+        r->pending++;
+
+        p += n;
+        off += n;
+        len -= n;
+    }
+}
+
+/**
+ * Collect completions from the kernel */
+static void __reap(diskuring_t *me)
+{
+    unsigned int head = *me->cq_head,
+                 tail = __atomic_load_n(me->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++)
+    {
+        struct io_uring_cqe *cqe = &me->cqes[head & *me->cq_mask];
+        req_t *r = (req_t*)(unsigned long)cqe->user_data;
+
+        if (cqe->res < 0)
+            r->failed = 1;
+        else
+            r->nbytes += cqe->res;
+
+        if (0 == --r->pending)
+            __finished(me, r);
+    }
+
+    __atomic_store_n(me->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void __ring_free(diskuring_t *me)
+{
+    if (me->sqes)
+        munmap(me->sqes, me->sqes_len);
+    if (me->cq_map && me->cq_map != me->sq_map)
+        munmap(me->cq_map, me->cq_map_len);
+    if (me->sq_map)
+        munmap(me->sq_map, me->sq_map_len);
+    close(me->ring);
+    me->ring = -1;
+}
+
+/**
+ * @return 1 if we have a ring; otherwise 0 */
+static int __ring_init(diskuring_t *me, const unsigned int entries)
+{
+    struct io_uring_params p;
+    struct iovec iov[NBUFS];
+    int i;
+
+    memset(&p, 0, sizeof(p));
+    if (-1 == (me->ring = syscall(__NR_io_uring_setup, entries, &p)))
+        return 0;
+
+    me->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    me->cq_map_len = p.cq_off.cqes +
+                     p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        me->sq_map_len = me->cq_map_len =
+            me->sq_map_len < me->cq_map_len ? me->cq_map_len : me->sq_map_len;
+
+    me->sq_map = mmap(NULL, me->sq_map_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, me->ring, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == me->sq_map)
+    {
+        me->sq_map = NULL;
+        __ring_free(me);
+        return 0;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        me->cq_map = me->sq_map;
+    else if (MAP_FAILED == (me->cq_map = mmap(NULL, me->cq_map_len,
+                                              PROT_READ | PROT_WRITE,
+                                              MAP_SHARED | MAP_POPULATE,
+                                              me->ring, IORING_OFF_CQ_RING)))
+    {
+        me->cq_map = NULL;
+        __ring_free(me);
+        return 0;
+    }
+
+    me->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    me->sqes = mmap(NULL, me->sqes_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, me->ring, IORING_OFF_SQES);
+    if (MAP_FAILED == me->sqes)
+    {
+        me->sqes = NULL;
+        __ring_free(me);
+        return 0;
+    }
+
+    me->sq_head = (unsigned*)((char*)me->sq_map + p.sq_off.head);
+    me->sq_tail = (unsigned*)((char*)me->sq_map + p.sq_off.tail);
+    me->sq_mask = (unsigned*)((char*)me->sq_map + p.sq_off.ring_mask);
+    me->sq_entries = (unsigned*)((char*)me->sq_map + p.sq_off.ring_entries);
+    me->sq_array = (unsigned*)((char*)me->sq_map + p.sq_off.array);
+    me->cq_head = (unsigned*)((char*)me->cq_map + p.cq_off.head);
+    me->cq_tail = (unsigned*)((char*)me->cq_map + p.cq_off.tail);
+    me->cq_mask = (unsigned*)((char*)me->cq_map + p.cq_off.ring_mask);
+    me->cqes = (struct io_uring_cqe*)((char*)me->cq_map + p.cq_off.cqes);
+    me->sq_tail_local = *me->sq_tail;
+
+    /* registered buffers need locked memory; do without if we can't */
+    if (0 != posix_memalign((void**)&me->bufs, sysconf(_SC_PAGESIZE),
+                            NBUFS * (BT_BLOCK_SIZE)))
+        me->bufs = NULL;
+    else
+    {
+        for (i = 0; i < NBUFS; i++)
+        {
+            iov[i].iov_base = me->bufs + i * (BT_BLOCK_SIZE);
+            iov[i].iov_len = (BT_BLOCK_SIZE);
+        }
+
+        if (0 == __register(me, IORING_REGISTER_BUFFERS, iov, NBUFS))
+            for (i = 0; i < NBUFS; i++)
+                me->free_bufs[me->nfree_bufs++] = NBUFS - 1 - i;
+    }
+
+    return 1;
+}
+#endif
+
+static int __submit(diskuring_t *me, req_t *r)
+{
+    me->inflight++;
+
+#if HAVE_IO_URING
+    if (-1 != me->ring)
+        __io_ring(me, r);
+    else
+#endif
+    __io_sync(me, r);
+
+    /* nothing in flight; either done already or failed before starting */
+    if (0 == r->pending)
+        __finished(me, r);
+    return 1;
+}
+
+static int __submit_write(void *udata, const bt_block_t * blk,
+                          const void *blkdata, func_block_done_f done,
+                          void *cb_udata)
+{
+    diskuring_t *me = udata;
+    req_t *r = calloc(1, sizeof(req_t));
+
+    assert(0 < me->piece_length);
+
+    r->blk = *blk;
+    r->is_write = 1;
+    r->done = done;
+    r->cb_udata = cb_udata;
+    r->buf = __get_buf(me, blk->len, &r->buf_idx);
+    memcpy(r->buf, blkdata, blk->len);
+    return __submit(me, r);
+}
+
+static int __submit_read(void *udata, const bt_block_t * blk,
+                         func_block_done_f done, void *cb_udata)
+{
+    diskuring_t *me = udata;
+    req_t *r = calloc(1, sizeof(req_t));
+
+    assert(0 < me->piece_length);
+
+    r->blk = *blk;
+    r->done = done;
+    r->cb_udata = cb_udata;
+    r->buf = __get_buf(me, blk->len, &r->buf_idx);
+    return __submit(me, r);
+}
+
+static int __poll(void *udata, int wait)
+{
+    diskuring_t *me = udata;
+    int n = 0;
+    req_t *r;
+
+#if HAVE_IO_URING
+    if (-1 != me->ring)
+    {
+        __enter(me, wait && !me->finished_head && 0 < me->inflight ? 1 : 0);
+        __reap(me);
+    }
+#endif
+
+    /* the callbacks might submit more */
+    while ((r = me->finished_head))
+    {
+        if (!(me->finished_head = r->next))
+            me->finished_tail = NULL;
+
+        if (r->done)
+            r->done(r->cb_udata, &r->blk, r->is_write ? NULL : r->buf,
+                    !r->failed && r->nbytes == r->blk.len);
+        __release_buf(me, r);
+        free(r);
+        me->inflight--;
+        n++;
+    }
+
+    return n;
+}
+
+static void __sync_done(void *cb_udata, const bt_block_t * blk,
+                        const void *data, int ok)
+{
+    diskuring_t *me = cb_udata;
+
+    if (ok && data)
+    {
+        if (me->sbuf_size < blk->len)
+        {
+            me->sbuf_size = blk->len;
+            me->sbuf = realloc(me->sbuf, me->sbuf_size);
+        }
+        memcpy(me->sbuf, data, blk->len);
+    }
+
+    me->sync_ok = ok;
+    me->sync_done = 1;
+}
+
+/**
+ * Wait for the request we just submitted */
+static int __sync_wait(diskuring_t *me)
+{
+    while (!me->sync_done)
+        if (0 == __poll(me, 1) && 0 == me->inflight)
+            return 0;
+    return me->sync_ok;
+}
+
+static int __write_block(void *udata, void *caller __attribute__((__unused__)),
+                         const bt_block_t * blk, const void *blkdata)
+{
+    diskuring_t *me = udata;
+
+    me->sync_done = 0;
+    __submit_write(me, blk, blkdata, __sync_done, me);
+    return __sync_wait(me);
+}
+
+static void *__read_block(void *udata, void *caller __attribute__((__unused__)),
+                          const bt_block_t * blk)
+{
+    diskuring_t *me = udata;
+
+    me->sync_done = 0;
+    __submit_read(me, blk, __sync_done, me);
+    return __sync_wait(me) ? me->sbuf : NULL;
+}
+
+static int __flush_block(void *udata, void *caller __attribute__((__unused__)),
+                         const bt_block_t * blk)
+{
+    diskuring_t *me = udata;
+    uint64_t off = (uint64_t)blk->piece_idx * me->piece_length + blk->offset;
+    int i, ok = 1;
+
+    /* writes still in the ring haven't reached the file yet */
+    while (0 < me->inflight)
+        if (0 == __poll(me, 1))
+            break;
+
+    for (i = __file_at(me, off);
+         i < me->nfiles && me->files[i].off < off + blk->len; i++)
+    {
+        file_t *f = &me->files[i];
+        int fd;
+
+        /* the ring has the only descriptor */
+        if (f->registered)
+        {
+            if (-1 == (fd = open(__path(me, f), O_RDWR)))
+                return 0;
+            if (0 != fdatasync(fd))
+                ok = 0;
+            close(fd);
+        }
+        else if (-1 != f->fd && 0 != fdatasync(f->fd))
+            ok = 0;
+    }
+
+    return ok;
+}
+
+void *bt_diskuring_new(const unsigned int entries)
+{
+    diskuring_t *me;
+
+    me = calloc(1, sizeof(diskuring_t));
+    me->iarw.submit_write = __submit_write;
+    me->iarw.submit_read = __submit_read;
+    me->iarw.poll = __poll;
+    me->irw.write_block = __write_block;
+    me->irw.read_block = __read_block;
+    me->irw.flush_block = __flush_block;
+    me->cwd = strdup(".");
+    me->ring = -1;
+
+#if HAVE_IO_URING
+    if (0 < entries)
+        __ring_init(me, entries);
+#endif
+
+    return me;
+}
+
+void bt_diskuring_free(void *duo)
+{
+    diskuring_t *me = duo;
+    int i;
+
+    /* finish what's in flight; the ring is about to go */
+    while (0 < me->inflight)
+        if (0 == __poll(me, 1))
+            break;
+
+#if HAVE_IO_URING
+    if (-1 != me->ring)
+        __ring_free(me);
+#endif
+
+    for (i = 0; i < me->nfiles; i++)
+    {
+        if (-1 != me->files[i].fd)
+            close(me->files[i].fd);
+        free(me->files[i].name);
+        free(me->files[i].path);
+    }
+
+    free(me->files);
+    free(me->bufs);
+    free(me->sbuf);
+    free(me->cwd);
+    free(me);
+}
+
+int bt_diskuring_is_async(void *duo)
+{
+    return -1 != priv(duo)->ring;
+}
+
+void bt_diskuring_set_piece_length(void *duo, const int piece_size)
+{
+    priv(duo)->piece_length = piece_size;
+}
+
+void bt_diskuring_set_cwd(void *duo, const char *path)
+{
+    diskuring_t *me = duo;
+
+    free(me->cwd);
+    me->cwd = strdup(path);
+}
+
+void bt_diskuring_add_file(void *duo, const char *fname, int fname_len,
+                           const uint64_t size)
+{
+    diskuring_t *me = duo;
+    file_t *f;
+
+#if HAVE_IO_URING
+    /* the file table is sized for the files we had; start again */
+    if (1 == me->files_registered)
+    {
+        int i;
+
+        while (0 < me->inflight)
+            if (0 == __poll(me, 1))
+                break;
+        __register(me, IORING_UNREGISTER_FILES, NULL, 0);
+        for (i = 0; i < me->nfiles; i++)
+            me->files[i].registered = 0;
+        me->files_registered = 0;
+    }
+#endif
+
+    me->files = realloc(me->files, (me->nfiles + 1) * sizeof(file_t));
+    f = &me->files[me->nfiles++];
+    f->name = bt_path_sanitize(fname, fname_len);
+    f->path = NULL;
+    f->off = me->tot_size;
+    f->size = size;
+    f->fd = -1;
+    f->registered = 0;
+    me->tot_size += size;
+}
+
+void bt_diskuring_set_blockpool(void *duo, void *pool)
+{
+    ((diskuring_t*)duo)->pool = pool;
+}
+
+bt_blockrw_async_i *bt_diskuring_get_blockrw_async(void *duo)
+{
+    return &priv(duo)->iarw;
+}
+
+bt_blockrw_i *bt_diskuring_get_blockrw(void *duo)
+{
+    return &priv(duo)->irw;
+}
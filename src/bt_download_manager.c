@@ -43,9 +43,31 @@
 #include "bt_selector_random.h"
 #include "bt_selector_rarestfirst.h"
 #include "bt_selector_sequential.h"
+#include "bt_fastresume.h"
+#include "bt_recheck.h"
+#include "bt_blockpool.h"
 
 #include <time.h>
 
+/* most of a peer's requests we look ahead at, for prefetching */
+#define MAX_PREFETCH_REQUESTS 32
+
+/* set on a skipped piece we took from a selector that doesn't know about
+ * priorities; we hand it back when it's wanted again */
+#define PRIORITY_PARKED (1 << 7)
+
+/* open_piece_t.bucket of pieces that aren't open */
+#define OPEN_NONE -1
+
+typedef struct
+{
+    /* blocks left to request; OPEN_NONE if not open */
+    int bucket;
+
+    /* neighbours in the bucket; -1 if none */
+    int prev, next;
+} open_piece_t;
+
 typedef struct
 {
     /* database for writing pieces */
@@ -86,6 +108,43 @@ typedef struct
 
     chunkybar_t* pieces_completed;
 
+    /* fast-resume state; NULL if we're not keeping any */
+    void* fr;
+
+    /* when we last saved the fast-resume state */
+    time_t fr_saved;
+
+    /* for writing blocks asynchronously; iarw.submit_write is NULL if not */
+    bt_blockrw_async_i iarw;
+    void* arw;
+
+    /* don't request blocks while this says storage is congested */
+    int (*is_congested)(void* udata);
+    void* congested_udata;
+
+    /* for blocks we copy to send to peers; NULL for the heap */
+    void* pool;
+
+    /* BT_PRIORITY_* of every piece, and PRIORITY_PARKED; pieces past the
+     * end are BT_PRIORITY_NORMAL */
+    unsigned char* prios;
+    int nprios;
+
+    /* pieces we've started requesting and haven't finished; their blocks
+     * are handed out before new pieces are started. Open pieces are kept
+     * in buckets by how many blocks they have left to request, so that the
+     * piece closest to being fully requested is found first */
+    open_piece_t* open;
+    int nopen;
+
+    /* first piece in each bucket; -1 if none */
+    int* open_head;
+    int nbuckets;
+
+    /* where peers' download rates come from; NULL for the measured rate */
+    int (*peer_rate)(void* udata, const void* peer);
+    void* peer_rate_udata;
+
 } bt_dm_private_t;
 
 typedef struct
@@ -100,6 +159,13 @@ typedef struct
     int piece_idx;
 } bt_job_validate_piece_t;
 
+/* a block being written asynchronously */
+typedef struct
+{
+    bt_dm_private_t* me;
+    bt_peer_t* peer;
+} bt_async_write_t;
+
 enum
 {
     BT_JOB_NONE,
@@ -120,6 +186,16 @@ typedef struct
 
 void *bt_dm_get_piecedb(bt_dm_t* me_);
 
+/**
+ * Get piece from the piece database.
+ * Bypass the interface when we're using the default piece database */
+static inline void* __get_piece(bt_dm_private_t* me, const unsigned int idx)
+{
+    if (me->ipdb.get_piece == bt_piecedb_get)
+        return bt_piecedb_get_fast(me->pdb, idx);
+    return me->ipdb.get_piece(me->pdb, idx);
+}
+
 static void __log(void *me_, void *src, const char *fmt, ...)
 {
     bt_dm_private_t *me = me_;
@@ -148,6 +224,68 @@ static int __FUNC_peerconn_send_to_peer(void *me_,
 
 int __FUNC_peerconn_disconnect(void *me_, void* pr, char *reason);
 
+/**
+ * @param blk Range of the piece; NULL for the whole piece */
+static void __prefetch_piece(bt_dm_private_t* me, const int idx,
+                             const bt_block_t* blk)
+{
+    bt_piece_t* p;
+
+    if (idx < 0 || config_get_int(me->cfg, "npieces") <= idx)
+        return;
+
+    /* we won't be serving pieces we don't have */
+    if ((p = __get_piece(me, idx)) && bt_piece_is_complete(p))
+        bt_piece_prefetch(p, blk);
+}
+
+/**
+ * Tell storage about the pieces we'll soon be sending to this peer, so that
+ * reading them from disk overlaps with sending */
+static void __prefetch_peer_requests(bt_dm_private_t* me, bt_peer_t* p)
+{
+    bt_block_t reqs[MAX_PREFETCH_REQUESTS], run;
+    int i, n, newest;
+    const bt_block_t* last = &p->prefetch_last;
+
+    n = config_get_int(me->cfg, "prefetch_requests");
+    if (MAX_PREFETCH_REQUESTS < n)
+        n = MAX_PREFETCH_REQUESTS;
+    if (n <= 0 || 0 == (n = pwp_conn_peek_peer_requests(p->pc, reqs, n)))
+        return;
+
+    newest = reqs[n - 1].piece_idx;
+
+    /* requests are served in order, so everything up to the newest one we
+     * hinted last time has been hinted already */
+    for (i = n - 1; 0 <= i; i--)
+        if (0 < last->len && reqs[i].piece_idx == last->piece_idx &&
+            reqs[i].offset == last->offset && reqs[i].len == last->len)
+            break;
+
+    /* hint each run of back-to-back blocks of a piece as one range */
+    for (i++; i < n; i++)
+    {
+        run = reqs[i];
+        while (i + 1 < n && reqs[i + 1].piece_idx == run.piece_idx &&
+               reqs[i + 1].offset == run.offset + run.len)
+            run.len += reqs[++i].len;
+        __prefetch_piece(me, run.piece_idx, &run);
+    }
+
+    /* a peer working through the torrent in order; read ahead for them */
+    if (newest == p->prefetch_piece + 1)
+        p->prefetch_nsequential++;
+    else if (newest != p->prefetch_piece)
+        p->prefetch_nsequential = 0;
+
+    if (newest != p->prefetch_piece && 2 <= p->prefetch_nsequential)
+        __prefetch_piece(me, newest + 1, NULL);
+
+    p->prefetch_piece = newest;
+    p->prefetch_last = reqs[n - 1];
+}
+
 void __FUNC_peer_periodic(void* cb_ctx, void* peer, void* udata)
 {
     bt_peer_t* p = peer;
@@ -156,6 +294,7 @@ void __FUNC_peer_periodic(void* cb_ctx, void* peer, void* udata)
         return;
     if (!pwp_conn_flag_is_set(p->pc, PC_HANDSHAKE_RECEIVED))
         return;
+    __prefetch_peer_requests(cb_ctx, p);
     pwp_conn_periodic(p->pc);
 }
 
@@ -371,10 +510,179 @@ static void* __poll_job(void *me_, void* __attribute__ ((unused)) unused)
     return llqueue_poll(me->jobs);
 }
 
+/**
+ * @return the bucket for the piece's unrequested blocks */
+static int __open_bucket(bt_dm_private_t* me, bt_piece_t* pce)
+{
+    int b = (bt_piece_get_nbytes_unrequested(pce) + (BT_BLOCK_SIZE) - 1) /
+            (BT_BLOCK_SIZE);
+
+    return b < me->nbuckets ? b : me->nbuckets - 1;
+}
+
+static void __open_link(bt_dm_private_t* me, const int idx, const int b)
+{
+    open_piece_t* o = &me->open[idx];
+
+    o->bucket = b;
+    o->prev = -1;
+    o->next = me->open_head[b];
+    if (-1 != o->next)
+        me->open[o->next].prev = idx;
+    me->open_head[b] = idx;
+}
+
+static void __open_unlink(bt_dm_private_t* me, const int idx)
+{
+    open_piece_t* o = &me->open[idx];
+
+    if (-1 == o->prev)
+        me->open_head[o->bucket] = o->next;
+    else
+        me->open[o->prev].next = o->next;
+    if (-1 != o->next)
+        me->open[o->next].prev = o->prev;
+    o->bucket = OPEN_NONE;
+}
+
+static void __open_piece(bt_dm_private_t* me, const int idx)
+{
+    bt_piece_t* pce = __get_piece(me, idx);
+    int i;
+
+    if (!pce)
+        return;
+
+    if (!me->open_head)
+    {
+        me->nbuckets = (config_get_int(me->cfg, "piece_length") +
+                        (BT_BLOCK_SIZE) - 1) / (BT_BLOCK_SIZE) + 1;
+        me->open_head = malloc(sizeof(int) * me->nbuckets);
+        for (i = 0; i < me->nbuckets; i++)
+            me->open_head[i] = -1;
+    }
+
+    if (me->nopen <= idx)
+    {
+        int n = config_get_int(me->cfg, "npieces");
+
+        n = idx < n ? n : idx + 1;
+        me->open = realloc(me->open, sizeof(open_piece_t) * n);
+        for (i = me->nopen; i < n; i++)
+            me->open[i].bucket = OPEN_NONE;
+        me->nopen = n;
+    }
+
+    if (OPEN_NONE == me->open[idx].bucket)
+        __open_link(me, idx, __open_bucket(me, pce));
+}
+
+static void __close_piece(bt_dm_private_t* me, const int idx)
+{
+    if (idx < me->nopen && OPEN_NONE != me->open[idx].bucket)
+        __open_unlink(me, idx);
+}
+
+/**
+ * The piece's blocks have been requested or given back */
+static void __refile_piece(bt_dm_private_t* me, const int idx)
+{
+    bt_piece_t* pce;
+    int b;
+
+    if (me->nopen <= idx || OPEN_NONE == me->open[idx].bucket ||
+        !(pce = __get_piece(me, idx)))
+        return;
+
+    if ((b = __open_bucket(me, pce)) == me->open[idx].bucket)
+        return;
+
+    __open_unlink(me, idx);
+    __open_link(me, idx, b);
+}
+
+/**
+ * Pieces are looked at from the fewest blocks left to request upwards;
+ * fully requested pieces aren't looked at
+ * @return the open piece the peer can help with that's closest to being
+ *  fully requested; otherwise NULL */
+static bt_piece_t* __poll_open_piece(bt_dm_private_t* me, bt_peer_t* peer)
+{
+    int b, idx, next;
+
+    for (b = 1; b < me->nbuckets; b++)
+        for (idx = me->open_head[b]; -1 != idx; idx = next)
+        {
+            bt_piece_t* pce = __get_piece(me, idx);
+
+            next = me->open[idx].next;
+
+            if (!pce || bt_piece_is_complete(pce))
+            {
+                __close_piece(me, idx);
+                continue;
+            }
+
+            if (BT_PRIORITY_SKIP == bt_dm_get_piece_priority((void*)me, idx) ||
+                !pwp_conn_peer_has_piece(peer->pc, idx))
+                continue;
+
+            return pce;
+        }
+
+    return NULL;
+}
+
+/**
+ * @return the peer's download rate in bytes per second */
+static int __peer_rate(bt_dm_private_t* me, bt_peer_t* peer)
+{
+    if (me->peer_rate)
+        return me->peer_rate(me->peer_rate_udata, peer);
+    return pwp_conn_get_download_rate(peer->pc);
+}
+
+/**
+ * Request the piece's blocks from the peer. A peer that would get the rest
+ * of the piece within piece_finish_secs is given all of it; slower peers
+ * get a block at a time, so that they share the piece with others */
+static void __request_blocks(bt_dm_private_t* me, bt_peer_t* peer,
+                             bt_piece_t* pce)
+{
+    int whole = (uint64_t)bt_piece_get_nbytes_unrequested(pce) <=
+                (uint64_t)__peer_rate(me, peer) *
+                config_get_int(me->cfg, "piece_finish_secs");
+
+    while (!bt_piece_is_fully_requested(pce))
+    {
+        bt_block_t blk;
+
+        bt_piece_poll_block_request(pce, &blk);
+        pwp_conn_offer_block(peer->pc, &blk);
+        if (!whole)
+            break;
+    }
+
+    __refile_piece(me, bt_piece_get_idx(pce));
+}
+
 static void __job_dispatch_poll_piece(bt_dm_private_t* me, bt_job_t* j)
 {
+    bt_piece_t* open;
+
     assert(me->ips.poll_piece);
 
+    /* the peer will poll again later */
+    if (me->is_congested && me->is_congested(me->congested_udata))
+        return;
+
+    /* finish what we've started before starting anything new */
+    if ((open = __poll_open_piece(me, j->pollblock.peer)))
+    {
+        __request_blocks(me, j->pollblock.peer, open);
+        return;
+    }
+
     while (1)
     {
         int p_idx = me->ips.poll_piece(me->pselector, j->pollblock.peer);
@@ -382,7 +690,16 @@ static void __job_dispatch_poll_piece(bt_dm_private_t* me, bt_job_t* j)
         if (-1 == p_idx)
             break;
 
-        bt_piece_t* pce = me->ipdb.get_piece(me->pdb, p_idx);
+        bt_piece_t* pce;
+
+        /* the selector can't skip it for us */
+        if (BT_PRIORITY_SKIP == bt_dm_get_piece_priority((void*)me, p_idx))
+        {
+            me->prios[p_idx] |= PRIORITY_PARKED;
+            continue;
+        }
+
+        pce = __get_piece(me, p_idx);
 
         if (pce && bt_piece_is_complete(pce))
         {
@@ -390,40 +707,67 @@ static void __job_dispatch_poll_piece(bt_dm_private_t* me, bt_job_t* j)
             continue;
         }
 
-        while (!bt_piece_is_fully_requested(pce))
+        /* the selector wants another peer to race for it */
+        if (bt_piece_is_fully_requested(pce))
         {
             bt_block_t blk;
-            bt_piece_poll_block_request(pce, &blk);
-            pwp_conn_offer_block(j->pollblock.peer->pc, &blk);
+            int iter = 0;
+
+            while (bt_piece_poll_missing_block(pce, &blk, &iter))
+                pwp_conn_offer_block(j->pollblock.peer->pc, &blk);
+            break;
         }
 
+        __open_piece(me, p_idx);
+        __request_blocks(me, j->pollblock.peer, pce);
         break;
     }
 }
 
 static void __job_dispatch_validate_piece(bt_dm_private_t* me, bt_job_t* j)
 {
-    bt_piece_t *p = me->ipdb.get_piece(me->pdb, j->validate_piece.piece_idx);
+    bt_piece_t *p = __get_piece(me, j->validate_piece.piece_idx);
     int piece_idx = bt_piece_get_idx(p);
 
     switch (bt_piece_validate(p))
     {
     case BT_PIECE_VALIDATE_COMPLETE_PIECE:
+        /* the piece only counts once its data is safely on disk */
+        if (!bt_piece_flush(p))
+        {
+            __log(me, NULL, "ERROR,couldn't flush piece,pieceidx=%d",
+                  piece_idx);
+            if (me->fr)
+                bt_fastresume_mark_complete(me->fr, piece_idx, 0);
+            bt_piece_drop_download_progress(p);
+            __refile_piece(me, piece_idx);
+            me->ips.peer_giveback_piece(me->pselector, NULL, piece_idx);
+            break;
+        }
+
     {
         __log(me, NULL, "client,piece completed,pieceidx=%d", piece_idx);
         assert(me->ips.have_piece);
         me->ips.have_piece(me->pselector, piece_idx);
+        __close_piece(me, piece_idx);
         chunky_mark_complete(me->pieces_completed, piece_idx, 1);
         bt_peermanager_forall(me->pm, me, p, __FUNC_peerconn_send_have);
+        if (me->fr)
+            bt_fastresume_mark_complete(me->fr, piece_idx, 1);
     }
     break;
 
     case BT_PIECE_VALIDATE_ERROR: /* error */
         printf("error validating piece: %d\n", piece_idx);
+        if (me->fr)
+            bt_fastresume_mark_complete(me->fr, piece_idx, 0);
         break;
 
     case BT_PIECE_VALIDATE_INVALID_PIECE: /* invalid piece */
     {
+        if (me->fr)
+            bt_fastresume_mark_complete(me->fr, piece_idx, 0);
+
         /* only peer involved in piece download, therefore treat as
          * untrusted and blacklist */
         if (1 == bt_piece_num_peers(p))
@@ -443,6 +787,7 @@ static void __job_dispatch_validate_piece(bt_dm_private_t* me, bt_job_t* j)
                     me->blacklist, p, p2);
 
             bt_piece_drop_download_progress(p);
+            __refile_piece(me, piece_idx);
             me->ips.peer_giveback_piece(me->pselector, NULL,
                                         bt_piece_get_idx(p));
         }
@@ -492,6 +837,51 @@ static int __FUNC_peerconn_pollblock(void *me_, void* peer)
     return 0;
 }
 
+/**
+ * @param peer The peer who gave us the last block; NULL if nobody did */
+static void __offer_validate_job(bt_dm_private_t* me,
+                                 bt_peer_t* peer,
+                                 const int piece_idx)
+{
+    /* TODO: replace malloc() with memory pool/arena */
+    bt_job_t * j = malloc(sizeof(bt_job_t));
+    j->type = BT_JOB_VALIDATE_PIECE;
+    j->validate_piece.peer = peer;
+    j->validate_piece.piece_idx = piece_idx;
+    __call_exclusively(me, &me->job_lock, j, __offer_job);
+}
+
+/**
+ * An asynchronous write of a peer's block has finished */
+static void __async_write_done(
+    void *cb_udata,
+    const bt_block_t * b,
+    const void *data __attribute__((__unused__)),
+    int ok)
+{
+    bt_async_write_t* w = cb_udata;
+    bt_dm_private_t *me = w->me;
+    bt_piece_t *p = __get_piece(me, b->piece_idx);
+
+    if (!ok)
+    {
+        printf("error writing block\n");
+        bt_piece_giveback_block(p, (bt_block_t*)b);
+        __refile_piece(me, b->piece_idx);
+        free(w);
+        return;
+    }
+
+    if (me->fr)
+        bt_fastresume_mark_block(me->fr, b);
+
+    if (BT_PIECE_WRITE_BLOCK_COMPLETELY_DOWNLOADED ==
+        bt_piece_set_block_downloaded(p, b, w->peer))
+        __offer_validate_job(me, w->peer, b->piece_idx);
+
+    free(w);
+}
+
 /**
  * Received a block from a peer
  * @param peer Peer received from
@@ -507,20 +897,38 @@ int __FUNC_peerconn_pushblock(
 
     assert(me->ipdb.get_piece);
 
-    bt_piece_t *p = me->ipdb.get_piece(me->pdb, b->piece_idx);
+    /* we raced for the block, and lost */
+    if (bt_piece_have_block(__get_piece(me, b->piece_idx), b))
+        return 1;
 
-    switch (bt_piece_write_block(p, NULL, b, data, peer))
-    {
-    case BT_PIECE_WRITE_BLOCK_COMPLETELY_DOWNLOADED:
+    if (me->iarw.submit_write)
     {
-        /* TODO: replace malloc() with memory pool/arena */
-        bt_job_t * j = malloc(sizeof(bt_job_t));
-        j->type = BT_JOB_VALIDATE_PIECE;
-        j->validate_piece.peer = peer;
-        j->validate_piece.piece_idx = b->piece_idx;
-        __call_exclusively(me, &me->job_lock, j, __offer_job);
+        bt_async_write_t* w = malloc(sizeof(bt_async_write_t));
+
+        w->me = me;
+        w->peer = peer;
+        if (0 == me->iarw.submit_write(me->arw, b, data,
+                                       __async_write_done, w))
+        {
+            printf("error writing block\n");
+            bt_piece_giveback_block(__get_piece(me, b->piece_idx), b);
+            __refile_piece(me, b->piece_idx);
+            free(w);
+        }
+        return 1;
     }
-    break;
+
+    bt_piece_t *p = __get_piece(me, b->piece_idx);
+    int ret = bt_piece_write_block(p, NULL, b, data, peer);
+
+    if (me->fr && 0 != ret)
+        bt_fastresume_mark_block(me->fr, b);
+
+    switch (ret)
+    {
+    case BT_PIECE_WRITE_BLOCK_COMPLETELY_DOWNLOADED:
+        __offer_validate_job(me, peer, b->piece_idx);
+        break;
     case BT_PIECE_WRITE_BLOCK_SUCCESS: break;
     case 0:
         printf("error writing block\n");
@@ -559,9 +967,10 @@ static void __FUNC_peerconn_giveback_block(void* bt, void* peer, bt_block_t* b)
 {
     bt_dm_private_t *me = bt;
 
-    void* pce = me->ipdb.get_piece(me->pdb, b->piece_idx);
+    void* pce = __get_piece(me, b->piece_idx);
 
     bt_piece_giveback_block(pce, b);
+    __refile_piece(me, b->piece_idx);
     me->ips.peer_giveback_piece(me->pselector, peer, b->piece_idx);
 }
 
@@ -572,7 +981,7 @@ static void __FUNC_peerconn_write_block_to_stream(void* cb_ctx,
     bt_dm_private_t *me = cb_ctx;
     void* p;
 
-    if (!(p = me->ipdb.get_piece(me->pdb, blk->piece_idx)))
+    if (!(p = __get_piece(me, blk->piece_idx)))
     {
         __log(me, NULL, "ERROR,unable to obtain piece");
         return;
@@ -582,6 +991,54 @@ static void __FUNC_peerconn_write_block_to_stream(void* cb_ctx,
         __log(me, NULL, "ERROR,unable to write block to stream");
 }
 
+static void *__FUNC_peerconn_alloc_block(void* cb_ctx, const unsigned int len)
+{
+    bt_dm_private_t *me = cb_ctx;
+
+    /* bigger than a buffer; only odd peers ask for these */
+    if (!me->pool || (BT_BLOCK_SIZE) < len)
+        return malloc(len);
+
+    return bt_blockpool_alloc(me->pool);
+}
+
+static void __FUNC_peerconn_free_block(void* cb_ctx, void *buf)
+{
+    bt_dm_private_t *me = cb_ctx;
+
+    if (me->pool && bt_blockpool_owns(me->pool, buf))
+        bt_blockpool_unref(me->pool, buf);
+    else
+        free(buf);
+}
+
+/**
+ * Send the block straight from the file it's stored in, if we can */
+static int __FUNC_peerconn_send_piece(void* cb_ctx,
+                                      const void* pc_peer,
+                                      const bt_block_t * blk,
+                                      const void *header,
+                                      const int header_len)
+{
+    bt_dm_private_t *me = cb_ctx;
+    const bt_peer_t * peer = pc_peer;
+    uint64_t offset;
+    void* p;
+    int fd;
+
+    if (!me->cb.peer_sendfile)
+        return -1;
+
+    if (!(p = __get_piece(me, blk->piece_idx)))
+        return -1;
+
+    if (-1 == (fd = bt_piece_get_block_fd(p, blk, &offset)))
+        return -1;
+
+    return me->cb.peer_sendfile(me, &me->cb_ctx, peer->conn_ctx,
+                                header, header_len, fd, offset, blk->len);
+}
+
 void *bt_dm_add_peer(bt_dm_t* me_,
                      const char *peer_id,
                      const int peer_id_len,
@@ -627,6 +1084,9 @@ void *bt_dm_add_peer(bt_dm_t* me_,
                                __FUNC_peerconn_giveback_block,
                            .write_block_to_stream =
                                __FUNC_peerconn_write_block_to_stream,
+                           .send_piece = __FUNC_peerconn_send_piece,
+                           .alloc_block = __FUNC_peerconn_alloc_block,
+                           .free_block = __FUNC_peerconn_free_block,
                            .call_exclusively = me->cb.call_exclusively
                        }), me);
     pwp_conn_set_progress(pc, me->pieces_completed);
@@ -693,12 +1153,24 @@ void bt_dm_periodic(bt_dm_t* me_, bt_dm_stats_t *stats)
 
     /* TODO: pump out keep alive message */
 
+    /* blocks whose writes have finished */
+    if (me->iarw.poll)
+        me->iarw.poll(me->arw, 0);
+
     while (0 < llqueue_count(me->jobs))
     {
         void *j = __call_exclusively(me_, &me->job_lock, NULL, __poll_job);
         __dispatch_job(me, j);
     }
 
+    if (me->fr && bt_fastresume_is_dirty(me->fr) &&
+        config_get_int(me->cfg, "fastresume_save_interval") <=
+        time(NULL) - me->fr_saved)
+    {
+        bt_fastresume_save(me->fr);
+        me->fr_saved = time(NULL);
+    }
+
     if (1 == me->am_seeding
         && 1 == config_get_int(me->cfg, "shutdown_when_complete"))
         goto cleanup;
@@ -719,6 +1191,9 @@ cleanup:
         }
         stats->npeers = 0;
         bt_peermanager_forall(me->pm, me, stats, __FUNC_peer_stats_visitor);
+
+        if (me->ipdb.get_piece == bt_piecedb_get)
+            stats->completed_bytes = bt_piecedb_get_completed_bytes(me->pdb);
     }
 
     return;
@@ -777,6 +1252,70 @@ void *bt_dm_get_piecedb(bt_dm_t* me_)
     return me->pdb;
 }
 
+static void __FUNC_peer_unpark_piece(void* me_, void* peer, void* udata)
+{
+    bt_dm_private_t* me = me_;
+    bt_peer_t* p = peer;
+    int idx = (long)udata;
+
+    if (p->pc && pwp_conn_peer_has_piece(p->pc, idx))
+        me->ips.peer_giveback_piece(me->pselector, p, idx);
+}
+
+void bt_dm_set_piece_priority_range(bt_dm_t* me_, const int idx,
+                                    const int npieces, const int prio)
+{
+    bt_dm_private_t* me = (void*)me_;
+    int i;
+
+    if (idx < 0 || npieces <= 0 ||
+        prio < BT_PRIORITY_SKIP || BT_PRIORITY_HIGH < prio)
+        return;
+
+    if (me->nprios < idx + npieces)
+    {
+        int n = config_get_int(me->cfg, "npieces");
+
+        n = idx + npieces < n ? n : idx + npieces;
+        me->prios = realloc(me->prios, n);
+        memset(me->prios + me->nprios, BT_PRIORITY_NORMAL, n - me->nprios);
+        me->nprios = n;
+    }
+
+    if (me->ips.set_piece_priority_range)
+        me->ips.set_piece_priority_range(me->pselector, idx, npieces, prio);
+    else if (me->ips.set_piece_priority)
+        for (i = idx; i < idx + npieces; i++)
+            me->ips.set_piece_priority(me->pselector, i, prio);
+
+    for (i = idx; i < idx + npieces; i++)
+    {
+        int was_parked = me->prios[i] & PRIORITY_PARKED;
+
+        me->prios[i] = prio;
+
+        if (was_parked && BT_PRIORITY_SKIP != prio)
+            bt_peermanager_forall(me->pm, me, (void*)(long)i,
+                                  __FUNC_peer_unpark_piece);
+        else if (was_parked)
+            me->prios[i] |= PRIORITY_PARKED;
+    }
+}
+
+void bt_dm_set_piece_priority(bt_dm_t* me_, const int idx, const int prio)
+{
+    bt_dm_set_piece_priority_range(me_, idx, 1, prio);
+}
+
+int bt_dm_get_piece_priority(bt_dm_t* me_, const int idx)
+{
+    bt_dm_private_t* me = (void*)me_;
+
+    if (idx < 0 || me->nprios <= idx)
+        return BT_PRIORITY_NORMAL;
+    return me->prios[idx] & ~PRIORITY_PARKED;
+}
+
 void bt_dm_set_piece_selector(
     bt_dm_t* me_,
     bt_pieceselector_i* ips,
@@ -789,6 +1328,17 @@ void bt_dm_set_piece_selector(
         me->pselector = me->ips.new(0);
     else
         me->pselector = piece_selector;
+
+    /* priorities set before the selector */
+    if (me->ips.set_piece_priority)
+    {
+        int i;
+
+        for (i = 0; i < me->nprios; i++)
+            if (BT_PRIORITY_NORMAL != bt_dm_get_piece_priority(me_, i))
+                me->ips.set_piece_priority(me->pselector, i,
+                                           bt_dm_get_piece_priority(me_, i));
+    }
     bt_dm_check_pieces(me_);
 }
 
@@ -800,6 +1350,110 @@ void bt_dm_set_piece_db(bt_dm_t* me_, bt_piecedb_i* ipdb, void* piece_db)
     me->pdb = piece_db;
 }
 
+void bt_dm_set_async_blockrw(bt_dm_t* me_, bt_blockrw_async_i* iarw,
+                             void* udata)
+{
+    bt_dm_private_t* me = (void*)me_;
+
+    if (iarw)
+        memcpy(&me->iarw, iarw, sizeof(bt_blockrw_async_i));
+    else
+        memset(&me->iarw, 0, sizeof(bt_blockrw_async_i));
+    me->arw = udata;
+}
+
+void bt_dm_set_write_throttle(bt_dm_t* me_, int (*is_congested)(void* udata),
+                              void* udata)
+{
+    bt_dm_private_t* me = (void*)me_;
+
+    me->is_congested = is_congested;
+    me->congested_udata = udata;
+}
+
+void bt_dm_set_peer_rate(bt_dm_t* me_,
+                         int (*rate)(void* udata, const void* peer),
+                         void* udata)
+{
+    bt_dm_private_t* me = (void*)me_;
+
+    me->peer_rate = rate;
+    me->peer_rate_udata = udata;
+}
+
+void bt_dm_set_blockpool(bt_dm_t* me_, void* pool)
+{
+    bt_dm_private_t* me = (void*)me_;
+
+    me->pool = pool;
+}
+
+void bt_dm_set_fastresume(bt_dm_t* me_, void* fr)
+{
+    bt_dm_private_t* me = (void*)me_;
+
+    me->fr = fr;
+    me->fr_saved = time(NULL);
+}
+
+/**
+ * We know we have this piece without having to validate it */
+static void __set_piece_complete(bt_dm_private_t* me, const int idx)
+{
+    bt_piece_t* p;
+
+    /* don't materialize pieces we won't be downloading */
+    if (me->ipdb.get_piece == bt_piecedb_get)
+        bt_piecedb_set_complete(me->pdb, idx);
+    else if ((p = __get_piece(me, idx)))
+        bt_piece_set_complete(p, 1);
+    chunky_mark_complete(me->pieces_completed, idx, 1);
+}
+
+/**
+ * The piece's data is bad; we don't have it after all */
+static void __set_piece_incomplete(bt_dm_private_t* me, const int idx)
+{
+    bt_piece_t* p;
+
+    if (me->ipdb.get_piece == bt_piecedb_get)
+        bt_piecedb_clear_complete(me->pdb, idx);
+    else if ((p = __get_piece(me, idx)))
+        bt_piece_drop_download_progress(p);
+    chunky_mark_incomplete(me->pieces_completed, idx, 1);
+}
+
+/**
+ * Take fast-resume's word for the piece instead of hashing it
+ * @return 1 if fast-resume knows about the piece; otherwise 0 */
+static int __check_piece_fastresume(bt_dm_private_t* me, const int idx)
+{
+    bt_block_t blk;
+    bt_piece_t* p;
+    int iter = 0;
+
+    switch (bt_fastresume_get_piece_state(me->fr, idx))
+    {
+    case BT_FASTRESUME_COMPLETE:
+        __set_piece_complete(me, idx);
+        return 1;
+
+    case BT_FASTRESUME_INCOMPLETE:
+        /* restore the blocks we'd already written */
+        while (bt_fastresume_get_partial(me->fr, idx, &blk, &iter))
+        {
+            if (!(p = __get_piece(me, idx)))
+                break;
+            if (BT_PIECE_WRITE_BLOCK_COMPLETELY_DOWNLOADED ==
+                bt_piece_set_block_downloaded(p, &blk, NULL))
+                __offer_validate_job(me, NULL, idx);
+        }
+        return 1;
+    }
+
+    return 0;
+}
+
 void bt_dm_check_pieces(bt_dm_t* me_)
 {
     bt_dm_private_t* me = (void*)me_;
@@ -807,20 +1461,51 @@ void bt_dm_check_pieces(bt_dm_t* me_)
 
     for (i = 0, end = config_get_int(me->cfg, "npieces"); i < end; i++)
     {
-        bt_piece_t* p = me->ipdb.get_piece(me->pdb, i);
+        bt_piece_t* p;
 
-        if (!p)
+        if (me->fr && __check_piece_fastresume(me, i))
+            continue;
+
+        if (!(p = __get_piece(me, i)))
             continue;
         if (bt_piece_is_complete(p))
             chunky_mark_complete(me->pieces_completed, i, 1);
         else
+            __offer_validate_job(me, NULL, bt_piece_get_idx(p));
+    }
+}
+
+void bt_dm_recheck(bt_dm_t* me_, void* rc)
+{
+    bt_dm_private_t* me = (void*)me_;
+    int i, end;
+
+    bt_recheck_run(rc);
+
+    for (i = 0, end = config_get_int(me->cfg, "npieces"); i < end; i++)
+    {
+        int valid = bt_recheck_piece_is_valid(rc, i);
+
+        if (valid)
         {
-            bt_job_t * j = malloc(sizeof(bt_job_t));
-            j->type = BT_JOB_VALIDATE_PIECE;
-            j->validate_piece.peer = NULL;
-            j->validate_piece.piece_idx = bt_piece_get_idx(p);
-            __call_exclusively(me, &me->job_lock, j, __offer_job);
+            __set_piece_complete(me, i);
+            if (me->ips.have_piece)
+                me->ips.have_piece(me->pselector, i);
         }
+        else if (chunky_have(me->pieces_completed, i, 1))
+        {
+            __set_piece_incomplete(me, i);
+            if (me->ips.lost_piece)
+                me->ips.lost_piece(me->pselector, i);
+        }
+        if (me->fr)
+            bt_fastresume_mark_complete(me->fr, i, valid);
+    }
+
+    if (me->fr)
+    {
+        bt_fastresume_save(me->fr);
+        me->fr_saved = time(NULL);
     }
 }
 
@@ -853,6 +1538,9 @@ void *bt_dm_new()
     config_set_if_not_set(me->cfg, "piece_length", "0");
     config_set_if_not_set(me->cfg, "download_path", ".");
     config_set_if_not_set(me->cfg, "shutdown_when_complete", "0");
+    config_set_if_not_set(me->cfg, "fastresume_save_interval", "60");
+    config_set_if_not_set(me->cfg, "prefetch_requests", "8");
+    config_set_if_not_set(me->cfg, "piece_finish_secs", "10");
 
     /*  set leeching choker */
     me->lchoke = bt_leeching_choker_new(
@@ -0,0 +1,608 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Remember what we have between sessions, so we don't re-hash it
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ * @section description
+ * Resume file layout (host byte order; it never leaves this machine):
+ *
+ *  header      bt_fastresume_header_t
+ *  files       nfiles x bt_fastresume_file_t
+ *  bitmap      (npieces + 7) / 8 bytes, MSB first like the PWP bitfield
+ *  partials    npartial x { uint32_t idx; block bitmap }
+ *
+ * The header, file records and bitmap are at fixed offsets, so piece
+ * completions are written in place with pwrite(). Partial progress changes
+ * with every block and is only written by bt_fastresume_save().
+ *
+ * A file is only vouched for once every piece it spans has been validated
+ * this session (or was vouched for last session); otherwise we'd record the
+ * mtime of data we've never looked at.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+/* for uint32_t */
+#include <stdint.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "bt.h"
+#include "bt_fastresume.h"
+
+#include "linked_list_hashmap.h"
+
+#define BT_FASTRESUME_MAGIC 0x52465442 /* "BTFR" */
+#define BT_FASTRESUME_VERSION 1
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t npieces;
+    uint32_t piece_len;
+    uint32_t nfiles;
+    uint32_t npartial;
+} bt_fastresume_header_t;
+
+typedef struct
+{
+    uint64_t size;
+
+    /* nanoseconds; -1 if we don't vouch for this file */
+    int64_t mtime;
+} bt_fastresume_file_t;
+
+typedef struct
+{
+    char* path;
+
+    /* offset of the file within the torrent */
+    uint64_t off;
+
+    /* length according to the torrent */
+    uint64_t len;
+
+    /* what the resume file says */
+    bt_fastresume_file_t rec;
+
+    /* number of pieces spanning this file that we haven't validated */
+    unsigned int nunknown;
+} file_t;
+
+typedef struct
+{
+    char* path;
+
+    /* resume file; -1 if its layout isn't in step with us */
+    int fd;
+
+    unsigned int npieces;
+    unsigned int piece_len;
+
+    file_t* files;
+    int nfiles;
+
+    uint64_t tot_len;
+
+    /* pieces we have */
+    unsigned char* have;
+
+    /* pieces whose state we don't know yet */
+    unsigned char* unknown;
+
+    /* piece idx + 1 -> bitmap of blocks on disk */
+    hashmap_t* partial;
+
+    int dirty;
+} bt_fastresume_t;
+
+#define priv(x) ((bt_fastresume_t*)(x))
+
+#define BITMAP_BYTES(n) (((n) + 7) / 8)
+#define BIT_IS_SET(b, i) ((b)[(i) / 8] & (0x80 >> ((i) % 8)))
+#define BIT_SET(b, i) ((b)[(i) / 8] |= (0x80 >> ((i) % 8)))
+#define BIT_CLEAR(b, i) ((b)[(i) / 8] &= ~(0x80 >> ((i) % 8)))
+
+#define BLOCK_SIZE (BT_BLOCK_SIZE)
+
+static unsigned long __idx_hash(const void *obj)
+{
+    return (unsigned long)obj;
+}
+
+static long __idx_compare(const void *obj, const void *other)
+{
+    return (long)obj - (long)other;
+}
+
+#define IDX_KEY(idx) ((void*)((unsigned long)(idx) + 1))
+
+static unsigned int __blocks_per_piece(bt_fastresume_t* me)
+{
+    return (me->piece_len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+static unsigned int __piece_size(bt_fastresume_t* me, const unsigned int idx)
+{
+    uint64_t start = (uint64_t)idx * me->piece_len;
+
+    if (0 == me->nfiles || me->tot_len - start > me->piece_len)
+        return me->piece_len;
+    return me->tot_len - start;
+}
+
+static off_t __bitmap_offset(bt_fastresume_t* me)
+{
+    return sizeof(bt_fastresume_header_t) +
+           me->nfiles * sizeof(bt_fastresume_file_t);
+}
+
+/**
+ * @return the first file that this piece spans; nfiles if none */
+static int __first_file(bt_fastresume_t* me, const unsigned int idx)
+{
+    uint64_t start = (uint64_t)idx * me->piece_len;
+    int lo = 0, hi = me->nfiles;
+
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+
+        if (me->files[mid].off + me->files[mid].len <= start)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+#define forall_files_of_piece(me, idx, f)                                     \
+    for (f = &(me)->files[__first_file(me, idx)];                            \
+         f < (me)->files + (me)->nfiles &&                                    \
+         f->off < (uint64_t)((idx) + 1) * (me)->piece_len;                    \
+         f++)                                                                 \
+        if (0 < f->len)
+
+/**
+ * @return 1 if we could stat the file */
+static int __stat(const file_t* f, bt_fastresume_file_t* out)
+{
+    struct stat st;
+
+    if (-1 == stat(f->path, &st))
+    {
+        out->size = 0;
+        out->mtime = 0;
+        return 0;
+    }
+
+    out->size = st.st_size;
+#if defined(__APPLE__)
+    out->mtime = (int64_t)st.st_mtimespec.tv_sec * 1000000000 +
+                 st.st_mtimespec.tv_nsec;
+#else
+    out->mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 +
+                 st.st_mtim.tv_nsec;
+#endif
+    return 1;
+}
+
+/**
+ * Vouch for the file as it is right now, if we can */
+static void __refresh_file(file_t* f)
+{
+    if (0 == f->nunknown)
+        __stat(f, &f->rec);
+    else
+        f->rec.mtime = -1;
+}
+
+static void __set_unknown(bt_fastresume_t* me, const unsigned int idx,
+                          const int yes)
+{
+    file_t* f;
+
+    if (!BIT_IS_SET(me->unknown, idx) == !yes)
+        return;
+
+    if (yes)
+        BIT_SET(me->unknown, idx);
+    else
+        BIT_CLEAR(me->unknown, idx);
+
+    forall_files_of_piece(me, idx, f)
+        f->nunknown += yes ? 1 : -1;
+}
+
+static void __drop_partial(bt_fastresume_t* me, const unsigned int idx)
+{
+    void* bits = hashmap_remove(me->partial, IDX_KEY(idx));
+
+    if (!bits)
+        return;
+    free(bits);
+    me->dirty = 1;
+}
+
+static void __clear_partials(bt_fastresume_t* me)
+{
+    hashmap_iterator_t iter;
+
+    hashmap_iterator(me->partial, &iter);
+    while (hashmap_iterator_has_next(me->partial, &iter))
+        free(hashmap_remove(me->partial,
+                            hashmap_iterator_next(me->partial, &iter)));
+}
+
+void* bt_fastresume_new(const char* path,
+                        const unsigned int npieces,
+                        const unsigned int piece_len)
+{
+    bt_fastresume_t* me = calloc(1, sizeof(bt_fastresume_t));
+
+    me->path = strdup(path);
+    me->fd = -1;
+    me->npieces = npieces;
+    me->piece_len = piece_len;
+    me->have = calloc(1, BITMAP_BYTES(npieces));
+    /* until a resume file says otherwise we know nothing */
+    me->unknown = malloc(BITMAP_BYTES(npieces));
+    memset(me->unknown, 0xff, BITMAP_BYTES(npieces));
+    me->partial = hashmap_new(__idx_hash, __idx_compare, 11);
+    me->dirty = 1;
+    return me;
+}
+
+void bt_fastresume_free(void* fr)
+{
+    bt_fastresume_t* me = fr;
+    int i;
+
+    if (-1 != me->fd)
+        close(me->fd);
+    for (i = 0; i < me->nfiles; i++)
+        free(me->files[i].path);
+    __clear_partials(me);
+    hashmap_freeall(me->partial);
+    free(me->files);
+    free(me->have);
+    free(me->unknown);
+    free(me->path);
+    free(me);
+}
+
+void bt_fastresume_add_file(void* fr, const char* path, const uint64_t size)
+{
+    bt_fastresume_t* me = fr;
+    file_t* f;
+    unsigned int i;
+
+    me->files = realloc(me->files, (me->nfiles + 1) * sizeof(file_t));
+    f = &me->files[me->nfiles++];
+    f->path = strdup(path);
+    f->off = me->tot_len;
+    f->len = size;
+    f->rec.size = 0;
+    f->rec.mtime = -1;
+    f->nunknown = 0;
+    me->tot_len += size;
+
+    if (0 == size)
+        return;
+    for (i = f->off / me->piece_len;
+         i <= (f->off + size - 1) / me->piece_len && i < me->npieces; i++)
+        if (BIT_IS_SET(me->unknown, i))
+            f->nunknown++;
+}
+
+int bt_fastresume_load(void* fr)
+{
+    bt_fastresume_t* me = fr;
+    bt_fastresume_header_t h;
+    unsigned int i, nbits = BITMAP_BYTES(__blocks_per_piece(me));
+    int fd, j;
+
+    if (-1 == (fd = open(me->path, O_RDWR)))
+        return 0;
+
+    if (sizeof(h) != pread(fd, &h, sizeof(h), 0) ||
+        BT_FASTRESUME_MAGIC != h.magic ||
+        BT_FASTRESUME_VERSION != h.version ||
+        me->npieces != h.npieces ||
+        me->piece_len != h.piece_len ||
+        (uint32_t)me->nfiles != h.nfiles)
+        goto fail;
+
+    for (j = 0; j < me->nfiles; j++)
+        if (sizeof(bt_fastresume_file_t) !=
+            pread(fd, &me->files[j].rec, sizeof(bt_fastresume_file_t),
+                  sizeof(h) + j * sizeof(bt_fastresume_file_t)))
+            goto fail;
+
+    if (BITMAP_BYTES(me->npieces) !=
+        pread(fd, me->have, BITMAP_BYTES(me->npieces), __bitmap_offset(me)))
+        goto fail;
+
+    __clear_partials(me);
+    for (i = 0; i < h.npartial; i++)
+    {
+        off_t off = __bitmap_offset(me) + BITMAP_BYTES(me->npieces) +
+                    i * (sizeof(uint32_t) + nbits);
+        unsigned char* bits = malloc(nbits);
+        uint32_t idx;
+
+        if (sizeof(idx) != pread(fd, &idx, sizeof(idx), off) ||
+            nbits != pread(fd, bits, nbits, off + sizeof(idx)) ||
+            me->npieces <= idx)
+        {
+            free(bits);
+            goto fail;
+        }
+
+        free(hashmap_put(me->partial, IDX_KEY(idx), bits));
+    }
+
+    /* only believe the bitmap for files that haven't changed since */
+    memset(me->unknown, 0, BITMAP_BYTES(me->npieces));
+    for (j = 0; j < me->nfiles; j++)
+        me->files[j].nunknown = 0;
+    for (j = 0; j < me->nfiles; j++)
+    {
+        file_t* f = &me->files[j];
+        bt_fastresume_file_t now;
+
+        __stat(f, &now);
+        if (0 == f->len || (now.size == f->rec.size &&
+                            now.mtime == f->rec.mtime))
+            continue;
+
+        for (i = f->off / me->piece_len;
+             i <= (f->off + f->len - 1) / me->piece_len && i < me->npieces;
+             i++)
+            __set_unknown(me, i, 1);
+    }
+
+    /* we can't trust the partial progress of pieces we're re-hashing */
+    for (i = 0; i < me->npieces; i++)
+        if (BIT_IS_SET(me->unknown, i))
+        {
+            BIT_CLEAR(me->have, i);
+            if (hashmap_get(me->partial, IDX_KEY(i)))
+                free(hashmap_remove(me->partial, IDX_KEY(i)));
+        }
+
+    if (-1 != me->fd)
+        close(me->fd);
+    me->fd = fd;
+    me->dirty = 0;
+    return 1;
+
+fail:
+    close(fd);
+    __clear_partials(me);
+    memset(me->have, 0, BITMAP_BYTES(me->npieces));
+    return 0;
+}
+
+/**
+ * Make a rename in the directory of this file durable
+ * @return 1 on success; otherwise 0 */
+static int __sync_dir(const char* path)
+{
+    char* dir = strdup(path), *slash = strrchr(dir, '/');
+    int fd, ok;
+
+    if (!slash)
+        strcpy(dir, ".");
+    else if (slash == dir)
+        slash[1] = '\0';
+    else
+        *slash = '\0';
+
+    fd = open(dir, O_RDONLY);
+    free(dir);
+    if (-1 == fd)
+        return 0;
+    ok = 0 == fsync(fd);
+    close(fd);
+    return ok;
+}
+
+int bt_fastresume_save(void* fr)
+{
+    bt_fastresume_t* me = fr;
+    bt_fastresume_header_t h;
+    hashmap_iterator_t iter;
+    unsigned int nbits = BITMAP_BYTES(__blocks_per_piece(me));
+    char* tmp;
+    FILE* f;
+    int j;
+
+    tmp = malloc(strlen(me->path) + strlen(".tmp") + 1);
+    sprintf(tmp, "%s.tmp", me->path);
+
+    if (!(f = fopen(tmp, "wb")))
+    {
+        free(tmp);
+        return 0;
+    }
+
+    h.magic = BT_FASTRESUME_MAGIC;
+    h.version = BT_FASTRESUME_VERSION;
+    h.npieces = me->npieces;
+    h.piece_len = me->piece_len;
+    h.nfiles = me->nfiles;
+    h.npartial = hashmap_count(me->partial);
+    fwrite(&h, sizeof(h), 1, f);
+
+    for (j = 0; j < me->nfiles; j++)
+    {
+        __refresh_file(&me->files[j]);
+        fwrite(&me->files[j].rec, sizeof(bt_fastresume_file_t), 1, f);
+    }
+
+    fwrite(me->have, BITMAP_BYTES(me->npieces), 1, f);
+
+    hashmap_iterator(me->partial, &iter);
+    while (hashmap_iterator_has_next(me->partial, &iter))
+    {
+        uint32_t idx = (unsigned long)hashmap_iterator_peek(me->partial,
+                                                            &iter) - 1;
+        void* bits = hashmap_iterator_next_value(me->partial, &iter);
+
+        fwrite(&idx, sizeof(idx), 1, f);
+        fwrite(bits, nbits, 1, f);
+    }
+
+    if (0 != fflush(f) || ferror(f) || 0 != fsync(fileno(f)))
+    {
+        fclose(f);
+        unlink(tmp);
+        free(tmp);
+        return 0;
+    }
+    fclose(f);
+
+    if (0 != rename(tmp, me->path))
+    {
+        unlink(tmp);
+        free(tmp);
+        return 0;
+    }
+    free(tmp);
+
+    /* the new file is in step with us; keep it open for in place writes */
+    if (-1 != me->fd)
+        close(me->fd);
+    me->fd = open(me->path, O_RDWR);
+
+    /* until the directory is synced a crash could bring back the old file */
+    if (!__sync_dir(me->path))
+    {
+        me->dirty = 1;
+        return 0;
+    }
+
+    me->dirty = 0;
+    return 1;
+}
+
+int bt_fastresume_is_dirty(void* fr)
+{
+    return priv(fr)->dirty;
+}
+
+int bt_fastresume_get_piece_state(void* fr, const unsigned int idx)
+{
+    bt_fastresume_t* me = fr;
+
+    if (me->npieces <= idx || BIT_IS_SET(me->unknown, idx))
+        return BT_FASTRESUME_UNKNOWN;
+    return BIT_IS_SET(me->have, idx) ?
+           BT_FASTRESUME_COMPLETE : BT_FASTRESUME_INCOMPLETE;
+}
+
+void bt_fastresume_mark_complete(void* fr, const unsigned int idx,
+                                 const int yes)
+{
+    bt_fastresume_t* me = fr;
+    off_t off;
+    file_t* f;
+
+    if (me->npieces <= idx)
+        return;
+
+    if (yes)
+        BIT_SET(me->have, idx);
+    else
+        BIT_CLEAR(me->have, idx);
+    __set_unknown(me, idx, 0);
+    __drop_partial(me, idx);
+
+    if (-1 == me->fd)
+    {
+        me->dirty = 1;
+        return;
+    }
+
+    off = __bitmap_offset(me) + idx / 8;
+    if (1 != pwrite(me->fd, &me->have[idx / 8], 1, off))
+        me->dirty = 1;
+
+    /* the piece's data is on disk; vouch for its files as they are now */
+    forall_files_of_piece(me, idx, f)
+    {
+        __refresh_file(f);
+        off = sizeof(bt_fastresume_header_t) +
+              (f - me->files) * sizeof(bt_fastresume_file_t);
+        if (sizeof(f->rec) != pwrite(me->fd, &f->rec, sizeof(f->rec), off))
+            me->dirty = 1;
+    }
+}
+
+void bt_fastresume_mark_block(void* fr, const bt_block_t* blk)
+{
+    bt_fastresume_t* me = fr;
+    unsigned int i, end, psize;
+    unsigned char* bits;
+
+    if (me->npieces <= blk->piece_idx)
+        return;
+
+    psize = __piece_size(me, blk->piece_idx);
+
+    /* only whole blocks; the tail block of a piece may be short */
+    i = (blk->offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    end = blk->offset + blk->len == psize ?
+          __blocks_per_piece(me) : (blk->offset + blk->len) / BLOCK_SIZE;
+    if (end <= i)
+        return;
+
+    if (!(bits = hashmap_get(me->partial, IDX_KEY(blk->piece_idx))))
+    {
+        bits = calloc(1, BITMAP_BYTES(__blocks_per_piece(me)));
+        hashmap_put(me->partial, IDX_KEY(blk->piece_idx), bits);
+    }
+
+    for (; i < end; i++)
+        BIT_SET(bits, i);
+    me->dirty = 1;
+}
+
+int bt_fastresume_get_partial(void* fr, const unsigned int idx,
+                              bt_block_t* blk, int* iter)
+{
+    bt_fastresume_t* me = fr;
+    unsigned int psize;
+    unsigned char* bits;
+
+    if (!(bits = hashmap_get(me->partial, IDX_KEY(idx))))
+        return 0;
+
+    psize = __piece_size(me, idx);
+    for (; (unsigned int)*iter * BLOCK_SIZE < psize; (*iter)++)
+    {
+        if (!BIT_IS_SET(bits, *iter))
+            continue;
+
+        blk->piece_idx = idx;
+        blk->offset = *iter * BLOCK_SIZE;
+        blk->len = psize - blk->offset < BLOCK_SIZE ?
+                   psize - blk->offset : BLOCK_SIZE;
+        (*iter)++;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,1126 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief A disk layer which reads and writes the torrent's files
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ * @section description
+ * A backend block read/writer that puts data into files.
+ * The torrent is one byte stream that is cut up into files; a block is
+ * mapped onto the stream, and split across files where it straddles them.
+ * Only a limited number of files are kept open at once. A file that's been
+ * written to is synced before it's closed, so that a flush doesn't have to
+ * find it open; if that sync fails, the next flush of the file says so.
+ *
+ * Disk space can be allocated ahead of the writes, either for whole files
+ * or a region at a time, using posix_fallocate(). Filesystems that can't
+ * allocate are left sparse.
+ *
+ * With direct I/O files are opened with O_DIRECT, so that the page cache is
+ * bypassed. Requests then have to be aligned in both memory and file
+ * offset. Aligned runs go straight to the caller's memory; the unaligned
+ * edges go through a block sized buffer from our own bt_blockpool, with
+ * writes reading in the rest of the aligned chunk first. Filesystems that
+ * refuse O_DIRECT get ordinary buffered I/O.
+ *
+ * Files can be skipped. A skipped file is never created; the bytes of it
+ * that fall in pieces shared with wanted files go into the part-file
+ * instead. The part-file starts with a table of one uint32_t per piece,
+ * giving the piece's slot + 1 (0 for no slot); slots are a piece long and
+ * follow the table in the order they were handed out.
+ */
+
+/* for O_DIRECT */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <errno.h>
+
+/* for uint32_t */
+#include <stdint.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "bt.h"
+#include "bt_filedumper.h"
+#include "bt_util.h"
+#include "bt_blockpool.h"
+
+/* for LRU of open files */
+#include "pseudolru.h"
+
+typedef struct
+{
+    /* name relative to cwd */
+    char *name;
+
+    /* cwd + name; built on first use */
+    char *path;
+
+    /* offset of the file within the torrent */
+    uint64_t off;
+
+    uint64_t size;
+
+    /* -1 if not open */
+    int fd;
+
+    /* 1 if fd was opened with O_DIRECT */
+    int direct;
+
+    /* written to since it was last synced */
+    int dirty;
+
+    /* a sync failed while nobody was flushing; the next flush reports it */
+    int sync_failed;
+
+    /* BT_PRIORITY_* */
+    int priority;
+} file_t;
+
+typedef struct
+{
+    bt_blockrw_i irw;
+
+    file_t *files;
+    int nfiles;
+
+    uint64_t tot_size;
+
+    int piece_length;
+
+    char *cwd;
+
+    /* open files; keys are file idx + 1 */
+    pseudolru_t *lru_file;
+    int max_open_files;
+
+    /* what we hand out from read_block() */
+    char *buf;
+    unsigned int buf_size;
+
+    /* BT_FILEDUMPER_ALLOC_* */
+    int alloc_mode;
+
+    /* for BT_FILEDUMPER_ALLOC_ON_WRITE, the torrent is allocated in regions
+     * of this many bytes */
+    uint64_t region_size;
+
+    /* regions that have had their space allocated; one bit per region */
+    unsigned char *alloced;
+    unsigned int nalloced;
+
+    /* 1 to open files with O_DIRECT */
+    int direct_io;
+
+    /* aligned buffers for direct I/O; NULL until needed */
+    void *pool;
+
+    /* holds the parts of skipped files; name relative to cwd */
+    char *part_name;
+    int part_fd;
+
+    /* slot + 1 of every piece; 0 if the piece has no slot */
+    uint32_t *part_slots;
+    unsigned int part_npieces;
+    unsigned int part_nslots;
+
+    bt_filedumper_stats_t stats;
+} filedumper_private_t;
+
+#define priv(x) ((filedumper_private_t*)(x))
+
+/* file offsets and memory have to be aligned to this for O_DIRECT */
+#define DIRECT_ALIGN 4096
+
+#define DIRECT_POOL_LEN (1 << 21)
+
+#define FILE_KEY(idx) ((void*)((unsigned long)(idx) + 1))
+#define FILE_IDX(key) ((int)((unsigned long)(key) - 1))
+
+static int __lru_file_compare(
+    const void *e1,
+    const void *e2
+)
+{
+    return FILE_IDX(e1) - FILE_IDX(e2);
+}
+
+static const char *__path(filedumper_private_t *me, file_t *f)
+{
+    if (!f->path)
+    {
+        f->path = malloc(strlen(me->cwd) + 1 + strlen(f->name) + 1);
+        sprintf(f->path, "%s/%s", me->cwd, f->name);
+    }
+
+    return f->path;
+}
+
+/**
+ * Create the directories leading up to this file */
+static void __mkdirs(const char *path)
+{
+    char *p, *dir = strdup(path);
+
+    for (p = strchr(dir + 1, '/'); p; p = strchr(p + 1, '/'))
+    {
+        *p = '\0';
+        mkdir(dir, 0755);
+        *p = '/';
+    }
+
+    free(dir);
+}
+
+/**
+ * Put what's been written to the open file on disk
+ * @return 1 on success; otherwise 0 */
+static int __sync(filedumper_private_t *me, file_t *f)
+{
+    if (!f->dirty)
+        return 1;
+
+    me->stats.syncs++;
+    if (0 != fdatasync(f->fd))
+    {
+        f->sync_failed = 1;
+        return 0;
+    }
+
+    f->dirty = 0;
+    return 1;
+}
+
+/**
+ * Sync and close the file; it's already off the LRU */
+static void __close_fd(filedumper_private_t *me, file_t *f)
+{
+    __sync(me, f);
+    f->dirty = 0;
+    close(f->fd);
+    f->fd = -1;
+}
+
+static void __close(filedumper_private_t *me, const int idx)
+{
+    if (-1 == me->files[idx].fd)
+        return;
+
+    pseudolru_remove(me->lru_file, FILE_KEY(idx));
+    __close_fd(me, &me->files[idx]);
+}
+
+/**
+ * Close files until no more than max files are open */
+static void __close_lru(filedumper_private_t *me, const int max)
+{
+    while (max < pseudolru_count(me->lru_file))
+        __close_fd(me,
+                   &me->files[FILE_IDX(pseudolru_pop_lru(me->lru_file))]);
+}
+
+/**
+ * @param create Create the file if it doesn't exist
+ * @return file descriptor; otherwise -1 */
+static int __open(filedumper_private_t *me, const int idx, const int create)
+{
+    file_t *f = &me->files[idx];
+
+    if (-1 != f->fd)
+    {
+        /* most recently used */
+        pseudolru_get(me->lru_file, FILE_KEY(idx));
+        return f->fd;
+    }
+
+    /* make room first, so that we can't be the one that's closed */
+    __close_lru(me, me->max_open_files - 1);
+
+    f->direct = 0;
+#if defined(O_DIRECT)
+    if (me->direct_io)
+    {
+        f->direct = 1;
+        f->fd = open(__path(me, f), O_RDWR | O_DIRECT);
+        if (-1 == f->fd && ENOENT == errno && create)
+        {
+            __mkdirs(__path(me, f));
+            f->fd = open(__path(me, f), O_RDWR | O_CREAT | O_DIRECT, 0644);
+        }
+
+        /* the filesystem won't do it */
+        if (-1 == f->fd && EINVAL == errno)
+            f->direct = 0;
+        else if (-1 == f->fd)
+            return -1;
+    }
+#endif
+
+    if (!f->direct)
+    {
+        f->fd = open(__path(me, f), O_RDWR);
+        if (-1 == f->fd && ENOENT == errno && create)
+        {
+            __mkdirs(__path(me, f));
+            f->fd = open(__path(me, f), O_RDWR | O_CREAT, 0644);
+        }
+    }
+
+    if (-1 == f->fd)
+        return -1;
+
+    pseudolru_put(me->lru_file, FILE_KEY(idx), FILE_KEY(idx));
+    return f->fd;
+}
+
+/**
+ * @return idx of the file that holds this byte of the torrent */
+static int __file_at(filedumper_private_t *me, const uint64_t off)
+{
+    int lo = 0, hi = me->nfiles;
+
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+
+        if (me->files[mid].off + me->files[mid].size <= off)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/**
+ * Allocate disk space for this part of the file.
+ * It's only a hint, so failures are ignored */
+static void __allocate(filedumper_private_t *me, const int idx,
+                       const uint64_t off, const uint64_t len)
+{
+    int fd;
+
+    if (0 == len || BT_PRIORITY_SKIP == me->files[idx].priority ||
+        -1 == (fd = __open(me, idx, 1)))
+        return;
+
+    posix_fallocate(fd, off, len);
+}
+
+/**
+ * Allocate disk space for every region that these bytes of the torrent
+ * touch, if we haven't already */
+static void __allocate_regions(filedumper_private_t *me, const uint64_t off,
+                               const unsigned int len)
+{
+    uint64_t r, last = (off + len - 1) / me->region_size;
+
+    if (me->nalloced <= last)
+    {
+        unsigned int n = (me->tot_size + me->region_size - 1) /
+                         me->region_size;
+
+        if (n <= last)
+            return;
+        me->alloced = realloc(me->alloced, (n + 7) / 8);
+        memset(me->alloced + (me->nalloced + 7) / 8, 0,
+               (n + 7) / 8 - (me->nalloced + 7) / 8);
+        me->nalloced = n;
+    }
+
+    for (r = off / me->region_size; r <= last; r++)
+    {
+        uint64_t start = r * me->region_size, end = start + me->region_size;
+        int i;
+
+        if (me->alloced[r / 8] & (1 << (r % 8)))
+            continue;
+        me->alloced[r / 8] |= 1 << (r % 8);
+
+        for (i = __file_at(me, start);
+             i < me->nfiles && me->files[i].off < end; i++)
+        {
+            file_t *f = &me->files[i];
+            uint64_t from = start < f->off ? 0 : start - f->off,
+                     to = f->off + f->size < end ? f->size : end - f->off;
+
+            if (from < to)
+                __allocate(me, i, from, to - from);
+        }
+    }
+}
+
+/**
+ * Read or write the block, splitting it across the files it straddles
+ * @return 1 on success; otherwise 0 */
+static int __rw(int fd, char *data, const unsigned int n, const uint64_t off,
+                const int is_write)
+{
+    unsigned int done;
+
+    for (done = 0; done < n; )
+    {
+        ssize_t r = is_write ?
+            pwrite(fd, data + done, n - done, off + done) :
+            pread(fd, data + done, n - done, off + done);
+
+        if (-1 == r && EINTR == errno)
+            continue;
+        /* a short file doesn't have this data yet */
+        if (r <= 0)
+            return 0;
+        done += r;
+    }
+
+    return 1;
+}
+
+/**
+ * One read; at the end of the file O_DIRECT reads come up short
+ * @return bytes read; -1 on error */
+static ssize_t __read_direct(int fd, char *buf, const unsigned int n,
+                             const uint64_t off)
+{
+    ssize_t r;
+
+    while (-1 == (r = pread(fd, buf, n, off)) && EINTR == errno)
+        ;
+    return r;
+}
+
+/**
+ * Read or write part of a file opened with O_DIRECT */
+static int __rw_direct(filedumper_private_t *me, int fd, char *data,
+                       const unsigned int n, const uint64_t off,
+                       const int is_write)
+{
+    uint64_t lo, end = off + n;
+    char *buf = NULL;
+    int ok = 1;
+
+    for (lo = off; ok && lo < end; )
+    {
+        uint64_t io_lo, io_hi, hi;
+        ssize_t r;
+
+        /* aligned on both sides; no need to copy */
+        if (0 == lo % DIRECT_ALIGN &&
+            0 == (unsigned long)(data + (lo - off)) % DIRECT_ALIGN &&
+            DIRECT_ALIGN <= end - lo)
+        {
+            hi = end - (end - lo) % DIRECT_ALIGN;
+            ok = __rw(fd, data + (lo - off), hi - lo, lo, is_write);
+            lo = hi;
+            continue;
+        }
+
+        if (!buf)
+        {
+            if (!me->pool)
+                me->pool = bt_blockpool_new(DIRECT_POOL_LEN);
+            if (!me->pool || !(buf = bt_blockpool_alloc(me->pool)))
+                return 0;
+        }
+
+        /* the aligned chunk around lo, no bigger than buf */
+        io_lo = lo - lo % DIRECT_ALIGN;
+        hi = io_lo + (BT_BLOCK_SIZE) < end ? io_lo + (BT_BLOCK_SIZE) : end;
+        io_hi = hi + (DIRECT_ALIGN - hi % DIRECT_ALIGN) % DIRECT_ALIGN;
+
+        r = io_hi - io_lo;
+        if (!is_write || lo != io_lo || hi != io_hi)
+        {
+            if (-1 == (r = __read_direct(fd, buf, io_hi - io_lo, io_lo)) ||
+                (!is_write && (uint64_t)r < hi - io_lo))
+            {
+                ok = 0;
+                break;
+            }
+            memset(buf + r, 0, io_hi - io_lo - r);
+        }
+
+        if (!is_write)
+            memcpy(data + (lo - off), buf + (lo - io_lo), hi - lo);
+        else
+        {
+            memcpy(buf + (lo - io_lo), data + (lo - off), hi - lo);
+            ok = __rw(fd, buf, io_hi - io_lo, io_lo, 1);
+
+            /* we wrote padding past the end of the file; cut it off */
+            if (ok && io_lo + r < io_hi)
+                ok = 0 == ftruncate(fd, io_lo + r < hi ? hi : io_lo + r);
+        }
+
+        lo = hi;
+    }
+
+    if (buf)
+        bt_blockpool_unref(me->pool, buf);
+    return ok;
+}
+
+static void __part_close(filedumper_private_t *me)
+{
+    if (-1 != me->part_fd)
+    {
+        me->stats.syncs++;
+        fdatasync(me->part_fd);
+        close(me->part_fd);
+    }
+    me->part_fd = -1;
+    free(me->part_slots);
+    me->part_slots = NULL;
+    me->part_nslots = 0;
+}
+
+/**
+ * Open the part-file and load its table of slots
+ * @param create Create the part-file if it doesn't exist
+ * @return 1 on success; otherwise 0 */
+static int __part_open(filedumper_private_t *me, const int create)
+{
+    char *path;
+    unsigned int i;
+    ssize_t r;
+
+    if (-1 != me->part_fd)
+        return 1;
+
+    path = malloc(strlen(me->cwd) + 1 + strlen(me->part_name) + 1);
+    sprintf(path, "%s/%s", me->cwd, me->part_name);
+    me->part_fd = open(path, O_RDWR | (create ? O_CREAT : 0), 0644);
+    free(path);
+    if (-1 == me->part_fd)
+        return 0;
+
+    me->part_npieces = (me->tot_size + me->piece_length - 1) /
+                       me->piece_length;
+    me->part_slots = calloc(me->part_npieces + 1, sizeof(uint32_t));
+
+    /* a new part-file reads short, and has no slots */
+    r = pread(me->part_fd, me->part_slots, me->part_npieces * sizeof(uint32_t),
+              0);
+    if (r < 0)
+        r = 0;
+    memset((char*)me->part_slots + r, 0,
+           me->part_npieces * sizeof(uint32_t) - r);
+
+    for (i = 0; i < me->part_npieces; i++)
+        if (me->part_nslots < me->part_slots[i])
+            me->part_nslots = me->part_slots[i];
+    return 1;
+}
+
+/**
+ * @param create Give the piece a slot if it doesn't have one
+ * @return 1 and the slot's offset within the part-file; otherwise 0 */
+static int __part_slot(filedumper_private_t *me, const unsigned int piece_idx,
+                       const int create, uint64_t *off)
+{
+    if (!__part_open(me, create) || me->part_npieces <= piece_idx)
+        return 0;
+
+    if (0 == me->part_slots[piece_idx])
+    {
+        uint32_t s = me->part_nslots + 1;
+
+        if (!create ||
+            !__rw(me->part_fd, (char*)&s, sizeof(s),
+                  (uint64_t)piece_idx * sizeof(uint32_t), 1))
+            return 0;
+        me->part_slots[piece_idx] = s;
+        me->part_nslots++;
+    }
+
+    *off = (uint64_t)me->part_npieces * sizeof(uint32_t) +
+           (uint64_t)(me->part_slots[piece_idx] - 1) * me->piece_length;
+    return 1;
+}
+
+/**
+ * Read or write bytes of the torrent that belong to a skipped file
+ * @return 1 on success; otherwise 0 */
+static int __rw_part(filedumper_private_t *me, char *data, unsigned int n,
+                     uint64_t off, const int is_write)
+{
+    while (0 < n)
+    {
+        unsigned int in = off % me->piece_length,
+                     k = me->piece_length - in < n ? me->piece_length - in : n;
+        uint64_t slot;
+
+        if (!__part_slot(me, off / me->piece_length, is_write, &slot) ||
+            !__rw(me->part_fd, data, k, slot + in, is_write))
+            return 0;
+
+        data += k;
+        off += k;
+        n -= k;
+    }
+
+    return 1;
+}
+
+static int __io(filedumper_private_t *me, const bt_block_t *blk, char *data,
+                const int is_write)
+{
+    uint64_t off = (uint64_t)blk->piece_idx * me->piece_length + blk->offset;
+    unsigned int len = blk->len;
+    int i;
+
+    for (i = __file_at(me, off); 0 < len; i++)
+    {
+        file_t *f = &me->files[i];
+        unsigned int n;
+        int fd, ok;
+
+        if (me->nfiles <= i)
+            return 0;
+
+        /* skip empty files */
+        if (0 == f->size)
+            continue;
+
+        n = f->off + f->size - off < len ? f->off + f->size - off : len;
+
+        if (BT_PRIORITY_SKIP == f->priority)
+            ok = __rw_part(me, data, n, off, is_write);
+        else if (-1 == (fd = __open(me, i, is_write)))
+            return 0;
+        else
+        {
+            if (is_write)
+                f->dirty = 1;
+            if (f->direct)
+                ok = __rw_direct(me, fd, data, n, off - f->off, is_write);
+            else
+                ok = __rw(fd, data, n, off - f->off, is_write);
+        }
+        if (!ok)
+            return 0;
+
+        data += n;
+        off += n;
+        len -= n;
+    }
+
+    return 1;
+}
+
+int bt_filedumper_write_block(
+    void *flo,
+    void *caller __attribute__((__unused__)),
+    const bt_block_t * blk,
+    const void *data)
+{
+    filedumper_private_t *me = flo;
+
+    assert(0 < me->piece_length);
+
+    if (BT_FILEDUMPER_ALLOC_ON_WRITE == me->alloc_mode && 0 < blk->len)
+        __allocate_regions(me,
+            (uint64_t)blk->piece_idx * me->piece_length + blk->offset,
+            blk->len);
+
+    return __io(me, blk, (char*)data, 1);
+}
+
+/**
+ * pwritev() all of the buffers
+ * @return 1 on success; otherwise 0 */
+static int __writev(int fd, const bt_iovec_t * iov, const int iovcnt,
+                    uint64_t off)
+{
+    struct iovec v[64];
+    unsigned int skip = 0;
+    int i = 0;
+
+    while (i < iovcnt)
+    {
+        ssize_t r;
+        int n;
+
+        /* skip is how much of iov[i] has already been written */
+        for (n = 0; n < 64 && i + n < iovcnt; n++)
+        {
+            v[n].iov_base = (char*)iov[i + n].data + (0 == n ? skip : 0);
+            v[n].iov_len = iov[i + n].len - (0 == n ? skip : 0);
+        }
+
+        if (-1 == (r = pwritev(fd, v, n, off)))
+        {
+            if (EINTR == errno)
+                continue;
+            return 0;
+        }
+
+        off += r;
+        for (r += skip, skip = 0; i < iovcnt && iov[i].len <= r; i++)
+            r -= iov[i].len;
+        skip = r;
+    }
+
+    return 1;
+}
+
+static int __write_blockv(
+    void *flo,
+    void *caller __attribute__((__unused__)),
+    const bt_block_t * blk,
+    const bt_iovec_t * iov,
+    const int iovcnt)
+{
+    filedumper_private_t *me = flo;
+    uint64_t off = (uint64_t)blk->piece_idx * me->piece_length + blk->offset;
+    bt_block_t b;
+    file_t *f;
+    int i, fd;
+
+    assert(0 < me->piece_length);
+
+    if (BT_FILEDUMPER_ALLOC_ON_WRITE == me->alloc_mode && 0 < blk->len)
+        __allocate_regions(me, off, blk->len);
+
+    i = __file_at(me, off);
+    f = &me->files[i];
+    if (i < me->nfiles && off + blk->len <= f->off + f->size &&
+        BT_PRIORITY_SKIP != f->priority &&
+        -1 != (fd = __open(me, i, 1)) && !f->direct)
+    {
+        f->dirty = 1;
+        return __writev(fd, iov, iovcnt, off - f->off);
+    }
+
+    /* it spans files, or needs aligning; one buffer at a time */
+    b = *blk;
+    for (i = 0; i < iovcnt; i++)
+    {
+        b.len = iov[i].len;
+        if (!__io(me, &b, (char*)iov[i].data, 1))
+            return 0;
+        b.offset += b.len;
+    }
+
+    return 1;
+}
+
+void *bt_filedumper_read_block(
+    void *flo,
+    void *caller __attribute__((__unused__)),
+    const bt_block_t * blk
+)
+{
+    filedumper_private_t *me = flo;
+
+    assert(0 < me->piece_length);
+
+    if (me->buf_size < blk->len)
+    {
+        /* aligned, so that direct I/O can read straight into it */
+        free(me->buf);
+        if (0 != posix_memalign((void**)&me->buf, DIRECT_ALIGN, blk->len))
+        {
+            me->buf = NULL;
+            me->buf_size = 0;
+            return NULL;
+        }
+        me->buf_size = blk->len;
+    }
+
+    if (!__io(me, blk, me->buf, 0))
+        return NULL;
+    return me->buf;
+}
+
+/**
+ * Make sure the block is on disk */
+static int __flush_block(
+    void *flo,
+    void *caller __attribute__((__unused__)),
+    const bt_block_t * blk
+)
+{
+    filedumper_private_t *me = flo;
+    uint64_t off = (uint64_t)blk->piece_idx * me->piece_length + blk->offset;
+    int i, ok = 1;
+
+    for (i = __file_at(me, off);
+         i < me->nfiles && me->files[i].off < off + blk->len; i++)
+    {
+        file_t *f = &me->files[i];
+
+        /* a closed file was synced when it was closed */
+        if (-1 != f->fd)
+            __sync(me, f);
+
+        if (f->sync_failed)
+        {
+            f->sync_failed = 0;
+            ok = 0;
+        }
+    }
+
+    if (-1 != me->part_fd)
+    {
+        me->stats.syncs++;
+        if (0 != fdatasync(me->part_fd))
+            ok = 0;
+    }
+
+    return ok;
+}
+
+/**
+ * Have the kernel start reading the block in */
+static void __prefetch_block(
+    void *flo,
+    void *caller __attribute__((__unused__)),
+    const bt_block_t * blk
+)
+{
+    filedumper_private_t *me = flo;
+    uint64_t off = (uint64_t)blk->piece_idx * me->piece_length + blk->offset;
+    unsigned int len = blk->len;
+    int i;
+
+    for (i = __file_at(me, off); 0 < len && i < me->nfiles; i++)
+    {
+        file_t *f = &me->files[i];
+        unsigned int n;
+        int fd;
+
+        if (0 == f->size)
+            continue;
+
+        n = f->off + f->size - off < len ? f->off + f->size - off : len;
+
+        /* the page cache isn't used with direct I/O */
+        if (BT_PRIORITY_SKIP != f->priority &&
+            -1 != (fd = __open(me, i, 0)) && !f->direct)
+            posix_fadvise(fd, off - f->off, n, POSIX_FADV_WILLNEED);
+
+        off += n;
+        len -= n;
+    }
+}
+
+static int __block_fd(void *flo, const bt_block_t * blk, uint64_t *offset)
+{
+    filedumper_private_t *me = flo;
+    uint64_t off = (uint64_t)blk->piece_idx * me->piece_length + blk->offset;
+    int i = __file_at(me, off);
+
+    if (me->nfiles <= i)
+        return -1;
+
+    /* spans files, or lives in the part-file */
+    if (me->files[i].off + me->files[i].size < off + blk->len ||
+        BT_PRIORITY_SKIP == me->files[i].priority)
+        return -1;
+
+    *offset = off - me->files[i].off;
+
+    /* sendfile() would fill the page cache we're avoiding */
+    if (-1 == __open(me, i, 0) || me->files[i].direct)
+        return -1;
+    return me->files[i].fd;
+}
+
+void *bt_filedumper_new()
+{
+    filedumper_private_t *me;
+
+    me = calloc(1, sizeof(filedumper_private_t));
+    me->irw.write_block = bt_filedumper_write_block;
+    me->irw.read_block = bt_filedumper_read_block;
+    me->irw.flush_block = __flush_block;
+    me->irw.prefetch_block = __prefetch_block;
+    me->irw.block_fd = __block_fd;
+    me->irw.write_blockv = __write_blockv;
+    me->cwd = strdup(".");
+    me->lru_file = pseudolru_new(__lru_file_compare);
+    me->max_open_files = 64;
+    me->region_size = 1 << 24;
+    me->part_name = strdup(".parts");
+    me->part_fd = -1;
+    return me;
+}
+
+void bt_filedumper_free(void* fl)
+{
+    filedumper_private_t *me = fl;
+    int i;
+
+    for (i = 0; i < me->nfiles; i++)
+    {
+        __close(me, i);
+        free(me->files[i].name);
+        free(me->files[i].path);
+    }
+    pseudolru_free(me->lru_file);
+    free(me->files);
+    free(me->cwd);
+    free(me->buf);
+    free(me->alloced);
+    __part_close(me);
+    free(me->part_name);
+    if (me->pool)
+        bt_blockpool_free(me->pool);
+    free(me);
+}
+
+void bt_filedumper_add_file(
+    void* fl,
+    const char *fname,
+    int fname_len,
+    const uint64_t size)
+{
+    filedumper_private_t *me = fl;
+    file_t *f;
+
+    me->files = realloc(me->files, (me->nfiles + 1) * sizeof(file_t));
+    f = &me->files[me->nfiles++];
+    f->name = bt_path_sanitize(fname, fname_len);
+    f->path = NULL;
+    f->off = me->tot_size;
+    f->size = size;
+    f->fd = -1;
+    f->dirty = 0;
+    f->sync_failed = 0;
+    f->priority = BT_PRIORITY_NORMAL;
+    me->tot_size += size;
+
+    /* the part-file's table is sized from the torrent */
+    __part_close(me);
+
+    if (BT_FILEDUMPER_ALLOC_FULL == me->alloc_mode)
+        __allocate(me, me->nfiles - 1, 0, size);
+}
+
+int bt_filedumper_get_nfiles(void * fl)
+{
+    return priv(fl)->nfiles;
+}
+
+const char *bt_filedumper_file_get_path(
+    void * fl,
+    const int idx
+)
+{
+    filedumper_private_t *me = fl;
+
+    if (idx < 0 || me->nfiles <= idx)
+        return NULL;
+    return __path(me, &me->files[idx]);
+}
+
+bt_blockrw_i *bt_filedumper_get_blockrw(void * fl)
+{
+    return &priv(fl)->irw;
+}
+
+void bt_filedumper_set_piece_length(void * fl, const int piece_size)
+{
+    priv(fl)->piece_length = piece_size;
+}
+
+void bt_filedumper_set_cwd(void * fl, const char *path)
+{
+    filedumper_private_t *me = fl;
+    int i;
+
+    free(me->cwd);
+    me->cwd = strdup(path);
+
+    /* paths have changed */
+    __part_close(me);
+    for (i = 0; i < me->nfiles; i++)
+    {
+        __close(me, i);
+        free(me->files[i].path);
+        me->files[i].path = NULL;
+    }
+}
+
+void bt_filedumper_set_max_open_files(void * fl, const int max)
+{
+    filedumper_private_t *me = fl;
+
+    me->max_open_files = 0 < max ? max : 1;
+    __close_lru(me, me->max_open_files);
+}
+
+void bt_filedumper_set_allocation(void * fl, const int mode)
+{
+    filedumper_private_t *me = fl;
+    int i;
+
+    me->alloc_mode = mode;
+
+    if (BT_FILEDUMPER_ALLOC_FULL == mode)
+        for (i = 0; i < me->nfiles; i++)
+            __allocate(me, i, 0, me->files[i].size);
+}
+
+void bt_filedumper_set_allocation_region(void * fl, const uint64_t size)
+{
+    filedumper_private_t *me = fl;
+
+    assert(0 < size);
+
+    /* the regions have moved */
+    me->region_size = size;
+    free(me->alloced);
+    me->alloced = NULL;
+    me->nalloced = 0;
+}
+
+void bt_filedumper_set_direct_io(void * fl, const int on)
+{
+    filedumper_private_t *me = fl;
+    int i;
+
+    me->direct_io = on;
+
+    /* reopen with the new flags */
+    for (i = 0; i < me->nfiles; i++)
+        __close(me, i);
+}
+
+uint64_t bt_filedumper_get_total_size(void * fl)
+{
+    return priv(fl)->tot_size;
+}
+
+/**
+ * Move the bytes of this file that share pieces with other files between
+ * the file and the part-file. Only the file's first and last pieces can be
+ * shared.
+ * @param to_part 1 to move them into the part-file; 0 to move them out */
+static void __migrate(filedumper_private_t *me, const int idx,
+                      const int to_part)
+{
+    file_t *f = &me->files[idx];
+    unsigned int p, first, last;
+    char *buf;
+
+    if (0 == f->size)
+        return;
+
+    first = f->off / me->piece_length;
+    last = (f->off + f->size - 1) / me->piece_length;
+    buf = malloc(me->piece_length);
+
+    for (p = first; p <= last; p = last == p ? p + 1 : last)
+    {
+        uint64_t lo = (uint64_t)p * me->piece_length,
+                 hi = lo + me->piece_length, slot;
+        int fd;
+
+        if (me->tot_size < hi)
+            hi = me->tot_size;
+
+        /* the piece is all ours */
+        if (f->off <= lo && hi <= f->off + f->size)
+            continue;
+
+        lo = lo < f->off ? f->off : lo;
+        hi = f->off + f->size < hi ? f->off + f->size : hi;
+
+        if (to_part)
+        {
+            if (-1 != (fd = __open(me, idx, 0)) &&
+                __rw(fd, buf, hi - lo, lo - f->off, 0))
+                __rw_part(me, buf, hi - lo, lo, 1);
+        }
+        else if (__part_slot(me, p, 0, &slot) &&
+                 __rw(me->part_fd, buf, hi - lo,
+                      slot + lo % me->piece_length, 0) &&
+                 -1 != (fd = __open(me, idx, 1)))
+        {
+            f->dirty = 1;
+            __rw(fd, buf, hi - lo, lo - f->off, 1);
+        }
+    }
+
+    free(buf);
+}
+
+void bt_filedumper_set_file_priority(void * fl, const int idx,
+                                     const int priority)
+{
+    filedumper_private_t *me = fl;
+    file_t *f;
+    int was;
+
+    if (idx < 0 || me->nfiles <= idx)
+        return;
+
+    f = &me->files[idx];
+    if (f->priority == priority)
+        return;
+
+    if (BT_PRIORITY_SKIP == priority && 0 < me->piece_length)
+    {
+        __migrate(me, idx, 1);
+        __close(me, idx);
+    }
+
+    was = f->priority;
+    f->priority = priority;
+
+    /* only a file that was skipped has bytes in the part-file */
+    if (BT_PRIORITY_SKIP == was && 0 < me->piece_length)
+        __migrate(me, idx, 0);
+}
+
+int bt_filedumper_get_file_priority(void * fl, const int idx)
+{
+    filedumper_private_t *me = fl;
+
+    if (idx < 0 || me->nfiles <= idx)
+        return BT_PRIORITY_SKIP;
+    return me->files[idx].priority;
+}
+
+int bt_filedumper_get_piece_priority(void * fl, const unsigned int piece_idx)
+{
+    filedumper_private_t *me = fl;
+    uint64_t off = (uint64_t)piece_idx * me->piece_length,
+             end = off + me->piece_length;
+    int i, prio = BT_PRIORITY_SKIP;
+
+    assert(0 < me->piece_length);
+
+    for (i = __file_at(me, off); i < me->nfiles && me->files[i].off < end; i++)
+        if (0 < me->files[i].size && prio < me->files[i].priority)
+            prio = me->files[i].priority;
+
+    return prio;
+}
+
+void bt_filedumper_set_partfile(void * fl, const char *name)
+{
+    filedumper_private_t *me = fl;
+
+    __part_close(me);
+    free(me->part_name);
+    me->part_name = strdup(name);
+}
+
+void bt_filedumper_get_stats(void * fl, bt_filedumper_stats_t *stats)
+{
+    memcpy(stats, &priv(fl)->stats, sizeof(bt_filedumper_stats_t));
+}
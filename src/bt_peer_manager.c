@@ -141,6 +141,7 @@ bt_peer_t *bt_peermanager_add_peer(void *pm,
     }
     asprintf(&peer->ip, "%.*s", ip_len, ip);
     peer->port = port;
+    peer->prefetch_piece = -1;
 
 #if 0 /*  debug */
     printf("adding peer: ip:%.*s port:%d\n", ip_len, ip, port);
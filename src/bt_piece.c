@@ -42,20 +42,23 @@ typedef struct
 {
     int idx;
 
-    /* for marking peers as invalid piece givers */
-    avltree_t* peers;
-
     int validity;
 
     int piece_length;
 
+    /* in-flight state; allocated on first request/write and released once
+     * the piece completes. See __inflight() */
+
+    /* for marking peers as invalid piece givers */
+    avltree_t* peers;
+
     /* downloaded: we have this block downloaded */
     chunkybar_t *progress_downloaded;
 
     /* we have requested this block */
     chunkybar_t *progress_requested;
 
-    char *sha1;
+    char sha1[20];
 
     /* modification time */
     unsigned int mtime;
@@ -66,12 +69,75 @@ typedef struct
     /* functions and data for reading/writing block data */
     bt_blockrw_i *disk;
     void *disk_udata;
+
+    /* BT_PIECE_STATE_* bits we last told the observer about */
+    int state;
+    func_piece_state_f state_cb;
+    void *state_udata;
 } __piece_private_t;
 
 #define priv(x) ((__piece_private_t*)(x))
 
+/**
+ * Let the observer know if we've become downloaded or complete (or have
+ * stopped being so) */
+static void __state_changed(bt_piece_t *me)
+{
+    int state = 0;
+
+    if (!priv(me)->state_cb)
+        return;
+
+    if (bt_piece_is_downloaded(me))
+        state |= BT_PIECE_STATE_DOWNLOADED;
+    if (priv(me)->is_completed)
+        state |= BT_PIECE_STATE_COMPLETE;
+
+    if (state == priv(me)->state)
+        return;
+
+    priv(me)->state = state;
+    priv(me)->state_cb(priv(me)->state_udata, me, state);
+}
+
+static long __cmp_address(const void *e1, const void *e2)
+{
+    return (unsigned long)e2 - (unsigned long)e1;
+}
+
+/**
+ * Allocate the state we only need while the piece is being downloaded.
+ * Most pieces of a large torrent are never in flight at the same time, so
+ * we don't pay for this until a block is requested or written */
+static void __inflight(bt_piece_t *me)
+{
+    if (priv(me)->progress_downloaded)
+        return;
+
+    priv(me)->progress_downloaded = chunky_new(priv(me)->piece_length);
+    priv(me)->progress_requested = chunky_new(priv(me)->piece_length);
+    priv(me)->peers = avltree_new(__cmp_address);
+}
+
+static void __inflight_release(bt_piece_t *me)
+{
+    if (!priv(me)->progress_downloaded)
+        return;
+
+    chunky_free(priv(me)->progress_downloaded);
+    chunky_free(priv(me)->progress_requested);
+    free(priv(me)->peers->nodes);
+    free(priv(me)->peers);
+    priv(me)->progress_downloaded = NULL;
+    priv(me)->progress_requested = NULL;
+    priv(me)->peers = NULL;
+}
+
 void* bt_piece_get_peers(bt_piece_t *me, int *iter)
 {
+    if (!priv(me)->peers)
+        return NULL;
+
     for (; *iter < avltree_size(priv(me)->peers); (*iter)++)
     {
         void* k;
@@ -88,6 +154,8 @@ void* bt_piece_get_peers(bt_piece_t *me, int *iter)
 
 int bt_piece_num_peers(bt_piece_t *me)
 {
+    if (!priv(me)->peers)
+        return 0;
     return avltree_count(priv(me)->peers);
 }
 
@@ -108,6 +176,7 @@ int bt_piece_write_block(
     if (!priv(me)->disk)
         return 0;
 
+    __inflight(me);
     avltree_insert(priv(me)->peers, peer, peer);
 
     assert(priv(me)->disk->write_block);
@@ -130,7 +199,31 @@ int bt_piece_write_block(
 #endif
 
     if (chunky_is_complete(priv(me)->progress_downloaded))
+    {
+        __state_changed(me);
+        return BT_PIECE_WRITE_BLOCK_COMPLETELY_DOWNLOADED;
+    }
+
+    return BT_PIECE_WRITE_BLOCK_SUCCESS;
+}
+
+int bt_piece_set_block_downloaded(bt_piece_t *me, const bt_block_t * b,
+                                  void* peer)
+{
+    __inflight(me);
+    if (peer)
+    {
+        avltree_insert(priv(me)->peers, peer, peer);
+        priv(me)->validity = VALIDITY_NOTCHECKED;
+    }
+    chunky_mark_complete(priv(me)->progress_requested, b->offset, b->len);
+    chunky_mark_complete(priv(me)->progress_downloaded, b->offset, b->len);
+
+    if (chunky_is_complete(priv(me)->progress_downloaded))
+    {
+        __state_changed(me);
         return BT_PIECE_WRITE_BLOCK_COMPLETELY_DOWNLOADED;
+    }
 
     return BT_PIECE_WRITE_BLOCK_SUCCESS;
 }
@@ -142,17 +235,14 @@ void *bt_piece_read_block(bt_piece_t *me, void *caller, const bt_block_t * b)
     if (!priv(me)->disk->read_block)
         return NULL;
 
-    if (!chunky_have(priv(me)->progress_downloaded, b->offset, b->len))
+    if (!priv(me)->is_completed &&
+        (!priv(me)->progress_downloaded ||
+         !chunky_have(priv(me)->progress_downloaded, b->offset, b->len)))
         return NULL;
 
     return priv(me)->disk->read_block(priv(me)->disk_udata, me, b);
 }
 
-static long __cmp_address(const void *e1, const void *e2)
-{
-    return (unsigned long)e2 - (unsigned long)e1;
-}
-
 bt_piece_t *bt_piece_new(
     const char *sha1sum,
     const int piece_bytes_size)
@@ -160,11 +250,8 @@ bt_piece_t *bt_piece_new(
     __piece_private_t *me;
 
     me = calloc(1, sizeof(__piece_private_t));
-    priv(me)->progress_downloaded = chunky_new(piece_bytes_size);
-    priv(me)->progress_requested = chunky_new(piece_bytes_size);
     priv(me)->piece_length = piece_bytes_size;
     priv(me)->is_completed = FALSE;
-    priv(me)->peers = avltree_new(__cmp_address);
     if (sha1sum)
         bt_piece_set_hash((bt_piece_t*)me, sha1sum);
     return (bt_piece_t*)me;
@@ -172,9 +259,7 @@ bt_piece_t *bt_piece_new(
 
 void bt_piece_free(bt_piece_t * me)
 {
-    free(priv(me)->sha1);
-    chunky_free(priv(me)->progress_downloaded);
-    chunky_free(priv(me)->progress_requested);
+    __inflight_release(me);
     free(me);
 }
 
@@ -205,6 +290,72 @@ static void *__get_data(bt_piece_t * me)
     return priv(me)->disk->read_block(priv(me)->disk_udata, me, &tmp);
 }
 
+/**
+ * Get just this block's data via block read */
+static void *__get_block(bt_piece_t * me, const bt_block_t * blk)
+{
+    bt_block_t tmp;
+
+    if (!priv(me)->disk || !priv(me)->disk->read_block)
+        return NULL;
+
+    tmp.piece_idx = priv(me)->idx;
+    tmp.offset = blk->offset;
+    tmp.len = blk->len;
+    return priv(me)->disk->read_block(priv(me)->disk_udata, me, &tmp);
+}
+
+void bt_piece_prefetch(bt_piece_t *me, const bt_block_t *blk)
+{
+    bt_block_t tmp;
+
+    if (!priv(me)->disk || !priv(me)->disk->prefetch_block)
+        return;
+
+    tmp.piece_idx = priv(me)->idx;
+    tmp.offset = 0;
+    tmp.len = priv(me)->piece_length;
+
+    /* blocks are read on their own, so only hint what will be read */
+    if (blk)
+    {
+        if (priv(me)->piece_length <= blk->offset)
+            return;
+        tmp.offset = blk->offset;
+        tmp.len = priv(me)->piece_length - blk->offset < blk->len ?
+                  priv(me)->piece_length - blk->offset : blk->len;
+    }
+
+    priv(me)->disk->prefetch_block(priv(me)->disk_udata, me, &tmp);
+}
+
+int bt_piece_flush(bt_piece_t *me)
+{
+    bt_block_t tmp;
+
+    if (!priv(me)->disk || !priv(me)->disk->flush_block)
+        return 1;
+
+    tmp.piece_idx = priv(me)->idx;
+    tmp.offset = 0;
+    tmp.len = priv(me)->piece_length;
+    return 0 != priv(me)->disk->flush_block(priv(me)->disk_udata, me, &tmp);
+}
+
+int bt_piece_get_block_fd(bt_piece_t *me, const bt_block_t *blk,
+                          uint64_t *offset)
+{
+    bt_block_t tmp;
+
+    if (!priv(me)->disk || !priv(me)->disk->block_fd)
+        return -1;
+
+    tmp.piece_idx = priv(me)->idx;
+    tmp.offset = blk->offset;
+    tmp.len = blk->len;
+    return priv(me)->disk->block_fd(priv(me)->disk_udata, &tmp, offset);
+}
+
 void bt_piece_set_disk_blockrw(bt_piece_t *me, bt_blockrw_i * irw, void *udata)
 {
     priv(me)->disk = irw;
@@ -229,6 +380,10 @@ int bt_piece_is_valid(bt_piece_t * me)
 
 int bt_piece_is_downloaded(bt_piece_t * me)
 {
+    if (priv(me)->is_completed)
+        return TRUE;
+    if (!priv(me)->progress_downloaded)
+        return FALSE;
     return chunky_is_complete(priv(me)->progress_downloaded);
 }
 
@@ -239,6 +394,17 @@ int bt_piece_is_complete(bt_piece_t * me)
 
     unsigned int off, ln;
 
+    /* nothing downloaded; only a validated piece can be complete */
+    if (!priv(me)->progress_downloaded)
+    {
+        if (1 == bt_piece_is_valid(me))
+        {
+            priv(me)->is_completed = TRUE;
+            return TRUE;
+        }
+        return FALSE;
+    }
+
     chunky_get_incomplete(priv(me)->progress_downloaded, &off, &ln,
                           priv(me)->piece_length);
 
@@ -257,9 +423,19 @@ int bt_piece_is_complete(bt_piece_t * me)
 
 int bt_piece_is_fully_requested(bt_piece_t * me)
 {
+    if (!priv(me)->progress_requested)
+        return priv(me)->is_completed;
     return chunky_is_complete(priv(me)->progress_requested);
 }
 
+unsigned int bt_piece_get_nbytes_unrequested(bt_piece_t * me)
+{
+    if (!priv(me)->progress_requested)
+        return priv(me)->is_completed ? 0 : priv(me)->piece_length;
+    return priv(me)->piece_length -
+           chunky_get_nbytes_completed(priv(me)->progress_requested);
+}
+
 void bt_piece_poll_block_request(bt_piece_t * me, bt_block_t * request)
 {
     unsigned int offset, len, blk_size;
@@ -271,6 +447,8 @@ void bt_piece_poll_block_request(bt_piece_t * me, bt_block_t * request)
     else
         blk_size = BT_BLOCK_SIZE;
 
+    __inflight(me);
+
     /* create the request by getting an incomplete block */
     chunky_get_incomplete(priv(me)->progress_requested, &offset, &len,
                           blk_size);
@@ -287,27 +465,67 @@ void bt_piece_poll_block_request(bt_piece_t * me, bt_block_t * request)
     chunky_mark_complete(priv(me)->progress_requested, offset, len);
 }
 
+int bt_piece_poll_missing_block(bt_piece_t * me, bt_block_t * request,
+                                int *iter)
+{
+    unsigned int blk_size = priv(me)->piece_length < BT_BLOCK_SIZE ?
+                            priv(me)->piece_length : BT_BLOCK_SIZE;
+
+    __inflight(me);
+
+    for (; (unsigned int)*iter < priv(me)->piece_length; *iter += blk_size)
+    {
+        unsigned int off = *iter,
+                     len = priv(me)->piece_length - off < blk_size ?
+                           priv(me)->piece_length - off : blk_size;
+
+        if (!chunky_have(priv(me)->progress_requested, off, len) ||
+            chunky_have(priv(me)->progress_downloaded, off, len))
+            continue;
+
+        request->piece_idx = priv(me)->idx;
+        request->offset = off;
+        request->len = len;
+        *iter += blk_size;
+        return 1;
+    }
+
+    return 0;
+}
+
+int bt_piece_have_block(bt_piece_t * me, const bt_block_t * b)
+{
+    if (priv(me)->is_completed)
+        return 1;
+    return priv(me)->progress_downloaded &&
+           chunky_have(priv(me)->progress_downloaded, b->offset, b->len);
+}
+
 void bt_piece_giveback_block(bt_piece_t * me, bt_block_t * b)
 {
+    if (!priv(me)->progress_requested)
+        return;
     chunky_mark_incomplete(priv(me)->progress_requested, b->offset, b->len);
 }
 
 void bt_piece_set_complete(bt_piece_t * me, int yes)
 {
     priv(me)->is_completed = yes;
+    __state_changed(me);
 }
 
 void bt_piece_set_size(bt_piece_t * me, const unsigned int piece_bytes_size)
 {
-    chunky_set_max(priv(me)->progress_downloaded, piece_bytes_size);
-    chunky_set_max(priv(me)->progress_requested, piece_bytes_size);
+    if (priv(me)->progress_downloaded)
+    {
+        chunky_set_max(priv(me)->progress_downloaded, piece_bytes_size);
+        chunky_set_max(priv(me)->progress_requested, piece_bytes_size);
+    }
     priv(me)->piece_length = piece_bytes_size;
 }
 
 void bt_piece_set_hash(bt_piece_t * me, const char *sha1sum)
 {
-    assert(!priv(me)->sha1);
-    priv(me)->sha1 = malloc(20);
     memcpy(priv(me)->sha1, sha1sum, 20);
 }
 
@@ -341,11 +559,9 @@ int bt_piece_write_block_to_stream(
     char *data;
     int i;
 
-    if (!(data = __get_data(me)))
+    if (!(data = __get_block(me, blk)))
         return 0;
 
-    data += blk->offset;
-
     for (i = 0; i < blk->len; i++)
     {
         char val = *(data + i);
@@ -357,23 +573,21 @@ int bt_piece_write_block_to_stream(
 
 int bt_piece_write_block_to_str(bt_piece_t *me, bt_block_t *blk, char *out)
 {
-    int offset, len;
     void *data;
 
-    data = __get_data(me);
-    offset = blk->offset;
-    len = blk->len;
-    memcpy(out, (char*)data + offset, len);
+    if (!(data = __get_block(me, blk)))
+        return 0;
+
+    memcpy(out, data, blk->len);
     return 1;
 }
 
 void bt_piece_drop_download_progress(bt_piece_t *me)
 {
-    avltree_empty(priv(me)->peers);
     priv(me)->is_completed = 0;
     priv(me)->validity = VALIDITY_NOTCHECKED;
-    chunky_mark_all_incomplete(priv(me)->progress_downloaded);
-    chunky_mark_all_incomplete(priv(me)->progress_requested);
+    __inflight_release(me);
+    __state_changed(me);
 }
 
 int bt_piece_calculate_hash(bt_piece_t* me, char *hash)
@@ -399,12 +613,16 @@ int bt_piece_validate(bt_piece_t* me)
     {
         priv(me)->validity = VALIDITY_VALID;
         priv(me)->is_completed = TRUE;
+        /* contributors and progress aren't needed once we have the piece */
+        __inflight_release(me);
+        __state_changed(me);
         return BT_PIECE_VALIDATE_COMPLETE_PIECE;
     }
     else
     {
         priv(me)->validity = VALIDITY_INVALID;
         priv(me)->is_completed = FALSE;
+        __state_changed(me);
         return BT_PIECE_VALIDATE_INVALID_PIECE;
     }
 
@@ -426,6 +644,12 @@ int bt_piece_validate(bt_piece_t* me)
     return BT_PIECE_VALIDATE_ERROR;
 }
 
+void bt_piece_set_state_cb(bt_piece_t *me, func_piece_state_f cb, void *udata)
+{
+    priv(me)->state_cb = cb;
+    priv(me)->state_udata = udata;
+}
+
 void bt_piece_set_mtime(bt_piece_t * me, unsigned int mtime)
 {
     priv(me)->mtime = mtime;
@@ -9,6 +9,10 @@
  * @version 0.1
  * @section description
  * Piece database's role: holding pieces
+ *
+ * Pieces are kept in a flat table: one contiguous array of 20 byte hashes,
+ * and flat arrays of sizes and state bits. bt_piece_t objects are only
+ * materialized when a piece is first asked for.
  */
 
 #include <stdlib.h>
@@ -24,19 +28,64 @@
 #include "bt_piece_db.h"
 #include "bt_piece.h"
 
-#include "linked_list_hashmap.h"
-
 /* for finding empty slots */
 #include "chunkybar.h"
 
+/* piece table state bits */
+#define PIECE_PRESENT (1 << 0)
+#define PIECE_HAS_HASH (1 << 1)
+#define PIECE_DOWNLOADED (1 << 2)
+#define PIECE_COMPLETE (1 << 3)
+
+/* number of bits covered by each entry of the rank index */
+#define RANK_BLOCK_BITS 512
+#define RANK_BLOCK_WORDS (RANK_BLOCK_BITS / 64)
+
 typedef struct
 {
-    /* piece map */
-    hashmap_t *pmap;
+    /* dense idx -> piece table; must be first, see bt_piecedb_get_fast() */
+    bt_piecedb_table_t t;
 
     chunkybar_t *space;
 
-    int tot_file_size_bytes;
+    uint64_t tot_file_size_bytes;
+
+    /* number of pieces in the table */
+    int npieces;
+
+    /* 20 byte sha1 of every piece, concatenated.
+     * This might be the caller's bt_piece_info_t.pieces_hash; see
+     * bt_piecedb_add_from_info() */
+    char *hashes;
+
+    /* number of slots hashes covers */
+    unsigned int hashes_size;
+
+    /* hashes belongs to the caller; we copy it before writing to it */
+    int hashes_borrowed;
+
+    /* size of every piece in bytes */
+    unsigned int *sizes;
+
+    /* PIECE_* bits for every piece */
+    unsigned char *flags;
+
+    /* maintained as pieces change state, so that we don't need to scan */
+    int ndownloaded;
+    int ncompleted;
+
+    /* sum of the sizes of completed pieces */
+    uint64_t completed_bytes;
+
+    /* bitmap of completed pieces */
+    uint64_t *completed;
+
+    /* rank index over the completed bitmap.
+     * rank[i] is the number of completed pieces before bit i * 512 */
+    unsigned int *rank;
+
+    /* rank entries from here onwards are stale */
+    unsigned int rank_dirty;
 
     /*  reader and writer of blocks to disk */
     bt_blockrw_i *blockrw;
@@ -46,37 +95,24 @@ typedef struct
 
 #define priv(x) ((bt_piecedb_private_t*)(x))
 
-static unsigned long __piece_hash(const void *obj)
-{
-    const unsigned long p = (unsigned long)obj;
-    return p;
-}
-
-static long __piece_cmp(const void *obj, const void *other)
-{
-    const unsigned long p1 = (unsigned long)obj;
-    const unsigned long p2 = (unsigned long)other;
-    return p2 - p1;
-}
-
 bt_piecedb_t *bt_piecedb_new()
 {
     bt_piecedb_t *db;
 
     db = calloc(1, sizeof(bt_piecedb_private_t));
     priv(db)->tot_file_size_bytes = 0;
-    priv(db)->pmap = hashmap_new(__piece_hash, __piece_cmp, 11);
-    priv(db)->space = chunky_new(1 << 31);
+    priv(db)->space = chunky_new((unsigned int)1 << 31);
+    priv(db)->rank_dirty = UINT32_MAX;
     return db;
 }
 
 void bt_piecedb_set_tot_file_size(bt_piecedb_t * db,
-                                  const int tot_file_size_bytes)
+                                  const uint64_t tot_file_size_bytes)
 {
     priv(db)->tot_file_size_bytes = tot_file_size_bytes;
 }
 
-int bt_piecedb_get_tot_file_size(bt_piecedb_t * db)
+uint64_t bt_piecedb_get_tot_file_size(bt_piecedb_t * db)
 {
     return priv(db)->tot_file_size_bytes;
 }
@@ -99,25 +135,201 @@ void* bt_piecedb_get_diskstorage(bt_piecedb_t * db)
     return priv(db)->blockrw_data;
 }
 
+static void __mark_completed(bt_piecedb_t * db, const unsigned int idx,
+                             const int yes)
+{
+    uint64_t bit = (uint64_t)1 << (idx % 64);
+
+    if (yes)
+        priv(db)->completed[idx / 64] |= bit;
+    else
+        priv(db)->completed[idx / 64] &= ~bit;
+
+    if (idx / RANK_BLOCK_BITS + 1 < priv(db)->rank_dirty)
+        priv(db)->rank_dirty = idx / RANK_BLOCK_BITS + 1;
+}
+
+/**
+ * Keep the flags, counters and completed bitmap in sync with the piece */
+static void __set_state(bt_piecedb_t * db, const unsigned int idx,
+                        const int state)
+{
+    unsigned char *f = &priv(db)->flags[idx];
+
+    if (!(*f & PIECE_DOWNLOADED) != !(state & BT_PIECE_STATE_DOWNLOADED))
+    {
+        *f ^= PIECE_DOWNLOADED;
+        priv(db)->ndownloaded += (*f & PIECE_DOWNLOADED) ? 1 : -1;
+    }
+
+    if (!(*f & PIECE_COMPLETE) != !(state & BT_PIECE_STATE_COMPLETE))
+    {
+        *f ^= PIECE_COMPLETE;
+        priv(db)->ncompleted += (*f & PIECE_COMPLETE) ? 1 : -1;
+        if (*f & PIECE_COMPLETE)
+            priv(db)->completed_bytes += priv(db)->sizes[idx];
+        else
+            priv(db)->completed_bytes -= priv(db)->sizes[idx];
+        __mark_completed(db, idx, *f & PIECE_COMPLETE);
+    }
+}
+
+static void __piece_state_changed(void *udata, bt_piece_t *p, int state)
+{
+    __set_state(udata, bt_piece_get_idx(p), state);
+}
+
+/**
+ * Bring the stale part of the rank index up to date */
+static void __rank_refresh(bt_piecedb_t * db)
+{
+    unsigned int i, end = priv(db)->t.size / RANK_BLOCK_BITS + 1;
+
+    for (i = priv(db)->rank_dirty; i <= end; i++)
+    {
+        unsigned int w, cnt = priv(db)->rank[i - 1];
+
+        for (w = (i - 1) * RANK_BLOCK_WORDS;
+             w < i * RANK_BLOCK_WORDS && w < priv(db)->t.size / 64; w++)
+            cnt += __builtin_popcountll(priv(db)->completed[w]);
+        priv(db)->rank[i] = cnt;
+    }
+
+    priv(db)->rank_dirty = UINT32_MAX;
+}
+
+/**
+ * @return number of completed pieces with an idx lower than idx */
+static unsigned int __rank(bt_piecedb_t * db, const unsigned int idx)
+{
+    unsigned int w, cnt;
+
+    if (priv(db)->rank_dirty != UINT32_MAX)
+        __rank_refresh(db);
+
+    cnt = priv(db)->rank[idx / RANK_BLOCK_BITS];
+    for (w = idx / RANK_BLOCK_BITS * RANK_BLOCK_WORDS; w < idx / 64; w++)
+        cnt += __builtin_popcountll(priv(db)->completed[w]);
+    if (idx % 64)
+        cnt += __builtin_popcountll(priv(db)->completed[idx / 64] &
+                                    (((uint64_t)1 << (idx % 64)) - 1));
+    return cnt;
+}
+
 void *bt_piecedb_get(void* dbo, const unsigned int idx)
 {
     bt_piecedb_t * db = dbo;
 
-    return hashmap_get(priv(db)->pmap, (void*)((unsigned long)idx+1));
+    bt_piece_t *p;
+
+    if (priv(db)->t.size <= idx || !(priv(db)->flags[idx] & PIECE_PRESENT))
+        return NULL;
+
+    if ((p = priv(db)->t.pieces[idx]))
+        return p;
+
+    /* first access; materialize from the table */
+    p = bt_piece_new(priv(db)->flags[idx] & PIECE_HAS_HASH ?
+                     priv(db)->hashes + idx * 20 : NULL,
+                     priv(db)->sizes[idx]);
+    bt_piece_set_disk_blockrw(p, priv(db)->blockrw, priv(db)->blockrw_data);
+    bt_piece_set_idx(p, idx);
+    bt_piece_set_state_cb(p, __piece_state_changed, db);
+    if (priv(db)->flags[idx] & PIECE_COMPLETE)
+        bt_piece_set_complete(p, 1);
+    priv(db)->t.pieces[idx] = p;
+    return p;
+}
+
+void bt_piecedb_set_complete(bt_piecedb_t * db, const unsigned int idx)
+{
+    if (priv(db)->t.size <= idx || !(priv(db)->flags[idx] & PIECE_PRESENT))
+        return;
+
+    if (priv(db)->t.pieces[idx])
+        bt_piece_set_complete(priv(db)->t.pieces[idx], 1);
+    else
+        __set_state(db, idx, BT_PIECE_STATE_DOWNLOADED |
+                    BT_PIECE_STATE_COMPLETE);
+}
+
+void bt_piecedb_clear_complete(bt_piecedb_t * db, const unsigned int idx)
+{
+    if (priv(db)->t.size <= idx || !(priv(db)->flags[idx] & PIECE_PRESENT))
+        return;
+
+    if (priv(db)->t.pieces[idx])
+        bt_piece_drop_download_progress(priv(db)->t.pieces[idx]);
+    else
+        __set_state(db, idx, 0);
 }
 
 int bt_piecedb_count(bt_piecedb_t * db)
 {
-    return hashmap_count(priv(db)->pmap);
+    return priv(db)->npieces;
+}
+
+/**
+ * Make sure the table has room for slots [0, n) */
+static void __grow(bt_piecedb_t * db, const unsigned int n)
+{
+    unsigned int size = priv(db)->t.size;
+
+    if (n <= size)
+        return;
+
+    while (size < n)
+        size = size ? size * 2 : 64;
+
+    priv(db)->t.pieces = realloc(priv(db)->t.pieces, size * sizeof(void*));
+    memset(priv(db)->t.pieces + priv(db)->t.size, 0,
+           (size - priv(db)->t.size) * sizeof(void*));
+    if (!priv(db)->hashes_borrowed)
+    {
+        priv(db)->hashes = realloc(priv(db)->hashes, size * 20);
+        priv(db)->hashes_size = size;
+    }
+    priv(db)->sizes = realloc(priv(db)->sizes, size * sizeof(unsigned int));
+    priv(db)->flags = realloc(priv(db)->flags, size);
+    memset(priv(db)->flags + priv(db)->t.size, 0, size - priv(db)->t.size);
+    priv(db)->completed = realloc(priv(db)->completed, size / 8);
+    memset(priv(db)->completed + priv(db)->t.size / 64, 0,
+           (size - priv(db)->t.size) / 8);
+    priv(db)->rank = realloc(priv(db)->rank,
+            (size / RANK_BLOCK_BITS + 2) * sizeof(unsigned int));
+    priv(db)->rank[0] = 0;
+    priv(db)->rank_dirty = 1;
+    priv(db)->t.size = size;
+}
+
+/**
+ * Make sure we own the hash array, and that it covers the whole table */
+static void __own_hashes(bt_piecedb_t * db)
+{
+    char *hashes;
+
+    if (!priv(db)->hashes_borrowed)
+        return;
+
+    hashes = malloc(priv(db)->t.size * 20);
+    memcpy(hashes, priv(db)->hashes, priv(db)->hashes_size * 20);
+    priv(db)->hashes = hashes;
+    priv(db)->hashes_size = priv(db)->t.size;
+    priv(db)->hashes_borrowed = 0;
 }
 
 int bt_piecedb_add_with_hash_and_size(bt_piecedb_t * db,
     const char *sha1sum, const int piece_bytes_size)
 {
     int i = bt_piecedb_add(db, 1);
-    void *p = bt_piecedb_get(db, i);
-    bt_piece_set_hash(p, sha1sum);
-    bt_piece_set_size(p, piece_bytes_size);
+
+    if (-1 == i)
+        return -1;
+
+    __own_hashes(db);
+    memcpy(priv(db)->hashes + i * 20, sha1sum, 20);
+    priv(db)->sizes[i] = piece_bytes_size;
+    priv(db)->flags[i] |= PIECE_HAS_HASH;
     return i;
 }
 
@@ -138,74 +350,145 @@ int bt_piecedb_add_at_idx(bt_piecedb_t * db, unsigned int npieces, int idx)
 
     chunky_mark_complete(priv(db)->space, idx, npieces);
 
-    int i;
-    for (i=0; i<npieces; i++)
+    __grow(db, idx + npieces);
+    memset(priv(db)->sizes + idx, 0, npieces * sizeof(unsigned int));
+    memset(priv(db)->flags + idx, PIECE_PRESENT, npieces);
+    priv(db)->npieces += npieces;
+    return idx;
+}
+
+int bt_piecedb_add_from_info(bt_piecedb_t * db,
+    const bt_piece_info_t * info, const uint64_t tot_file_size_bytes)
+{
+    unsigned int i, n = info->npieces;
+    int idx;
+
+    if (0 == n)
+        return -1;
+
+    if (0 == priv(db)->npieces)
+    {
+        if (-1 == (idx = bt_piecedb_add_at_idx(db, n, 0)))
+            return -1;
+
+        /* use the caller's hashes in place */
+        if (!priv(db)->hashes_borrowed)
+            free(priv(db)->hashes);
+        priv(db)->hashes = info->pieces_hash;
+        priv(db)->hashes_size = n;
+        priv(db)->hashes_borrowed = 1;
+    }
+    else
     {
-        bt_piece_t *p = bt_piece_new(NULL, 0);
-        bt_piece_set_disk_blockrw(p, priv(db)->blockrw, priv(db)->blockrw_data);
-        bt_piece_set_idx(p, idx + i);
-        hashmap_put(priv(db)->pmap,
-            (void*)((unsigned long)bt_piece_get_idx(p)+1), p);
+        if (-1 == (idx = bt_piecedb_add(db, n)))
+            return -1;
+        __own_hashes(db);
+        memcpy(priv(db)->hashes + idx * 20, info->pieces_hash, n * 20);
     }
 
+    memset(priv(db)->flags + idx, PIECE_PRESENT | PIECE_HAS_HASH, n);
+    for (i = 0; i < n - 1; i++)
+        priv(db)->sizes[idx + i] = info->piece_len;
+    priv(db)->sizes[idx + n - 1] =
+        tot_file_size_bytes - (uint64_t)(n - 1) * info->piece_len;
+    priv(db)->tot_file_size_bytes += tot_file_size_bytes;
     return idx;
 }
 
 void bt_piecedb_remove(bt_piecedb_t * db, int idx)
 {
-    // TODO memleak here?
-    hashmap_remove(priv(db)->pmap, (void*)((unsigned long)idx+1));
+    bt_piece_t *p;
+
+    if (priv(db)->t.size <= idx || !(priv(db)->flags[idx] & PIECE_PRESENT))
+        return;
+
+    if ((p = priv(db)->t.pieces[idx]))
+        bt_piece_free(p);
+    priv(db)->t.pieces[idx] = NULL;
+    __set_state(db, idx, 0);
+    priv(db)->flags[idx] = 0;
+    priv(db)->npieces -= 1;
     chunky_mark_incomplete(priv(db)->space, idx, 1);
 }
 
 int bt_piecedb_get_num_downloaded(bt_piecedb_t * db)
 {
-    int ii, downloaded = 0;
+    return priv(db)->ndownloaded;
+}
 
-    for (ii = 0; ii < bt_piecedb_get_length(db); ii++)
-    {
-        bt_piece_t *p = bt_piecedb_get(db, ii);
-        if (bt_piece_is_downloaded(p))
-            downloaded += 1;
-    }
+int bt_piecedb_get_num_completed(bt_piecedb_t * db)
+{
+    return priv(db)->ncompleted;
+}
+
+uint64_t bt_piecedb_get_completed_bytes(bt_piecedb_t * db)
+{
+    return priv(db)->completed_bytes;
+}
+
+int bt_piecedb_contains_piecerange(void* dbo,
+    const unsigned int idx,
+    const unsigned int pieces)
+{
+    bt_piecedb_t * db = dbo;
+
+    if (priv(db)->t.size < idx + pieces || idx + pieces < idx)
+        return 0;
 
-    return downloaded;
+    return __rank(db, idx + pieces) - __rank(db, idx) == pieces;
 }
 
-int bt_piecedb_get_num_completed(bt_piecedb_t * db)
+int bt_piecedb_nth_completed(bt_piecedb_t * db, const unsigned int n)
 {
-    int ii, cnt = 0;
+    unsigned int lo, hi, w, k;
 
-    for (ii = 0; ii < bt_piecedb_get_length(db); ii++)
+    if (priv(db)->ncompleted <= n)
+        return -1;
+
+    if (priv(db)->rank_dirty != UINT32_MAX)
+        __rank_refresh(db);
+
+    /* find the last rank block with fewer than n+1 pieces before it */
+    lo = 0;
+    hi = priv(db)->t.size / RANK_BLOCK_BITS;
+    while (lo < hi)
     {
-        bt_piece_t *p = bt_piecedb_get(db, ii);
-        if (bt_piece_is_complete(p))
-            cnt += 1;
+        unsigned int mid = (lo + hi + 1) / 2;
+
+        if (priv(db)->rank[mid] <= n)
+            lo = mid;
+        else
+            hi = mid - 1;
     }
 
-    return cnt;
+    k = n - priv(db)->rank[lo];
+    for (w = lo * RANK_BLOCK_WORDS; ; w++)
+    {
+        uint64_t word = priv(db)->completed[w];
+        unsigned int cnt = __builtin_popcountll(word);
+
+        if (k < cnt)
+        {
+            /* drop the k lowest set bits */
+            for (; k; k--)
+                word &= word - 1;
+            return w * 64 + __builtin_ctzll(word);
+        }
+        k -= cnt;
+    }
 }
 
 int bt_piecedb_get_length(bt_piecedb_t * db)
 {
-    return hashmap_count(priv(db)->pmap);
+    return priv(db)->npieces;
 }
 
 int bt_piecedb_all_pieces_are_complete(bt_piecedb_t* db)
 {
-    int ii;
-
-    for (ii = 0; ii < bt_piecedb_get_length(db); ii++)
-    {
-        bt_piece_t *pce = bt_piecedb_get(db, ii);
-        if (!bt_piece_is_complete(pce))
-            return 0;
-    }
-
-    return 1;
+    return priv(db)->ncompleted == priv(db)->npieces;
 }
 
-void bt_piecedb_increase_piece_space(bt_piecedb_t* db, const int size)
+void bt_piecedb_increase_piece_space(bt_piecedb_t* db, const uint64_t size)
 {
     bt_piecedb_set_tot_file_size(db,
             bt_piecedb_get_tot_file_size(db) + size);
@@ -220,9 +503,7 @@ void bt_piecedb_print_pieces_downloaded(bt_piecedb_t * db)
     for (ii = 0, depth = 3;
          ii < bt_piecedb_get_length(db); ii++, depth += 1)
     {
-        bt_piece_t * p = bt_piecedb_get(db, ii);
-
-        if (bt_piece_is_complete(p))
+        if (priv(db)->flags[ii] & PIECE_COMPLETE)
         {
             printf("1");
         }
@@ -0,0 +1,312 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Hash all pieces from the storage files, across all cores
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ * @section description
+ * Threads take runs of consecutive pieces from a shared cursor, so between
+ * them they read the torrent front to back. Each thread asks the kernel to
+ * read ahead the run it will most likely take next.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+/* for uint32_t */
+#include <stdint.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "bt.h"
+#include "bt_recheck.h"
+#include "sha1.h"
+
+/* bytes we try to hand to a thread at a time */
+#define RUN_BYTES (1 << 22)
+
+/* bytes we read at a time */
+#define READ_BYTES (1 << 20)
+
+typedef struct
+{
+    char* path;
+
+    /* offset of the file within the torrent */
+    uint64_t off;
+
+    uint64_t len;
+
+    /* -1 if we couldn't open it */
+    int fd;
+} file_t;
+
+typedef struct
+{
+    const char* hashes;
+    unsigned int npieces;
+    unsigned int piece_len;
+
+    file_t* files;
+    int nfiles;
+    uint64_t tot_len;
+
+    int nthreads;
+
+    /* 1 if the piece is valid */
+    unsigned char* valid;
+
+    /* number of pieces a thread takes at a time */
+    unsigned int run;
+
+    /* guards everything below */
+    pthread_mutex_t lock;
+
+    /* next piece to be handed out */
+    unsigned int next;
+
+    unsigned int ndone;
+    unsigned int nvalid;
+
+    func_recheck_progress_f progress;
+    void* progress_udata;
+} bt_recheck_t;
+
+void* bt_recheck_new(const bt_piece_info_t* info)
+{
+    bt_recheck_t* me = calloc(1, sizeof(bt_recheck_t));
+
+    me->hashes = info->pieces_hash;
+    me->npieces = info->npieces;
+    me->piece_len = info->piece_len;
+    me->valid = calloc(1, me->npieces + 1);
+    me->run = RUN_BYTES / me->piece_len ? RUN_BYTES / me->piece_len : 1;
+    pthread_mutex_init(&me->lock, NULL);
+    return me;
+}
+
+void bt_recheck_free(void* rc)
+{
+    bt_recheck_t* me = rc;
+    int i;
+
+    for (i = 0; i < me->nfiles; i++)
+        free(me->files[i].path);
+    pthread_mutex_destroy(&me->lock);
+    free(me->files);
+    free(me->valid);
+    free(me);
+}
+
+void bt_recheck_add_file(void* rc, const char* path, const uint64_t size)
+{
+    bt_recheck_t* me = rc;
+    file_t* f;
+
+    me->files = realloc(me->files, (me->nfiles + 1) * sizeof(file_t));
+    f = &me->files[me->nfiles++];
+    f->path = strdup(path);
+    f->off = me->tot_len;
+    f->len = size;
+    f->fd = -1;
+    me->tot_len += size;
+}
+
+void bt_recheck_set_nthreads(void* rc, const int nthreads)
+{
+    ((bt_recheck_t*)rc)->nthreads = nthreads;
+}
+
+void bt_recheck_set_progress_cb(void* rc, func_recheck_progress_f cb,
+                                void* udata)
+{
+    bt_recheck_t* me = rc;
+
+    me->progress = cb;
+    me->progress_udata = udata;
+}
+
+int bt_recheck_piece_is_valid(void* rc, const unsigned int idx)
+{
+    bt_recheck_t* me = rc;
+
+    return idx < me->npieces && me->valid[idx];
+}
+
+/**
+ * @return the file that holds this byte of the torrent */
+static file_t* __file_at(bt_recheck_t* me, const uint64_t off)
+{
+    int lo = 0, hi = me->nfiles;
+
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+
+        if (me->files[mid].off + me->files[mid].len <= off)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return &me->files[lo];
+}
+
+/**
+ * Read from the torrent's byte stream, across file boundaries
+ * @return 1 on success; 0 if something is missing */
+static int __read(bt_recheck_t* me, char* buf, uint64_t off, unsigned int len)
+{
+    while (0 < len)
+    {
+        file_t* f = __file_at(me, off);
+        unsigned int n;
+        ssize_t got;
+
+        if (f == me->files + me->nfiles || -1 == f->fd)
+            return 0;
+
+        n = f->off + f->len - off < len ? f->off + f->len - off : len;
+        got = pread(f->fd, buf, n, off - f->off);
+        if (got <= 0)
+            return 0;
+
+        buf += got;
+        off += got;
+        len -= got;
+    }
+
+    return 1;
+}
+
+static void __readahead(bt_recheck_t* me, uint64_t off, uint64_t len)
+{
+#if defined(POSIX_FADV_WILLNEED)
+    while (0 < len && off < me->tot_len)
+    {
+        file_t* f = __file_at(me, off);
+        uint64_t n = f->off + f->len - off < len ? f->off + f->len - off : len;
+
+        if (-1 != f->fd)
+            posix_fadvise(f->fd, off - f->off, n, POSIX_FADV_WILLNEED);
+        off += n;
+        len -= n;
+    }
+#endif
+}
+
+static int __check_piece(bt_recheck_t* me, char* buf, const unsigned int idx)
+{
+    uint64_t off = (uint64_t)idx * me->piece_len;
+    unsigned char hash[20];
+    unsigned int len, done;
+    SHA1_CTX ctx;
+
+    if (me->tot_len <= off)
+        return 0;
+    len = me->tot_len - off < me->piece_len ? me->tot_len - off :
+          me->piece_len;
+
+    SHA1Init(&ctx);
+    for (done = 0; done < len; )
+    {
+        unsigned int n = len - done < READ_BYTES ? len - done : READ_BYTES;
+
+        if (!__read(me, buf, off + done, n))
+            return 0;
+        SHA1Update(&ctx, (unsigned char*)buf, n);
+        done += n;
+    }
+    SHA1Final(hash, &ctx);
+
+    return 0 == memcmp(hash, me->hashes + idx * 20, 20);
+}
+
+static void* __worker(void* rc)
+{
+    bt_recheck_t* me = rc;
+    char* buf = malloc(me->piece_len < READ_BYTES ?
+                       me->piece_len : READ_BYTES);
+    unsigned int start = 0, end = 0, nvalid = 0;
+
+    while (1)
+    {
+        unsigned int i;
+
+        pthread_mutex_lock(&me->lock);
+        me->ndone += end - start;
+        me->nvalid += nvalid;
+        if (me->progress && start != end)
+            me->progress(me->progress_udata, me->ndone, me->npieces);
+        start = me->next;
+        end = me->npieces - start < me->run ? me->npieces : start + me->run;
+        me->next = end;
+        pthread_mutex_unlock(&me->lock);
+
+        if (start == end)
+            break;
+
+        /* by the time we're back, the other threads have taken a run each */
+        __readahead(me, ((uint64_t)start + me->run * me->nthreads) *
+                    me->piece_len, (uint64_t)me->run * me->piece_len);
+
+        for (nvalid = 0, i = start; i < end; i++)
+            if ((me->valid[i] = __check_piece(me, buf, i)))
+                nvalid++;
+    }
+
+    free(buf);
+    return NULL;
+}
+
+int bt_recheck_run(void* rc)
+{
+    bt_recheck_t* me = rc;
+    pthread_t* threads;
+    int i, nthreads;
+
+    nthreads = 0 < me->nthreads ? me->nthreads :
+               sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1)
+        nthreads = 1;
+    me->nthreads = nthreads;
+
+    for (i = 0; i < me->nfiles; i++)
+    {
+        me->files[i].fd = open(me->files[i].path, O_RDONLY);
+#if defined(POSIX_FADV_SEQUENTIAL)
+        if (-1 != me->files[i].fd)
+            posix_fadvise(me->files[i].fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    }
+
+    me->next = me->ndone = me->nvalid = 0;
+    memset(me->valid, 0, me->npieces);
+
+    /* we're one of the threads */
+    threads = malloc(sizeof(pthread_t) * nthreads);
+    for (i = 1; i < nthreads; i++)
+        if (0 != pthread_create(&threads[i], NULL, __worker, me))
+            break;
+    nthreads = i;
+    __worker(me);
+    for (i = 1; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    for (i = 0; i < me->nfiles; i++)
+        if (-1 != me->files[i].fd)
+        {
+            close(me->files[i].fd);
+            me->files[i].fd = -1;
+        }
+
+    return me->nvalid;
+}
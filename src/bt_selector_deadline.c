@@ -0,0 +1,641 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Select pieces by the time they're needed
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ * @section description
+ * Pieces are kept in one flat table, which grows as we hear of new pieces.
+ * Each peer has a bitmap of the pieces it has.
+ *
+ * A peer is only given a window piece if, at its current rate, it would
+ * finish the piece before the deadline; the fastest peer is always allowed,
+ * so that urgent pieces don't wait for nobody. Peers too slow for the window
+ * download from the rest of the torrent, rarest first.
+ *
+ * For rarest first, the pieces we don't have are kept in an array sorted by
+ * how many peers have them. A piece's count only ever changes by one, so it
+ * moves to the edge of its run of equal counts with one swap.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* for uint64_t */
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_selector_deadline.h"
+
+#include "linked_list_hashmap.h"
+
+#define PIECE_HAVE (1 << 0)
+#define PIECE_POLLED (1 << 1)
+
+typedef struct
+{
+    /* number of peers that have this piece; for rarity */
+    int nhaves;
+
+    /* PIECE_* */
+    unsigned char flags;
+
+    /* peer downloading the piece, and the peer racing it */
+    const void *holder;
+    const void *dup;
+
+    /* in ms; 0 if the piece has never been in the window */
+    uint64_t deadline;
+
+    /* where the piece is in the rarity order; -1 once we have it */
+    int pos;
+} piece_t;
+
+typedef struct
+{
+    /* one bit per piece */
+    uint64_t *have;
+    int nwords;
+} peer_t;
+
+typedef struct
+{
+    hashmap_t *peers;
+
+    piece_t *pieces;
+    int npieces;
+
+    /* pieces we don't have, rarest first */
+    int *order;
+
+    /* first[n] is where pieces that n or more peers have start in order.
+     * first[nbuckets] is the number of pieces in order */
+    int *first;
+    int nbuckets;
+
+    /* the fastest peer's rate, as of fastest_at */
+    int fastest;
+    uint64_t fastest_at;
+    int fastest_stale;
+
+    int playhead;
+    int window;
+    int piece_ms;
+    unsigned int piece_len;
+
+    /* -1 to use piece_ms */
+    int urgent_ms;
+
+    func_peer_rate_f rate;
+    void *rate_udata;
+
+    func_now_ms_f now;
+    void *clock_udata;
+
+    bt_deadline_selector_stats_t stats;
+} deadline_t;
+
+static unsigned long __peer_hash(
+    const void *obj
+)
+{
+    return (unsigned long) obj;
+}
+
+static long __peer_compare(
+    const void *obj,
+    const void *other
+)
+{
+    return obj - other;
+}
+
+static uint64_t __now(deadline_t *me)
+{
+    struct timespec ts;
+
+    if (me->now)
+        return me->now(me->clock_udata);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int __rate(deadline_t *me, const void *peer)
+{
+    return me->rate ? me->rate(me->rate_udata, peer) : 0;
+}
+
+static void __swap(deadline_t *me, const int a, const int b)
+{
+    int pa = me->order[a], pb = me->order[b];
+
+    me->order[a] = pb;
+    me->order[b] = pa;
+    me->pieces[pb].pos = a;
+    me->pieces[pa].pos = b;
+}
+
+/**
+ * Make sure there's a run in the order for pieces that n - 1 peers have */
+static void __more_buckets(deadline_t *me, const int n)
+{
+    int b;
+
+    if (n <= me->nbuckets)
+        return;
+
+    me->first = realloc(me->first, sizeof(int) * (n + 1));
+    for (b = me->nbuckets + 1; b <= n; b++)
+        me->first[b] = me->first[me->nbuckets];
+    me->nbuckets = n;
+}
+
+/**
+ * One more peer has this piece */
+static void __nhaves_inc(deadline_t *me, const int idx)
+{
+    piece_t *pce = &me->pieces[idx];
+
+    if (-1 != pce->pos)
+    {
+        /* the last of its run becomes the first of the next */
+        __more_buckets(me, pce->nhaves + 2);
+        __swap(me, pce->pos, me->first[pce->nhaves + 1] - 1);
+        me->first[pce->nhaves + 1]--;
+    }
+
+    pce->nhaves++;
+}
+
+/**
+ * One less peer has this piece */
+static void __nhaves_dec(deadline_t *me, const int idx)
+{
+    piece_t *pce = &me->pieces[idx];
+
+    if (-1 != pce->pos)
+    {
+        /* the first of its run becomes the last of the previous */
+        __swap(me, pce->pos, me->first[pce->nhaves]);
+        me->first[pce->nhaves]++;
+    }
+
+    pce->nhaves--;
+}
+
+/**
+ * Take the piece out of the order; we have it */
+static void __order_remove(deadline_t *me, const int idx)
+{
+    piece_t *pce = &me->pieces[idx];
+    int b;
+
+    if (-1 == pce->pos)
+        return;
+
+    /* move it to the end, a run at a time */
+    for (b = pce->nhaves + 1; b <= me->nbuckets; b++)
+    {
+        __swap(me, pce->pos, me->first[b] - 1);
+        me->first[b]--;
+    }
+
+    pce->pos = -1;
+}
+
+/**
+ * Put the piece back into the order; we don't have it after all */
+static void __order_insert(deadline_t *me, const int idx)
+{
+    piece_t *pce = &me->pieces[idx];
+    int b;
+
+    if (-1 != pce->pos)
+        return;
+
+    __more_buckets(me, pce->nhaves + 1);
+
+    /* in at the end, then down a run at a time */
+    pce->pos = me->first[me->nbuckets]++;
+    me->order[pce->pos] = idx;
+    for (b = me->nbuckets - 1; pce->nhaves < b; b--)
+    {
+        __swap(me, pce->pos, me->first[b]);
+        me->first[b]++;
+    }
+}
+
+/**
+ * Make sure the table covers this piece */
+static void __grow(deadline_t *me, const int npieces)
+{
+    int i, b;
+
+    if (npieces <= me->npieces)
+        return;
+
+    me->pieces = realloc(me->pieces, sizeof(piece_t) * npieces);
+    memset(me->pieces + me->npieces, 0,
+           sizeof(piece_t) * (npieces - me->npieces));
+    me->order = realloc(me->order, sizeof(int) * npieces);
+    __more_buckets(me, 1);
+
+    /* nobody has the new pieces yet; they join the rarest run */
+    for (i = me->npieces; i < npieces; i++)
+    {
+        piece_t *pce = &me->pieces[i];
+
+        pce->pos = me->first[me->nbuckets]++;
+        me->order[pce->pos] = i;
+        for (b = me->nbuckets - 1; 1 <= b; b--)
+        {
+            __swap(me, pce->pos, me->first[b]);
+            me->first[b]++;
+        }
+    }
+
+    me->npieces = npieces;
+}
+
+static int __peer_has(const peer_t *pr, const int idx)
+{
+    return idx / 64 < pr->nwords &&
+           (pr->have[idx / 64] & ((uint64_t)1 << (idx % 64)));
+}
+
+/**
+ * Rates are only looked at once per ms, however many peers poll
+ * @return 1 if no peer is faster than this rate */
+static int __is_fastest(deadline_t *me, const int rate, const uint64_t now)
+{
+    hashmap_iterator_t iter;
+    void *peer;
+
+    if (me->fastest_stale || me->fastest_at != now)
+    {
+        me->fastest = 0;
+        for (hashmap_iterator(me->peers, &iter);
+             (peer = hashmap_iterator_next(me->peers, &iter));)
+            if (me->fastest < __rate(me, peer))
+                me->fastest = __rate(me, peer);
+        me->fastest_at = now;
+        me->fastest_stale = 0;
+    }
+
+    return me->fastest <= rate;
+}
+
+/**
+ * @return 1 if the peer would finish the piece within left ms */
+static int __can_make(deadline_t *me, const int rate, const int64_t left)
+{
+    return 0 < left && 0 < rate &&
+           me->piece_len <= (uint64_t)rate * left / 1000;
+}
+
+void *bt_deadline_selector_new(
+    const int npieces
+)
+{
+    deadline_t *me;
+
+    me = calloc(1, sizeof(deadline_t));
+    me->peers = hashmap_new(__peer_hash, __peer_compare, 11);
+    me->urgent_ms = -1;
+    me->piece_len = BT_BLOCK_SIZE;
+    me->first = calloc(1, sizeof(int));
+    me->fastest_stale = 1;
+    __grow(me, npieces);
+    return me;
+}
+
+void bt_deadline_selector_free(
+    void *r
+)
+{
+    deadline_t *me = r;
+    hashmap_iterator_t iter;
+    void *peer;
+
+    for (hashmap_iterator(me->peers, &iter);
+         (peer = hashmap_iterator_next(me->peers, &iter));)
+    {
+        peer_t *pr = hashmap_get(me->peers, peer);
+
+        free(pr->have);
+        free(pr);
+    }
+
+    hashmap_free(me->peers);
+    free(me->pieces);
+    free(me->order);
+    free(me->first);
+    free(me);
+}
+
+void bt_deadline_selector_add_peer(
+    void *r,
+    void *peer
+)
+{
+    deadline_t *me = r;
+
+    if (!hashmap_get(me->peers, peer))
+        hashmap_put(me->peers, peer, calloc(1, sizeof(peer_t)));
+    me->fastest_stale = 1;
+}
+
+void bt_deadline_selector_giveback_piece(
+    void *r,
+    void *peer,
+    int piece_idx
+)
+{
+    deadline_t *me = r;
+    piece_t *pce;
+
+    if (piece_idx < 0 || me->npieces <= piece_idx)
+        return;
+
+    pce = &me->pieces[piece_idx];
+
+    if (!peer)
+        pce->holder = pce->dup = NULL;
+    else if (pce->dup == peer)
+        pce->dup = NULL;
+    else if (pce->holder == peer)
+    {
+        pce->holder = pce->dup;
+        pce->dup = NULL;
+    }
+
+    if (!pce->holder)
+        pce->flags &= ~PIECE_POLLED;
+}
+
+void bt_deadline_selector_remove_peer(
+    void *r,
+    void *peer
+)
+{
+    deadline_t *me = r;
+    peer_t *pr;
+    int i;
+
+    if (!(pr = hashmap_remove(me->peers, peer)))
+        return;
+
+    me->fastest_stale = 1;
+    for (i = 0; i < me->npieces; i++)
+    {
+        if (__peer_has(pr, i))
+            __nhaves_dec(me, i);
+        if (me->pieces[i].holder == peer || me->pieces[i].dup == peer)
+            bt_deadline_selector_giveback_piece(me, peer, i);
+    }
+
+    free(pr->have);
+    free(pr);
+}
+
+void bt_deadline_selector_have_piece(
+    void *r,
+    int piece_idx
+)
+{
+    deadline_t *me = r;
+    piece_t *pce;
+
+    __grow(me, piece_idx + 1);
+    pce = &me->pieces[piece_idx];
+
+    if (pce->flags & PIECE_HAVE)
+        return;
+
+    if (0 < pce->deadline)
+    {
+        if (__now(me) <= pce->deadline)
+            me->stats.nmet++;
+        else
+            me->stats.nmissed++;
+    }
+
+    pce->flags = PIECE_HAVE;
+    pce->holder = pce->dup = NULL;
+    __order_remove(me, piece_idx);
+}
+
+void bt_deadline_selector_lost_piece(
+    void *r,
+    int piece_idx
+)
+{
+    deadline_t *me = r;
+    piece_t *pce;
+
+    if (piece_idx < 0 || me->npieces <= piece_idx)
+        return;
+
+    pce = &me->pieces[piece_idx];
+    if (!(pce->flags & PIECE_HAVE))
+        return;
+
+    pce->flags = 0;
+    __order_insert(me, piece_idx);
+}
+
+void bt_deadline_selector_peer_have_piece(
+    void *r,
+    void *peer,
+    const int piece_idx
+)
+{
+    deadline_t *me = r;
+    peer_t *pr;
+
+    pr = hashmap_get(me->peers, peer);
+
+    assert(pr);
+
+    if (__peer_has(pr, piece_idx))
+        return;
+
+    if (pr->nwords <= piece_idx / 64)
+    {
+        int n = piece_idx / 64 + 1;
+
+        pr->have = realloc(pr->have, sizeof(uint64_t) * n);
+        memset(pr->have + pr->nwords, 0, sizeof(uint64_t) * (n - pr->nwords));
+        pr->nwords = n;
+    }
+
+    pr->have[piece_idx / 64] |= (uint64_t)1 << (piece_idx % 64);
+    __grow(me, piece_idx + 1);
+    __nhaves_inc(me, piece_idx);
+}
+
+int bt_deadline_selector_get_npeers(void *r)
+{
+    deadline_t *me = r;
+
+    return hashmap_count(me->peers);
+}
+
+int bt_deadline_selector_get_npieces(void *r)
+{
+    deadline_t *me = r;
+
+    return me->npieces;
+}
+
+int bt_deadline_selector_poll_best_piece(
+    void *r,
+    const void *peer
+)
+{
+    deadline_t *me = r;
+    peer_t *pr;
+    uint64_t now;
+    int i, o, rate, best = -1, end, urgent;
+
+    if (!(pr = hashmap_get(me->peers, peer)))
+        return -1;
+
+    now = __now(me);
+    rate = __rate(me, peer);
+    urgent = -1 == me->urgent_ms ? me->piece_ms : me->urgent_ms;
+    end = me->playhead + me->window < me->npieces ?
+          me->playhead + me->window : me->npieces;
+
+    /* the window; deadlines are in piece order */
+    for (i = me->playhead; i < end; i++)
+    {
+        piece_t *pce = &me->pieces[i];
+        int64_t left = (int64_t)(pce->deadline - now);
+
+        if ((pce->flags & PIECE_HAVE) || !__peer_has(pr, i))
+            continue;
+
+        if (!(pce->flags & PIECE_POLLED))
+        {
+            if (!__can_make(me, rate, left) && !__is_fastest(me, rate, now))
+                continue;
+
+            pce->flags |= PIECE_POLLED;
+            pce->holder = peer;
+            return i;
+        }
+
+        /* about to be late; race the peer that has it */
+        if (left < urgent && !pce->dup && pce->holder != peer &&
+            __rate(me, pce->holder) < rate)
+        {
+            pce->dup = peer;
+            me->stats.nduplicates++;
+            return i;
+        }
+    }
+
+    /* everything else, rarest first. Pieces that will reach the window
+     * before this peer could finish them are a last resort */
+    for (o = 0; o < me->first[me->nbuckets]; o++)
+    {
+        i = me->order[o];
+
+        if ((me->pieces[i].flags & PIECE_POLLED) || !__peer_has(pr, i) ||
+            (0 < me->window && me->playhead <= i && i < end))
+            continue;
+
+        if (!(0 < me->window && me->playhead < i &&
+              !__can_make(me, rate,
+                          (int64_t)(i - me->playhead + 1) * me->piece_ms)))
+        {
+            best = i;
+            break;
+        }
+
+        if (-1 == best)
+            best = i;
+    }
+
+    if (-1 != best)
+    {
+        me->pieces[best].flags |= PIECE_POLLED;
+        me->pieces[best].holder = peer;
+    }
+
+    return best;
+}
+
+/**
+ * Give pieces that have just entered the window their deadlines */
+static void __assign_deadlines(deadline_t *me)
+{
+    uint64_t now = __now(me);
+    int i;
+
+    __grow(me, me->playhead + me->window);
+
+    for (i = me->playhead; i < me->playhead + me->window; i++)
+        if (0 == me->pieces[i].deadline)
+            me->pieces[i].deadline =
+                now + (uint64_t)(i - me->playhead + 1) * me->piece_ms;
+}
+
+void bt_deadline_selector_set_playhead(void *r, int piece_idx)
+{
+    deadline_t *me = r;
+
+    me->playhead = piece_idx;
+    __assign_deadlines(me);
+}
+
+void bt_deadline_selector_set_window(void *r, int npieces, int piece_ms)
+{
+    deadline_t *me = r;
+
+    me->window = npieces;
+    me->piece_ms = piece_ms;
+    __assign_deadlines(me);
+}
+
+void bt_deadline_selector_set_piece_length(void *r, unsigned int piece_len)
+{
+    ((deadline_t*)r)->piece_len = piece_len;
+}
+
+void bt_deadline_selector_set_peer_rate(void *r, func_peer_rate_f rate,
+                                        void *udata)
+{
+    deadline_t *me = r;
+
+    me->rate = rate;
+    me->rate_udata = udata;
+}
+
+void bt_deadline_selector_set_clock(void *r, func_now_ms_f now, void *udata)
+{
+    deadline_t *me = r;
+
+    me->now = now;
+    me->clock_udata = udata;
+}
+
+void bt_deadline_selector_set_urgent_ms(void *r, int ms)
+{
+    ((deadline_t*)r)->urgent_ms = ms;
+}
+
+void bt_deadline_selector_get_stats(void *r,
+                                    bt_deadline_selector_stats_t *stats)
+{
+    memcpy(stats, &((deadline_t*)r)->stats,
+           sizeof(bt_deadline_selector_stats_t));
+}
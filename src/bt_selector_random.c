@@ -2,12 +2,17 @@
 /**
  * Copyright (c) 2011, Willem-Hendrik Thiart
  * Use of this source code is governed by a BSD-style license that can be
- * found in the LICENSE file. 
+ * found in the LICENSE file.
  *
  * @file
  * @brief Select a random piece to download
  * @author  Willem Thiart himself@willemthiart.com
  * @version 0.1
+ * @section description
+ * Pieces we want are kept in one bitmap per priority, shared by all peers.
+ * Each peer has a bitmap of the pieces it has. A poll ANDs the two a word
+ * at a time, starting from a random word, so nothing is kept per peer and
+ * piece besides a bit.
  */
 
 #include <assert.h>
@@ -17,20 +22,43 @@
 
 #include "bt.h"
 
+/* for uint64_t */
+#include <stdint.h>
+
 #include "linked_list_queue.h"
 #include "linked_list_hashmap.h"
-#include "bag.h"
+
+#define PIECE_HAVE (1 << 0)
+#define PIECE_POLLED (1 << 1)
+
+#define NPRIOS (BT_PRIORITY_HIGH + 1)
+
+#define WORD(idx) ((idx) / 64)
+#define BIT(idx) ((uint64_t)1 << ((idx) % 64))
+
+/*  piece */
+typedef struct
+{
+    /*  BT_PRIORITY_* */
+    unsigned char prio;
+    /*  PIECE_* */
+    unsigned char flags;
+} piece_t;
 
 /*  random  */
 typedef struct
 {
     hashmap_t *peers;
 
-    /*  pieces that are candidates for polling  */
-    //hashmap_t *p_candidates;
+    /*  pieces that are candidates for polling, by priority; skipped pieces
+     *  aren't candidates */
+    uint64_t *wanted[NPRIOS];
+    int nwanted[NPRIOS];
+
+    piece_t *pieces;
 
-    /*  pieces that we've polled */
-    hashmap_t *p_polled;
+    /*  words in each bitmap */
+    int nwords;
 
     /*  number of pieces to download */
     int npieces;
@@ -39,8 +67,9 @@ typedef struct
 /*  peer */
 typedef struct
 {
-    //hashmap_t *have_pieces;
-    bag_t *p_candidates;
+    /*  one bit per piece */
+    uint64_t *have;
+    int nwords;
 } peer_t;
 
 static unsigned long __peer_hash(
@@ -58,13 +87,72 @@ static long __peer_compare(
     return obj - other;
 }
 
-static int __cmp_piece(
-    const void *i1,
-    const void *i2,
-    const void *ckr
-)
+static int __is_wanted(const random_t *rf, const int idx, const int prio)
+{
+    return BT_PRIORITY_SKIP != prio &&
+        !(rf->pieces[idx].flags & (PIECE_HAVE | PIECE_POLLED));
+}
+
+/**
+ * Put the piece in, or take it out of, the wanted set of its priority */
+static void __update(random_t *rf, const int idx)
+{
+    int p = rf->pieces[idx].prio;
+    uint64_t *w = &rf->wanted[p][WORD(idx)];
+
+    if (__is_wanted(rf, idx, p) && !(*w & BIT(idx)))
+    {
+        *w |= BIT(idx);
+        rf->nwanted[p]++;
+    }
+    else if (!__is_wanted(rf, idx, p) && (*w & BIT(idx)))
+    {
+        *w &= ~BIT(idx);
+        rf->nwanted[p]--;
+    }
+}
+
+/**
+ * Take the piece out of the wanted set of its priority */
+static void __unwant(random_t *rf, const int idx)
 {
-    return i2 - i1;
+    int p = rf->pieces[idx].prio;
+
+    if (rf->wanted[p][WORD(idx)] & BIT(idx))
+    {
+        rf->wanted[p][WORD(idx)] &= ~BIT(idx);
+        rf->nwanted[p]--;
+    }
+}
+
+/**
+ * Make sure we know about this many pieces */
+static void __grow(random_t *rf, const int npieces)
+{
+    int i, p, nwords = WORD(npieces - 1) + 1;
+
+    if (npieces <= rf->npieces)
+        return;
+
+    if (rf->nwords < nwords)
+    {
+        for (p = 0; p < NPRIOS; p++)
+        {
+            rf->wanted[p] = realloc(rf->wanted[p], sizeof(uint64_t) * nwords);
+            memset(rf->wanted[p] + rf->nwords, 0,
+                   sizeof(uint64_t) * (nwords - rf->nwords));
+        }
+        rf->nwords = nwords;
+    }
+
+    rf->pieces = realloc(rf->pieces, sizeof(piece_t) * npieces);
+    for (i = rf->npieces; i < npieces; i++)
+    {
+        rf->pieces[i].prio = BT_PRIORITY_NORMAL;
+        rf->pieces[i].flags = 0;
+        __update(rf, i);
+    }
+    rf->npieces = npieces;
 }
 
 void *bt_random_selector_new(
@@ -74,9 +162,8 @@ void *bt_random_selector_new(
     random_t *rf;
 
     rf = calloc(1, sizeof(random_t));
-    rf->npieces = npieces;
     rf->peers = hashmap_new(__peer_hash, __peer_compare, 17);
-    rf->p_polled = hashmap_new(__peer_hash, __peer_compare, 17);
+    __grow(rf, npieces);
     return rf;
 }
 
@@ -84,11 +171,23 @@ void bt_random_selector_free(
     void *r
 )
 {
+    random_t *rf = r;
+    hashmap_iterator_t iter;
+    peer_t *pr;
+    int p;
+
+    for (hashmap_iterator(rf->peers, &iter);
+        (pr = hashmap_iterator_next_value(rf->peers, &iter));)
+    {
+        free(pr->have);
+        free(pr);
+    }
 
-//    hashmap_free(rf->peers);
-//    bag_free(rf->p_candidates);
-//    hashmap_free(rf->p_polled);
-//    free(rf);
+    for (p = 0; p < NPRIOS; p++)
+        free(rf->wanted[p]);
+    hashmap_free(rf->peers);
+    free(rf->pieces);
+    free(rf);
 }
 
 void bt_random_selector_remove_peer(
@@ -101,7 +200,7 @@ void bt_random_selector_remove_peer(
 
     if ((pr = hashmap_remove(rf->peers, peer)))
     {
-//        hashmap_free(pr->have_pieces);
+        free(pr->have);
         free(pr);
     }
 }
@@ -119,8 +218,6 @@ void bt_random_selector_add_peer(
         return;
 
     pr = calloc(1,sizeof(peer_t));
-    pr->p_candidates = bag_new();
-//    pr->have_pieces = hashmap_new(__peer_hash, __peer_compare, 11);
     hashmap_put(rf->peers, peer, pr);
 }
 
@@ -131,16 +228,12 @@ void bt_random_selector_giveback_piece(
 )
 {
     random_t *rf = r;
-    peer_t *pr;
 
-    hashmap_remove(rf->p_polled, (void *) (long) piece_idx + 1);
+    if (piece_idx < 0 || rf->npieces <= piece_idx)
+        return;
 
-    if (peer)
-    {
-        pr = hashmap_get(rf->peers, peer);
-        assert(pr);
-        bag_put(pr->p_candidates, (void *) (long) piece_idx + 1);
-    }
+    rf->pieces[piece_idx].flags &= ~PIECE_POLLED;
+    __update(rf, piece_idx);
 }
 
 void bt_random_selector_have_piece(
@@ -151,8 +244,23 @@ void bt_random_selector_have_piece(
     random_t *rf = r;
 
     assert(rf);
-    assert(rf->p_polled);
-    hashmap_put(rf->p_polled, (void *) (long) piece_idx + 1, (void *) (long) piece_idx + 1);
+    __grow(rf, piece_idx + 1);
+    rf->pieces[piece_idx].flags |= PIECE_HAVE;
+    __update(rf, piece_idx);
+}
+
+void bt_random_selector_lost_piece(
+    void *r,
+    int piece_idx
+)
+{
+    random_t *rf = r;
+
+    if (piece_idx < 0 || rf->npieces <= piece_idx)
+        return;
+
+    rf->pieces[piece_idx].flags &= ~(PIECE_HAVE | PIECE_POLLED);
+    __update(rf, piece_idx);
 }
 
 void bt_random_selector_peer_have_piece(
@@ -163,17 +271,53 @@ void bt_random_selector_peer_have_piece(
 {
     random_t *rf = r;
     peer_t *pr;
-    void* p;
 
     /*  get the peer */
     pr = hashmap_get(rf->peers, peer);
 
     assert(pr);
 
-    if (!(p = hashmap_get(rf->p_polled, (void *) (long) piece_idx + 1)))
+    __grow(rf, piece_idx + 1);
+
+    if (pr->nwords <= WORD(piece_idx))
     {
-        bag_put(pr->p_candidates, (void *) (long) piece_idx + 1);
+        pr->have = realloc(pr->have, sizeof(uint64_t) * rf->nwords);
+        memset(pr->have + pr->nwords, 0,
+               sizeof(uint64_t) * (rf->nwords - pr->nwords));
+        pr->nwords = rf->nwords;
     }
+
+    pr->have[WORD(piece_idx)] |= BIT(piece_idx);
+}
+
+void bt_random_selector_set_piece_priority(
+    void *r,
+    int piece_idx,
+    int prio
+)
+{
+    random_t *rf = r;
+
+    if (piece_idx < 0 || prio < BT_PRIORITY_SKIP || BT_PRIORITY_HIGH < prio)
+        return;
+
+    __grow(rf, piece_idx + 1);
+    __unwant(rf, piece_idx);
+    rf->pieces[piece_idx].prio = prio;
+    __update(rf, piece_idx);
+}
+
+void bt_random_selector_set_piece_priority_range(
+    void *r,
+    int piece_idx,
+    int npieces,
+    int prio
+)
+{
+    int i;
+
+    for (i = piece_idx; i < piece_idx + npieces; i++)
+        bt_random_selector_set_piece_priority(r, i, prio);
 }
 
 int bt_random_selector_get_npeers(void *r)
@@ -195,27 +339,41 @@ int bt_random_selector_poll_best_piece(
 {
     random_t *rf = r;
     peer_t *pr;
-    int piece_idx;
+    int p;
 
     if (!(pr = hashmap_get(rf->peers, peer)))
     {
         return -1;
     }
 
-    /* get a random piece that the client might have */
-    while (0 < bag_count(pr->p_candidates))
+    /* walk the wanted set from a random word onwards; higher priorities
+     * first */
+    for (p = BT_PRIORITY_HIGH; BT_PRIORITY_SKIP < p; p--)
     {
-        piece_idx = ((unsigned long int)bag_take(pr->p_candidates)) - 1;
+        int i, start;
 
-        /* don't poll if it has been polled already */
-        if (!(hashmap_get(rf->p_polled, (void *) (long) piece_idx + 1)))
+        if (0 == rf->nwanted[p] || 0 == pr->nwords)
+            continue;
+
+        start = rand() % pr->nwords;
+        for (i = 0; i < pr->nwords; i++)
         {
-            void* i = (void *) ((long) piece_idx + 1);
-            hashmap_put(rf->p_polled, i, i);
+            int w = (start + i) % pr->nwords, b, piece_idx;
+            uint64_t hits = rf->wanted[p][w] & pr->have[w];
+
+            if (!hits)
+                continue;
+
+            /* the first hit from a random bit onwards */
+            b = rand() % 64;
+            hits = hits >> b | (b ? hits << (64 - b) : 0);
+            piece_idx = w * 64 + (__builtin_ctzll(hits) + b) % 64;
+
+            rf->pieces[piece_idx].flags |= PIECE_POLLED;
+            __update(rf, piece_idx);
             return piece_idx;
         }
     }
 
     return -1;
 }
-
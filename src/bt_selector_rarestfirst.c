@@ -21,6 +21,9 @@
 #include "linked_list_hashmap.h"
 #include "heap.h"
 
+/*  hashmaps don't take NULL keys, so piece 0 would be lost */
+#define __key(idx) ((void *) (long) ((idx) + 1))
+
 /*  rarestfirst  */
 typedef struct
 {
@@ -28,6 +31,8 @@ typedef struct
     hashmap_t *pieces;
     /*  pieces that we've polled */
     hashmap_t *pieces_polled;
+    /*  priorities of pieces that aren't BT_PRIORITY_NORMAL; stored + 1 */
+    hashmap_t *prios;
     int npieces;
 } rarestfirst_t;
 
@@ -63,6 +68,16 @@ static long __peer_compare(
     return obj - other;
 }
 
+static int __prio(
+    const rarestfirst_t *rf,
+    const int piece_idx
+)
+{
+    void *prio = hashmap_get(rf->prios, __key(piece_idx));
+
+    return prio ? (long) prio - 1 : BT_PRIORITY_NORMAL;
+}
+
 static int __cmp_piece(
     const void *i1,
     const void *i2,
@@ -71,7 +86,11 @@ static int __cmp_piece(
 {
     const piece_t *p1 = i1;
     const piece_t *p2 = i2;
+    int pr1 = __prio(ckr, p1->idx), pr2 = __prio(ckr, p2->idx);
 
+    /*  higher priorities first, then rarest */
+    if (pr1 != pr2)
+        return pr1 - pr2;
     return p2->nhaves - p1->nhaves;
 }
 
@@ -86,6 +105,7 @@ void *bt_rarestfirst_selector_new(
     rf->peers = hashmap_new(__peer_hash, __peer_compare, 11);
     rf->pieces = hashmap_new(__peer_hash, __peer_compare, 11);
     rf->pieces_polled = hashmap_new(__peer_hash, __peer_compare, 11);
+    rf->prios = hashmap_new(__peer_hash, __peer_compare, 11);
     return rf;
 }
 
@@ -119,6 +139,7 @@ void bt_rarestfirst_selector_free(
     hashmap_free(rf->peers);
     hashmap_free(rf->pieces);
     hashmap_free(rf->pieces_polled);
+    hashmap_free(rf->prios);
     free(rf);
 }
 
@@ -163,9 +184,9 @@ void bt_rarestfirst_selector_giveback_piece(
 
     piece_t *pce;
 
-    if ((pce = hashmap_remove(rf->pieces_polled, (void *) (long) piece_idx)))
+    if ((pce = hashmap_remove(rf->pieces_polled, __key(piece_idx))))
     {
-        hashmap_put(rf->pieces, (void *) (long) piece_idx, pce);
+        hashmap_put(rf->pieces, __key(piece_idx), pce);
     }
 }
 
@@ -177,11 +198,20 @@ void bt_rarestfirst_selector_have_piece(
     rarestfirst_t *rf = r;
     piece_t *pce;
 
-    pce = hashmap_remove(rf->pieces, (void *) (long) piece_idx);
-    pce = hashmap_put(rf->pieces_polled, (void *) (long) piece_idx, pce);
+    pce = hashmap_remove(rf->pieces, __key(piece_idx));
+    pce = hashmap_put(rf->pieces_polled, __key(piece_idx), pce);
     /*  possible memory leak here */
 }
 
+void bt_rarestfirst_selector_lost_piece(
+    void *r,
+    int piece_idx
+)
+{
+    /*  pieces we have are kept with the polled ones */
+    bt_rarestfirst_selector_giveback_piece(r, NULL, piece_idx);
+}
+
 void bt_rarestfirst_selector_peer_have_piece(
     void *r,
     void *peer,
@@ -197,19 +227,50 @@ void bt_rarestfirst_selector_peer_have_piece(
 
     assert(pr);
 
-    if (!(piece = hashmap_get(rf->pieces, (void *) (long) piece_idx)))
+    if (!(piece = hashmap_get(rf->pieces, __key(piece_idx))))
     {
         piece = malloc(sizeof(piece_t));
         piece->nhaves = 1;
         piece->idx = piece_idx;
-        hashmap_put(rf->pieces, (void *) (long) piece_idx, piece);
+        hashmap_put(rf->pieces, __key(piece_idx), piece);
     }
 
     /*  increment haves  */
     piece->nhaves += 1;
 
     /*  add to peer's pieces */
-    hashmap_put(pr->have_pieces, (void *) (long) piece_idx, piece);
+    hashmap_put(pr->have_pieces, __key(piece_idx), piece);
+}
+
+void bt_rarestfirst_selector_set_piece_priority(
+    void *r,
+    int piece_idx,
+    int prio
+)
+{
+    rarestfirst_t *rf = r;
+
+    if (prio < BT_PRIORITY_SKIP || BT_PRIORITY_HIGH < prio)
+        return;
+
+    if (BT_PRIORITY_NORMAL == prio)
+        hashmap_remove(rf->prios, __key(piece_idx));
+    else
+        hashmap_put(rf->prios, __key(piece_idx),
+                    (void *) (long) (prio + 1));
+}
+
+void bt_rarestfirst_selector_set_piece_priority_range(
+    void *r,
+    int piece_idx,
+    int npieces,
+    int prio
+)
+{
+    int i;
+
+    for (i = piece_idx; i < piece_idx + npieces; i++)
+        bt_rarestfirst_selector_set_piece_priority(r, i, prio);
 }
 
 int bt_rarestfirst_selector_get_npeers(void *r)
@@ -256,8 +317,9 @@ int bt_rarestfirst_selector_poll_best_piece(
     for (hashmap_iterator(rf->pieces, &iter);
         (p = hashmap_iterator_next(rf->pieces, &iter));)
     {
-        /* only add if peer has it */
-        if (hashmap_get(pr->have_pieces, p))
+        /* only add if peer has it, and we want it */
+        if (hashmap_get(pr->have_pieces, p) &&
+            BT_PRIORITY_SKIP != __prio(rf, (long) p - 1))
         {
             pce = hashmap_get(rf->pieces, p);
             heap_offer(hp, pce);
@@ -268,8 +330,8 @@ int bt_rarestfirst_selector_poll_best_piece(
     if ((pce = heap_poll(hp)))
     {
         piece_idx = pce->idx;
-        hashmap_remove(rf->pieces, (void *) (long) pce->idx);
-        hashmap_put(rf->pieces_polled, (void *) (long) pce->idx, pce);
+        hashmap_remove(rf->pieces, __key(pce->idx));
+        hashmap_put(rf->pieces_polled, __key(pce->idx), pce);
     }
     else
     {
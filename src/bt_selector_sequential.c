@@ -2,12 +2,15 @@
 /**
  * Copyright (c) 2011, Willem-Hendrik Thiart
  * Use of this source code is governed by a BSD-style license that can be
- * found in the LICENSE file. 
+ * found in the LICENSE file.
  *
  * @file
  * @brief Select a sequential piece to download
  * @author  Willem Thiart himself@willemthiart.com
  * @version 0.1
+ * @section description
+ * Every priority has a cursor at its first wanted piece. Changing a piece's
+ * priority only moves the cursor back if the piece is before it.
  */
 
 #include <assert.h>
@@ -19,15 +22,30 @@
 
 #include "linked_list_queue.h"
 #include "linked_list_hashmap.h"
-#include "heap.h"
+
+#define PIECE_HAVE (1 << 0)
+#define PIECE_POLLED (1 << 1)
+
+#define NPRIOS (BT_PRIORITY_HIGH + 1)
+
+/*  piece */
+typedef struct
+{
+    /*  BT_PRIORITY_* */
+    unsigned char prio;
+    /*  PIECE_* */
+    unsigned char flags;
+} piece_t;
 
 /*  sequential  */
 typedef struct
 {
     hashmap_t *peers;
 
-    /*  pieces that we've polled */
-    hashmap_t *p_polled;
+    piece_t *pieces;
+
+    /*  no piece of this priority before this one is wanted */
+    int first[NPRIOS];
 
     int npieces;
 
@@ -36,8 +54,7 @@ typedef struct
 /*  peer */
 typedef struct
 {
-    //hashmap_t *have_pieces;
-    heap_t* p_candidates;
+    hashmap_t *have_pieces;
 } peer_t;
 
 static unsigned long __peer_hash(
@@ -55,13 +72,38 @@ static long __peer_compare(
     return obj - other;
 }
 
-static int __cmp_piece(
-    const void *i1,
-    const void *i2,
-    const void *ckr
-)
+static int __is_wanted(const sequential_t *me, const int idx, const int prio)
 {
-    return i2 - i1;
+    return me->pieces[idx].prio == prio &&
+        !(me->pieces[idx].flags & (PIECE_HAVE | PIECE_POLLED));
+}
+
+static void __want(sequential_t *me, const int idx)
+{
+    int p = me->pieces[idx].prio;
+
+    if (idx < me->first[p])
+        me->first[p] = idx;
+}
+
+/**
+ * Make sure we know about this many pieces */
+static void __grow(sequential_t *me, const int npieces)
+{
+    int i;
+
+    if (npieces <= me->npieces)
+        return;
+
+    me->pieces = realloc(me->pieces, sizeof(piece_t) * npieces);
+    for (i = me->npieces; i < npieces; i++)
+    {
+        me->pieces[i].prio = BT_PRIORITY_NORMAL;
+        me->pieces[i].flags = 0;
+    }
+
+    __want(me, me->npieces);
+    me->npieces = npieces;
 }
 
 void *bt_sequential_selector_new(
@@ -71,9 +113,8 @@ void *bt_sequential_selector_new(
     sequential_t *me;
 
     me = calloc(1, sizeof(sequential_t));
-    me->npieces = npieces;
     me->peers = hashmap_new(__peer_hash, __peer_compare, 11);
-    me->p_polled = hashmap_new(__peer_hash, __peer_compare, 11);
+    __grow(me, npieces);
     return me;
 }
 
@@ -82,10 +123,18 @@ void bt_sequential_selector_free(
 )
 {
     sequential_t *me = r;
+    hashmap_iterator_t iter;
+    peer_t *pr;
+
+    for (hashmap_iterator(me->peers, &iter);
+        (pr = hashmap_iterator_next_value(me->peers, &iter));)
+    {
+        hashmap_free(pr->have_pieces);
+        free(pr);
+    }
 
     hashmap_free(me->peers);
-//    heap_free(me->p_candidates);
-    hashmap_free(me->p_polled);
+    free(me->pieces);
     free(me);
 }
 
@@ -99,7 +148,7 @@ void bt_sequential_selector_remove_peer(
 
     if ((pr = hashmap_remove(me->peers, peer)))
     {
-//        hashmap_free(pr->have_pieces);
+        hashmap_free(pr->have_pieces);
         free(pr);
     }
 }
@@ -117,7 +166,7 @@ void bt_sequential_selector_add_peer(
         return;
 
     pr = calloc(1,sizeof(peer_t));
-    pr->p_candidates = heap_new(__cmp_piece, NULL);
+    pr->have_pieces = hashmap_new(__peer_hash, __peer_compare, 11);
     hashmap_put(me->peers, peer, pr);
 }
 
@@ -128,23 +177,12 @@ void bt_sequential_selector_giveback_piece(
 )
 {
     sequential_t *me = r;
-    peer_t *pr;
-
-    hashmap_remove(me->p_polled, (void *) (long) piece_idx + 1);
 
-    if (peer)
-    {
-        pr = hashmap_get(me->peers, peer);
-        assert(pr);
-        heap_offer(pr->p_candidates, (void *) (long) piece_idx + 1);
-    }
+    if (piece_idx < 0 || me->npieces <= piece_idx)
+        return;
 
-#if 0
-    if (!(p = hashmap_get(me->p_polled, (void *) (long) piece_idx + 1)))
-    {
-        heap_offer(pr->p_candidates, (void *) (long) piece_idx + 1);
-    }
-#endif
+    me->pieces[piece_idx].flags &= ~PIECE_POLLED;
+    __want(me, piece_idx);
 }
 
 void bt_sequential_selector_have_piece(
@@ -154,8 +192,22 @@ void bt_sequential_selector_have_piece(
 {
     sequential_t *me = r;
 
-    assert(me->p_polled);
-    hashmap_put(me->p_polled, (void *) (long) piece_idx + 1, (void *) (long) piece_idx + 1);
+    __grow(me, piece_idx + 1);
+    me->pieces[piece_idx].flags |= PIECE_HAVE;
+}
+
+void bt_sequential_selector_lost_piece(
+    void *r,
+    int piece_idx
+)
+{
+    sequential_t *me = r;
+
+    if (piece_idx < 0 || me->npieces <= piece_idx)
+        return;
+
+    me->pieces[piece_idx].flags &= ~(PIECE_HAVE | PIECE_POLLED);
+    __want(me, piece_idx);
 }
 
 void bt_sequential_selector_peer_have_piece(
@@ -166,17 +218,51 @@ void bt_sequential_selector_peer_have_piece(
 {
     sequential_t *me = r;
     peer_t *pr;
-    void* p;
 
     /*  get the peer */
     pr = hashmap_get(me->peers, peer);
 
     assert(pr);
 
-    if (!(p = hashmap_get(me->p_polled, (void *) (long) piece_idx + 1)))
-    {
-        heap_offer(pr->p_candidates, (void *) (long) piece_idx + 1);
-    }
+    __grow(me, piece_idx + 1);
+    hashmap_put(pr->have_pieces, (void *) (long) piece_idx + 1,
+                (void *) (long) piece_idx + 1);
+}
+
+void bt_sequential_selector_set_piece_priority(
+    void *r,
+    int piece_idx,
+    int prio
+)
+{
+    sequential_t *me = r;
+
+    if (piece_idx < 0 || prio < BT_PRIORITY_SKIP || BT_PRIORITY_HIGH < prio)
+        return;
+
+    __grow(me, piece_idx + 1);
+    me->pieces[piece_idx].prio = prio;
+    __want(me, piece_idx);
+}
+
+void bt_sequential_selector_set_piece_priority_range(
+    void *r,
+    int piece_idx,
+    int npieces,
+    int prio
+)
+{
+    sequential_t *me = r;
+    int i;
+
+    if (piece_idx < 0 || npieces <= 0 ||
+        prio < BT_PRIORITY_SKIP || BT_PRIORITY_HIGH < prio)
+        return;
+
+    __grow(me, piece_idx + npieces);
+    for (i = piece_idx; i < piece_idx + npieces; i++)
+        me->pieces[i].prio = prio;
+    __want(me, piece_idx);
 }
 
 int bt_sequential_selector_get_npeers(void *r)
@@ -200,25 +286,32 @@ int bt_sequential_selector_poll_best_piece(
 {
     sequential_t *me = r;
     peer_t *pr;
-    int piece_idx;
+    int p;
 
     if (!(pr = hashmap_get(me->peers, peer)))
     {
         return -1;
     }
 
-    while (0 < heap_count(pr->p_candidates))
+    for (p = BT_PRIORITY_HIGH; BT_PRIORITY_SKIP < p; p--)
     {
-        piece_idx = (unsigned long int)heap_poll(pr->p_candidates) - 1;
+        int i;
+
+        /*  move the cursor past pieces that aren't wanted anymore */
+        while (me->first[p] < me->npieces &&
+               !__is_wanted(me, me->first[p], p))
+            me->first[p]++;
 
-        if (!(hashmap_get(me->p_polled, (void *) (long) piece_idx + 1)))
+        for (i = me->first[p]; i < me->npieces; i++)
         {
-            hashmap_put(me->p_polled,
-                    (void *) (long) piece_idx + 1, (void *) (long) piece_idx + 1);
-            return piece_idx;
+            if (!__is_wanted(me, i, p) ||
+                !hashmap_get(pr->have_pieces, (void *) (long) i + 1))
+                continue;
+
+            me->pieces[i].flags |= PIECE_POLLED;
+            return i;
         }
     }
 
     return -1;
 }
-
@@ -0,0 +1,244 @@
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Send blocks straight from files to sockets
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ * @section description
+ * A send is a header followed by a range of a file; plain data is a send
+ * with no file range. Sends never wait for the socket. A send that doesn't
+ * fit remembers how far it got, and is resumed when the socket is writable.
+ *
+ * The send queue keeps a connection's sends in order: nothing goes out
+ * while an earlier send is still waiting.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <errno.h>
+
+/* for uint32_t */
+#include <stdint.h>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+
+#include "bt.h"
+#include "bt_sendfile.h"
+
+#if !defined(MSG_MORE)
+#define MSG_MORE 0
+#endif
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
+
+typedef struct sendfile_s sendfile_t;
+
+struct sendfile_s
+{
+    char *header;
+    unsigned int header_len;
+    unsigned int header_sent;
+
+    /* our own descriptor, so the file can't be closed from under us;
+     * -1 if there's no file range */
+    int fd;
+    uint64_t offset;
+    unsigned int len;
+    unsigned int sent;
+
+    /* next send in the queue */
+    sendfile_t *next;
+};
+
+typedef struct
+{
+    sendfile_t *head, *tail;
+} sendqueue_t;
+
+/**
+ * @return BT_SENDFILE_AGAIN if the socket is full; otherwise
+ *  BT_SENDFILE_ERROR */
+static int __errno_result(void)
+{
+    if (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno)
+        return BT_SENDFILE_AGAIN;
+    return BT_SENDFILE_ERROR;
+}
+
+#if defined(__linux__)
+static ssize_t __send_file(int sock, sendfile_t *me)
+{
+    off_t off = me->offset + me->sent;
+
+    return sendfile(sock, me->fd, &off, me->len - me->sent);
+}
+#else
+static ssize_t __send_file(int sock, sendfile_t *me)
+{
+    char buf[1 << 14];
+    unsigned int n = me->len - me->sent < sizeof(buf) ?
+                     me->len - me->sent : sizeof(buf);
+    ssize_t r = pread(me->fd, buf, n, me->offset + me->sent);
+
+    if (r <= 0)
+        return r;
+
+    /* what doesn't fit is read again when we resume */
+    return send(sock, buf, r, MSG_NOSIGNAL);
+}
+#endif
+
+void *bt_sendfile_new(const char *header, const int header_len,
+                      int fd, uint64_t offset, const unsigned int len)
+{
+    sendfile_t *me = calloc(1, sizeof(sendfile_t));
+
+    if (header && 0 < header_len)
+    {
+        me->header = malloc(header_len);
+        memcpy(me->header, header, header_len);
+        me->header_len = header_len;
+    }
+
+    me->fd = -1;
+    if (0 < len && -1 == (me->fd = dup(fd)))
+    {
+        bt_sendfile_free(me);
+        return NULL;
+    }
+
+    me->offset = offset;
+    me->len = len;
+    return me;
+}
+
+void bt_sendfile_free(void *sf)
+{
+    sendfile_t *me = sf;
+
+    if (-1 != me->fd)
+        close(me->fd);
+    free(me->header);
+    free(me);
+}
+
+int bt_sendfile_send(void *sf, int sock)
+{
+    sendfile_t *me = sf;
+
+    /* hold the header back so it goes out with the first of the file */
+    while (me->header_sent < me->header_len)
+    {
+        ssize_t r = send(sock, me->header + me->header_sent,
+                         me->header_len - me->header_sent,
+                         MSG_NOSIGNAL | (me->sent < me->len ? MSG_MORE : 0));
+
+        if (-1 == r)
+            return __errno_result();
+        me->header_sent += r;
+    }
+
+    while (me->sent < me->len)
+    {
+        ssize_t r = __send_file(sock, me);
+
+        if (-1 == r)
+            return __errno_result();
+
+        /* the file is shorter than we thought */
+        if (0 == r)
+            return BT_SENDFILE_ERROR;
+
+        me->sent += r;
+    }
+
+    return BT_SENDFILE_DONE;
+}
+
+void *bt_sendqueue_new()
+{
+    return calloc(1, sizeof(sendqueue_t));
+}
+
+void bt_sendqueue_free(void *sq)
+{
+    sendqueue_t *me = sq;
+
+    while (me->head)
+    {
+        sendfile_t *s = me->head;
+
+        me->head = s->next;
+        bt_sendfile_free(s);
+    }
+
+    free(me);
+}
+
+int bt_sendqueue_is_empty(void *sq)
+{
+    return NULL == ((sendqueue_t*)sq)->head;
+}
+
+int bt_sendqueue_flush(void *sq, int sock)
+{
+    sendqueue_t *me = sq;
+
+    while (me->head)
+    {
+        sendfile_t *s = me->head;
+        int r = bt_sendfile_send(s, sock);
+
+        if (BT_SENDFILE_DONE != r)
+            return r;
+
+        if (!(me->head = s->next))
+            me->tail = NULL;
+        bt_sendfile_free(s);
+    }
+
+    return BT_SENDFILE_DONE;
+}
+
+/**
+ * Put the send at the back of the queue, and send what we can
+ * @return 1 if sent or queued; 0 on failure */
+static int __enqueue(sendqueue_t *me, int sock, sendfile_t *s)
+{
+    if (!s)
+        return 0;
+
+    if (me->tail)
+        me->tail->next = s;
+    else
+        me->head = s;
+    me->tail = s;
+
+    return BT_SENDFILE_ERROR != bt_sendqueue_flush(me, sock);
+}
+
+int bt_sendqueue_send(void *sq, int sock, const char *data, const int len)
+{
+    return __enqueue(sq, sock, bt_sendfile_new(data, len, -1, 0, 0));
+}
+
+int bt_sendqueue_sendfile(void *sq, int sock,
+                          const char *header, const int header_len,
+                          int fd, uint64_t offset, const unsigned int len)
+{
+    return __enqueue(sq, sock,
+                     bt_sendfile_new(header, header_len, fd, offset, len));
+}
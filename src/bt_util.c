@@ -34,3 +34,35 @@ char *bt_generate_peer_id()
     return str;
 }
 
+
+char *bt_path_sanitize(const char *name, const int len)
+{
+    char *out = malloc(len + 2), *o = out;
+    int i = 0;
+
+    while (i < len)
+    {
+        int j = i;
+
+        while (j < len && name[j] != '/')
+            j++;
+
+        /* keep the component unless it's empty, "." or ".." */
+        if (!(j - i == 0 ||
+              (j - i == 1 && name[i] == '.') ||
+              (j - i == 2 && name[i] == '.' && name[i + 1] == '.')))
+        {
+            if (o != out)
+                *o++ = '/';
+            memcpy(o, name + i, j - i);
+            o += j - i;
+        }
+
+        i = j + 1;
+    }
+
+    if (o == out)
+        *o++ = '_';
+    *o = '\0';
+    return out;
+}
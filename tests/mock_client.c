@@ -166,7 +166,11 @@ client_t* mock_client_setup(int piecelen)
                                    .get_npieces =
                                        bt_random_selector_get_npieces,
                                    .poll_piece =
-                                       bt_random_selector_poll_best_piece
+                                       bt_random_selector_poll_best_piece,
+                                   .set_piece_priority =
+                                       bt_random_selector_set_piece_priority,
+                                   .set_piece_priority_range =
+                               bt_random_selector_set_piece_priority_range
                                }), NULL);
     mock_client_setup_disk_backend(cli->bt, piecelen);
 
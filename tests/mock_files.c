@@ -0,0 +1,65 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+/* for uint64_t */
+#include <stdint.h>
+
+#include "mock_files.h"
+
+static const struct
+{
+    const char *suffix;
+    uint64_t size;
+} __files[] = {
+    { "_a.dat", 15 },
+    { "_b.dat", 0 },
+    { "_c.dat", 15 }
+};
+
+#define NFILES (sizeof(__files) / sizeof(__files[0]))
+
+void mock_files_add(void *udata, mock_files_add_f add, const char *prefix)
+{
+    char path[256];
+    unsigned int i;
+
+    mock_files_remove(prefix);
+
+    for (i = 0; i < NFILES; i++)
+    {
+        int len = snprintf(path, sizeof(path), "%s%s", prefix,
+                           __files[i].suffix);
+
+        add(udata, path, len, __files[i].size);
+    }
+}
+
+void mock_files_remove(const char *prefix)
+{
+    char path[256];
+    unsigned int i;
+
+    for (i = 0; i < NFILES; i++)
+    {
+        snprintf(path, sizeof(path), "%s%s", prefix, __files[i].suffix);
+        unlink(path);
+    }
+}
+
+int mock_file_has(const char *path, const int off, const char *expected)
+{
+    char buf[32];
+    FILE *f = fopen(path, "rb");
+    int len = strlen(expected);
+
+    if (!f)
+        return 0;
+    fseek(f, off, SEEK_SET);
+    if (len != (int)fread(buf, 1, len, f))
+        len = -1;
+    fclose(f);
+    return 0 < len && 0 == strncmp(buf, expected, len);
+}
@@ -0,0 +1,31 @@
+#ifndef MOCK_FILES_H
+#define MOCK_FILES_H
+
+/* the files are made of 10 byte pieces */
+#define MOCK_FILES_PIECE_LEN 10
+
+typedef void (
+*mock_files_add_f
+)   (
+    void *udata,
+    const char *fname,
+    int fname_len,
+    const uint64_t size
+    );
+
+/**
+ * Add the storage tests' files, from scratch:
+ *  <prefix>_a.dat is 15 bytes, <prefix>_b.dat is empty and <prefix>_c.dat
+ *  is 15 bytes. Piece 1 spans a and c
+ * @param add The storage's add_file function */
+void mock_files_add(void *udata, mock_files_add_f add, const char *prefix);
+
+/**
+ * Remove what mock_files_add() created */
+void mock_files_remove(const char *prefix);
+
+/**
+ * @return 1 if the file has expected at this offset; otherwise 0 */
+int mock_file_has(const char *path, const int off, const char *expected);
+
+#endif /* MOCK_FILES_H */
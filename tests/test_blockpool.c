@@ -0,0 +1,213 @@
+
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_blockpool.h"
+
+#define BLOCK_LEN (BT_BLOCK_SIZE)
+
+/* one slab */
+#define POOL_LEN (1 << 21)
+
+void TestBTBlockpool_alloc_gives_distinct_block_sized_buffers(CuTest * tc)
+{
+    void* bp = bt_blockpool_new(POOL_LEN);
+    char *a, *b;
+
+    a = bt_blockpool_alloc(bp);
+    b = bt_blockpool_alloc(bp);
+    CuAssertPtrNotNull(tc, a);
+    CuAssertPtrNotNull(tc, b);
+    CuAssertTrue(tc, BLOCK_LEN <= (a < b ? b - a : a - b));
+    memset(a, 'a', BLOCK_LEN);
+    memset(b, 'b', BLOCK_LEN);
+    CuAssertTrue(tc, 'a' == a[BLOCK_LEN - 1]);
+    bt_blockpool_free(bp);
+}
+
+void TestBTBlockpool_owns_only_its_buffers(CuTest * tc)
+{
+    void* bp = bt_blockpool_new(POOL_LEN);
+    char *a = bt_blockpool_alloc(bp);
+    char other;
+
+    CuAssertTrue(tc, 1 == bt_blockpool_owns(bp, a));
+    CuAssertTrue(tc, 1 == bt_blockpool_owns(bp, a + 100));
+    CuAssertTrue(tc, 0 == bt_blockpool_owns(bp, &other));
+    bt_blockpool_free(bp);
+}
+
+void TestBTBlockpool_buffer_is_released_by_last_unref(CuTest * tc)
+{
+    void* bp = bt_blockpool_new(POOL_LEN);
+    bt_blockpool_stats_t s;
+    char *a = bt_blockpool_alloc(bp);
+
+    bt_blockpool_ref(bp, a);
+    bt_blockpool_unref(bp, a);
+    bt_blockpool_get_stats(bp, &s);
+    CuAssertIntEquals(tc, 1, s.in_use);
+
+    /* a pointer into the buffer works too */
+    bt_blockpool_unref(bp, a + 10);
+    bt_blockpool_get_stats(bp, &s);
+    CuAssertIntEquals(tc, 0, s.in_use);
+
+    /* the freed buffer is the first to be reused */
+    CuAssertTrue(tc, a == bt_blockpool_alloc(bp));
+    bt_blockpool_free(bp);
+}
+
+void TestBTBlockpool_alloc_fails_at_cap(CuTest * tc)
+{
+    void* bp = bt_blockpool_new(POOL_LEN);
+    bt_blockpool_stats_t s;
+    void* last = NULL;
+    int i;
+
+    bt_blockpool_get_stats(bp, &s);
+    CuAssertIntEquals(tc, POOL_LEN / BLOCK_LEN, s.max);
+
+    for (i = 0; i < s.max; i++)
+    {
+        last = bt_blockpool_alloc(bp);
+        CuAssertPtrNotNull(tc, last);
+    }
+    CuAssertTrue(tc, NULL == bt_blockpool_alloc(bp));
+
+    bt_blockpool_unref(bp, last);
+    CuAssertTrue(tc, last == bt_blockpool_alloc(bp));
+
+    bt_blockpool_get_stats(bp, &s);
+    CuAssertIntEquals(tc, 1, s.nslabs);
+    bt_blockpool_free(bp);
+}
+
+void TestBTBlockpool_slabs_are_added_as_needed(CuTest * tc)
+{
+    void* bp = bt_blockpool_new(POOL_LEN * 2);
+    bt_blockpool_stats_t s;
+    int i;
+
+    bt_blockpool_get_stats(bp, &s);
+    CuAssertIntEquals(tc, 0, s.nslabs);
+
+    for (i = 0; i < POOL_LEN / BLOCK_LEN + 1; i++)
+        bt_blockpool_alloc(bp);
+    bt_blockpool_get_stats(bp, &s);
+    CuAssertIntEquals(tc, 2, s.nslabs);
+    bt_blockpool_free(bp);
+}
+
+void TestBTBlockpool_span_is_contiguous_and_counts_towards_cap(CuTest * tc)
+{
+    void* bp = bt_blockpool_new(POOL_LEN * 2);
+    bt_blockpool_stats_t s;
+    char* span;
+
+    span = bt_blockpool_alloc_span(bp, POOL_LEN + 1);
+    CuAssertPtrNotNull(tc, span);
+    memset(span, 'a', POOL_LEN * 2);
+    CuAssertTrue(tc, 0 == bt_blockpool_owns(bp, span));
+    bt_blockpool_get_stats(bp, &s);
+    CuAssertIntEquals(tc, 2, s.nslabs_span);
+
+    /* the span took all of the pool */
+    CuAssertTrue(tc, NULL == bt_blockpool_alloc(bp));
+
+    bt_blockpool_free_span(bp, span);
+    CuAssertPtrNotNull(tc, bt_blockpool_alloc(bp));
+    bt_blockpool_get_stats(bp, &s);
+    CuAssertIntEquals(tc, 0, s.nslabs_span);
+    CuAssertIntEquals(tc, 2, s.nslabs);
+    bt_blockpool_free(bp);
+}
+
+void TestBTBlockpool_span_fails_without_room(CuTest * tc)
+{
+    void* bp = bt_blockpool_new(POOL_LEN * 2);
+    char* a = bt_blockpool_alloc(bp);
+    void* span;
+
+    CuAssertTrue(tc, NULL == bt_blockpool_alloc_span(bp, POOL_LEN * 2));
+    span = bt_blockpool_alloc_span(bp, POOL_LEN);
+    CuAssertPtrNotNull(tc, span);
+
+    /* buffers are still found after a span */
+    CuAssertTrue(tc, 1 == bt_blockpool_owns(bp, a));
+    bt_blockpool_free_span(bp, span);
+    bt_blockpool_free(bp);
+}
+
+typedef struct
+{
+    void* bp;
+    int failed;
+} worker_t;
+
+static void* __worker(void* udata)
+{
+    worker_t* w = udata;
+    char* bufs[8];
+    int i, j;
+
+    for (i = 0; i < 2000; i++)
+    {
+        for (j = 0; j < 8; j++)
+        {
+            if (!(bufs[j] = bt_blockpool_alloc(w->bp)))
+            {
+                w->failed = 1;
+                return NULL;
+            }
+            bufs[j][0] = j;
+        }
+
+        for (j = 0; j < 8; j++)
+        {
+            if (bufs[j][0] != j)
+                w->failed = 1;
+            bt_blockpool_unref(w->bp, bufs[j]);
+        }
+    }
+
+    return NULL;
+}
+
+void TestBTBlockpool_threads_share_pool(CuTest * tc)
+{
+    void* bp = bt_blockpool_new(POOL_LEN);
+    bt_blockpool_stats_t s;
+    pthread_t threads[4];
+    worker_t w[4];
+    int i;
+
+    for (i = 0; i < 4; i++)
+    {
+        w[i].bp = bp;
+        w[i].failed = 0;
+        pthread_create(&threads[i], NULL, __worker, &w[i]);
+    }
+
+    for (i = 0; i < 4; i++)
+    {
+        pthread_join(threads[i], NULL);
+        CuAssertTrue(tc, 0 == w[i].failed);
+    }
+
+    bt_blockpool_get_stats(bp, &s);
+    CuAssertIntEquals(tc, 0, s.in_use);
+
+    /* exited threads gave their cached buffers back */
+    for (i = 0; i < s.max; i++)
+        CuAssertPtrNotNull(tc, bt_blockpool_alloc(bp));
+    bt_blockpool_free(bp);
+}
@@ -0,0 +1,122 @@
+
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_diskmem.h"
+#include "bt_diskasync.h"
+#include "bt_blockpool.h"
+
+typedef struct
+{
+    int ndone;
+    int ok;
+    char data[32];
+} done_t;
+
+static void __done(void *cb_udata, const bt_block_t * blk, const void *data,
+                   int ok)
+{
+    done_t* d = cb_udata;
+
+    d->ndone++;
+    d->ok = ok;
+    if (data)
+        memcpy(d->data, data, blk->len);
+}
+
+void TestBTDiskasync_write_is_done_on_poll(CuTest * tc)
+{
+    void* dc = bt_diskmem_new();
+    void* da;
+    bt_blockrw_async_i* iarw;
+    bt_block_t blk = { .piece_idx = 0, .offset = 0, .len = 5 };
+    done_t d;
+
+    memset(&d, 0, sizeof(d));
+    bt_diskmem_set_size(dc, 10);
+    da = bt_diskasync_new(bt_diskmem_get_blockrw(dc), dc);
+    iarw = bt_diskasync_get_blockrw_async(da);
+
+    CuAssertTrue(tc, 1 == iarw->submit_write(da, &blk, "abcde", __done, &d));
+    CuAssertTrue(tc, 0 == d.ndone);
+    CuAssertTrue(tc, 1 == iarw->poll(da, 0));
+    CuAssertTrue(tc, 1 == d.ndone);
+    CuAssertTrue(tc, 1 == d.ok);
+    bt_diskasync_free(da);
+    bt_diskmem_free(dc);
+}
+
+void TestBTDiskasync_read_gets_written_data(CuTest * tc)
+{
+    void* dc = bt_diskmem_new();
+    void* da;
+    bt_blockrw_async_i* iarw;
+    bt_block_t blk = { .piece_idx = 1, .offset = 2, .len = 5 };
+    done_t d;
+
+    memset(&d, 0, sizeof(d));
+    bt_diskmem_set_size(dc, 10);
+    da = bt_diskasync_new(bt_diskmem_get_blockrw(dc), dc);
+    iarw = bt_diskasync_get_blockrw_async(da);
+
+    iarw->submit_write(da, &blk, "abcde", __done, &d);
+    iarw->submit_read(da, &blk, __done, &d);
+    CuAssertTrue(tc, 2 == iarw->poll(da, 1));
+    CuAssertTrue(tc, 1 == d.ok);
+    CuAssertTrue(tc, 0 == strncmp("abcde", d.data, 5));
+    bt_diskasync_free(da);
+    bt_diskmem_free(dc);
+}
+
+typedef struct
+{
+    void* bp;
+    const void* data;
+} keep_t;
+
+static void __keep(void *cb_udata, const bt_block_t * blk, const void *data,
+                   int ok)
+{
+    keep_t* k = cb_udata;
+
+    k->data = data;
+    bt_blockpool_ref(k->bp, data);
+}
+
+void TestBTDiskasync_read_data_can_be_kept_from_blockpool(CuTest * tc)
+{
+    void* dc = bt_diskmem_new();
+    void* bp = bt_blockpool_new(1 << 21);
+    void* da;
+    bt_blockrw_async_i* iarw;
+    bt_block_t blk = { .piece_idx = 0, .offset = 0, .len = 5 };
+    bt_blockpool_stats_t s;
+    keep_t k = { .bp = bp, .data = NULL };
+
+    bt_diskmem_set_size(dc, 10);
+    da = bt_diskasync_new(bt_diskmem_get_blockrw(dc), dc);
+    bt_diskasync_set_blockpool(da, bp);
+    iarw = bt_diskasync_get_blockrw_async(da);
+
+    iarw->submit_write(da, &blk, "abcde", NULL, NULL);
+    iarw->submit_read(da, &blk, __keep, &k);
+    iarw->poll(da, 1);
+    CuAssertTrue(tc, 1 == bt_blockpool_owns(bp, k.data));
+    CuAssertTrue(tc, 0 == strncmp("abcde", k.data, 5));
+    bt_blockpool_get_stats(bp, &s);
+    CuAssertIntEquals(tc, 1, s.in_use);
+
+    bt_blockpool_unref(bp, k.data);
+    bt_blockpool_get_stats(bp, &s);
+    CuAssertIntEquals(tc, 0, s.in_use);
+    bt_diskasync_free(da);
+    bt_blockpool_free(bp);
+    bt_diskmem_free(dc);
+}
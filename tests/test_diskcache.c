@@ -0,0 +1,480 @@
+
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_diskmem.h"
+#include "bt_diskcache.h"
+#include "bt_blockpool.h"
+
+#define BLOCK_LEN (BT_BLOCK_SIZE)
+
+/* pieces are 4 blocks */
+#define PIECE_LEN (BLOCK_LEN * 4)
+
+typedef struct
+{
+    void* dm;
+    int nreads;
+    int nwrites;
+    int nprefetches;
+
+    /* writes fail */
+    int fail;
+
+    /* bytes read from disk */
+    int read_bytes;
+} disk_t;
+
+static int __disk_write(void *udata, void *caller, const bt_block_t * blk,
+                        const void *blkdata)
+{
+    disk_t* d = udata;
+
+    d->nwrites++;
+    if (d->fail)
+        return 0;
+    return bt_diskmem_get_blockrw(d->dm)->write_block(d->dm, caller, blk,
+                                                      blkdata);
+}
+
+static void *__disk_read(void *udata, void *caller, const bt_block_t * blk)
+{
+    disk_t* d = udata;
+
+    d->nreads++;
+    d->read_bytes += blk->len;
+    return bt_diskmem_get_blockrw(d->dm)->read_block(d->dm, caller, blk);
+}
+
+static void __disk_prefetch(void *udata, void *caller, const bt_block_t * blk)
+{
+    disk_t* d = udata;
+
+    d->nprefetches++;
+}
+
+static int __disk_block_fd(void *udata, const bt_block_t * blk,
+                           uint64_t *offset)
+{
+    *offset = (uint64_t)blk->piece_idx * PIECE_LEN + blk->offset;
+    return 99;
+}
+
+static bt_blockrw_i __disk_irw = {
+    .write_block = __disk_write,
+    .read_block = __disk_read,
+    .prefetch_block = __disk_prefetch,
+    .block_fd = __disk_block_fd
+};
+
+/**
+ * A cache with room for four pieces */
+static void* __new(disk_t* d)
+{
+    void* dc = bt_diskcache_new();
+
+    memset(d, 0, sizeof(disk_t));
+    d->dm = bt_diskmem_new();
+    bt_diskmem_set_size(d->dm, PIECE_LEN);
+    bt_diskcache_set_piece_length(dc, PIECE_LEN);
+    bt_diskcache_set_budget(dc, PIECE_LEN * 4);
+    bt_diskcache_set_dirty_watermarks(dc, PIECE_LEN * 4, PIECE_LEN * 4);
+    bt_diskcache_set_disk_blockrw(dc, &__disk_irw, d);
+    return dc;
+}
+
+static void __free(void* dc, disk_t* d)
+{
+    bt_diskcache_free(dc);
+    bt_diskmem_free(d->dm);
+}
+
+static void __read(void* dc, const int idx)
+{
+    bt_block_t blk = { .piece_idx = idx, .offset = 0, .len = PIECE_LEN };
+
+    bt_diskcache_get_blockrw(dc)->read_block(dc, NULL, &blk);
+}
+
+static int __write(void* dc, const int idx, const int block, const char c)
+{
+    static char data[BLOCK_LEN];
+    bt_block_t blk = { .piece_idx = idx, .offset = block * BLOCK_LEN,
+                       .len = BLOCK_LEN };
+
+    memset(data, c, BLOCK_LEN);
+    return bt_diskcache_get_blockrw(dc)->write_block(dc, NULL, &blk, data);
+}
+
+/**
+ * @return the byte on disk */
+static char __on_disk(disk_t* d, const int idx, const int offset)
+{
+    bt_block_t blk = { .piece_idx = idx, .offset = offset, .len = 1 };
+
+    return *(char*)bt_diskmem_get_blockrw(d->dm)->read_block(d->dm, NULL, &blk);
+}
+
+void TestBTDiskcache_read_after_write_is_cached(CuTest * tc)
+{
+    disk_t d;
+    void* dc = __new(&d);
+    bt_block_t blk = { .piece_idx = 1, .offset = BLOCK_LEN, .len = 5 };
+    bt_diskcache_stats_t s;
+
+    CuAssertTrue(tc, 1 == __write(dc, 1, 1, 'a'));
+    CuAssertTrue(tc, 0 == strncmp("aaaaa",
+                 bt_diskcache_get_blockrw(dc)->read_block(dc, NULL, &blk), 5));
+    bt_diskcache_get_stats(dc, &s);
+    CuAssertTrue(tc, 1 == s.hits);
+    CuAssertTrue(tc, 0 == s.misses);
+    CuAssertTrue(tc, BLOCK_LEN == s.dirty_bytes);
+    CuAssertTrue(tc, 0 == d.nwrites);
+    __free(dc, &d);
+}
+
+void TestBTDiskcache_flush_writes_only_dirty_blocks(CuTest * tc)
+{
+    disk_t d;
+    void* dc = __new(&d);
+    bt_block_t blk = { .piece_idx = 1, .offset = 0, .len = PIECE_LEN };
+
+    CuAssertTrue(tc, 1 == __write(dc, 1, 1, 'a'));
+    CuAssertTrue(tc, 1 == bt_diskcache_get_blockrw(dc)->flush_block(dc, NULL,
+                                                                     &blk));
+    CuAssertTrue(tc, 1 == d.nwrites);
+    CuAssertTrue(tc, 0 == __on_disk(&d, 1, 0));
+    CuAssertTrue(tc, 'a' == __on_disk(&d, 1, BLOCK_LEN));
+    CuAssertTrue(tc, 0 == __on_disk(&d, 1, BLOCK_LEN * 2));
+    __free(dc, &d);
+}
+
+void TestBTDiskcache_dirty_runs_are_written_together(CuTest * tc)
+{
+    disk_t d;
+    void* dc = __new(&d);
+    bt_diskcache_stats_t s;
+
+    __write(dc, 0, 0, 'a');
+    __write(dc, 0, 1, 'b');
+    __write(dc, 0, 3, 'd');
+    bt_diskcache_disk_dump(dc);
+    bt_diskcache_get_stats(dc, &s);
+    CuAssertTrue(tc, 2 == d.nwrites);
+    CuAssertTrue(tc, 2 == s.writebacks);
+    CuAssertTrue(tc, 0 == s.dirty_bytes);
+    CuAssertTrue(tc, 'b' == __on_disk(&d, 0, BLOCK_LEN));
+    CuAssertTrue(tc, 'd' == __on_disk(&d, 0, BLOCK_LEN * 3));
+    __free(dc, &d);
+}
+
+void TestBTDiskcache_partial_block_write_goes_to_disk(CuTest * tc)
+{
+    disk_t d;
+    void* dc = __new(&d);
+    bt_block_t blk = { .piece_idx = 0, .offset = 2, .len = 5 };
+    bt_diskcache_stats_t s;
+
+    CuAssertTrue(tc, 1 == bt_diskcache_get_blockrw(dc)->write_block(dc, NULL,
+                                                                     &blk, "abcde"));
+    bt_diskcache_get_stats(dc, &s);
+    CuAssertTrue(tc, 1 == d.nwrites);
+    CuAssertTrue(tc, 0 == s.dirty_bytes);
+    CuAssertTrue(tc, 'a' == __on_disk(&d, 0, 2));
+    __free(dc, &d);
+}
+
+void TestBTDiskcache_budget_limits_pieces(CuTest * tc)
+{
+    disk_t d;
+    void* dc = __new(&d);
+    bt_diskcache_stats_t s;
+    int i;
+
+    for (i = 0; i < 8; i++)
+        __read(dc, i);
+    bt_diskcache_get_stats(dc, &s);
+    CuAssertTrue(tc, 8 == s.misses);
+    CuAssertTrue(tc, 4 == s.evictions);
+    __free(dc, &d);
+}
+
+void TestBTDiskcache_evicted_dirty_piece_is_written(CuTest * tc)
+{
+    disk_t d;
+    void* dc = __new(&d);
+    int i;
+
+    __write(dc, 0, 0, 'x');
+    for (i = 1; i < 8; i++)
+        __read(dc, i);
+    CuAssertTrue(tc, 1 == d.nwrites);
+    CuAssertTrue(tc, 'x' == __on_disk(&d, 0, 0));
+    __free(dc, &d);
+}
+
+void TestBTDiskcache_scan_doesnt_flush_hot_pieces(CuTest * tc)
+{
+    disk_t d;
+    void* dc = __new(&d);
+    bt_diskcache_stats_t s;
+    int i;
+
+    /* make room on disk for 20 pieces */
+    __write(dc, 19, 0, 'z');
+
+    /* pieces 0 and 1 are asked for again after falling off A1in */
+    __read(dc, 0);
+    __read(dc, 1);
+    __read(dc, 2);
+    __read(dc, 3);
+    __read(dc, 4);
+    __read(dc, 0);
+    __read(dc, 1);
+
+    /* someone reads a lot of other pieces once */
+    for (i = 5; i < 19; i++)
+        __read(dc, i);
+
+    __read(dc, 0);
+    __read(dc, 1);
+    bt_diskcache_get_stats(dc, &s);
+    CuAssertTrue(tc, 2 == s.hits);
+    CuAssertTrue(tc, 21 == s.misses);
+    __free(dc, &d);
+}
+
+void TestBTDiskcache_writes_past_high_watermark_are_written_back(CuTest * tc)
+{
+    disk_t d;
+    void* dc = __new(&d);
+    bt_diskcache_stats_t s;
+
+    bt_diskcache_set_dirty_watermarks(dc, 0, BLOCK_LEN);
+    __write(dc, 0, 0, 'a');
+    __write(dc, 1, 0, 'b');
+    __write(dc, 2, 0, 'c');
+    bt_diskcache_get_stats(dc, &s);
+    CuAssertTrue(tc, s.dirty_bytes <= BLOCK_LEN);
+    CuAssertTrue(tc, 2 == d.nwrites);
+    CuAssertTrue(tc, 0 == bt_diskcache_is_congested(dc));
+    __free(dc, &d);
+}
+
+/**
+ * Wait for the write-behind thread to get the dirty bytes down
+ * @return 1 if it did; otherwise 0 */
+static int __wait_for_dirty_bytes(void* dc, const uint64_t dirty_bytes)
+{
+    bt_diskcache_stats_t s;
+    int i;
+
+    for (i = 0; i < 1000; i++)
+    {
+        bt_diskcache_get_stats(dc, &s);
+        if (s.dirty_bytes <= dirty_bytes)
+            return 1;
+        usleep(1000);
+    }
+
+    return 0;
+}
+
+void TestBTDiskcache_writebehind_writes_dirty_blocks(CuTest * tc)
+{
+    disk_t d;
+    void* dc = __new(&d);
+
+    bt_diskcache_set_dirty_watermarks(dc, 0, PIECE_LEN * 4);
+    CuAssertTrue(tc, 1 == bt_diskcache_set_writebehind(dc, 1));
+    __write(dc, 0, 0, 'a');
+    __write(dc, 3, 2, 'b');
+    CuAssertTrue(tc, 1 == __wait_for_dirty_bytes(dc, 0));
+
+    /* wait for the last write to finish */
+    bt_diskcache_set_writebehind(dc, 0);
+    CuAssertTrue(tc, 2 == d.nwrites);
+    CuAssertTrue(tc, 'a' == __on_disk(&d, 0, 0));
+    CuAssertTrue(tc, 'b' == __on_disk(&d, 3, BLOCK_LEN * 2));
+    __free(dc, &d);
+}
+
+void TestBTDiskcache_flush_reports_failed_writebehind(CuTest * tc)
+{
+    disk_t d;
+    void* dc = __new(&d);
+    bt_block_t blk = { .piece_idx = 0, .offset = 0, .len = PIECE_LEN };
+    bt_blockrw_i* irw = bt_diskcache_get_blockrw(dc);
+
+    d.fail = 1;
+    bt_diskcache_set_dirty_watermarks(dc, 0, PIECE_LEN * 4);
+    CuAssertTrue(tc, 1 == bt_diskcache_set_writebehind(dc, 1));
+    CuAssertTrue(tc, 1 == __write(dc, 0, 0, 'a'));
+    CuAssertTrue(tc, 1 == __write(dc, 1, 0, 'b'));
+    CuAssertTrue(tc, 1 == __wait_for_dirty_bytes(dc, 0));
+    bt_diskcache_set_writebehind(dc, 0);
+    d.fail = 0;
+
+    /* nothing is dirty any more, but the data never got to disk */
+    CuAssertTrue(tc, 0 == irw->flush_block(dc, NULL, &blk));
+
+    /* reported once */
+    CuAssertTrue(tc, 1 == irw->flush_block(dc, NULL, &blk));
+
+    /* a flush of other bytes doesn't see it */
+    blk.piece_idx = 1;
+    blk.offset = BLOCK_LEN;
+    blk.len = BLOCK_LEN;
+    CuAssertTrue(tc, 1 == irw->flush_block(dc, NULL, &blk));
+    blk.offset = 0;
+    CuAssertTrue(tc, 0 == irw->flush_block(dc, NULL, &blk));
+    __free(dc, &d);
+}
+
+void TestBTDiskcache_flush_reports_failed_eviction(CuTest * tc)
+{
+    disk_t d;
+    void* dc = __new(&d);
+    bt_block_t blk = { .piece_idx = 0, .offset = 0, .len = PIECE_LEN };
+    int i;
+
+    d.fail = 1;
+    __write(dc, 0, 0, 'x');
+    for (i = 1; i < 8; i++)
+        __read(dc, i);
+    CuAssertTrue(tc, 1 == d.nwrites);
+    d.fail = 0;
+
+    CuAssertTrue(tc, 0 == bt_diskcache_get_blockrw(dc)->flush_block(dc, NULL,
+                                                                     &blk));
+    __free(dc, &d);
+}
+
+void TestBTDiskcache_congested_above_high_watermark(CuTest * tc)
+{
+    disk_t d;
+    void* dc = __new(&d);
+
+    /* the write-behind thread won't start until the low watermark */
+    bt_diskcache_set_dirty_watermarks(dc, PIECE_LEN * 4, BLOCK_LEN);
+    CuAssertTrue(tc, 1 == bt_diskcache_set_writebehind(dc, 1));
+    __write(dc, 0, 0, 'a');
+    CuAssertTrue(tc, 0 == bt_diskcache_is_congested(dc));
+    __write(dc, 0, 1, 'a');
+    CuAssertTrue(tc, 1 == bt_diskcache_is_congested(dc));
+
+    bt_diskcache_set_dirty_watermarks(dc, 0, BLOCK_LEN);
+    CuAssertTrue(tc, 1 == __wait_for_dirty_bytes(dc, 0));
+    CuAssertTrue(tc, 0 == bt_diskcache_is_congested(dc));
+    __free(dc, &d);
+}
+
+void TestBTDiskcache_prefetch_is_only_passed_on_for_uncached_pieces(CuTest * tc)
+{
+    disk_t d;
+    void* dc = __new(&d);
+    bt_block_t blk = { .piece_idx = 0, .offset = 0, .len = PIECE_LEN };
+
+    bt_diskcache_get_blockrw(dc)->prefetch_block(dc, NULL, &blk);
+    CuAssertIntEquals(tc, 1, d.nprefetches);
+
+    __write(dc, 0, 0, 'a');
+    __write(dc, 0, 1, 'a');
+    __write(dc, 0, 2, 'a');
+    __write(dc, 0, 3, 'a');
+    bt_diskcache_get_blockrw(dc)->prefetch_block(dc, NULL, &blk);
+    CuAssertIntEquals(tc, 1, d.nprefetches);
+    __free(dc, &d);
+}
+
+void TestBTDiskcache_read_miss_only_reads_requested_block(CuTest * tc)
+{
+    disk_t d;
+    void* dc = __new(&d);
+    bt_block_t blk = { .piece_idx = 0, .offset = BLOCK_LEN, .len = BLOCK_LEN };
+    bt_blockrw_i* irw = bt_diskcache_get_blockrw(dc);
+
+    bt_diskmem_set_size(d.dm, PIECE_LEN);
+    irw->read_block(dc, NULL, &blk);
+    CuAssertIntEquals(tc, 1, d.nreads);
+    CuAssertIntEquals(tc, BLOCK_LEN, d.read_bytes);
+
+    /* now cached */
+    irw->read_block(dc, NULL, &blk);
+    CuAssertIntEquals(tc, 1, d.nreads);
+
+    /* only the rest of the piece is read */
+    __read(dc, 0);
+    CuAssertIntEquals(tc, PIECE_LEN, d.read_bytes);
+    __free(dc, &d);
+}
+
+void TestBTDiskcache_readahead_reads_whole_piece_on_miss(CuTest * tc)
+{
+    disk_t d;
+    void* dc = __new(&d);
+    bt_block_t blk = { .piece_idx = 0, .offset = BLOCK_LEN, .len = BLOCK_LEN };
+    bt_blockrw_i* irw = bt_diskcache_get_blockrw(dc);
+
+    bt_diskcache_set_readahead(dc, 1);
+    irw->read_block(dc, NULL, &blk);
+    CuAssertIntEquals(tc, PIECE_LEN, d.read_bytes);
+
+    blk.offset = BLOCK_LEN * 3;
+    irw->read_block(dc, NULL, &blk);
+    CuAssertIntEquals(tc, 1, d.nreads);
+    __free(dc, &d);
+}
+
+void TestBTDiskcache_no_block_fd_while_block_is_dirty(CuTest * tc)
+{
+    disk_t d;
+    void* dc = __new(&d);
+    bt_block_t blk = { .piece_idx = 1, .offset = BLOCK_LEN, .len = BLOCK_LEN };
+    bt_blockrw_i* irw = bt_diskcache_get_blockrw(dc);
+    uint64_t offset;
+
+    bt_diskmem_set_size(d.dm, PIECE_LEN * 2);
+    __write(dc, 1, 1, 'a');
+    CuAssertIntEquals(tc, -1, irw->block_fd(dc, &blk, &offset));
+
+    /* other blocks of the piece are fine */
+    blk.offset = 0;
+    CuAssertIntEquals(tc, 99, irw->block_fd(dc, &blk, &offset));
+
+    blk.offset = BLOCK_LEN;
+    irw->flush_block(dc, NULL, &blk);
+    CuAssertIntEquals(tc, 99, irw->block_fd(dc, &blk, &offset));
+    CuAssertTrue(tc, PIECE_LEN + BLOCK_LEN == offset);
+    __free(dc, &d);
+}
+
+void TestBTDiskcache_slots_come_from_blockpool(CuTest * tc)
+{
+    disk_t d;
+    void* dc = __new(&d);
+    void* bp = bt_blockpool_new(1 << 21);
+    bt_block_t blk = { .piece_idx = 1, .offset = BLOCK_LEN, .len = 5 };
+    bt_blockpool_stats_t s;
+
+    bt_diskcache_set_blockpool(dc, bp);
+    CuAssertTrue(tc, 1 == __write(dc, 1, 1, 'a'));
+    CuAssertTrue(tc, 0 == strncmp("aaaaa",
+                 bt_diskcache_get_blockrw(dc)->read_block(dc, NULL, &blk), 5));
+    bt_blockpool_get_stats(bp, &s);
+    CuAssertIntEquals(tc, 1, s.nslabs_span);
+
+    /* the cache has all of the pool */
+    CuAssertTrue(tc, NULL == bt_blockpool_alloc(bp));
+
+    __free(dc, &d);
+    bt_blockpool_free(bp);
+}
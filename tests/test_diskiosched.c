@@ -0,0 +1,264 @@
+
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_diskmem.h"
+#include "bt_diskiosched.h"
+#include "bt_filedumper.h"
+
+#define PIECE_LEN 40
+
+typedef struct
+{
+    void* dm;
+
+    /* offsets of writes, in the order they were made */
+    unsigned int offs[32];
+    int nwrites;
+
+    /* buffers in the last writev */
+    int iovcnt;
+
+    /* writes to this piece + 1 fail; 0 for none */
+    int fail_piece;
+} disk_t;
+
+static int __disk_write(void *udata, void *caller, const bt_block_t * blk,
+                        const void *blkdata)
+{
+    disk_t* d = udata;
+
+    d->offs[d->nwrites++] = blk->piece_idx * PIECE_LEN + blk->offset;
+    d->iovcnt = 1;
+    if (d->fail_piece == blk->piece_idx + 1)
+        return 0;
+    return bt_diskmem_get_blockrw(d->dm)->write_block(d->dm, caller, blk,
+                                                      blkdata);
+}
+
+static int __disk_writev(void *udata, void *caller, const bt_block_t * blk,
+                         const bt_iovec_t * iov, const int iovcnt)
+{
+    disk_t* d = udata;
+    bt_block_t b = *blk;
+    int i;
+
+    d->offs[d->nwrites++] = blk->piece_idx * PIECE_LEN + blk->offset;
+    d->iovcnt = iovcnt;
+    for (i = 0; i < iovcnt; i++)
+    {
+        b.len = iov[i].len;
+        bt_diskmem_get_blockrw(d->dm)->write_block(d->dm, caller, &b,
+                                                   iov[i].data);
+        b.offset += b.len;
+    }
+    return 1;
+}
+
+static void *__disk_read(void *udata, void *caller, const bt_block_t * blk)
+{
+    disk_t* d = udata;
+
+    return bt_diskmem_get_blockrw(d->dm)->read_block(d->dm, caller, blk);
+}
+
+static bt_blockrw_i __disk_irw = {
+    .write_block = __disk_write,
+    .read_block = __disk_read,
+    .write_blockv = __disk_writev
+};
+
+static void* __new(disk_t* d)
+{
+    void* dio = bt_diskiosched_new();
+
+    memset(d, 0, sizeof(disk_t));
+    d->dm = bt_diskmem_new();
+    bt_diskmem_set_size(d->dm, PIECE_LEN);
+    bt_diskiosched_set_piece_length(dio, PIECE_LEN);
+    bt_diskiosched_set_disk_blockrw(dio, &__disk_irw, d);
+    return dio;
+}
+
+static void __free(void* dio, disk_t* d)
+{
+    bt_diskiosched_free(dio);
+    bt_diskmem_free(d->dm);
+}
+
+static int __write(void* dio, const int idx, const int offset, const char* s)
+{
+    bt_block_t blk = { .piece_idx = idx, .offset = offset, .len = strlen(s) };
+
+    return bt_diskiosched_get_blockrw(dio)->write_block(dio, NULL, &blk, s);
+}
+
+void TestBTDiskiosched_writes_wait_for_dispatch(CuTest * tc)
+{
+    disk_t d;
+    void* dio = __new(&d);
+
+    CuAssertTrue(tc, 1 == __write(dio, 2, 0, "abc"));
+    CuAssertIntEquals(tc, 0, d.nwrites);
+    CuAssertTrue(tc, 1 == bt_diskiosched_dispatch(dio));
+    CuAssertIntEquals(tc, 1, d.nwrites);
+    __free(dio, &d);
+}
+
+void TestBTDiskiosched_writes_are_dispatched_in_order(CuTest * tc)
+{
+    disk_t d;
+    void* dio = __new(&d);
+
+    __write(dio, 3, 10, "a");
+    __write(dio, 0, 5, "b");
+    __write(dio, 1, 20, "c");
+    __write(dio, 0, 30, "d");
+    bt_diskiosched_dispatch(dio);
+    CuAssertIntEquals(tc, 4, d.nwrites);
+    CuAssertIntEquals(tc, 5, d.offs[0]);
+    CuAssertIntEquals(tc, 30, d.offs[1]);
+    CuAssertIntEquals(tc, 60, d.offs[2]);
+    CuAssertIntEquals(tc, 130, d.offs[3]);
+    __free(dio, &d);
+}
+
+void TestBTDiskiosched_adjacent_writes_are_merged(CuTest * tc)
+{
+    disk_t d;
+    void* dio = __new(&d);
+    bt_diskiosched_stats_t s;
+    bt_block_t blk = { .piece_idx = 0, .offset = 35, .len = 15 };
+
+    /* the run crosses from piece 0 into piece 1 */
+    __write(dio, 1, 5, "fghij");
+    __write(dio, 0, 35, "abcde");
+    __write(dio, 1, 0, "12345");
+    bt_diskiosched_get_stats(dio, &s);
+    CuAssertIntEquals(tc, 3, s.depth);
+    CuAssertTrue(tc, 15 == s.depth_bytes);
+
+    bt_diskiosched_dispatch(dio);
+    CuAssertIntEquals(tc, 1, d.nwrites);
+    CuAssertIntEquals(tc, 3, d.iovcnt);
+    CuAssertIntEquals(tc, 35, d.offs[0]);
+    CuAssertTrue(tc, 0 == strncmp("abcde12345fghij",
+                 __disk_read(&d, NULL, &blk), 15));
+
+    bt_diskiosched_get_stats(dio, &s);
+    CuAssertIntEquals(tc, 0, s.depth);
+    CuAssertIntEquals(tc, 3, s.max_depth);
+    CuAssertTrue(tc, 3 == s.writes_in);
+    CuAssertTrue(tc, 1 == s.writes_out);
+    __free(dio, &d);
+}
+
+void TestBTDiskiosched_full_batch_is_dispatched(CuTest * tc)
+{
+    disk_t d;
+    void* dio = __new(&d);
+
+    bt_diskiosched_set_batch(dio, 10);
+    __write(dio, 0, 0, "abcde");
+    CuAssertIntEquals(tc, 0, d.nwrites);
+    __write(dio, 1, 0, "fghij");
+    CuAssertIntEquals(tc, 2, d.nwrites);
+    __free(dio, &d);
+}
+
+void TestBTDiskiosched_read_sees_queued_write(CuTest * tc)
+{
+    disk_t d;
+    void* dio = __new(&d);
+    bt_block_t blk = { .piece_idx = 0, .offset = 2, .len = 2 };
+
+    __write(dio, 0, 0, "abcde");
+    CuAssertTrue(tc, 0 == strncmp("cd",
+                 bt_diskiosched_get_blockrw(dio)->read_block(dio, NULL, &blk),
+                 2));
+    __free(dio, &d);
+}
+
+void TestBTDiskiosched_later_overlapping_write_wins(CuTest * tc)
+{
+    disk_t d;
+    void* dio = __new(&d);
+    bt_block_t blk = { .piece_idx = 0, .offset = 0, .len = 5 };
+
+    __write(dio, 0, 0, "abcde");
+    __write(dio, 0, 2, "XY");
+    bt_diskiosched_dispatch(dio);
+    CuAssertTrue(tc, 0 == strncmp("abXYe", __disk_read(&d, NULL, &blk), 5));
+    __free(dio, &d);
+}
+
+void TestBTDiskiosched_merged_writes_reach_files(CuTest * tc)
+{
+    const char* data = "0123456789abcdefghijklmnopqrst";
+    void* fd = bt_filedumper_new();
+    void* dio = bt_diskiosched_new();
+    bt_block_t blk = { .piece_idx = 0, .offset = 0, .len = 30 };
+    bt_diskiosched_stats_t s;
+    char chunk[6];
+    int i;
+
+    unlink("test_diskiosched.a");
+    unlink("test_diskiosched.b");
+    bt_filedumper_set_piece_length(fd, 10);
+    bt_filedumper_add_file(fd, "test_diskiosched.a",
+                           strlen("test_diskiosched.a"), 12);
+    bt_filedumper_add_file(fd, "test_diskiosched.b",
+                           strlen("test_diskiosched.b"), 18);
+    bt_diskiosched_set_piece_length(dio, 10);
+    bt_diskiosched_set_disk_blockrw(dio, bt_filedumper_get_blockrw(fd), fd);
+
+    /* backwards, 5 bytes at a time */
+    for (i = 5; 0 <= i; i--)
+    {
+        sprintf(chunk, "%.5s", data + i * 5);
+        __write(dio, i / 2, i % 2 * 5, chunk);
+    }
+
+    bt_diskiosched_dispatch(dio);
+    bt_diskiosched_get_stats(dio, &s);
+    CuAssertTrue(tc, 6 == s.writes_in);
+    CuAssertTrue(tc, 1 == s.writes_out);
+    CuAssertTrue(tc, 0 == memcmp(data,
+                 bt_filedumper_read_block(fd, NULL, &blk), 30));
+
+    bt_diskiosched_free(dio);
+    bt_filedumper_free(fd);
+    unlink("test_diskiosched.a");
+    unlink("test_diskiosched.b");
+}
+
+void TestBTDiskiosched_failed_write_is_reported_by_its_flush(CuTest * tc)
+{
+    bt_block_t blk = { .offset = 0, .len = PIECE_LEN };
+    disk_t d;
+    void* dio = __new(&d);
+
+    d.fail_piece = 3 + 1;
+    CuAssertTrue(tc, 1 == __write(dio, 1, 0, "a"));
+    CuAssertTrue(tc, 1 == __write(dio, 3, 0, "b"));
+    CuAssertTrue(tc, 0 == bt_diskiosched_dispatch(dio));
+
+    /* only the owner of the failed bytes hears about it, and only once */
+    blk.piece_idx = 1;
+    CuAssertTrue(tc, 1 == bt_diskiosched_get_blockrw(dio)->flush_block(
+                     dio, NULL, &blk));
+    blk.piece_idx = 3;
+    CuAssertTrue(tc, 0 == bt_diskiosched_get_blockrw(dio)->flush_block(
+                     dio, NULL, &blk));
+    CuAssertTrue(tc, 1 == bt_diskiosched_get_blockrw(dio)->flush_block(
+                     dio, NULL, &blk));
+    __free(dio, &d);
+}
@@ -0,0 +1,135 @@
+
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_diskmem.h"
+#include "bt_blockpool.h"
+
+static int __write(void* dm, const int idx, const int offset, const char* s)
+{
+    bt_block_t blk = { .piece_idx = idx, .offset = offset, .len = strlen(s) };
+
+    return bt_diskmem_get_blockrw(dm)->write_block(dm, NULL, &blk, s);
+}
+
+static char* __read(void* dm, const int idx, const int offset, const int len)
+{
+    bt_block_t blk = { .piece_idx = idx, .offset = offset, .len = len };
+
+    return bt_diskmem_get_blockrw(dm)->read_block(dm, NULL, &blk);
+}
+
+void TestBTDiskmem_grows_for_writes_past_end(CuTest * tc)
+{
+    void* dm = bt_diskmem_new();
+
+    bt_diskmem_set_size(dm, 10);
+    CuAssertTrue(tc, NULL == __read(dm, 50, 0, 5));
+    CuAssertTrue(tc, 1 == __write(dm, 50, 0, "abcde"));
+    CuAssertTrue(tc, 1 == __write(dm, 20, 5, "fghij"));
+    CuAssertTrue(tc, 0 == strncmp("abcde", __read(dm, 50, 0, 5), 5));
+    CuAssertTrue(tc, 0 == strncmp("fghij", __read(dm, 20, 5, 5), 5));
+
+    /* never written */
+    CuAssertTrue(tc, NULL == __read(dm, 51, 0, 5));
+    bt_diskmem_free(dm);
+}
+
+void TestBTDiskmem_total_size_is_allocated_once(CuTest * tc)
+{
+    void* dm = bt_diskmem_new();
+    char* start;
+
+    bt_diskmem_set_size(dm, 10);
+    CuAssertTrue(tc, 1 == bt_diskmem_set_total_size(dm, 1000));
+    start = __read(dm, 0, 0, 1);
+    CuAssertTrue(tc, 0 == *start);
+
+    CuAssertTrue(tc, 1 == __write(dm, 99, 5, "abcde"));
+    CuAssertTrue(tc, 0 == __write(dm, 99, 6, "abcde"));
+    CuAssertTrue(tc, 0 == __write(dm, 100, 0, "a"));
+    CuAssertTrue(tc, start + 995 == __read(dm, 99, 5, 5));
+    CuAssertTrue(tc, BT_DISKMEM_BACKING_HEAP == bt_diskmem_get_backing(dm));
+    bt_diskmem_free(dm);
+}
+
+void TestBTDiskmem_hugepage_backing_holds_data(CuTest * tc)
+{
+    void* dm = bt_diskmem_new();
+
+    bt_diskmem_set_size(dm, 1 << 20);
+    bt_diskmem_set_backing(dm, BT_DISKMEM_BACKING_HUGEPAGES);
+    CuAssertTrue(tc, 1 == bt_diskmem_set_total_size(dm, 1 << 22));
+    CuAssertTrue(tc, 1 == __write(dm, 3, 100, "abcde"));
+    CuAssertTrue(tc, 0 == strncmp("abcde", __read(dm, 3, 100, 5), 5));
+    bt_diskmem_free(dm);
+}
+
+void TestBTDiskmem_memfd_backing_gives_block_fd(CuTest * tc)
+{
+    void* dm = bt_diskmem_new();
+    bt_block_t blk = { .piece_idx = 2, .offset = 3, .len = 5 };
+    uint64_t offset;
+    char out[5];
+    int fd;
+
+    bt_diskmem_set_size(dm, 10);
+    bt_diskmem_set_backing(dm, BT_DISKMEM_BACKING_MEMFD);
+    CuAssertTrue(tc, 1 == bt_diskmem_set_total_size(dm, 100));
+
+    /* no memfd here; nothing to test */
+    if (BT_DISKMEM_BACKING_MEMFD != bt_diskmem_get_backing(dm))
+    {
+        bt_diskmem_free(dm);
+        return;
+    }
+
+    __write(dm, 2, 3, "abcde");
+    fd = bt_diskmem_get_blockrw(dm)->block_fd(dm, &blk, &offset);
+    CuAssertTrue(tc, -1 != fd);
+    CuAssertTrue(tc, 23 == offset);
+    CuAssertTrue(tc, 5 == pread(fd, out, 5, offset));
+    CuAssertTrue(tc, 0 == strncmp("abcde", out, 5));
+    bt_diskmem_free(dm);
+}
+
+void TestBTDiskmem_heap_backing_has_no_block_fd(CuTest * tc)
+{
+    void* dm = bt_diskmem_new();
+    bt_block_t blk = { .piece_idx = 0, .offset = 0, .len = 5 };
+    uint64_t offset;
+
+    bt_diskmem_set_size(dm, 10);
+    CuAssertTrue(tc, -1 == bt_diskmem_get_blockrw(dm)->block_fd(dm, &blk,
+                                                              &offset));
+    bt_diskmem_free(dm);
+}
+
+void TestBTDiskmem_blockpool_backing_is_capped_by_pool(CuTest * tc)
+{
+    void* dm = bt_diskmem_new();
+    void* bp = bt_blockpool_new(1 << 22);
+
+    bt_diskmem_set_blockpool(dm, bp);
+    bt_diskmem_set_size(dm, 1 << 16);
+    CuAssertTrue(tc, BT_DISKMEM_BACKING_BLOCKPOOL == bt_diskmem_get_backing(dm));
+    CuAssertTrue(tc, 1 == __write(dm, 0, 0, "abcde"));
+
+    /* grows within the pool, keeping what was written */
+    CuAssertTrue(tc, 1 == __write(dm, 15, 0, "fghij"));
+    CuAssertTrue(tc, 0 == strncmp("abcde", __read(dm, 0, 0, 5), 5));
+    CuAssertTrue(tc, 0 == strncmp("fghij", __read(dm, 15, 0, 5), 5));
+
+    /* but not past it; the old memory is held while growing */
+    CuAssertTrue(tc, 0 == __write(dm, 40, 0, "klmno"));
+    bt_diskmem_free(dm);
+    bt_blockpool_free(bp);
+}
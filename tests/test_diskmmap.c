@@ -0,0 +1,150 @@
+
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_diskmmap.h"
+#include "bt_filedumper.h"
+#include "mock_files.h"
+
+#include <sys/stat.h>
+
+static void* __new(void)
+{
+    void* dm = bt_diskmmap_new();
+
+    bt_diskmmap_set_piece_length(dm, MOCK_FILES_PIECE_LEN);
+    mock_files_add(dm, bt_diskmmap_add_file, "test_diskmmap");
+    return dm;
+}
+
+void TestBTDiskmmap_files_are_created_at_full_size(CuTest * tc)
+{
+    void* dm = __new();
+    bt_blockrw_i* irw = bt_diskmmap_get_blockrw(dm);
+    bt_block_t blk = { .piece_idx = 2, .offset = 5, .len = 1 };
+    FILE* f;
+
+    CuAssertTrue(tc, 1 == irw->write_block(dm, NULL, &blk, "x"));
+    f = fopen("test_diskmmap_c.dat", "rb");
+    CuAssertPtrNotNull(tc, f);
+    fseek(f, 0, SEEK_END);
+    CuAssertTrue(tc, 15 == ftell(f));
+    fclose(f);
+    bt_diskmmap_free(dm);
+    mock_files_remove("test_diskmmap");
+}
+
+void TestBTDiskmmap_writes_allocate_their_space(CuTest * tc)
+{
+    bt_block_t blk = { .piece_idx = 3, .offset = 0, .len = 1 };
+    struct stat st;
+    void* dm;
+
+    /* sparse only allocates what was written */
+    dm = bt_diskmmap_new();
+    unlink("test_diskmmap_big.dat");
+    bt_diskmmap_set_piece_length(dm, 1 << 16);
+    bt_diskmmap_add_file(dm, "test_diskmmap_big.dat",
+                         strlen("test_diskmmap_big.dat"), 1 << 20);
+    CuAssertTrue(tc, 1 == bt_diskmmap_get_blockrw(dm)->write_block(
+                     dm, NULL, &blk, "x"));
+    CuAssertTrue(tc, 0 == stat("test_diskmmap_big.dat", &st));
+    CuAssertTrue(tc, 0 < st.st_blocks);
+    CuAssertTrue(tc, (uint64_t)st.st_blocks * 512 < 1 << 20);
+    bt_diskmmap_free(dm);
+
+    dm = bt_diskmmap_new();
+    unlink("test_diskmmap_big.dat");
+    bt_diskmmap_set_piece_length(dm, 1 << 16);
+    bt_diskmmap_set_allocation(dm, BT_FILEDUMPER_ALLOC_FULL);
+    bt_diskmmap_add_file(dm, "test_diskmmap_big.dat",
+                         strlen("test_diskmmap_big.dat"), 1 << 20);
+    CuAssertTrue(tc, 1 == bt_diskmmap_get_blockrw(dm)->write_block(
+                     dm, NULL, &blk, "x"));
+    CuAssertTrue(tc, 0 == stat("test_diskmmap_big.dat", &st));
+    CuAssertTrue(tc, 1 << 20 <= (uint64_t)st.st_blocks * 512);
+    bt_diskmmap_free(dm);
+    unlink("test_diskmmap_big.dat");
+}
+
+void TestBTDiskmmap_read_is_in_place(CuTest * tc)
+{
+    void* dm = __new();
+    bt_blockrw_i* irw = bt_diskmmap_get_blockrw(dm);
+    bt_block_t blk = { .piece_idx = 0, .offset = 2, .len = 5 };
+    char *a, *b;
+
+    CuAssertTrue(tc, 1 == irw->write_block(dm, NULL, &blk, "abcde"));
+    a = irw->read_block(dm, NULL, &blk);
+    CuAssertTrue(tc, 0 == strncmp("abcde", a, 5));
+
+    /* later writes show through the pointer we were given */
+    CuAssertTrue(tc, 1 == irw->write_block(dm, NULL, &blk, "vwxyz"));
+    b = irw->read_block(dm, NULL, &blk);
+    CuAssertTrue(tc, a == b);
+    CuAssertTrue(tc, 0 == strncmp("vwxyz", a, 5));
+    bt_diskmmap_free(dm);
+    mock_files_remove("test_diskmmap");
+}
+
+void TestBTDiskmmap_block_spans_files(CuTest * tc)
+{
+    void* dm = __new();
+    bt_blockrw_i* irw = bt_diskmmap_get_blockrw(dm);
+
+    /* piece 1 is bytes 10-19: a[10..14], c[0..4] */
+    bt_block_t blk = { .piece_idx = 1, .offset = 0, .len = 10 };
+
+    CuAssertTrue(tc, 1 == irw->write_block(dm, NULL, &blk, "0123456789"));
+    CuAssertTrue(tc, 0 == strncmp("0123456789",
+                 irw->read_block(dm, NULL, &blk), 10));
+    CuAssertTrue(tc, 1 == irw->flush_block(dm, NULL, &blk));
+    CuAssertTrue(tc, mock_file_has("test_diskmmap_a.dat", 10, "01234"));
+    CuAssertTrue(tc, mock_file_has("test_diskmmap_c.dat", 0, "56789"));
+    bt_diskmmap_free(dm);
+    mock_files_remove("test_diskmmap");
+}
+
+void TestBTDiskmmap_block_past_end_fails(CuTest * tc)
+{
+    void* dm = __new();
+    bt_blockrw_i* irw = bt_diskmmap_get_blockrw(dm);
+    bt_block_t blk = { .piece_idx = 2, .offset = 5, .len = 10 };
+
+    CuAssertTrue(tc, 0 == irw->write_block(dm, NULL, &blk, "0123456789"));
+    CuAssertTrue(tc, NULL == irw->read_block(dm, NULL, &blk));
+    bt_diskmmap_free(dm);
+    mock_files_remove("test_diskmmap");
+}
+
+void TestBTDiskmmap_data_survives_reopening(CuTest * tc)
+{
+    void* dm = __new();
+    bt_blockrw_i* irw = bt_diskmmap_get_blockrw(dm);
+    bt_block_t blk = { .piece_idx = 2, .offset = 0, .len = 10 };
+
+    bt_diskmmap_set_advice(dm, BT_DISKMMAP_ADVICE_SEQUENTIAL);
+    CuAssertTrue(tc, 1 == irw->write_block(dm, NULL, &blk, "abcdefghij"));
+    bt_diskmmap_free(dm);
+
+    dm = bt_diskmmap_new();
+    irw = bt_diskmmap_get_blockrw(dm);
+    bt_diskmmap_set_piece_length(dm, MOCK_FILES_PIECE_LEN);
+    bt_diskmmap_set_advice(dm, BT_DISKMMAP_ADVICE_RANDOM);
+    bt_diskmmap_add_file(dm, "test_diskmmap_a.dat",
+                         strlen("test_diskmmap_a.dat"), 15);
+    bt_diskmmap_add_file(dm, "test_diskmmap_c.dat",
+                         strlen("test_diskmmap_c.dat"), 15);
+    CuAssertTrue(tc, 0 == strncmp("abcdefghij",
+                 irw->read_block(dm, NULL, &blk), 10));
+    bt_diskmmap_free(dm);
+    mock_files_remove("test_diskmmap");
+}
@@ -0,0 +1,151 @@
+
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_diskuring.h"
+#include "mock_files.h"
+
+typedef struct
+{
+    int ndone;
+    int nok;
+    char data[32];
+} done_t;
+
+static void __done(void *cb_udata, const bt_block_t * blk, const void *data,
+                   int ok)
+{
+    done_t* d = cb_udata;
+
+    d->ndone++;
+    d->nok += ok;
+    if (data)
+        memcpy(d->data, data, blk->len);
+}
+
+static void* __new(const unsigned int entries)
+{
+    void* du = bt_diskuring_new(entries);
+
+    bt_diskuring_set_piece_length(du, MOCK_FILES_PIECE_LEN);
+    mock_files_add(du, bt_diskuring_add_file, "test_diskuring");
+    return du;
+}
+
+static void __write_then_read(CuTest * tc, const unsigned int entries)
+{
+    void* du = __new(entries);
+    bt_blockrw_async_i* iarw = bt_diskuring_get_blockrw_async(du);
+    bt_block_t blk = { .piece_idx = 1, .offset = 2, .len = 5 };
+    done_t d;
+
+    memset(&d, 0, sizeof(d));
+    CuAssertTrue(tc, 1 == iarw->submit_write(du, &blk, "abcde", __done, &d));
+    while (d.ndone < 1)
+        iarw->poll(du, 1);
+    CuAssertTrue(tc, 1 == d.nok);
+
+    CuAssertTrue(tc, 1 == iarw->submit_read(du, &blk, __done, &d));
+    while (d.ndone < 2)
+        iarw->poll(du, 1);
+    CuAssertTrue(tc, 2 == d.nok);
+    CuAssertTrue(tc, 0 == strncmp("abcde", d.data, 5));
+    bt_diskuring_free(du);
+    mock_files_remove("test_diskuring");
+}
+
+void TestBTDiskuring_write_then_read(CuTest * tc)
+{
+    __write_then_read(tc, 64);
+}
+
+void TestBTDiskuring_write_then_read_without_io_uring(CuTest * tc)
+{
+    __write_then_read(tc, 0);
+}
+
+void TestBTDiskuring_without_io_uring_is_not_async(CuTest * tc)
+{
+    void* du = __new(0);
+
+    CuAssertTrue(tc, 0 == bt_diskuring_is_async(du));
+    bt_diskuring_free(du);
+    mock_files_remove("test_diskuring");
+}
+
+static void __block_spans_files(CuTest * tc, const unsigned int entries)
+{
+    void* du = __new(entries);
+    bt_blockrw_i* irw = bt_diskuring_get_blockrw(du);
+
+    /* piece 1 is bytes 10-19: a[10..14], c[0..4] */
+    bt_block_t blk = { .piece_idx = 1, .offset = 0, .len = 10 };
+
+    CuAssertTrue(tc, 1 == irw->write_block(du, NULL, &blk, "0123456789"));
+    CuAssertTrue(tc, 0 == strncmp("0123456789",
+                 irw->read_block(du, NULL, &blk), 10));
+    CuAssertTrue(tc, 1 == irw->flush_block(du, NULL, &blk));
+    CuAssertTrue(tc, mock_file_has("test_diskuring_a.dat", 10, "01234"));
+    CuAssertTrue(tc, mock_file_has("test_diskuring_c.dat", 0, "56789"));
+    bt_diskuring_free(du);
+    mock_files_remove("test_diskuring");
+}
+
+void TestBTDiskuring_block_spans_files(CuTest * tc)
+{
+    __block_spans_files(tc, 64);
+}
+
+void TestBTDiskuring_block_spans_files_without_io_uring(CuTest * tc)
+{
+    __block_spans_files(tc, 0);
+}
+
+void TestBTDiskuring_many_writes_before_poll(CuTest * tc)
+{
+    /* more requests than the submission queue holds */
+    void* du = __new(4);
+    bt_blockrw_async_i* iarw = bt_diskuring_get_blockrw_async(du);
+    bt_block_t blk = { .piece_idx = 0, .offset = 0, .len = 1 };
+    done_t d;
+    int i;
+
+    memset(&d, 0, sizeof(d));
+    for (i = 0; i < 30; i++)
+    {
+        blk.piece_idx = i / 10;
+        blk.offset = i % 10;
+        CuAssertTrue(tc, 1 == iarw->submit_write(du, &blk, "abcdefghijklmnopqrstuvwxyz0123" + i, __done, &d));
+    }
+    while (d.ndone < 30)
+        iarw->poll(du, 1);
+    CuAssertTrue(tc, 30 == d.nok);
+
+    blk.piece_idx = 2;
+    blk.offset = 0;
+    blk.len = 10;
+    CuAssertTrue(tc, 0 == strncmp("uvwxyz0123",
+                 bt_diskuring_get_blockrw(du)->read_block(du, NULL, &blk), 10));
+    bt_diskuring_free(du);
+    mock_files_remove("test_diskuring");
+}
+
+void TestBTDiskuring_read_past_end_fails(CuTest * tc)
+{
+    void* du = __new(64);
+    bt_blockrw_i* irw = bt_diskuring_get_blockrw(du);
+    bt_block_t blk = { .piece_idx = 2, .offset = 5, .len = 10 };
+
+    CuAssertTrue(tc, 0 == irw->write_block(du, NULL, &blk, "0123456789"));
+    CuAssertTrue(tc, NULL == irw->read_block(du, NULL, &blk));
+    bt_diskuring_free(du);
+    mock_files_remove("test_diskuring");
+}
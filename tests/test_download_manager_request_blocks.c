@@ -0,0 +1,213 @@
+
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <CuTest.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_piece_db.h"
+#include "bt_piece.h"
+#include "bt_diskmem.h"
+#include "bt_selector_sequential.h"
+#include "bitfield.h"
+#include "config.h"
+#include "pwp_connection.h"
+
+#define NPIECES 20
+
+/* pieces are 4 blocks */
+#define PIECE_LEN ((BT_BLOCK_SIZE) * 4)
+
+/* a peer that's polled once asks for this many blocks */
+#define NPOLLS 10
+
+/* would get a whole piece within piece_finish_secs, or wouldn't */
+#define FAST (1 << 20)
+#define SLOW 100
+
+typedef struct
+{
+    const void* peer;
+    int rate;
+} rate_t;
+
+static rate_t __rates[2];
+
+static int __rate(void* udata, const void* peer)
+{
+    int i;
+
+    for (i = 0; i < 2; i++)
+        if (__rates[i].peer == peer)
+            return __rates[i].rate;
+    return 0;
+}
+
+static int __send(void* caller, void **udata, void* nethandle,
+                  const char *send_data, const int len)
+{
+    return 1;
+}
+
+static void* __call_exclusively(void* me, void* cb_ctx, void **lock,
+                                void* udata,
+                                void* (*cb)(void* me, void* udata))
+{
+    return cb(me, udata);
+}
+
+static void* __dm_new(void)
+{
+    void* dm = bt_dm_new(), *cfg = bt_dm_get_config(dm), *dc, *db;
+    char npieces[16], piece_len[16];
+    int i;
+
+    sprintf(npieces, "%d", NPIECES);
+    sprintf(piece_len, "%d", PIECE_LEN);
+    config_set(cfg, "npieces", npieces);
+    config_set(cfg, "piece_length", piece_len);
+    config_set(cfg, "infohash", "00000000000000000000");
+
+    bt_dm_set_cbs(dm, &((bt_dm_cbs_t) {
+                            .peer_send = __send,
+                            .call_exclusively = __call_exclusively
+                        }), NULL);
+
+    dc = bt_diskmem_new();
+    bt_diskmem_set_size(dc, PIECE_LEN);
+    db = bt_piecedb_new();
+    bt_piecedb_set_diskstorage(db, bt_diskmem_get_blockrw(dc), dc);
+    bt_piecedb_increase_piece_space(db, PIECE_LEN * NPIECES);
+    for (i = 0; i < NPIECES; i++)
+        bt_piecedb_add_with_hash_and_size(db, "00000000000000000000",
+                                          PIECE_LEN);
+    bt_dm_set_piece_db(dm, &((bt_piecedb_i){.get_piece = bt_piecedb_get }), db);
+
+    bt_dm_set_piece_selector(dm,
+                             &((bt_pieceselector_i) {
+                                   .new = bt_sequential_selector_new,
+                                   .peer_giveback_piece =
+                                       bt_sequential_selector_giveback_piece,
+                                   .have_piece =
+                                       bt_sequential_selector_have_piece,
+                                   .remove_peer =
+                                       bt_sequential_selector_remove_peer,
+                                   .add_peer = bt_sequential_selector_add_peer,
+                                   .peer_have_piece =
+                                       bt_sequential_selector_peer_have_piece,
+                                   .get_npeers =
+                                       bt_sequential_selector_get_npeers,
+                                   .get_npieces =
+                                       bt_sequential_selector_get_npieces,
+                                   .poll_piece =
+                                       bt_sequential_selector_poll_best_piece
+                               }), NULL);
+    bt_dm_set_peer_rate(dm, __rate, NULL);
+    return dm;
+}
+
+/**
+ * Add a peer who has unchoked us, and has these pieces
+ * @param rate The peer's download rate */
+static bt_peer_t* __add_peer(void* dm, const int n, const int first,
+                             const int npieces, const int rate)
+{
+    char ip[32];
+    bt_peer_t* peer;
+    int i;
+
+    sprintf(ip, "10.0.0.%d", n + 1);
+    peer = bt_dm_add_peer(dm, "", 0, ip, strlen(ip), 4000, NULL, NULL);
+    pwp_conn_set_state(peer->pc, PC_HANDSHAKE_RECEIVED | PC_CONNECTED |
+                       PC_IM_INTERESTED | PC_IM_CHOKING);
+    for (i = first; i < first + npieces; i++)
+        pwp_conn_mark_peer_has_piece(peer->pc, i);
+
+    __rates[n].peer = peer;
+    __rates[n].rate = rate;
+    return peer;
+}
+
+/**
+ * @return blocks of the piece that have been requested */
+static int __nrequested(void* dm, const int idx)
+{
+    bt_piece_t* p = bt_piecedb_get(bt_dm_get_piecedb(dm), idx);
+
+    return (PIECE_LEN - bt_piece_get_nbytes_unrequested(p)) / (BT_BLOCK_SIZE);
+}
+
+void TestBT_dm_fast_peer_is_given_whole_pieces(CuTest * tc)
+{
+    void* dm = __dm_new();
+    int i;
+
+    __add_peer(dm, 0, 0, NPIECES, FAST);
+    bt_dm_periodic(dm, NULL);
+
+    for (i = 0; i < NPOLLS; i++)
+        CuAssertIntEquals(tc, 4, __nrequested(dm, i));
+    for (; i < NPIECES; i++)
+        CuAssertIntEquals(tc, 0, __nrequested(dm, i));
+}
+
+void TestBT_dm_slow_peer_is_given_a_block_at_a_time(CuTest * tc)
+{
+    void* dm = __dm_new();
+
+    __add_peer(dm, 0, 0, NPIECES, SLOW);
+    bt_dm_periodic(dm, NULL);
+
+    /* each poll finishes requesting an open piece before starting another */
+    CuAssertIntEquals(tc, 4, __nrequested(dm, 0));
+    CuAssertIntEquals(tc, 4, __nrequested(dm, 1));
+    CuAssertIntEquals(tc, 2, __nrequested(dm, 2));
+    CuAssertIntEquals(tc, 0, __nrequested(dm, 3));
+}
+
+void TestBT_dm_peer_without_a_rate_is_given_a_block_at_a_time(CuTest * tc)
+{
+    void* dm = __dm_new();
+
+    __add_peer(dm, 0, 0, NPIECES, 0);
+    bt_dm_periodic(dm, NULL);
+
+    CuAssertIntEquals(tc, 4, __nrequested(dm, 0));
+    CuAssertIntEquals(tc, 4, __nrequested(dm, 1));
+    CuAssertIntEquals(tc, 2, __nrequested(dm, 2));
+    CuAssertIntEquals(tc, 0, __nrequested(dm, 3));
+}
+
+void TestBT_dm_open_piece_is_chosen_before_new_pieces(CuTest * tc)
+{
+    void* dm = __dm_new();
+    bt_peer_t* slow;
+
+    /* leaves piece 2 half requested */
+    slow = __add_peer(dm, 0, 0, NPIECES, SLOW);
+    bt_dm_periodic(dm, NULL);
+    CuAssertIntEquals(tc, 2, __nrequested(dm, 2));
+
+    /* the selector has already handed piece 2 out, so only the open piece
+     * can give it to the fast peer */
+    pwp_conn_set_state(slow->pc, PC_HANDSHAKE_RECEIVED | PC_CONNECTED |
+                       PC_IM_INTERESTED | PC_IM_CHOKING | PC_PEER_CHOKING);
+    __add_peer(dm, 1, 2, 2, FAST);
+    bt_dm_periodic(dm, NULL);
+    CuAssertIntEquals(tc, 4, __nrequested(dm, 2));
+    CuAssertIntEquals(tc, 4, __nrequested(dm, 3));
+    CuAssertIntEquals(tc, 0, __nrequested(dm, 4));
+}
@@ -0,0 +1,534 @@
+
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <CuTest.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_piece_db.h"
+#include "bt_piece.h"
+#include "bt_diskmem.h"
+#include "bt_diskasync.h"
+#include "bt_fastresume.h"
+#include "bt_recheck.h"
+#include "bt_selector_sequential.h"
+#include "bitfield.h"
+#include "config.h"
+#include "pwp_connection.h"
+#include "sha1.h"
+
+#define NPIECES 4
+
+/* pieces are 2 blocks */
+#define PIECE_LEN ((BT_BLOCK_SIZE) * 2)
+
+#define RESUME_FILE "test_dm_storage.resume"
+#define DATA_FILE "test_dm_storage.data"
+
+static char __data[PIECE_LEN * NPIECES];
+static char __hashes[NPIECES * 20];
+
+/* what the selector has been told since __setup() */
+static int __nhave[NPIECES];
+static int __nlost[NPIECES];
+
+/**
+ * Storage that can be told to fail */
+typedef struct
+{
+    void* dc;
+    bt_blockrw_i* irw;
+
+    int fail_write;
+    int fail_flush;
+
+    int nreads;
+    int nflushes;
+    int nprefetches;
+} disk_t;
+
+static disk_t __disk;
+
+static int __write_block(void* udata, void* caller, const bt_block_t* blk,
+                         const void* blkdata)
+{
+    disk_t* d = udata;
+
+    if (d->fail_write)
+        return 0;
+    return d->irw->write_block(d->dc, caller, blk, blkdata);
+}
+
+static void* __read_block(void* udata, void* caller, const bt_block_t* blk)
+{
+    disk_t* d = udata;
+
+    d->nreads++;
+    return d->irw->read_block(d->dc, caller, blk);
+}
+
+static int __flush_block(void* udata, void* caller, const bt_block_t* blk)
+{
+    disk_t* d = udata;
+
+    d->nflushes++;
+    return !d->fail_flush;
+}
+
+static void __prefetch_block(void* udata, void* caller,
+                             const bt_block_t* blk)
+{
+    disk_t* d = udata;
+
+    d->nprefetches++;
+}
+
+static bt_blockrw_i __disk_irw = {
+    .write_block = __write_block,
+    .read_block = __read_block,
+    .flush_block = __flush_block,
+    .prefetch_block = __prefetch_block
+};
+
+static int __send(void* caller, void **udata, void* nethandle,
+                  const char *send_data, const int len)
+{
+    return 1;
+}
+
+static void* __call_exclusively(void* me, void* cb_ctx, void **lock,
+                                void* udata,
+                                void* (*cb)(void* me, void* udata))
+{
+    return cb(me, udata);
+}
+
+static void __have_piece(void* r, int idx)
+{
+    __nhave[idx]++;
+    bt_sequential_selector_have_piece(r, idx);
+}
+
+static void __lost_piece(void* r, int idx)
+{
+    __nlost[idx]++;
+    bt_sequential_selector_lost_piece(r, idx);
+}
+
+/**
+ * Put the piece's data into storage, as if it had been downloaded before */
+static void __store_piece(const int idx)
+{
+    bt_block_t blk = { .piece_idx = idx, .offset = 0, .len = PIECE_LEN };
+
+    __disk.irw->write_block(__disk.dc, NULL, &blk, __data + idx * PIECE_LEN);
+}
+
+/**
+ * @return fast-resume over a file as big as the torrent */
+static void* __fr_new(void)
+{
+    void* fr = bt_fastresume_new(RESUME_FILE, NPIECES, PIECE_LEN);
+
+    bt_fastresume_add_file(fr, DATA_FILE, PIECE_LEN * NPIECES);
+    return fr;
+}
+
+static void __write_data_file(void)
+{
+    FILE* f = fopen(DATA_FILE, "wb");
+
+    fwrite(__data, 1, sizeof(__data), f);
+    fclose(f);
+}
+
+static void __setup(void)
+{
+    int i;
+
+    for (i = 0; i < PIECE_LEN * NPIECES; i++)
+        __data[i] = rand();
+
+    for (i = 0; i < NPIECES; i++)
+    {
+        SHA1_CTX ctx;
+
+        SHA1Init(&ctx);
+        SHA1Update(&ctx, (unsigned char*)__data + i * PIECE_LEN, PIECE_LEN);
+        SHA1Final((unsigned char*)__hashes + i * 20, &ctx);
+    }
+
+    unlink(RESUME_FILE);
+    __write_data_file();
+    memset(__nhave, 0, sizeof(__nhave));
+    memset(__nlost, 0, sizeof(__nlost));
+
+    memset(&__disk, 0, sizeof(disk_t));
+    __disk.dc = bt_diskmem_new();
+    bt_diskmem_set_size(__disk.dc, PIECE_LEN);
+    __disk.irw = bt_diskmem_get_blockrw(__disk.dc);
+}
+
+static void __teardown(void)
+{
+    unlink(RESUME_FILE);
+    unlink(DATA_FILE);
+}
+
+/**
+ * @param fr Fast-resume to give the download manager; or NULL */
+static void* __dm_new(void* fr)
+{
+    void* dm = bt_dm_new(), *cfg = bt_dm_get_config(dm), *db;
+    char npieces[16], piece_len[16];
+    int i;
+
+    sprintf(npieces, "%d", NPIECES);
+    sprintf(piece_len, "%d", PIECE_LEN);
+    config_set(cfg, "npieces", npieces);
+    config_set(cfg, "piece_length", piece_len);
+    config_set(cfg, "infohash", "00000000000000000000");
+
+    bt_dm_set_cbs(dm, &((bt_dm_cbs_t) {
+                            .peer_send = __send,
+                            .call_exclusively = __call_exclusively
+                        }), NULL);
+
+    db = bt_piecedb_new();
+    bt_piecedb_set_diskstorage(db, &__disk_irw, &__disk);
+    bt_piecedb_increase_piece_space(db, PIECE_LEN * NPIECES);
+    for (i = 0; i < NPIECES; i++)
+        bt_piecedb_add_with_hash_and_size(db, __hashes + i * 20, PIECE_LEN);
+    bt_dm_set_piece_db(dm, &((bt_piecedb_i){.get_piece = bt_piecedb_get }), db);
+
+    /* the selector checks the pieces; fast-resume has to be there first */
+    if (fr)
+        bt_dm_set_fastresume(dm, fr);
+
+    bt_dm_set_piece_selector(dm,
+                             &((bt_pieceselector_i) {
+                                   .new = bt_sequential_selector_new,
+                                   .peer_giveback_piece =
+                                       bt_sequential_selector_giveback_piece,
+                                   .have_piece = __have_piece,
+                                   .lost_piece = __lost_piece,
+                                   .remove_peer =
+                                       bt_sequential_selector_remove_peer,
+                                   .add_peer = bt_sequential_selector_add_peer,
+                                   .peer_have_piece =
+                                       bt_sequential_selector_peer_have_piece,
+                                   .get_npeers =
+                                       bt_sequential_selector_get_npeers,
+                                   .get_npieces =
+                                       bt_sequential_selector_get_npieces,
+                                   .poll_piece =
+                                       bt_sequential_selector_poll_best_piece
+                               }), NULL);
+    return dm;
+}
+
+/**
+ * Add a peer who only has piece 0, and have it request the whole piece.
+ * The peer is then choked so it doesn't ask for more */
+static bt_peer_t* __add_peer(void* dm)
+{
+    bt_peer_t* peer;
+
+    peer = bt_dm_add_peer(dm, "", 0, "10.0.0.1", 8, 4000, NULL, NULL);
+    pwp_conn_set_state(peer->pc, PC_HANDSHAKE_RECEIVED | PC_CONNECTED |
+                       PC_IM_INTERESTED | PC_IM_CHOKING);
+    pwp_conn_mark_peer_has_piece(peer->pc, 0);
+    bt_dm_periodic(dm, NULL);
+    pwp_conn_set_state(peer->pc, PC_HANDSHAKE_RECEIVED | PC_CONNECTED |
+                       PC_IM_INTERESTED | PC_IM_CHOKING | PC_PEER_CHOKING);
+    return peer;
+}
+
+/**
+ * The peer asks us for the nth block of the piece */
+static void __peer_requests(bt_peer_t* peer, const int idx, const int n)
+{
+    bt_block_t blk = {
+        .piece_idx = idx, .offset = n * (BT_BLOCK_SIZE), .len = BT_BLOCK_SIZE
+    };
+
+    pwp_conn_request(peer->pc, &blk);
+}
+
+/**
+ * The peer sends us the nth block of piece 0 */
+static void __receive_block(bt_peer_t* peer, const int n)
+{
+    msg_piece_t msg = {
+        .blk = {
+            .piece_idx = 0, .offset = n * (BT_BLOCK_SIZE), .len = BT_BLOCK_SIZE
+        },
+        .data = __data + n * (BT_BLOCK_SIZE)
+    };
+
+    pwp_conn_piece(peer->pc, &msg);
+}
+
+/**
+ * @return 1 if we've got the piece's nth block; otherwise 0 */
+static int __have_block(void* dm, const int idx, const int n)
+{
+    bt_piece_t* p = bt_piecedb_get(bt_dm_get_piecedb(dm), idx);
+    bt_block_t blk = {
+        .piece_idx = idx, .offset = n * (BT_BLOCK_SIZE), .len = BT_BLOCK_SIZE
+    };
+
+    return bt_piece_have_block(p, &blk);
+}
+
+void TestBT_dm_trusts_fastresume_at_startup(CuTest * tc)
+{
+    bt_block_t blk = { .piece_idx = 2, .offset = 0, .len = BT_BLOCK_SIZE };
+    void *dm, *fr;
+
+    __setup();
+    fr = __fr_new();
+    bt_fastresume_mark_complete(fr, 0, 1);
+    bt_fastresume_mark_complete(fr, 1, 1);
+    bt_fastresume_mark_complete(fr, 2, 0);
+    bt_fastresume_mark_block(fr, &blk);
+    bt_fastresume_mark_complete(fr, 3, 1);
+    CuAssertTrue(tc, 1 == bt_fastresume_save(fr));
+    bt_fastresume_free(fr);
+
+    fr = __fr_new();
+    CuAssertTrue(tc, 1 == bt_fastresume_load(fr));
+    dm = __dm_new(fr);
+    bt_dm_periodic(dm, NULL);
+
+    /* taken on its word, without reading anything back */
+    CuAssertTrue(tc, 0 == __disk.nreads);
+    CuAssertTrue(tc, 1 == bt_dm_piece_is_complete(dm, 0));
+    CuAssertTrue(tc, 1 == bt_dm_piece_is_complete(dm, 1));
+    CuAssertTrue(tc, 1 == bt_dm_piece_is_complete(dm, 3));
+
+    /* the block we'd already written is kept */
+    CuAssertTrue(tc, 0 == bt_dm_piece_is_complete(dm, 2));
+    CuAssertTrue(tc, 1 == __have_block(dm, 2, 0));
+    CuAssertTrue(tc, 0 == __have_block(dm, 2, 1));
+    bt_fastresume_free(fr);
+    __teardown();
+}
+
+void TestBT_dm_validated_and_flushed_piece_is_marked_complete_in_fastresume(
+    CuTest * tc)
+{
+    void *dm, *fr;
+
+    __setup();
+    __store_piece(0);
+    fr = __fr_new();
+    CuAssertTrue(tc, 0 == bt_fastresume_load(fr));
+    dm = __dm_new(fr);
+    bt_dm_periodic(dm, NULL);
+
+    CuAssertTrue(tc, 1 == bt_dm_piece_is_complete(dm, 0));
+    CuAssertTrue(tc, 0 < __disk.nflushes);
+    CuAssertTrue(tc, BT_FASTRESUME_COMPLETE ==
+                 bt_fastresume_get_piece_state(fr, 0));
+    bt_fastresume_free(fr);
+    __teardown();
+}
+
+void TestBT_dm_unflushable_piece_is_marked_incomplete_in_fastresume(
+    CuTest * tc)
+{
+    void *dm, *fr;
+
+    __setup();
+    __store_piece(0);
+    __disk.fail_flush = 1;
+    fr = __fr_new();
+    dm = __dm_new(fr);
+    bt_dm_periodic(dm, NULL);
+
+    /* valid, but not safely on disk */
+    CuAssertTrue(tc, 0 < __disk.nflushes);
+    CuAssertTrue(tc, 0 == bt_dm_piece_is_complete(dm, 0));
+    CuAssertTrue(tc, BT_FASTRESUME_INCOMPLETE ==
+                 bt_fastresume_get_piece_state(fr, 0));
+    bt_fastresume_free(fr);
+    __teardown();
+}
+
+void TestBT_dm_invalid_piece_is_marked_incomplete_in_fastresume(
+    CuTest * tc)
+{
+    void *dm, *fr;
+
+    __setup();
+    __data[0] ^= 1;
+    __store_piece(0);
+    __data[0] ^= 1;
+    fr = __fr_new();
+    dm = __dm_new(fr);
+    bt_dm_periodic(dm, NULL);
+
+    CuAssertTrue(tc, 0 == bt_dm_piece_is_complete(dm, 0));
+    CuAssertTrue(tc, BT_FASTRESUME_INCOMPLETE ==
+                 bt_fastresume_get_piece_state(fr, 0));
+    bt_fastresume_free(fr);
+    __teardown();
+}
+
+void TestBT_dm_recheck_marks_valid_pieces_complete_and_clears_bad_ones(
+    CuTest * tc)
+{
+    bt_piece_info_t info = {
+        .pieces_hash = __hashes, .piece_len = PIECE_LEN, .npieces = NPIECES
+    };
+    void *dm, *rc;
+    int i;
+
+    __setup();
+    __store_piece(1);
+    dm = __dm_new(NULL);
+    bt_dm_periodic(dm, NULL);
+    CuAssertTrue(tc, 1 == bt_dm_piece_is_complete(dm, 1));
+    CuAssertTrue(tc, 0 == bt_dm_piece_is_complete(dm, 2));
+
+    /* piece 1 goes bad on disk */
+    __data[PIECE_LEN + 1] ^= 1;
+    __write_data_file();
+    memset(__nhave, 0, sizeof(__nhave));
+
+    rc = bt_recheck_new(&info);
+    bt_recheck_add_file(rc, DATA_FILE, PIECE_LEN * NPIECES);
+    bt_dm_recheck(dm, rc);
+
+    for (i = 0; i < NPIECES; i++)
+    {
+        int valid = 1 != i;
+
+        CuAssertTrue(tc, valid == bt_dm_piece_is_complete(dm, i));
+        CuAssertIntEquals(tc, valid, __nhave[i]);
+        CuAssertIntEquals(tc, !valid, __nlost[i]);
+    }
+    bt_recheck_free(rc);
+    __teardown();
+}
+
+void TestBT_dm_async_write_completes_piece(CuTest * tc)
+{
+    bt_block_t blk;
+    bt_peer_t* peer;
+    void *dm, *fr, *da;
+    int iter = 0;
+
+    __setup();
+    fr = __fr_new();
+    dm = __dm_new(fr);
+    da = bt_diskasync_new(&__disk_irw, &__disk);
+    bt_dm_set_async_blockrw(dm, bt_diskasync_get_blockrw_async(da), da);
+    peer = __add_peer(dm);
+    CuAssertTrue(tc, 0 == bt_piece_get_nbytes_unrequested(
+                     bt_piecedb_get(bt_dm_get_piecedb(dm), 0)));
+
+    /* a block only counts once its write has finished */
+    __receive_block(peer, 0);
+    CuAssertTrue(tc, 0 == __have_block(dm, 0, 0));
+    bt_dm_periodic(dm, NULL);
+    CuAssertTrue(tc, 1 == __have_block(dm, 0, 0));
+    CuAssertTrue(tc, 1 == bt_fastresume_get_partial(fr, 0, &blk, &iter));
+    CuAssertTrue(tc, 0 == blk.offset);
+
+    /* the last block has the piece validated and flushed */
+    __receive_block(peer, 1);
+    bt_dm_periodic(dm, NULL);
+    CuAssertTrue(tc, 1 == bt_dm_piece_is_complete(dm, 0));
+    CuAssertTrue(tc, 0 < __disk.nflushes);
+    CuAssertTrue(tc, BT_FASTRESUME_COMPLETE ==
+                 bt_fastresume_get_piece_state(fr, 0));
+    bt_diskasync_free(da);
+    bt_fastresume_free(fr);
+    __teardown();
+}
+
+void TestBT_dm_failed_async_write_gives_block_back(CuTest * tc)
+{
+    bt_block_t blk;
+    bt_peer_t* peer;
+    void *dm, *fr, *da;
+    int iter = 0;
+
+    __setup();
+    fr = __fr_new();
+    dm = __dm_new(fr);
+    da = bt_diskasync_new(&__disk_irw, &__disk);
+    bt_dm_set_async_blockrw(dm, bt_diskasync_get_blockrw_async(da), da);
+    peer = __add_peer(dm);
+
+    __disk.fail_write = 1;
+    __receive_block(peer, 0);
+    bt_dm_periodic(dm, NULL);
+
+    /* up for grabs again, and not recorded anywhere */
+    CuAssertTrue(tc, 0 == __have_block(dm, 0, 0));
+    CuAssertTrue(tc, BT_BLOCK_SIZE == bt_piece_get_nbytes_unrequested(
+                     bt_piecedb_get(bt_dm_get_piecedb(dm), 0)));
+    CuAssertTrue(tc, 0 == bt_fastresume_get_partial(fr, 0, &blk, &iter));
+
+    /* the rest of the piece still arrives, but it can't be completed */
+    __disk.fail_write = 0;
+    __receive_block(peer, 1);
+    bt_dm_periodic(dm, NULL);
+    CuAssertTrue(tc, 1 == __have_block(dm, 0, 1));
+    CuAssertTrue(tc, 0 == bt_dm_piece_is_complete(dm, 0));
+    bt_diskasync_free(da);
+    bt_fastresume_free(fr);
+    __teardown();
+}
+
+void TestBT_dm_queued_requests_are_prefetched_once(CuTest * tc)
+{
+    bt_peer_t* peer;
+    void *dm;
+    int i;
+
+    __setup();
+    for (i = 0; i < NPIECES; i++)
+        __store_piece(i);
+    dm = __dm_new(NULL);
+    bt_dm_periodic(dm, NULL);
+
+    peer = bt_dm_add_peer(dm, "", 0, "10.0.0.1", 8, 4000, NULL, NULL);
+    pwp_conn_set_state(peer->pc, PC_HANDSHAKE_RECEIVED | PC_CONNECTED);
+    __peer_requests(peer, 0, 0);
+    __peer_requests(peer, 0, 1);
+    __peer_requests(peer, 1, 0);
+    __peer_requests(peer, 1, 1);
+
+    /* a hint for each piece's run of blocks */
+    bt_dm_periodic(dm, NULL);
+    CuAssertIntEquals(tc, 2, __disk.nprefetches);
+
+    /* one has been served; the rest were already hinted */
+    bt_dm_periodic(dm, NULL);
+    CuAssertIntEquals(tc, 2, __disk.nprefetches);
+
+    __peer_requests(peer, 2, 1);
+    bt_dm_periodic(dm, NULL);
+    CuAssertIntEquals(tc, 3, __disk.nprefetches);
+    bt_dm_periodic(dm, NULL);
+    CuAssertIntEquals(tc, 3, __disk.nprefetches);
+    __teardown();
+}
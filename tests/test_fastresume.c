@@ -0,0 +1,216 @@
+
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_fastresume.h"
+
+#define RESUME_FILE "test_fastresume.resume"
+
+static void __make_file(const char* path, const int size)
+{
+    FILE* f = fopen(path, "wb");
+    int i;
+
+    for (i = 0; i < size; i++)
+        fputc('a', f);
+    fclose(f);
+}
+
+/**
+ * 4 pieces of 10 bytes over two files:
+ *  piece 0, 1 are in a; piece 2 spans a and b; piece 3 is in b */
+static void* __new(void)
+{
+    void* fr = bt_fastresume_new(RESUME_FILE, 4, 10);
+
+    bt_fastresume_add_file(fr, "test_fastresume.a", 25);
+    bt_fastresume_add_file(fr, "test_fastresume.b", 15);
+    return fr;
+}
+
+static void __setup(void)
+{
+    unlink(RESUME_FILE);
+    __make_file("test_fastresume.a", 25);
+    __make_file("test_fastresume.b", 15);
+}
+
+static void __teardown(void)
+{
+    unlink(RESUME_FILE);
+    unlink("test_fastresume.a");
+    unlink("test_fastresume.b");
+}
+
+void TestBTFastresume_without_resume_file_pieces_are_unknown(CuTest * tc)
+{
+    void *fr;
+
+    __setup();
+    fr = __new();
+    CuAssertTrue(tc, 0 == bt_fastresume_load(fr));
+    CuAssertTrue(tc, BT_FASTRESUME_UNKNOWN ==
+                 bt_fastresume_get_piece_state(fr, 0));
+    CuAssertTrue(tc, BT_FASTRESUME_UNKNOWN ==
+                 bt_fastresume_get_piece_state(fr, 3));
+    bt_fastresume_free(fr);
+    __teardown();
+}
+
+void TestBTFastresume_saved_state_is_loaded(CuTest * tc)
+{
+    void *fr;
+
+    __setup();
+    fr = __new();
+    bt_fastresume_mark_complete(fr, 0, 1);
+    bt_fastresume_mark_complete(fr, 1, 0);
+    bt_fastresume_mark_complete(fr, 2, 1);
+    bt_fastresume_mark_complete(fr, 3, 1);
+    CuAssertTrue(tc, 1 == bt_fastresume_save(fr));
+    bt_fastresume_free(fr);
+
+    fr = __new();
+    CuAssertTrue(tc, 1 == bt_fastresume_load(fr));
+    CuAssertTrue(tc, BT_FASTRESUME_COMPLETE ==
+                 bt_fastresume_get_piece_state(fr, 0));
+    CuAssertTrue(tc, BT_FASTRESUME_INCOMPLETE ==
+                 bt_fastresume_get_piece_state(fr, 1));
+    CuAssertTrue(tc, BT_FASTRESUME_COMPLETE ==
+                 bt_fastresume_get_piece_state(fr, 2));
+    CuAssertTrue(tc, BT_FASTRESUME_COMPLETE ==
+                 bt_fastresume_get_piece_state(fr, 3));
+    bt_fastresume_free(fr);
+    __teardown();
+}
+
+void TestBTFastresume_changed_file_makes_its_pieces_unknown(CuTest * tc)
+{
+    void *fr;
+
+    __setup();
+    fr = __new();
+    bt_fastresume_mark_complete(fr, 0, 1);
+    bt_fastresume_mark_complete(fr, 1, 1);
+    bt_fastresume_mark_complete(fr, 2, 1);
+    bt_fastresume_mark_complete(fr, 3, 1);
+    bt_fastresume_save(fr);
+    bt_fastresume_free(fr);
+
+    __make_file("test_fastresume.b", 14);
+
+    fr = __new();
+    CuAssertTrue(tc, 1 == bt_fastresume_load(fr));
+    CuAssertTrue(tc, BT_FASTRESUME_COMPLETE ==
+                 bt_fastresume_get_piece_state(fr, 0));
+    CuAssertTrue(tc, BT_FASTRESUME_COMPLETE ==
+                 bt_fastresume_get_piece_state(fr, 1));
+    CuAssertTrue(tc, BT_FASTRESUME_UNKNOWN ==
+                 bt_fastresume_get_piece_state(fr, 2));
+    CuAssertTrue(tc, BT_FASTRESUME_UNKNOWN ==
+                 bt_fastresume_get_piece_state(fr, 3));
+    bt_fastresume_free(fr);
+    __teardown();
+}
+
+void TestBTFastresume_unvalidated_file_isnt_vouched_for(CuTest * tc)
+{
+    void *fr;
+
+    __setup();
+    fr = __new();
+
+    /* piece 3 is never validated, so b can't be trusted next time */
+    bt_fastresume_mark_complete(fr, 0, 1);
+    bt_fastresume_mark_complete(fr, 1, 1);
+    bt_fastresume_save(fr);
+    bt_fastresume_free(fr);
+
+    fr = __new();
+    CuAssertTrue(tc, 1 == bt_fastresume_load(fr));
+    CuAssertTrue(tc, BT_FASTRESUME_UNKNOWN ==
+                 bt_fastresume_get_piece_state(fr, 2));
+    CuAssertTrue(tc, BT_FASTRESUME_UNKNOWN ==
+                 bt_fastresume_get_piece_state(fr, 3));
+    bt_fastresume_free(fr);
+    __teardown();
+}
+
+void TestBTFastresume_completion_is_written_in_place(CuTest * tc)
+{
+    void *fr, *fr2;
+
+    __setup();
+    fr = __new();
+    bt_fastresume_mark_complete(fr, 0, 1);
+    bt_fastresume_mark_complete(fr, 1, 1);
+    bt_fastresume_mark_complete(fr, 2, 0);
+    bt_fastresume_mark_complete(fr, 3, 0);
+    bt_fastresume_save(fr);
+
+    /* no save after this */
+    bt_fastresume_mark_complete(fr, 3, 1);
+    CuAssertTrue(tc, 0 == bt_fastresume_is_dirty(fr));
+
+    fr2 = __new();
+    CuAssertTrue(tc, 1 == bt_fastresume_load(fr2));
+    CuAssertTrue(tc, BT_FASTRESUME_INCOMPLETE ==
+                 bt_fastresume_get_piece_state(fr2, 2));
+    CuAssertTrue(tc, BT_FASTRESUME_COMPLETE ==
+                 bt_fastresume_get_piece_state(fr2, 3));
+    bt_fastresume_free(fr2);
+    bt_fastresume_free(fr);
+    __teardown();
+}
+
+void TestBTFastresume_partial_progress_is_saved(CuTest * tc)
+{
+    void *fr;
+    bt_block_t blk;
+    int iter = 0;
+
+    unlink(RESUME_FILE);
+    __make_file("test_fastresume.a", 3 * (BT_BLOCK_SIZE));
+
+    /* one piece of 3 blocks */
+    fr = bt_fastresume_new(RESUME_FILE, 1, 3 * (BT_BLOCK_SIZE));
+    bt_fastresume_add_file(fr, "test_fastresume.a", 3 * (BT_BLOCK_SIZE));
+    bt_fastresume_mark_complete(fr, 0, 0);
+
+    /* only whole blocks count */
+    blk.piece_idx = 0;
+    blk.offset = 0;
+    blk.len = (BT_BLOCK_SIZE) / 2;
+    bt_fastresume_mark_block(fr, &blk);
+    blk.offset = 2 * (BT_BLOCK_SIZE);
+    blk.len = BT_BLOCK_SIZE;
+    bt_fastresume_mark_block(fr, &blk);
+    CuAssertTrue(tc, 1 == bt_fastresume_is_dirty(fr));
+    bt_fastresume_save(fr);
+    bt_fastresume_free(fr);
+
+    fr = bt_fastresume_new(RESUME_FILE, 1, 3 * (BT_BLOCK_SIZE));
+    bt_fastresume_add_file(fr, "test_fastresume.a", 3 * (BT_BLOCK_SIZE));
+    CuAssertTrue(tc, 1 == bt_fastresume_load(fr));
+    CuAssertTrue(tc, BT_FASTRESUME_INCOMPLETE ==
+                 bt_fastresume_get_piece_state(fr, 0));
+    CuAssertTrue(tc, 1 == bt_fastresume_get_partial(fr, 0, &blk, &iter));
+    CuAssertTrue(tc, 2 * (BT_BLOCK_SIZE) == blk.offset);
+    CuAssertTrue(tc, BT_BLOCK_SIZE == blk.len);
+    CuAssertTrue(tc, 0 == bt_fastresume_get_partial(fr, 0, &blk, &iter));
+
+    /* completing the piece forgets its progress */
+    bt_fastresume_mark_complete(fr, 0, 1);
+    iter = 0;
+    CuAssertTrue(tc, 0 == bt_fastresume_get_partial(fr, 0, &blk, &iter));
+    bt_fastresume_free(fr);
+    __teardown();
+}
@@ -0,0 +1,578 @@
+
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_filedumper.h"
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
+#define ALLOC_FILE "test_filedumper_alloc.dat"
+#define DIRECT_FILE "test_filedumper_direct.dat"
+
+/**
+ * Remove everything the tests create */
+static void __remove(void)
+{
+    unlink("test_filedumper_a.dat");
+    unlink("test_filedumper_b.dat");
+    unlink("test_filedumper_c.dat");
+    unlink(".parts");
+    unlink(ALLOC_FILE);
+    unlink(DIRECT_FILE);
+    unlink("test_filedumper_dir/sub/x");
+    rmdir("test_filedumper_dir/sub");
+    rmdir("test_filedumper_dir");
+}
+
+static int __file_size(const char* path)
+{
+    FILE* f = fopen(path, "rb");
+    int size;
+
+    if (!f)
+        return -1;
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fclose(f);
+    return size;
+}
+
+/**
+ * Files from an earlier run are kept */
+static void* __new_keep(void)
+{
+    void* fd = bt_filedumper_new();
+
+    bt_filedumper_set_piece_length(fd, 10);
+    bt_filedumper_add_file(fd, "test_filedumper_a.dat",
+                           strlen("test_filedumper_a.dat"), 15);
+    bt_filedumper_add_file(fd, "test_filedumper_b.dat",
+                           strlen("test_filedumper_b.dat"), 2);
+    bt_filedumper_add_file(fd, "test_filedumper_c.dat",
+                           strlen("test_filedumper_c.dat"), 13);
+    return fd;
+}
+
+static void* __new(void)
+{
+    __remove();
+    return __new_keep();
+}
+
+void TestBTFiledumper_total_size(CuTest * tc)
+{
+    void* fd = __new();
+
+    CuAssertTrue(tc, 3 == bt_filedumper_get_nfiles(fd));
+    CuAssertTrue(tc, 30 == bt_filedumper_get_total_size(fd));
+    bt_filedumper_free(fd);
+    __remove();
+}
+
+void TestBTFiledumper_path_is_under_cwd(CuTest * tc)
+{
+    void* fd = __new();
+
+    bt_filedumper_set_cwd(fd, "somewhere");
+    CuAssertStrEquals(tc, "somewhere/test_filedumper_b.dat",
+                      bt_filedumper_file_get_path(fd, 1));
+    bt_filedumper_free(fd);
+    __remove();
+}
+
+void TestBTFiledumper_path_cant_escape_cwd(CuTest * tc)
+{
+    void* fd = bt_filedumper_new();
+
+    bt_filedumper_set_cwd(fd, "somewhere");
+    bt_filedumper_add_file(fd, "../../etc/passwd", strlen("../../etc/passwd"), 1);
+    bt_filedumper_add_file(fd, "/abs//./x", strlen("/abs//./x"), 1);
+    bt_filedumper_add_file(fd, "..", strlen(".."), 1);
+    CuAssertStrEquals(tc, "somewhere/etc/passwd",
+                      bt_filedumper_file_get_path(fd, 0));
+    CuAssertStrEquals(tc, "somewhere/abs/x",
+                      bt_filedumper_file_get_path(fd, 1));
+    CuAssertStrEquals(tc, "somewhere/_",
+                      bt_filedumper_file_get_path(fd, 2));
+    bt_filedumper_free(fd);
+    __remove();
+}
+
+void TestBTFiledumper_read_of_missing_data_fails(CuTest * tc)
+{
+    void* fd = __new();
+    bt_block_t blk = { .piece_idx = 0, .offset = 0, .len = 10 };
+
+    CuAssertTrue(tc, NULL == bt_filedumper_read_block(fd, NULL, &blk));
+    bt_filedumper_free(fd);
+    __remove();
+}
+
+void TestBTFiledumper_block_within_file(CuTest * tc)
+{
+    void* fd = __new();
+    bt_block_t blk = { .piece_idx = 0, .offset = 2, .len = 5 };
+
+    CuAssertTrue(tc, 1 == bt_filedumper_write_block(fd, NULL, &blk, "abcde"));
+    CuAssertTrue(tc, 0 == strncmp("abcde",
+                 bt_filedumper_read_block(fd, NULL, &blk), 5));
+    CuAssertTrue(tc, 7 == __file_size("test_filedumper_a.dat"));
+    bt_filedumper_free(fd);
+    __remove();
+}
+
+void TestBTFiledumper_block_spans_files(CuTest * tc)
+{
+    void* fd = __new();
+
+    /* piece 1 is bytes 10-19: a[10..14], b[0..1], c[0..2] */
+    bt_block_t blk = { .piece_idx = 1, .offset = 0, .len = 10 };
+
+    CuAssertTrue(tc, 1 == bt_filedumper_write_block(fd, NULL, &blk,
+                                                    "0123456789"));
+    CuAssertTrue(tc, 15 == __file_size("test_filedumper_a.dat"));
+    CuAssertTrue(tc, 2 == __file_size("test_filedumper_b.dat"));
+    CuAssertTrue(tc, 3 == __file_size("test_filedumper_c.dat"));
+    CuAssertTrue(tc, 0 == strncmp("0123456789",
+                 bt_filedumper_read_block(fd, NULL, &blk), 10));
+
+    /* just the middle file */
+    blk.offset = 5;
+    blk.len = 2;
+    CuAssertTrue(tc, 0 == strncmp("56",
+                 bt_filedumper_read_block(fd, NULL, &blk), 2));
+    bt_filedumper_free(fd);
+    __remove();
+}
+
+void TestBTFiledumper_block_past_end_fails(CuTest * tc)
+{
+    void* fd = __new();
+    bt_block_t blk = { .piece_idx = 2, .offset = 5, .len = 10 };
+
+    CuAssertTrue(tc, 0 == bt_filedumper_write_block(fd, NULL, &blk,
+                                                    "0123456789"));
+    bt_filedumper_free(fd);
+    __remove();
+}
+
+void TestBTFiledumper_works_with_one_open_file(CuTest * tc)
+{
+    void* fd = __new();
+    bt_block_t blk = { .piece_idx = 0, .offset = 0, .len = 30 };
+    char data[30];
+    int i;
+
+    for (i = 0; i < 30; i++)
+        data[i] = 'a' + i % 26;
+
+    bt_filedumper_set_max_open_files(fd, 1);
+    CuAssertTrue(tc, 1 == bt_filedumper_write_block(fd, NULL, &blk, data));
+    CuAssertTrue(tc, 0 == memcmp(data,
+                 bt_filedumper_read_block(fd, NULL, &blk), 30));
+    bt_filedumper_free(fd);
+    __remove();
+}
+
+void TestBTFiledumper_closed_file_is_synced(CuTest * tc)
+{
+    void* fd = __new();
+    bt_blockrw_i* irw = bt_filedumper_get_blockrw(fd);
+    bt_block_t a = { .piece_idx = 0, .offset = 0, .len = 5 },
+               c = { .piece_idx = 2, .offset = 5, .len = 5 };
+    bt_filedumper_stats_t s;
+
+    bt_filedumper_set_max_open_files(fd, 1);
+    CuAssertTrue(tc, 1 == bt_filedumper_write_block(fd, NULL, &a, "abcde"));
+
+    /* a is closed to make room for c, so a flush won't find it open */
+    CuAssertTrue(tc, 1 == bt_filedumper_write_block(fd, NULL, &c, "vwxyz"));
+    bt_filedumper_get_stats(fd, &s);
+    CuAssertTrue(tc, 1 == s.syncs);
+
+    CuAssertTrue(tc, 1 == irw->flush_block(fd, NULL, &a));
+    bt_filedumper_get_stats(fd, &s);
+    CuAssertTrue(tc, 1 == s.syncs);
+
+    CuAssertTrue(tc, 1 == irw->flush_block(fd, NULL, &c));
+    bt_filedumper_get_stats(fd, &s);
+    CuAssertTrue(tc, 2 == s.syncs);
+    bt_filedumper_free(fd);
+    __remove();
+}
+
+void TestBTFiledumper_creates_directories(CuTest * tc)
+{
+    void* fd = bt_filedumper_new();
+    bt_block_t blk = { .piece_idx = 0, .offset = 0, .len = 3 };
+
+    unlink("test_filedumper_dir/sub/x");
+    bt_filedumper_set_piece_length(fd, 10);
+    bt_filedumper_add_file(fd, "test_filedumper_dir/sub/x",
+                           strlen("test_filedumper_dir/sub/x"), 3);
+    CuAssertTrue(tc, 1 == bt_filedumper_write_block(fd, NULL, &blk, "xyz"));
+    CuAssertTrue(tc, 3 == __file_size("test_filedumper_dir/sub/x"));
+    bt_filedumper_free(fd);
+    __remove();
+}
+
+/**
+ * Ask the filesystem how the file is laid out
+ * @param nbytes Bytes that have disk space
+ * @return number of extents; -1 if the filesystem won't say */
+static int __extents(const char* path, long *nbytes)
+{
+#if defined(FS_IOC_FIEMAP)
+    struct {
+        struct fiemap fm;
+        struct fiemap_extent fe[256];
+    } m;
+    int f, i, ret;
+
+    if (-1 == (f = open(path, O_RDONLY)))
+        return -1;
+    memset(&m, 0, sizeof(m));
+    m.fm.fm_length = FIEMAP_MAX_OFFSET;
+    m.fm.fm_flags = FIEMAP_FLAG_SYNC;
+    m.fm.fm_extent_count = 256;
+    ret = ioctl(f, FS_IOC_FIEMAP, &m);
+    close(f);
+    if (-1 == ret)
+        return -1;
+
+    *nbytes = 0;
+    for (i = 0; i < (int)m.fm.fm_mapped_extents; i++)
+        *nbytes += m.fe[i].fe_length;
+    return m.fm.fm_mapped_extents;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * Say that a test couldn't check anything, rather than quietly passing */
+static void __skip(CuTest * tc, const char* why)
+{
+    fprintf(stderr, "%s: skipped; %s\n", tc->name, why);
+}
+
+#define ALLOC_PIECE_LEN (1 << 16)
+#define ALLOC_NPIECES 64
+
+static void* __new_alloc(const int mode)
+{
+    void* fd = bt_filedumper_new();
+
+    unlink(ALLOC_FILE);
+    bt_filedumper_set_piece_length(fd, ALLOC_PIECE_LEN);
+    bt_filedumper_set_allocation(fd, mode);
+    bt_filedumper_add_file(fd, ALLOC_FILE,
+                           strlen(ALLOC_FILE),
+                           ALLOC_PIECE_LEN * ALLOC_NPIECES);
+    return fd;
+}
+
+/**
+ * Write every piece, last piece first, making each one hit the disk
+ * @return number of extents the file ends up with */
+static int __write_backwards(void* fd)
+{
+    static char data[ALLOC_PIECE_LEN];
+    bt_block_t blk = { .offset = 0, .len = ALLOC_PIECE_LEN };
+    long nbytes;
+    int i;
+
+    memset(data, 'x', sizeof(data));
+    for (i = ALLOC_NPIECES - 1; 0 <= i; i--)
+    {
+        blk.piece_idx = i;
+        bt_filedumper_write_block(fd, NULL, &blk, data);
+        bt_filedumper_get_blockrw(fd)->flush_block(fd, NULL, &blk);
+    }
+
+    return __extents(ALLOC_FILE, &nbytes);
+}
+
+void TestBTFiledumper_full_allocation_allocates_when_added(CuTest * tc)
+{
+    void* fd = __new_alloc(BT_FILEDUMPER_ALLOC_FULL);
+    long nbytes;
+
+    if (-1 == __extents(ALLOC_FILE, &nbytes))
+    {
+        __skip(tc, "FIEMAP isn't supported here");
+        bt_filedumper_free(fd);
+        __remove();
+        return;
+    }
+
+    CuAssertTrue(tc, ALLOC_PIECE_LEN * ALLOC_NPIECES ==
+                 __file_size(ALLOC_FILE));
+    CuAssertTrue(tc, ALLOC_PIECE_LEN * ALLOC_NPIECES <= nbytes);
+    bt_filedumper_free(fd);
+    __remove();
+}
+
+void TestBTFiledumper_on_write_allocation_allocates_the_region(CuTest * tc)
+{
+    void* fd = __new_alloc(BT_FILEDUMPER_ALLOC_ON_WRITE);
+    bt_block_t blk = { .piece_idx = 3, .offset = 0, .len = 1 };
+    long nbytes;
+
+    bt_filedumper_set_allocation_region(fd, ALLOC_PIECE_LEN * 4);
+    CuAssertTrue(tc, 1 == bt_filedumper_write_block(fd, NULL, &blk, "x"));
+    bt_filedumper_get_blockrw(fd)->flush_block(fd, NULL, &blk);
+
+    if (-1 == __extents(ALLOC_FILE, &nbytes))
+    {
+        __skip(tc, "FIEMAP isn't supported here");
+        bt_filedumper_free(fd);
+        __remove();
+        return;
+    }
+
+    /* the rest of the region has space, but the rest of the file doesn't */
+    CuAssertTrue(tc, ALLOC_PIECE_LEN * 4 <= nbytes);
+    CuAssertTrue(tc, nbytes < ALLOC_PIECE_LEN * ALLOC_NPIECES);
+    bt_filedumper_free(fd);
+    __remove();
+}
+
+void TestBTFiledumper_allocation_stops_fragmentation(CuTest * tc)
+{
+    void* fd;
+    int sparse, full, on_write;
+
+    fd = __new_alloc(BT_FILEDUMPER_ALLOC_SPARSE);
+    sparse = __write_backwards(fd);
+    bt_filedumper_free(fd);
+
+    fd = __new_alloc(BT_FILEDUMPER_ALLOC_FULL);
+    full = __write_backwards(fd);
+    bt_filedumper_free(fd);
+
+    fd = __new_alloc(BT_FILEDUMPER_ALLOC_ON_WRITE);
+    on_write = __write_backwards(fd);
+    bt_filedumper_free(fd);
+    __remove();
+
+    if (-1 == sparse)
+    {
+        __skip(tc, "FIEMAP isn't supported here");
+        return;
+    }
+
+    /* preallocated files end up in a handful of extents however they're
+     * written */
+    CuAssertTrue(tc, 0 < full);
+    CuAssertTrue(tc, full <= 2);
+    CuAssertTrue(tc, 0 < on_write);
+    CuAssertTrue(tc, on_write <= 2);
+    CuAssertTrue(tc, full <= sparse);
+}
+
+void TestBTFiledumper_direct_io_keeps_file_sizes_exact(CuTest * tc)
+{
+    void* fd = __new();
+    bt_block_t blk = { .piece_idx = 0, .offset = 2, .len = 5 };
+
+    bt_filedumper_set_direct_io(fd, 1);
+    CuAssertTrue(tc, 1 == bt_filedumper_write_block(fd, NULL, &blk, "abcde"));
+    CuAssertTrue(tc, 7 == __file_size("test_filedumper_a.dat"));
+
+    /* piece 1 is bytes 10-19: a[10..14], b[0..1], c[0..2] */
+    blk.piece_idx = 1;
+    blk.offset = 0;
+    blk.len = 10;
+    CuAssertTrue(tc, 1 == bt_filedumper_write_block(fd, NULL, &blk,
+                                                    "0123456789"));
+    CuAssertTrue(tc, 15 == __file_size("test_filedumper_a.dat"));
+    CuAssertTrue(tc, 2 == __file_size("test_filedumper_b.dat"));
+    CuAssertTrue(tc, 3 == __file_size("test_filedumper_c.dat"));
+    CuAssertTrue(tc, 0 == strncmp("0123456789",
+                 bt_filedumper_read_block(fd, NULL, &blk), 10));
+
+    /* earlier data survives the read-modify-write */
+    blk.piece_idx = 0;
+    blk.offset = 2;
+    blk.len = 5;
+    CuAssertTrue(tc, 0 == strncmp("abcde",
+                 bt_filedumper_read_block(fd, NULL, &blk), 5));
+    bt_filedumper_free(fd);
+    __remove();
+}
+
+#define DIRECT_PIECE_LEN (1 << 16)
+#define DIRECT_FILE_LEN (DIRECT_PIECE_LEN * 3 + 1000)
+
+static void __direct_check(CuTest * tc, void* fd, const char* data)
+{
+    bt_block_t blk;
+    int i;
+
+    CuAssertTrue(tc, DIRECT_FILE_LEN == __file_size(DIRECT_FILE));
+
+    for (i = 0; i < 4; i++)
+    {
+        blk.piece_idx = i;
+        blk.offset = 0;
+        blk.len = i < 3 ? DIRECT_PIECE_LEN : 1000;
+        CuAssertTrue(tc, 0 == memcmp(data + i * DIRECT_PIECE_LEN,
+                     bt_filedumper_read_block(fd, NULL, &blk), blk.len));
+    }
+
+    /* an unaligned read */
+    blk.piece_idx = 1;
+    blk.offset = 777;
+    blk.len = 20000;
+    CuAssertTrue(tc, 0 == memcmp(data + DIRECT_PIECE_LEN + 777,
+                 bt_filedumper_read_block(fd, NULL, &blk), blk.len));
+}
+
+void TestBTFiledumper_direct_io_handles_unaligned_blocks(CuTest * tc)
+{
+    void* fd = bt_filedumper_new();
+    char *data, *aligned;
+    bt_block_t blk;
+    int i;
+
+    unlink(DIRECT_FILE);
+    bt_filedumper_set_piece_length(fd, DIRECT_PIECE_LEN);
+    bt_filedumper_add_file(fd, DIRECT_FILE,
+                           strlen(DIRECT_FILE), DIRECT_FILE_LEN);
+    bt_filedumper_set_direct_io(fd, 1);
+
+    data = malloc(DIRECT_FILE_LEN);
+    for (i = 0; i < DIRECT_FILE_LEN; i++)
+        data[i] = i % 251;
+
+    /* odd sized blocks, last first */
+    for (i = DIRECT_FILE_LEN - 1; 0 <= i; i -= blk.len)
+    {
+        blk.piece_idx = i / DIRECT_PIECE_LEN;
+        blk.offset = i % DIRECT_PIECE_LEN / 5000 * 5000;
+        blk.len = i % DIRECT_PIECE_LEN - blk.offset + 1;
+        CuAssertTrue(tc, 1 == bt_filedumper_write_block(fd, NULL, &blk,
+            data + blk.piece_idx * DIRECT_PIECE_LEN + blk.offset));
+    }
+    __direct_check(tc, fd, data);
+
+    /* whole pieces from aligned memory go straight to disk */
+    CuAssertTrue(tc, 0 == posix_memalign((void**)&aligned, 4096,
+                                         DIRECT_PIECE_LEN));
+    for (i = 0; i < DIRECT_FILE_LEN; i++)
+        data[i] = i % 13;
+    for (i = 0; i < 4; i++)
+    {
+        blk.piece_idx = i;
+        blk.offset = 0;
+        blk.len = i < 3 ? DIRECT_PIECE_LEN : 1000;
+        memcpy(aligned, data + i * DIRECT_PIECE_LEN, blk.len);
+        CuAssertTrue(tc, 1 == bt_filedumper_write_block(fd, NULL, &blk,
+                                                        aligned));
+    }
+    __direct_check(tc, fd, data);
+
+    free(aligned);
+    free(data);
+    bt_filedumper_free(fd);
+    __remove();
+}
+
+void TestBTFiledumper_skipped_file_isnt_created(CuTest * tc)
+{
+    void* fd = __new();
+    bt_block_t blk = { .piece_idx = 0, .offset = 0, .len = 30 };
+    char* data = "0123456789abcdefghijklmnopqrst";
+
+    unlink(".parts");
+    bt_filedumper_set_file_priority(fd, 1, BT_PRIORITY_SKIP);
+    CuAssertTrue(tc, 1 == bt_filedumper_write_block(fd, NULL, &blk, data));
+    CuAssertTrue(tc, 15 == __file_size("test_filedumper_a.dat"));
+    CuAssertTrue(tc, -1 == __file_size("test_filedumper_b.dat"));
+    CuAssertTrue(tc, 13 == __file_size("test_filedumper_c.dat"));
+    CuAssertTrue(tc, 0 < __file_size(".parts"));
+    CuAssertTrue(tc, 0 == memcmp(data,
+                 bt_filedumper_read_block(fd, NULL, &blk), 30));
+    bt_filedumper_free(fd);
+    __remove();
+}
+
+void TestBTFiledumper_unskipped_file_gets_its_parts(CuTest * tc)
+{
+    void* fd = __new();
+    bt_block_t blk = { .piece_idx = 0, .offset = 0, .len = 30 };
+    char* data = "0123456789abcdefghijklmnopqrst";
+
+    unlink(".parts");
+    bt_filedumper_set_file_priority(fd, 1, BT_PRIORITY_SKIP);
+    bt_filedumper_write_block(fd, NULL, &blk, data);
+    bt_filedumper_free(fd);
+
+    /* the part-file outlives us */
+    fd = __new_keep();
+    bt_filedumper_set_file_priority(fd, 1, BT_PRIORITY_SKIP);
+    CuAssertTrue(tc, 0 == memcmp(data,
+                 bt_filedumper_read_block(fd, NULL, &blk), 30));
+
+    bt_filedumper_set_file_priority(fd, 1, BT_PRIORITY_NORMAL);
+    CuAssertTrue(tc, 2 == __file_size("test_filedumper_b.dat"));
+    CuAssertTrue(tc, 0 == memcmp(data,
+                 bt_filedumper_read_block(fd, NULL, &blk), 30));
+    bt_filedumper_free(fd);
+    __remove();
+}
+
+void TestBTFiledumper_reprioritised_file_keeps_its_data(CuTest * tc)
+{
+    void* fd = __new();
+    bt_block_t blk = { .piece_idx = 0, .offset = 0, .len = 30 };
+    char* data = "0123456789abcdefghijklmnopqrst";
+
+    unlink(".parts");
+    bt_filedumper_set_file_priority(fd, 2, BT_PRIORITY_SKIP);
+    CuAssertTrue(tc, 1 == bt_filedumper_write_block(fd, NULL, &blk, data));
+
+    /* b was never skipped, so there's nothing of it in the part-file */
+    bt_filedumper_set_file_priority(fd, 1, BT_PRIORITY_HIGH);
+    CuAssertTrue(tc, 0 == memcmp(data,
+                 bt_filedumper_read_block(fd, NULL, &blk), 30));
+    bt_filedumper_free(fd);
+    __remove();
+}
+
+void TestBTFiledumper_piece_priority_comes_from_files(CuTest * tc)
+{
+    void* fd = __new();
+
+    CuAssertIntEquals(tc, BT_PRIORITY_NORMAL,
+                      bt_filedumper_get_piece_priority(fd, 1));
+
+    /* piece 2 is all c's; piece 1 still has some of a and b */
+    bt_filedumper_set_file_priority(fd, 2, BT_PRIORITY_SKIP);
+    CuAssertIntEquals(tc, BT_PRIORITY_SKIP,
+                      bt_filedumper_get_piece_priority(fd, 2));
+    CuAssertIntEquals(tc, BT_PRIORITY_NORMAL,
+                      bt_filedumper_get_piece_priority(fd, 1));
+
+    bt_filedumper_set_file_priority(fd, 1, BT_PRIORITY_HIGH);
+    CuAssertIntEquals(tc, BT_PRIORITY_HIGH,
+                      bt_filedumper_get_piece_priority(fd, 1));
+    CuAssertIntEquals(tc, BT_PRIORITY_NORMAL,
+                      bt_filedumper_get_piece_priority(fd, 0));
+    bt_filedumper_free(fd);
+    __remove();
+}
@@ -448,3 +448,114 @@ void TestBTPiece_get_peers_from_write_block( CuTest * tc)
     CuAssertTrue(tc, (p1_ == p1 && p2_ == p2) || (p2_ == p1 && p1_ == p2));
     CuAssertTrue(tc, !bt_piece_get_peers(pce, &i));
 }
+
+static void __mock_disk_prefetch_block(
+    void *udata,
+    void *caller,
+    const bt_block_t * blk
+    )
+{
+    bt_block_t *last = udata;
+
+    *last = *blk;
+}
+
+void TestBTPiece_prefetch_covers_whole_piece( CuTest * tc)
+{
+    bt_blockrw_i irw = { .read_block = __mock_disk_read_block,
+                         .write_block = __mock_disk_write_block,
+                         .prefetch_block = __mock_disk_prefetch_block };
+    bt_piece_t *pce;
+    bt_block_t last;
+
+    memset(&last, 0, sizeof(bt_block_t));
+    pce = bt_piece_new(HASH_EXAMPLE, 40);
+    bt_piece_set_idx(pce, 3);
+    bt_piece_set_disk_blockrw(pce, &irw, &last);
+    bt_piece_prefetch(pce, NULL);
+    CuAssertTrue(tc, 3 == last.piece_idx);
+    CuAssertTrue(tc, 0 == last.offset);
+    CuAssertTrue(tc, 40 == last.len);
+}
+
+void TestBTPiece_prefetch_covers_only_the_block( CuTest * tc)
+{
+    bt_blockrw_i irw = { .read_block = __mock_disk_read_block,
+                         .write_block = __mock_disk_write_block,
+                         .prefetch_block = __mock_disk_prefetch_block };
+    bt_block_t blk = { .piece_idx = 3, .offset = 10, .len = 20 };
+    bt_piece_t *pce;
+    bt_block_t last;
+
+    memset(&last, 0, sizeof(bt_block_t));
+    pce = bt_piece_new(HASH_EXAMPLE, 40);
+    bt_piece_set_idx(pce, 3);
+    bt_piece_set_disk_blockrw(pce, &irw, &last);
+    bt_piece_prefetch(pce, &blk);
+    CuAssertTrue(tc, 3 == last.piece_idx);
+    CuAssertTrue(tc, 10 == last.offset);
+    CuAssertTrue(tc, 20 == last.len);
+
+    /* not past the end of the piece */
+    blk.offset = 30;
+    bt_piece_prefetch(pce, &blk);
+    CuAssertTrue(tc, 30 == last.offset);
+    CuAssertTrue(tc, 10 == last.len);
+}
+
+static void *__mock_disk_record_read_block(
+    void *udata,
+    void *caller,
+    const bt_block_t * blk
+    )
+{
+    bt_block_t *last = udata;
+
+    *last = *blk;
+    return __mockdisk.data;
+}
+
+void TestBTPiece_write_block_to_str_only_reads_block( CuTest * tc)
+{
+    bt_blockrw_i irw = { .read_block = __mock_disk_record_read_block,
+                         .write_block = __mock_disk_write_block };
+    bt_piece_t *pce;
+    bt_block_t blk, last;
+    char out[10];
+
+    memset(&last, 0, sizeof(bt_block_t));
+    pce = bt_piece_new(HASH_EXAMPLE, 40);
+    bt_piece_set_idx(pce, 2);
+    bt_piece_set_disk_blockrw(pce, &irw, &last);
+    blk.piece_idx = 2;
+    blk.offset = 20;
+    blk.len = 10;
+    CuAssertTrue(tc, 1 == bt_piece_write_block_to_str(pce, &blk, out));
+    CuAssertTrue(tc, 2 == last.piece_idx);
+    CuAssertTrue(tc, 20 == last.offset);
+    CuAssertTrue(tc, 10 == last.len);
+}
+
+void TestBTPiece_nbytes_unrequested_follows_requests( CuTest * tc)
+{
+    bt_piece_t *pce;
+    bt_block_t blk;
+
+    pce = bt_piece_new(HASH_EXAMPLE, 3 * (BT_BLOCK_SIZE));
+    CuAssertTrue(tc, 3 * (BT_BLOCK_SIZE) ==
+                 bt_piece_get_nbytes_unrequested(pce));
+
+    bt_piece_poll_block_request(pce, &blk);
+    CuAssertTrue(tc, 2 * (BT_BLOCK_SIZE) ==
+                 bt_piece_get_nbytes_unrequested(pce));
+
+    bt_piece_giveback_block(pce, &blk);
+    CuAssertTrue(tc, 3 * (BT_BLOCK_SIZE) ==
+                 bt_piece_get_nbytes_unrequested(pce));
+
+    bt_piece_poll_block_request(pce, &blk);
+    bt_piece_poll_block_request(pce, &blk);
+    bt_piece_poll_block_request(pce, &blk);
+    CuAssertTrue(tc, 0 == bt_piece_get_nbytes_unrequested(pce));
+    CuAssertTrue(tc, bt_piece_is_fully_requested(pce));
+}
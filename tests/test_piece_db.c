@@ -130,6 +130,198 @@ void TestBTPieceDB_add_pieces(CuTest * tc)
     CuAssertTrue(tc, NULL != bt_piecedb_get(db, 1));
 }
 
+void TestBTPieceDB_add_with_hash_and_size(CuTest * tc)
+{
+    void *db;
+    bt_piece_t *p;
+
+    db = bt_piecedb_new();
+    bt_piecedb_increase_piece_space(db, 80);
+    CuAssertTrue(tc, 0 == bt_piecedb_add_with_hash_and_size(db,
+                "00000000000000000000", 40));
+    CuAssertTrue(tc, 1 == bt_piecedb_add_with_hash_and_size(db,
+                "11111111111111111111", 30));
+    p = bt_piecedb_get(db, 1);
+    CuAssertTrue(tc, NULL != p);
+    CuAssertTrue(tc, 1 == bt_piece_get_idx(p));
+    CuAssertTrue(tc, 30 == bt_piece_get_size(p));
+    CuAssertTrue(tc, 0 == strncmp(bt_piece_get_hash(p),
+                "11111111111111111111", 20));
+}
+
+void TestBTPieceDB_get_returns_same_piece(CuTest * tc)
+{
+    void *db;
+
+    db = bt_piecedb_new();
+    bt_piecedb_increase_piece_space(db, 40);
+    bt_piecedb_add_with_hash_and_size(db, "00000000000000000000", 40);
+    CuAssertTrue(tc, bt_piecedb_get(db, 0) == bt_piecedb_get(db, 0));
+}
+
+void TestBTPieceDB_get_fast_returns_same_piece_as_get(CuTest * tc)
+{
+    void *db;
+
+    db = bt_piecedb_new();
+    bt_piecedb_increase_piece_space(db, 80);
+    bt_piecedb_add_at_idx(db, 1, 1);
+    CuAssertTrue(tc, NULL == bt_piecedb_get_fast(db, 0));
+    CuAssertTrue(tc, NULL == bt_piecedb_get_fast(db, 1000));
+    CuAssertTrue(tc, NULL != bt_piecedb_get_fast(db, 1));
+    CuAssertTrue(tc, bt_piecedb_get(db, 1) == bt_piecedb_get_fast(db, 1));
+    bt_piecedb_remove(db, 1);
+    CuAssertTrue(tc, NULL == bt_piecedb_get_fast(db, 1));
+}
+
+void TestBTPieceDB_num_completed_follows_piece_state(CuTest * tc)
+{
+    void *db;
+
+    db = bt_piecedb_new();
+    bt_piecedb_increase_piece_space(db, 40 * 3);
+    bt_piecedb_add(db, 3);
+    CuAssertTrue(tc, 0 == bt_piecedb_get_num_completed(db));
+    CuAssertTrue(tc, 0 == bt_piecedb_all_pieces_are_complete(db));
+
+    bt_piece_set_complete(bt_piecedb_get(db, 1), 1);
+    CuAssertTrue(tc, 1 == bt_piecedb_get_num_completed(db));
+    CuAssertTrue(tc, 1 == bt_piecedb_get_num_downloaded(db));
+
+    bt_piece_set_complete(bt_piecedb_get(db, 0), 1);
+    bt_piece_set_complete(bt_piecedb_get(db, 2), 1);
+    CuAssertTrue(tc, 3 == bt_piecedb_get_num_completed(db));
+    CuAssertTrue(tc, 1 == bt_piecedb_all_pieces_are_complete(db));
+
+    bt_piece_drop_download_progress(bt_piecedb_get(db, 1));
+    CuAssertTrue(tc, 2 == bt_piecedb_get_num_completed(db));
+    CuAssertTrue(tc, 0 == bt_piecedb_all_pieces_are_complete(db));
+
+    bt_piecedb_remove(db, 2);
+    CuAssertTrue(tc, 1 == bt_piecedb_get_num_completed(db));
+}
+
+void TestBTPieceDB_contains_piecerange(CuTest * tc)
+{
+    void *db;
+    int ii;
+
+    db = bt_piecedb_new();
+    bt_piecedb_add(db, 2000);
+    for (ii = 500; ii < 1500; ii++)
+        bt_piece_set_complete(bt_piecedb_get(db, ii), 1);
+
+    CuAssertTrue(tc, 1 == bt_piecedb_contains_piecerange(db, 500, 1000));
+    CuAssertTrue(tc, 1 == bt_piecedb_contains_piecerange(db, 700, 10));
+    CuAssertTrue(tc, 0 == bt_piecedb_contains_piecerange(db, 499, 2));
+    CuAssertTrue(tc, 0 == bt_piecedb_contains_piecerange(db, 1400, 101));
+    CuAssertTrue(tc, 0 == bt_piecedb_contains_piecerange(db, 0, 1));
+
+    bt_piece_set_complete(bt_piecedb_get(db, 1000), 0);
+    CuAssertTrue(tc, 0 == bt_piecedb_contains_piecerange(db, 500, 1000));
+    CuAssertTrue(tc, 1 == bt_piecedb_contains_piecerange(db, 500, 500));
+}
+
+void TestBTPieceDB_nth_completed(CuTest * tc)
+{
+    void *db;
+
+    db = bt_piecedb_new();
+    bt_piecedb_add(db, 2000);
+    CuAssertTrue(tc, -1 == bt_piecedb_nth_completed(db, 0));
+
+    bt_piece_set_complete(bt_piecedb_get(db, 3), 1);
+    bt_piece_set_complete(bt_piecedb_get(db, 64), 1);
+    bt_piece_set_complete(bt_piecedb_get(db, 1999), 1);
+    CuAssertTrue(tc, 3 == bt_piecedb_nth_completed(db, 0));
+    CuAssertTrue(tc, 64 == bt_piecedb_nth_completed(db, 1));
+    CuAssertTrue(tc, 1999 == bt_piecedb_nth_completed(db, 2));
+    CuAssertTrue(tc, -1 == bt_piecedb_nth_completed(db, 3));
+}
+
+void TestBTPieceDB_add_from_info(CuTest * tc)
+{
+    void *db;
+    bt_piece_info_t info;
+    char hashes[20 * 3 + 1] =
+        "00000000000000000000"
+        "11111111111111111111"
+        "22222222222222222222";
+
+    info.pieces_hash = hashes;
+    info.piece_len = 40;
+    info.npieces = 3;
+
+    db = bt_piecedb_new();
+    CuAssertTrue(tc, 0 == bt_piecedb_add_from_info(db, &info, 40 * 2 + 25));
+    CuAssertTrue(tc, 3 == bt_piecedb_count(db));
+
+    /* nothing is materialized until it's asked for */
+    CuAssertTrue(tc, NULL == ((bt_piecedb_table_t*)db)->pieces[1]);
+
+    CuAssertTrue(tc, 40 == bt_piece_get_size(bt_piecedb_get(db, 0)));
+    CuAssertTrue(tc, 25 == bt_piece_get_size(bt_piecedb_get(db, 2)));
+    CuAssertTrue(tc, 0 == strncmp(bt_piece_get_hash(bt_piecedb_get(db, 1)),
+                "11111111111111111111", 20));
+}
+
+void TestBTPieceDB_add_from_info_leaves_callers_hashes_alone(CuTest * tc)
+{
+    void *db;
+    bt_piece_info_t info;
+    char hashes[20 * 2 + 1] =
+        "00000000000000000000"
+        "11111111111111111111";
+
+    info.pieces_hash = hashes;
+    info.piece_len = 40;
+    info.npieces = 2;
+
+    db = bt_piecedb_new();
+    bt_piecedb_add_from_info(db, &info, 80);
+    CuAssertTrue(tc, 2 == bt_piecedb_add_with_hash_and_size(db,
+                "22222222222222222222", 40));
+    CuAssertTrue(tc, 0 == strcmp(hashes,
+                "00000000000000000000" "11111111111111111111"));
+    CuAssertTrue(tc, 0 == strncmp(bt_piece_get_hash(bt_piecedb_get(db, 0)),
+                "00000000000000000000", 20));
+    CuAssertTrue(tc, 0 == strncmp(bt_piece_get_hash(bt_piecedb_get(db, 2)),
+                "22222222222222222222", 20));
+}
+
+void TestBTPieceDB_set_complete_doesnt_materialize_piece(CuTest * tc)
+{
+    void *db;
+
+    db = bt_piecedb_new();
+    bt_piecedb_add(db, 2);
+    bt_piecedb_set_complete(db, 1);
+    CuAssertTrue(tc, NULL == ((bt_piecedb_table_t*)db)->pieces[1]);
+    CuAssertTrue(tc, 1 == bt_piecedb_get_num_completed(db));
+    CuAssertTrue(tc, 1 == bt_piece_is_complete(bt_piecedb_get(db, 1)));
+    CuAssertTrue(tc, 0 == bt_piece_is_complete(bt_piecedb_get(db, 0)));
+    CuAssertTrue(tc, 1 == bt_piecedb_get_num_completed(db));
+}
+
+void TestBTPieceDB_clear_complete(CuTest * tc)
+{
+    void *db;
+
+    db = bt_piecedb_new();
+    bt_piecedb_add(db, 3);
+    bt_piecedb_set_complete(db, 1);
+    bt_piecedb_set_complete(db, 2);
+    bt_piece_is_complete(bt_piecedb_get(db, 2));
+
+    /* one piece is only in the table, the other is materialized */
+    bt_piecedb_clear_complete(db, 1);
+    bt_piecedb_clear_complete(db, 2);
+    CuAssertTrue(tc, 0 == bt_piecedb_get_num_completed(db));
+    CuAssertTrue(tc, 0 == bt_piecedb_contains_piecerange(db, 1, 1));
+    CuAssertTrue(tc, 0 == bt_piece_is_complete(bt_piecedb_get(db, 1)));
+    CuAssertTrue(tc, 0 == bt_piece_is_complete(bt_piecedb_get(db, 2)));
+}
+
 #if 0
 void T_estBTPieceDB_AddingPiece_LastPieceFitsTotalSize(
     CuTest * tc
@@ -0,0 +1,157 @@
+
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_recheck.h"
+#include "sha1.h"
+
+#define PIECE_LEN 1000
+#define NPIECES 40
+
+/* 39.5 pieces over three files */
+#define TOT_LEN (PIECE_LEN * NPIECES - PIECE_LEN / 2)
+#define LEN_A 12345
+#define LEN_B 1
+#define LEN_C (TOT_LEN - LEN_A - LEN_B)
+
+static char __data[TOT_LEN];
+static char __hashes[NPIECES * 20];
+
+static void __write_file(const char* path, const char* data, const int len)
+{
+    FILE* f = fopen(path, "wb");
+
+    fwrite(data, 1, len, f);
+    fclose(f);
+}
+
+static void __setup(bt_piece_info_t* info)
+{
+    int i;
+
+    for (i = 0; i < TOT_LEN; i++)
+        __data[i] = rand();
+
+    for (i = 0; i < NPIECES; i++)
+    {
+        int len = TOT_LEN - i * PIECE_LEN < PIECE_LEN ?
+                  TOT_LEN - i * PIECE_LEN : PIECE_LEN;
+        SHA1_CTX ctx;
+
+        SHA1Init(&ctx);
+        SHA1Update(&ctx, (unsigned char*)__data + i * PIECE_LEN, len);
+        SHA1Final((unsigned char*)__hashes + i * 20, &ctx);
+    }
+
+    __write_file("test_recheck_a.dat", __data, LEN_A);
+    __write_file("test_recheck_b.dat", __data + LEN_A, LEN_B);
+    __write_file("test_recheck_c.dat", __data + LEN_A + LEN_B, LEN_C);
+
+    info->pieces_hash = __hashes;
+    info->piece_len = PIECE_LEN;
+    info->npieces = NPIECES;
+}
+
+static void __teardown(void)
+{
+    unlink("test_recheck_a.dat");
+    unlink("test_recheck_b.dat");
+    unlink("test_recheck_c.dat");
+}
+
+static void* __new(bt_piece_info_t* info, int nthreads)
+{
+    void* rc = bt_recheck_new(info);
+
+    bt_recheck_add_file(rc, "test_recheck_a.dat", LEN_A);
+    bt_recheck_add_file(rc, "test_recheck_b.dat", LEN_B);
+    bt_recheck_add_file(rc, "test_recheck_c.dat", LEN_C);
+    bt_recheck_set_nthreads(rc, nthreads);
+    return rc;
+}
+
+static void __progress(void *udata, unsigned int ndone, unsigned int npieces)
+{
+    unsigned int *last = udata;
+
+    assert(*last < ndone);
+    assert(ndone <= npieces);
+    *last = ndone;
+}
+
+void TestBTRecheck_all_pieces_valid(CuTest * tc)
+{
+    bt_piece_info_t info;
+    void *rc;
+    int i;
+
+    __setup(&info);
+    rc = __new(&info, 1);
+    CuAssertTrue(tc, NPIECES == bt_recheck_run(rc));
+    for (i = 0; i < NPIECES; i++)
+        CuAssertTrue(tc, 1 == bt_recheck_piece_is_valid(rc, i));
+    bt_recheck_free(rc);
+    __teardown();
+}
+
+void TestBTRecheck_corrupt_piece_is_invalid(CuTest * tc)
+{
+    bt_piece_info_t info;
+    void *rc;
+
+    __setup(&info);
+
+    /* the 1 byte file sits in piece 12 */
+    __data[LEN_A] ^= 1;
+    __write_file("test_recheck_b.dat", __data + LEN_A, LEN_B);
+
+    rc = __new(&info, 4);
+    CuAssertTrue(tc, NPIECES - 1 == bt_recheck_run(rc));
+    CuAssertTrue(tc, 1 == bt_recheck_piece_is_valid(rc, 11));
+    CuAssertTrue(tc, 0 == bt_recheck_piece_is_valid(rc, LEN_A / PIECE_LEN));
+    CuAssertTrue(tc, 1 == bt_recheck_piece_is_valid(rc, 13));
+    bt_recheck_free(rc);
+    __teardown();
+}
+
+void TestBTRecheck_missing_file_makes_its_pieces_invalid(CuTest * tc)
+{
+    bt_piece_info_t info;
+    void *rc;
+    int i;
+
+    __setup(&info);
+    unlink("test_recheck_a.dat");
+
+    rc = __new(&info, 3);
+    bt_recheck_run(rc);
+    for (i = 0; i <= LEN_A / PIECE_LEN; i++)
+        CuAssertTrue(tc, 0 == bt_recheck_piece_is_valid(rc, i));
+    for (; i < NPIECES; i++)
+        CuAssertTrue(tc, 1 == bt_recheck_piece_is_valid(rc, i));
+    bt_recheck_free(rc);
+    __teardown();
+}
+
+void TestBTRecheck_progress_is_reported(CuTest * tc)
+{
+    bt_piece_info_t info;
+    unsigned int last = 0;
+    void *rc;
+
+    __setup(&info);
+    rc = __new(&info, 2);
+    bt_recheck_set_progress_cb(rc, __progress, &last);
+    bt_recheck_run(rc);
+    CuAssertTrue(tc, NPIECES == last);
+    bt_recheck_free(rc);
+    __teardown();
+}
@@ -0,0 +1,240 @@
+
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_piece.h"
+#include "bt_piece_db.h"
+#include "bt_diskiosched.h"
+
+#define PIECE_LEN (1 << 22)
+#define TOT_LEN (100ULL << 30)
+#define NPIECES ((int)((TOT_LEN + PIECE_LEN - 1) / PIECE_LEN))
+
+/* 4GB; where 32 bit offsets wrap */
+#define WRAP (1ULL << 32)
+
+/**
+ * Sparse storage: only the blocks that have been written are kept */
+typedef struct
+{
+    struct {
+        uint64_t off;
+        unsigned int len;
+        char *data;
+    } writes[32];
+    int nwrites;
+
+    /* number of write_block/write_blockv calls */
+    int ncalls;
+} sparse_t;
+
+static uint64_t __off(const bt_block_t * blk)
+{
+    return (uint64_t)blk->piece_idx * PIECE_LEN + blk->offset;
+}
+
+static void __store(sparse_t* s, const uint64_t off, const unsigned int len,
+                    const void *data)
+{
+    s->writes[s->nwrites].off = off;
+    s->writes[s->nwrites].len = len;
+    s->writes[s->nwrites].data = malloc(len);
+    memcpy(s->writes[s->nwrites].data, data, len);
+    s->nwrites++;
+}
+
+static int __sparse_write(void *udata, void *caller, const bt_block_t * blk,
+                          const void *blkdata)
+{
+    sparse_t* s = udata;
+
+    s->ncalls++;
+    __store(s, __off(blk), blk->len, blkdata);
+    return 1;
+}
+
+static int __sparse_writev(void *udata, void *caller, const bt_block_t * blk,
+                           const bt_iovec_t * iov, const int iovcnt)
+{
+    sparse_t* s = udata;
+    uint64_t off = __off(blk);
+    int i;
+
+    s->ncalls++;
+    for (i = 0; i < iovcnt; off += iov[i].len, i++)
+        __store(s, off, iov[i].len, iov[i].data);
+    return 1;
+}
+
+static void *__sparse_read(void *udata, void *caller, const bt_block_t * blk)
+{
+    sparse_t* s = udata;
+    uint64_t off = __off(blk);
+    int i;
+
+    for (i = s->nwrites - 1; 0 <= i; i--)
+        if (s->writes[i].off <= off &&
+            off + blk->len <= s->writes[i].off + s->writes[i].len)
+            return s->writes[i].data + (off - s->writes[i].off);
+    return NULL;
+}
+
+static bt_blockrw_i __sparse_irw = {
+    .write_block = __sparse_write,
+    .read_block = __sparse_read,
+    .write_blockv = __sparse_writev
+};
+
+static void __sparse_free(sparse_t* s)
+{
+    int i;
+
+    for (i = 0; i < s->nwrites; i++)
+        free(s->writes[i].data);
+}
+
+static void* __new_db(bt_piece_info_t* info)
+{
+    void* db = bt_piecedb_new();
+
+    info->piece_len = PIECE_LEN;
+    info->npieces = NPIECES;
+    info->pieces_hash = calloc(NPIECES, 20);
+    bt_piecedb_add_from_info(db, info, TOT_LEN);
+    return db;
+}
+
+void TestBTScenario_100gb_torrent_is_sized_in_64_bits(CuTest * tc)
+{
+    bt_piece_info_t info;
+    void* db = __new_db(&info);
+
+    CuAssertIntEquals(tc, 25600, bt_piecedb_get_length(db));
+    CuAssertTrue(tc, TOT_LEN == bt_piecedb_get_tot_file_size(db));
+    CuAssertIntEquals(tc, PIECE_LEN,
+                      bt_piece_get_size(bt_piecedb_get(db, NPIECES - 1)));
+
+    /* files added one at a time add up past 4GB too */
+    bt_piecedb_set_tot_file_size(db, 0);
+    bt_piecedb_increase_piece_space(db, 3ULL << 30);
+    bt_piecedb_increase_piece_space(db, 97ULL << 30);
+    CuAssertTrue(tc, TOT_LEN == bt_piecedb_get_tot_file_size(db));
+    free(info.pieces_hash);
+}
+
+void TestBTScenario_100gb_torrent_blocks_reach_storage_past_4gb(CuTest * tc)
+{
+    bt_piece_info_t info;
+    void* db = __new_db(&info);
+    sparse_t s;
+    bt_block_t blk = { .offset = PIECE_LEN - 4, .len = 4 };
+    const int last = NPIECES - 1;
+
+    memset(&s, 0, sizeof(s));
+    bt_piecedb_set_diskstorage(db, &__sparse_irw, &s);
+
+    /* the last bytes of the torrent */
+    blk.piece_idx = last;
+    CuAssertTrue(tc, 1 == bt_piece_write_block(bt_piecedb_get(db, last),
+                                               NULL, &blk, "wxyz", NULL));
+    CuAssertTrue(tc, TOT_LEN - 4 == s.writes[0].off);
+
+    /* either side of the 4GB mark */
+    blk.piece_idx = WRAP / PIECE_LEN - 1;
+    bt_piece_write_block(bt_piecedb_get(db, blk.piece_idx), NULL, &blk,
+                         "abcd", NULL);
+    CuAssertTrue(tc, WRAP - 4 == s.writes[1].off);
+
+    blk.piece_idx = WRAP / PIECE_LEN;
+    blk.offset = 0;
+    bt_piece_write_block(bt_piecedb_get(db, blk.piece_idx), NULL, &blk,
+                         "efgh", NULL);
+    CuAssertTrue(tc, WRAP == s.writes[2].off);
+
+    /* and back again */
+    blk.piece_idx = last;
+    blk.offset = PIECE_LEN - 4;
+    CuAssertTrue(tc, 0 == strncmp("wxyz",
+                 bt_piece_read_block(bt_piecedb_get(db, last), NULL, &blk),
+                 4));
+
+    __sparse_free(&s);
+    free(info.pieces_hash);
+}
+
+void TestBTScenario_100gb_torrent_writes_are_ordered_past_4gb(CuTest * tc)
+{
+    void* dio = bt_diskiosched_new();
+    sparse_t s;
+    bt_diskiosched_stats_t st;
+    bt_block_t blk = { .len = 4 };
+
+    memset(&s, 0, sizeof(s));
+    bt_diskiosched_set_piece_length(dio, PIECE_LEN);
+    bt_diskiosched_set_disk_blockrw(dio, &__sparse_irw, &s);
+
+    /* would sort first if the offset wrapped at 4GB */
+    blk.piece_idx = WRAP / PIECE_LEN;
+    blk.offset = 0;
+    bt_diskiosched_get_blockrw(dio)->write_block(dio, NULL, &blk, "efgh");
+
+    blk.piece_idx = 0;
+    bt_diskiosched_get_blockrw(dio)->write_block(dio, NULL, &blk, "0123");
+
+    blk.piece_idx = WRAP / PIECE_LEN - 1;
+    blk.offset = PIECE_LEN - 4;
+    bt_diskiosched_get_blockrw(dio)->write_block(dio, NULL, &blk, "abcd");
+
+    bt_diskiosched_dispatch(dio);
+    bt_diskiosched_get_stats(dio, &st);
+
+    /* the two writes either side of 4GB were merged */
+    CuAssertIntEquals(tc, 2, s.ncalls);
+    CuAssertTrue(tc, 2 == st.writes_out);
+    CuAssertTrue(tc, 0 == s.writes[0].off);
+    CuAssertTrue(tc, WRAP - 4 == s.writes[1].off);
+    CuAssertTrue(tc, WRAP == s.writes[2].off);
+
+    bt_diskiosched_free(dio);
+    __sparse_free(&s);
+}
+
+void TestBTScenario_100gb_torrent_counts_completed_bytes(CuTest * tc)
+{
+    bt_piece_info_t info;
+    void* db = __new_db(&info);
+    void* dm = bt_dm_new();
+    bt_dm_stats_t stats;
+    int i;
+
+    memset(&stats, 0, sizeof(stats));
+    bt_dm_set_piece_db(dm, &((bt_piecedb_i){.get_piece = bt_piecedb_get }),
+                       db);
+
+    /* 5GB's worth */
+    for (i = 0; i < 1280; i++)
+        bt_piecedb_set_complete(db, NPIECES - 1 - i);
+    CuAssertTrue(tc, 5ULL << 30 == bt_piecedb_get_completed_bytes(db));
+
+    bt_dm_periodic(dm, &stats);
+    CuAssertTrue(tc, 5ULL << 30 == stats.completed_bytes);
+    free(stats.peers);
+    free(info.pieces_hash);
+}
@@ -0,0 +1,194 @@
+
+/**
+ * Copyright (c) 2011, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @author  Willem Thiart himself@willemthiart.com
+ * @version 0.1
+ */
+
+#include <stdbool.h>
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_selector_deadline.h"
+#include "bt_selector_rarestfirst.h"
+
+/* a 12 second clip played at 2.5MB/s; the fast peer could just about
+ * stream it alone */
+#define NPIECES 120
+#define PIECE_LEN (1 << 18)
+#define PIECE_MS 100
+#define WINDOW 8
+
+#define TICK_MS 10
+#define NPEERS 7
+
+/* one fast peer, and a crowd of slow ones */
+static const int __rates[NPEERS + 1] = {
+    0, 3 << 20, 150 << 10, 150 << 10, 150 << 10, 150 << 10, 150 << 10,
+    150 << 10
+};
+
+static uint64_t __clock;
+
+static uint64_t __now(void* udata)
+{
+    return __clock;
+}
+
+static int __rate(void* udata, const void* peer)
+{
+    return __rates[(long)peer];
+}
+
+typedef struct
+{
+    /* piece being downloaded; -1 if idle */
+    int piece;
+    uint64_t got;
+} sim_peer_t;
+
+/**
+ * Download from a swarm of seeds while playing the pieces back in order.
+ * Playback starts straight away, and stalls until the piece being played
+ * arrives.
+ * @param is_deadline 1 if r is a deadline selector
+ * @return how long playback was stalled for, in ms */
+static int __play(bt_pieceselector_i* ips, void* r, const int is_deadline)
+{
+    sim_peer_t peers[NPEERS + 1];
+    char have[NPIECES];
+    uint64_t next_play = PIECE_MS;
+    int playhead = 0, stalled_ms = 0;
+    long p;
+    int i;
+
+    memset(have, 0, sizeof(have));
+    __clock = 0;
+
+    for (p = 1; p <= NPEERS; p++)
+    {
+        peers[p].piece = -1;
+        ips->add_peer(r, (void*)p);
+        for (i = 0; i < NPIECES; i++)
+            ips->peer_have_piece(r, (void*)p, i);
+    }
+
+    if (is_deadline)
+        bt_deadline_selector_set_playhead(r, 0);
+
+    while (playhead < NPIECES && __clock < 600 * 1000)
+    {
+        for (p = 1; p <= NPEERS; p++)
+        {
+            sim_peer_t* sp = &peers[p];
+
+            if (-1 == sp->piece)
+            {
+                sp->piece = ips->poll_piece(r, (void*)p);
+                sp->got = 0;
+            }
+
+            if (-1 == sp->piece)
+                continue;
+
+            sp->got += (uint64_t)__rates[p] * TICK_MS / 1000;
+            if (sp->got < PIECE_LEN)
+                continue;
+
+            /* won the race; the other peer gives up */
+            if (!have[sp->piece])
+            {
+                long o;
+
+                have[sp->piece] = 1;
+                ips->have_piece(r, sp->piece);
+                for (o = 1; o <= NPEERS; o++)
+                    if (o != p && peers[o].piece == sp->piece)
+                    {
+                        ips->peer_giveback_piece(r, (void*)o, sp->piece);
+                        peers[o].piece = -1;
+                    }
+            }
+
+            sp->piece = -1;
+        }
+
+        if (next_play <= __clock)
+        {
+            if (have[playhead])
+            {
+                playhead++;
+                next_play = __clock + PIECE_MS;
+                if (is_deadline)
+                    bt_deadline_selector_set_playhead(r, playhead);
+            }
+            else
+                stalled_ms += TICK_MS;
+        }
+
+        __clock += TICK_MS;
+    }
+
+    return stalled_ms;
+}
+
+void TestScenario_streaming_deadline_selector_misses_fewer_deadlines(
+    CuTest * tc)
+{
+    bt_pieceselector_i rf = {
+        .new = bt_rarestfirst_selector_new,
+        .peer_giveback_piece = bt_rarestfirst_selector_giveback_piece,
+        .have_piece = bt_rarestfirst_selector_have_piece,
+        .remove_peer = bt_rarestfirst_selector_remove_peer,
+        .add_peer = bt_rarestfirst_selector_add_peer,
+        .peer_have_piece = bt_rarestfirst_selector_peer_have_piece,
+        .get_npeers = bt_rarestfirst_selector_get_npeers,
+        .get_npieces = bt_rarestfirst_selector_get_npieces,
+        .poll_piece = bt_rarestfirst_selector_poll_best_piece
+    };
+    bt_pieceselector_i dl = {
+        .new = bt_deadline_selector_new,
+        .peer_giveback_piece = bt_deadline_selector_giveback_piece,
+        .have_piece = bt_deadline_selector_have_piece,
+        .remove_peer = bt_deadline_selector_remove_peer,
+        .add_peer = bt_deadline_selector_add_peer,
+        .peer_have_piece = bt_deadline_selector_peer_have_piece,
+        .get_npeers = bt_deadline_selector_get_npeers,
+        .get_npieces = bt_deadline_selector_get_npieces,
+        .poll_piece = bt_deadline_selector_poll_best_piece
+    };
+    bt_deadline_selector_stats_t s;
+    void *r;
+    int rf_stalled, dl_stalled;
+
+    r = rf.new(NPIECES);
+    rf_stalled = __play(&rf, r, 0);
+    bt_rarestfirst_selector_free(r);
+
+    r = dl.new(NPIECES);
+    __clock = 0;
+    bt_deadline_selector_set_clock(r, __now, NULL);
+    bt_deadline_selector_set_peer_rate(r, __rate, NULL);
+    bt_deadline_selector_set_piece_length(r, PIECE_LEN);
+    bt_deadline_selector_set_window(r, WINDOW, PIECE_MS);
+    dl_stalled = __play(&dl, r, 1);
+    bt_deadline_selector_get_stats(r, &s);
+    bt_deadline_selector_free(r);
+
+    /* rarest first downloads the whole clip out of order */
+    CuAssertTrue(tc, dl_stalled < rf_stalled);
+    CuAssertTrue(tc, dl_stalled <= PIECE_MS);
+    CuAssertTrue(tc, 0 < s.nmet);
+    CuAssertTrue(tc, s.nmissed <= 1);
+}
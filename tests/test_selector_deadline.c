@@ -0,0 +1,262 @@
+#include <stdbool.h>
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_selector_deadline.h"
+
+#define PIECE_LEN 1000
+
+static bt_pieceselector_i iface = {
+    .new = bt_deadline_selector_new,
+    .peer_giveback_piece = bt_deadline_selector_giveback_piece,
+    .have_piece = bt_deadline_selector_have_piece,
+    .remove_peer = bt_deadline_selector_remove_peer,
+    .add_peer = bt_deadline_selector_add_peer,
+    .peer_have_piece = bt_deadline_selector_peer_have_piece,
+    .get_npeers = bt_deadline_selector_get_npeers,
+    .get_npieces = bt_deadline_selector_get_npieces,
+    .poll_piece = bt_deadline_selector_poll_best_piece,
+    .lost_piece = bt_deadline_selector_lost_piece
+};
+
+/* peers are (void*)1, (void*)2, ..; their rates in bytes per second */
+static int __rates[8];
+
+static uint64_t __clock;
+
+static uint64_t __now(void* udata)
+{
+    return __clock;
+}
+
+static int __rate(void* udata, const void* peer)
+{
+    return __rates[(long)peer];
+}
+
+/**
+ * Every peer has every piece */
+static void* __new(const int npieces, const int npeers)
+{
+    void *r = iface.new(npieces);
+    long p;
+    int i;
+
+    __clock = 1000;
+    memset(__rates, 0, sizeof(__rates));
+    bt_deadline_selector_set_clock(r, __now, NULL);
+    bt_deadline_selector_set_peer_rate(r, __rate, NULL);
+    bt_deadline_selector_set_piece_length(r, PIECE_LEN);
+
+    for (p = 1; p <= npeers; p++)
+    {
+        iface.add_peer(r, (void*)p);
+        for (i = 0; i < npieces; i++)
+            iface.peer_have_piece(r, (void*)p, i);
+    }
+
+    return r;
+}
+
+void TestDeadline_new_is_initialised_with_npieces(CuTest * tc)
+{
+    void *r = iface.new(10);
+
+    CuAssertTrue(tc, 10 == iface.get_npieces(r));
+    bt_deadline_selector_free(r);
+}
+
+void TestDeadline_without_window_polls_rarest_first(CuTest * tc)
+{
+    void *r = __new(0, 0);
+
+    iface.add_peer(r, (void*)1);
+    iface.add_peer(r, (void*)2);
+    iface.peer_have_piece(r, (void*)1, 1);
+    iface.peer_have_piece(r, (void*)2, 1);
+    iface.peer_have_piece(r, (void*)2, 2);
+    CuAssertTrue(tc, 2 == iface.poll_piece(r, (void*)2));
+    CuAssertTrue(tc, 1 == iface.poll_piece(r, (void*)2));
+    CuAssertTrue(tc, -1 == iface.poll_piece(r, (void*)2));
+    bt_deadline_selector_free(r);
+}
+
+void TestDeadline_window_is_polled_in_order(CuTest * tc)
+{
+    void *r = __new(10, 1);
+    int i;
+
+    bt_deadline_selector_set_window(r, 3, 1000);
+    bt_deadline_selector_set_playhead(r, 4);
+    CuAssertTrue(tc, 4 == iface.poll_piece(r, (void*)1));
+    CuAssertTrue(tc, 5 == iface.poll_piece(r, (void*)1));
+    CuAssertTrue(tc, 6 == iface.poll_piece(r, (void*)1));
+
+    /* outside the window */
+    i = iface.poll_piece(r, (void*)1);
+    CuAssertTrue(tc, 0 <= i && i < 4);
+    bt_deadline_selector_free(r);
+}
+
+void TestDeadline_window_set_after_playhead_gets_deadlines(CuTest * tc)
+{
+    bt_deadline_selector_stats_t s;
+    void *r = __new(10, 1);
+
+    bt_deadline_selector_set_playhead(r, 0);
+    bt_deadline_selector_set_window(r, 2, 1000);
+    iface.have_piece(r, 1);
+    bt_deadline_selector_get_stats(r, &s);
+    CuAssertIntEquals(tc, 1, s.nmet);
+    bt_deadline_selector_free(r);
+}
+
+void TestDeadline_outside_window_polls_rarest_first(CuTest * tc)
+{
+    void *r = __new(0, 0);
+    long p;
+    int i, j;
+
+    /* piece i is had by peers 1 to i + 1 */
+    for (p = 1; p <= 5; p++)
+    {
+        iface.add_peer(r, (void*)p);
+        for (i = p - 1; i < 5; i++)
+            iface.peer_have_piece(r, (void*)p, i);
+    }
+
+    CuAssertTrue(tc, 0 == iface.poll_piece(r, (void*)1));
+
+    /* only peers 1 and 5 are left; 4 is now the most common */
+    iface.have_piece(r, 1);
+    iface.remove_peer(r, (void*)2);
+    iface.remove_peer(r, (void*)3);
+    iface.remove_peer(r, (void*)4);
+    i = iface.poll_piece(r, (void*)1);
+    j = iface.poll_piece(r, (void*)1);
+    CuAssertTrue(tc, (2 == i && 3 == j) || (3 == i && 2 == j));
+    CuAssertTrue(tc, 4 == iface.poll_piece(r, (void*)1));
+    CuAssertTrue(tc, -1 == iface.poll_piece(r, (void*)5));
+    bt_deadline_selector_free(r);
+}
+
+void TestDeadline_slow_peer_is_kept_out_of_window(CuTest * tc)
+{
+    void *r = __new(10, 2);
+
+    /* 1 takes 10s a piece, 2 takes 100ms */
+    __rates[1] = 100;
+    __rates[2] = 10000;
+    bt_deadline_selector_set_window(r, 2, 1000);
+    bt_deadline_selector_set_playhead(r, 0);
+
+    /* the first piece that won't be needed before 1 has it */
+    CuAssertTrue(tc, 9 == iface.poll_piece(r, (void*)1));
+    CuAssertTrue(tc, 0 == iface.poll_piece(r, (void*)2));
+    CuAssertTrue(tc, 1 == iface.poll_piece(r, (void*)2));
+    bt_deadline_selector_free(r);
+}
+
+void TestDeadline_urgent_piece_is_raced_by_faster_peer(CuTest * tc)
+{
+    bt_deadline_selector_stats_t s;
+    void *r = __new(10, 2);
+    int i, other;
+
+    __rates[1] = 2000;
+    __rates[2] = 1000;
+    bt_deadline_selector_set_window(r, 1, 1000);
+    bt_deadline_selector_set_playhead(r, 0);
+    CuAssertTrue(tc, 0 == iface.poll_piece(r, (void*)2));
+
+    /* not urgent yet */
+    other = iface.poll_piece(r, (void*)1);
+    CuAssertTrue(tc, 0 < other);
+
+    /* half a piece before the deadline */
+    __clock += 500;
+    bt_deadline_selector_set_urgent_ms(r, 600);
+    CuAssertTrue(tc, 0 == iface.poll_piece(r, (void*)1));
+    bt_deadline_selector_get_stats(r, &s);
+    CuAssertIntEquals(tc, 1, s.nduplicates);
+
+    /* the slower peer can't race back */
+    i = iface.poll_piece(r, (void*)2);
+    CuAssertTrue(tc, 0 < i && i != other);
+    bt_deadline_selector_free(r);
+}
+
+void TestDeadline_giveback_by_holder_leaves_racer(CuTest * tc)
+{
+    void *r = __new(4, 2);
+
+    __rates[1] = 2000;
+    __rates[2] = 1000;
+    bt_deadline_selector_set_window(r, 1, 1000);
+    bt_deadline_selector_set_urgent_ms(r, 2000);
+    bt_deadline_selector_set_playhead(r, 0);
+    CuAssertTrue(tc, 0 == iface.poll_piece(r, (void*)2));
+    CuAssertTrue(tc, 0 == iface.poll_piece(r, (void*)1));
+
+    iface.peer_giveback_piece(r, (void*)2, 0);
+    CuAssertTrue(tc, 0 != iface.poll_piece(r, (void*)2));
+
+    /* nobody has it now */
+    iface.peer_giveback_piece(r, (void*)1, 0);
+    iface.remove_peer(r, (void*)2);
+    CuAssertTrue(tc, 0 == iface.poll_piece(r, (void*)1));
+    bt_deadline_selector_free(r);
+}
+
+void TestDeadline_misses_are_counted(CuTest * tc)
+{
+    bt_deadline_selector_stats_t s;
+    void *r = __new(10, 1);
+
+    bt_deadline_selector_set_window(r, 2, 1000);
+    bt_deadline_selector_set_playhead(r, 0);
+    __clock += 1000;
+    iface.have_piece(r, 0);
+    __clock += 1;
+    iface.have_piece(r, 1);
+    __clock += 5000;
+
+    /* never in the window */
+    iface.have_piece(r, 5);
+
+    bt_deadline_selector_get_stats(r, &s);
+    CuAssertIntEquals(tc, 2, s.nmet);
+    CuAssertIntEquals(tc, 0, s.nmissed);
+
+    bt_deadline_selector_set_playhead(r, 2);
+    __clock += 1001;
+    iface.have_piece(r, 2);
+    bt_deadline_selector_get_stats(r, &s);
+    CuAssertIntEquals(tc, 1, s.nmissed);
+    bt_deadline_selector_free(r);
+}
+
+void TestDeadline_lost_piece_is_polled_again(CuTest * tc)
+{
+    void *r = __new(4, 1);
+
+    iface.add_peer(r, (void*)2);
+    iface.peer_have_piece(r, (void*)2, 3);
+    iface.have_piece(r, 3);
+    iface.lost_piece(r, 3);
+
+    /* back in the order, as the one two peers have */
+    CuAssertTrue(tc, 3 != iface.poll_piece(r, (void*)1));
+    CuAssertTrue(tc, 3 != iface.poll_piece(r, (void*)1));
+    CuAssertTrue(tc, 3 != iface.poll_piece(r, (void*)1));
+    CuAssertTrue(tc, 3 == iface.poll_piece(r, (void*)1));
+    CuAssertTrue(tc, -1 == iface.poll_piece(r, (void*)1));
+    bt_deadline_selector_free(r);
+}
@@ -21,7 +21,11 @@ static bt_pieceselector_i iface = {
     .peer_have_piece = bt_rarestfirst_selector_peer_have_piece,
     .get_npeers = bt_rarestfirst_selector_get_npeers,
     .get_npieces = bt_rarestfirst_selector_get_npieces,
-    .poll_piece = bt_rarestfirst_selector_poll_best_piece
+    .poll_piece = bt_rarestfirst_selector_poll_best_piece,
+    .set_piece_priority = bt_rarestfirst_selector_set_piece_priority,
+    .set_piece_priority_range =
+        bt_rarestfirst_selector_set_piece_priority_range,
+    .lost_piece = bt_rarestfirst_selector_lost_piece
 };
 
 void TestRarestFirst_new_is_initialised_with_npieces(
@@ -161,3 +165,73 @@ void TestRarestFirst_have_removes_piece_from_polling(
     /*  ..which means we should poll it. */
     CuAssertTrue(tc, 1 == iface.poll_piece(cr, (void *) 3));
 }
+
+void TestRarestFirst_skipped_piece_isnt_polled(
+    CuTest * tc
+)
+{
+    void *cr;
+
+    cr = iface.new(10);
+    iface.add_peer(cr, (void *) 1);
+    iface.peer_have_piece(cr, (void *) 1, 1);
+    iface.set_piece_priority(cr, 1, BT_PRIORITY_SKIP);
+    CuAssertTrue(tc, -1 == iface.poll_piece(cr, (void *) 1));
+
+    /*  wanted again */
+    iface.set_piece_priority(cr, 1, BT_PRIORITY_NORMAL);
+    CuAssertTrue(tc, 1 == iface.poll_piece(cr, (void *) 1));
+}
+
+void TestRarestFirst_high_priority_beats_rarity(
+    CuTest * tc
+)
+{
+    void *cr;
+
+    cr = iface.new(10);
+    iface.add_peer(cr, (void *) 1);
+    iface.add_peer(cr, (void *) 2);
+    iface.peer_have_piece(cr, (void *) 1, 1);
+    iface.peer_have_piece(cr, (void *) 2, 1);
+    /*  this is the rarest */
+    iface.peer_have_piece(cr, (void *) 2, 2);
+    iface.set_piece_priority(cr, 1, BT_PRIORITY_HIGH);
+    CuAssertTrue(tc, 1 == iface.poll_piece(cr, (void *) 2));
+    CuAssertTrue(tc, 2 == iface.poll_piece(cr, (void *) 2));
+}
+
+void TestRarestFirst_priority_range_covers_npieces(
+    CuTest * tc
+)
+{
+    void *cr;
+    int i;
+
+    cr = iface.new(10);
+    iface.add_peer(cr, (void *) 1);
+    for (i = 0; i < 4; i++)
+        iface.peer_have_piece(cr, (void *) 1, i);
+    iface.set_piece_priority_range(cr, 1, 2, BT_PRIORITY_SKIP);
+    i = iface.poll_piece(cr, (void *) 1);
+    CuAssertTrue(tc, 0 == i || 3 == i);
+    i = iface.poll_piece(cr, (void *) 1);
+    CuAssertTrue(tc, 0 == i || 3 == i);
+    CuAssertTrue(tc, -1 == iface.poll_piece(cr, (void *) 1));
+}
+
+void TestRarestFirst_lost_piece_is_polled_again(
+    CuTest * tc
+)
+{
+    void *cr;
+
+    cr = iface.new(10);
+    iface.add_peer(cr, (void *) 1);
+    iface.peer_have_piece(cr, (void *) 1, 2);
+    iface.have_piece(cr, 2);
+    CuAssertTrue(tc, -1 == iface.poll_piece(cr, (void *) 1));
+    /*  its data turned out to be bad */
+    iface.lost_piece(cr, 2);
+    CuAssertTrue(tc, 2 == iface.poll_piece(cr, (void *) 1));
+}
@@ -21,7 +21,10 @@ static bt_pieceselector_i iface = {
     .peer_have_piece = bt_sequential_selector_peer_have_piece,
     .get_npeers = bt_sequential_selector_get_npeers,
     .get_npieces = bt_sequential_selector_get_npieces,
-    .poll_piece = bt_sequential_selector_poll_best_piece
+    .poll_piece = bt_sequential_selector_poll_best_piece,
+    .set_piece_priority = bt_sequential_selector_set_piece_priority,
+    .set_piece_priority_range = bt_sequential_selector_set_piece_priority_range,
+    .lost_piece = bt_sequential_selector_lost_piece
 };
 
 void TestSelectorSequential_new_is_initialised_with_npieces(
@@ -156,3 +159,124 @@ void TestSelectorSequential_have_removes_piece_from_polling(
     /*  ..which means we should poll it. */
     CuAssertTrue(tc, 1 == iface.poll_piece(cr, (void *) 3));
 }
+
+void TestSelectorSequential_skipped_piece_isnt_polled(
+    CuTest * tc
+)
+{
+    void *cr;
+
+    cr = iface.new(10);
+    iface.add_peer(cr, (void *) 1);
+    iface.peer_have_piece(cr, (void *) 1, 1);
+    iface.set_piece_priority(cr, 1, BT_PRIORITY_SKIP);
+    CuAssertTrue(tc, -1 == iface.poll_piece(cr, (void *) 1));
+
+    /*  wanted again */
+    iface.set_piece_priority(cr, 1, BT_PRIORITY_NORMAL);
+    CuAssertTrue(tc, 1 == iface.poll_piece(cr, (void *) 1));
+    bt_sequential_selector_free(cr);
+}
+
+void TestSelectorSequential_high_priority_is_polled_first(
+    CuTest * tc
+)
+{
+    void *cr;
+    int i;
+
+    cr = iface.new(10);
+    iface.add_peer(cr, (void *) 1);
+    for (i = 0; i < 10; i++)
+        iface.peer_have_piece(cr, (void *) 1, i);
+    iface.set_piece_priority(cr, 7, BT_PRIORITY_HIGH);
+    iface.set_piece_priority(cr, 8, BT_PRIORITY_HIGH);
+    i = iface.poll_piece(cr, (void *) 1);
+    CuAssertTrue(tc, 7 == i || 8 == i);
+    i = iface.poll_piece(cr, (void *) 1);
+    CuAssertTrue(tc, 7 == i || 8 == i);
+    i = iface.poll_piece(cr, (void *) 1);
+    CuAssertTrue(tc, 7 != i && 8 != i && -1 != i);
+    bt_sequential_selector_free(cr);
+}
+
+void TestSelectorSequential_priority_of_given_back_piece_holds(
+    CuTest * tc
+)
+{
+    void *cr;
+
+    cr = iface.new(10);
+    iface.add_peer(cr, (void *) 1);
+    iface.peer_have_piece(cr, (void *) 1, 2);
+    iface.peer_have_piece(cr, (void *) 1, 3);
+    iface.set_piece_priority(cr, 3, BT_PRIORITY_HIGH);
+    CuAssertTrue(tc, 3 == iface.poll_piece(cr, (void *) 1));
+
+    /*  the priority is kept while the piece is out */
+    iface.set_piece_priority(cr, 3, BT_PRIORITY_SKIP);
+    iface.peer_giveback_piece(cr, (void *) 1, 3);
+    CuAssertTrue(tc, 2 == iface.poll_piece(cr, (void *) 1));
+    CuAssertTrue(tc, -1 == iface.poll_piece(cr, (void *) 1));
+    bt_sequential_selector_free(cr);
+}
+
+void TestSelectorSequential_priority_range_covers_npieces(
+    CuTest * tc
+)
+{
+    void *cr;
+    int i;
+
+    cr = iface.new(10);
+    iface.add_peer(cr, (void *) 1);
+    for (i = 0; i < 10; i++)
+        iface.peer_have_piece(cr, (void *) 1, i);
+    iface.set_piece_priority_range(cr, 0, 8, BT_PRIORITY_SKIP);
+    i = iface.poll_piece(cr, (void *) 1);
+    CuAssertTrue(tc, 8 == i || 9 == i);
+    i = iface.poll_piece(cr, (void *) 1);
+    CuAssertTrue(tc, 8 == i || 9 == i);
+    CuAssertTrue(tc, -1 == iface.poll_piece(cr, (void *) 1));
+    bt_sequential_selector_free(cr);
+}
+
+void TestSelectorSequential_polls_in_order_within_priority(
+    CuTest * tc
+)
+{
+    void *cr;
+    int i;
+
+    cr = iface.new(10);
+    iface.add_peer(cr, (void *) 1);
+    for (i = 0; i < 10; i++)
+        iface.peer_have_piece(cr, (void *) 1, i);
+    iface.set_piece_priority_range(cr, 5, 3, BT_PRIORITY_HIGH);
+    CuAssertTrue(tc, 5 == iface.poll_piece(cr, (void *) 1));
+    CuAssertTrue(tc, 6 == iface.poll_piece(cr, (void *) 1));
+    CuAssertTrue(tc, 7 == iface.poll_piece(cr, (void *) 1));
+    CuAssertTrue(tc, 0 == iface.poll_piece(cr, (void *) 1));
+
+    /*  behind the cursor */
+    iface.peer_giveback_piece(cr, (void *) 1, 6);
+    CuAssertTrue(tc, 6 == iface.poll_piece(cr, (void *) 1));
+    CuAssertTrue(tc, 1 == iface.poll_piece(cr, (void *) 1));
+    bt_sequential_selector_free(cr);
+}
+
+void TestSelectorSequential_lost_piece_is_polled_again(
+    CuTest * tc
+)
+{
+    void *cr;
+
+    cr = iface.new(10);
+    iface.add_peer(cr, (void *) 1);
+    iface.peer_have_piece(cr, (void *) 1, 2);
+    iface.have_piece(cr, 2);
+    CuAssertTrue(tc, -1 == iface.poll_piece(cr, (void *) 1));
+    /*  its data turned out to be bad */
+    iface.lost_piece(cr, 2);
+    CuAssertTrue(tc, 2 == iface.poll_piece(cr, (void *) 1));
+}
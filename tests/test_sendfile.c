@@ -0,0 +1,258 @@
+
+#include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include "CuTest.h"
+
+#include <stdint.h>
+
+#include "bt.h"
+#include "bt_filedumper.h"
+#include "bt_piece.h"
+#include "bt_sendfile.h"
+
+#define HASH_EXAMPLE "00000000000000000000"
+
+static int __write_file(const char* path, const char* data, const int len)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if (-1 == fd)
+        return -1;
+    if (len != write(fd, data, len))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int __recv_all(int sock, char* buf, const int len)
+{
+    int done = 0;
+
+    while (done < len)
+    {
+        ssize_t r = recv(sock, buf + done, len - done, 0);
+
+        if (r <= 0)
+            return done;
+        done += r;
+    }
+    return done;
+}
+
+static int __sendfile(int sock, const char *header, const int header_len,
+                      int fd, uint64_t offset, const unsigned int len)
+{
+    void* sf = bt_sendfile_new(header, header_len, fd, offset, len);
+    int r = bt_sendfile_send(sf, sock);
+
+    bt_sendfile_free(sf);
+    return r;
+}
+
+/**
+ * Fill the socket's send buffer
+ * @return bytes it took */
+static int __fill(int sock)
+{
+    char buf[4096];
+    int n = 0;
+    ssize_t r;
+
+    memset(buf, 'z', sizeof(buf));
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    while (0 < (r = send(sock, buf, sizeof(buf), 0)))
+        n += r;
+    /* a unix socket may still take less than a whole buffer */
+    while (0 < (r = send(sock, buf, 1, 0)))
+        n += r;
+    return n;
+}
+
+/**
+ * Read and throw away n bytes */
+static void __drain(int sock, int n)
+{
+    char buf[4096];
+
+    while (0 < n)
+    {
+        ssize_t r = recv(sock, buf, n < (int)sizeof(buf) ? n :
+                         (int)sizeof(buf), 0);
+
+        if (r <= 0)
+            return;
+        n -= r;
+    }
+}
+
+void TestBTSendfile_sends_header_then_file_range(CuTest * tc)
+{
+    char out[32];
+    int sv[2], fd;
+
+    CuAssertTrue(tc, 0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    fd = __write_file("test_sendfile.a", "0123456789abcdef", 16);
+    CuAssertTrue(tc, -1 != fd);
+
+    CuAssertTrue(tc, BT_SENDFILE_DONE == __sendfile(sv[0], "HDR", 3, fd, 4, 6));
+    CuAssertTrue(tc, 9 == __recv_all(sv[1], out, 9));
+    CuAssertTrue(tc, 0 == strncmp(out, "HDR456789", 9));
+
+    close(fd);
+    close(sv[0]);
+    close(sv[1]);
+    unlink("test_sendfile.a");
+}
+
+void TestBTSendfile_fails_past_end_of_file(CuTest * tc)
+{
+    int sv[2], fd;
+
+    CuAssertTrue(tc, 0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    fd = __write_file("test_sendfile.a", "0123456789", 10);
+    CuAssertTrue(tc, BT_SENDFILE_ERROR == __sendfile(sv[0], NULL, 0, fd, 8, 4));
+
+    close(fd);
+    close(sv[0]);
+    close(sv[1]);
+    unlink("test_sendfile.a");
+}
+
+/**
+ * Two files of 15 and 15 bytes; pieces are 10 bytes */
+static void* __new_filedumper(void)
+{
+    void* fd = bt_filedumper_new();
+
+    unlink("test_sendfile.a");
+    unlink("test_sendfile.b");
+    bt_filedumper_set_piece_length(fd, 10);
+    bt_filedumper_add_file(fd, "test_sendfile.a", strlen("test_sendfile.a"), 15);
+    bt_filedumper_add_file(fd, "test_sendfile.b", strlen("test_sendfile.b"), 15);
+    bt_filedumper_get_blockrw(fd)->write_block(fd, NULL,
+        &((bt_block_t){ .piece_idx = 0, .offset = 0, .len = 30 }),
+        "aaaaaaaaaabbbbbbbbbbcccccccccc");
+    return fd;
+}
+
+static void __free_filedumper(void* fd)
+{
+    bt_filedumper_free(fd);
+    unlink("test_sendfile.a");
+    unlink("test_sendfile.b");
+}
+
+void TestBTSendfile_filedumper_finds_block_within_file(CuTest * tc)
+{
+    void* fd = __new_filedumper();
+    bt_block_t blk = { .piece_idx = 2, .offset = 2, .len = 5 };
+    uint64_t offset = 0;
+
+    CuAssertTrue(tc, -1 != bt_filedumper_get_blockrw(fd)->block_fd(
+                 fd, &blk, &offset));
+    CuAssertTrue(tc, 7 == offset);
+    __free_filedumper(fd);
+}
+
+void TestBTSendfile_filedumper_has_no_fd_for_block_spanning_files(CuTest * tc)
+{
+    void* fd = __new_filedumper();
+    bt_block_t blk = { .piece_idx = 1, .offset = 0, .len = 10 };
+    uint64_t offset;
+
+    CuAssertTrue(tc, -1 == bt_filedumper_get_blockrw(fd)->block_fd(
+                 fd, &blk, &offset));
+    __free_filedumper(fd);
+}
+
+void TestBTSendfile_piece_block_is_sent_from_its_file(CuTest * tc)
+{
+    void* fd = __new_filedumper();
+    bt_piece_t* pce = bt_piece_new(HASH_EXAMPLE, 10);
+    bt_block_t blk = { .piece_idx = 2, .offset = 0, .len = 10 };
+    uint64_t offset;
+    char out[16];
+    int sv[2], file;
+
+    bt_piece_set_idx(pce, 2);
+    bt_piece_set_disk_blockrw(pce, bt_filedumper_get_blockrw(fd), fd);
+    file = bt_piece_get_block_fd(pce, &blk, &offset);
+    CuAssertTrue(tc, -1 != file);
+
+    CuAssertTrue(tc, 0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    CuAssertTrue(tc, BT_SENDFILE_DONE ==
+                 __sendfile(sv[0], "PIECE", 5, file, offset, 10));
+    CuAssertTrue(tc, 15 == __recv_all(sv[1], out, 15));
+    CuAssertTrue(tc, 0 == strncmp(out, "PIECEccccccccccc", 15));
+
+    close(sv[0]);
+    close(sv[1]);
+    bt_piece_free(pce);
+    __free_filedumper(fd);
+}
+
+void TestBTSendfile_full_socket_resumes_later(CuTest * tc)
+{
+    char out[32];
+    int sv[2], fd, filled;
+    void* sf;
+
+    CuAssertTrue(tc, 0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    fd = __write_file("test_sendfile.a", "0123456789abcdef", 16);
+    filled = __fill(sv[0]);
+
+    /* doesn't wait for the socket; the file can be closed meanwhile */
+    sf = bt_sendfile_new("HDR", 3, fd, 4, 6);
+    close(fd);
+    CuAssertTrue(tc, BT_SENDFILE_AGAIN == bt_sendfile_send(sf, sv[0]));
+
+    __drain(sv[1], filled);
+    CuAssertTrue(tc, BT_SENDFILE_DONE == bt_sendfile_send(sf, sv[0]));
+    CuAssertTrue(tc, 9 == __recv_all(sv[1], out, 9));
+    CuAssertTrue(tc, 0 == strncmp(out, "HDR456789", 9));
+
+    bt_sendfile_free(sf);
+    close(sv[0]);
+    close(sv[1]);
+    unlink("test_sendfile.a");
+}
+
+void TestBTSendfile_queued_file_waits_behind_queued_data(CuTest * tc)
+{
+    char out[32];
+    int sv[2], fd, filled;
+    void* sq = bt_sendqueue_new();
+
+    CuAssertTrue(tc, 0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    fd = __write_file("test_sendfile.a", "0123456789abcdef", 16);
+    filled = __fill(sv[0]);
+
+    CuAssertTrue(tc, 1 == bt_sendqueue_send(sq, sv[0], "have", 4));
+    CuAssertTrue(tc, 1 == bt_sendqueue_sendfile(sq, sv[0], "HDR", 3, fd, 4, 6));
+    CuAssertTrue(tc, 0 == bt_sendqueue_is_empty(sq));
+    CuAssertTrue(tc, BT_SENDFILE_AGAIN == bt_sendqueue_flush(sq, sv[0]));
+
+    __drain(sv[1], filled);
+    CuAssertTrue(tc, BT_SENDFILE_DONE == bt_sendqueue_flush(sq, sv[0]));
+    CuAssertTrue(tc, 1 == bt_sendqueue_is_empty(sq));
+    CuAssertTrue(tc, 13 == __recv_all(sv[1], out, 13));
+    CuAssertTrue(tc, 0 == strncmp(out, "haveHDR456789", 13));
+
+    /* with nothing waiting, sends go straight out */
+    CuAssertTrue(tc, 1 == bt_sendqueue_send(sq, sv[0], "x", 1));
+    CuAssertTrue(tc, 1 == bt_sendqueue_is_empty(sq));
+
+    bt_sendqueue_free(sq);
+    close(fd);
+    close(sv[0]);
+    close(sv[1]);
+    unlink("test_sendfile.a");
+}